@@ -50,6 +50,15 @@ namespace lapack {
     // LU solve (with existing factorization)
     void dgetrs_(char *TRANS, int *N, int *NRHS, double *A, int *LDA,
 		 int *IPIV, double *B, int *LDB, int *INFO);
+
+    // eigenvalues (ascending) and eigenvectors of a symmetric matrix
+    void dsyev_(char *JOBZ, char *UPLO, int *N, double *A, int *LDA,
+		double *W, double *WORK, int *LWORK, int *INFO);
+
+    // singular value decomposition A = U * diag(S) * VT
+    void dgesvd_(char *JOBU, char *JOBVT, int *M, int *N, double *A,
+		 int *LDA, double *S, double *U, int *LDU, double *VT,
+		 int *LDVT, double *WORK, int *LWORK, int *INFO);
     
   }
 }
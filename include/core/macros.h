@@ -9,12 +9,6 @@ enum {
   FID_X,
 };
 
-// used in InitCirculantKmatTask::TaskArgs
-//  and NodeLaunchTask::TaskArgs
-// for the subtree stored in array
-const int MAX_TREE_SIZE = 50;
-
-
 /* Macros to throw exceptions */
 
 #define ThrowException(msg) \
@@ -1,6 +1,9 @@
 #ifndef RANGE_H
 #define RANGE_H
 
+#include <math.h>
+#include <vector>
+
 class Range {
  public:
  Range(                   ): mbegin(0),     msize(0)    {}
@@ -10,23 +13,74 @@ class Range {
   int size()  const {return msize;}
   Range lchild() const;
   Range rchild() const;
+  // the left part gets about frac of the (weighted) processors
+  Range lchild(double frac) const;
+  Range rchild(double frac) const;
+
+  // relative speed of every processor (mapping tag), 1 by default.
+  // set it before HighLevelRuntime::start() so that all processes
+  //  split ranges in the same way.
+  static std::vector<double>& speeds();
  public:
   int mbegin;
   int msize;
+
+ private:
+  int split(double frac) const;
 };
 
+inline std::vector<double>& Range::speeds()
+{
+  static std::vector<double> speed;
+  return speed;
+}
+
+// number of processors in the left part. a single processor is
+//  shared by both parts, otherwise each part gets at least one.
+inline int Range::split(double frac) const
+{
+  if (msize < 2)
+    return msize;
+
+  const std::vector<double>& speed = speeds();
+  std::vector<double> sum(msize+1, 0.0); // prefix sums of speeds
+  for (int i=0; i<msize; i++) {
+    int proc = mbegin + i;
+    double s = (proc < (int)speed.size()) ? speed[proc] : 1.0;
+    sum[i+1] = sum[i] + s;
+  }
+  double target = frac * sum[msize];
+  int    best   = 1;
+  for (int k=2; k<msize; k++)
+    if (fabs(sum[k] - target) < fabs(sum[best] - target))
+      best = k;
+  return best;
+}
+
 // return the first half
 inline Range Range::lchild () const
 {
-  int half_size = msize/2;
-  return (Range){mbegin, half_size};
+  return lchild(0.5);
 }
 
 // return the second half
 inline Range Range::rchild () const
 {
-  int half_size = msize/2;
-  return (Range){mbegin+half_size, half_size};
+  return rchild(0.5);
+}
+
+inline Range Range::lchild (double frac) const
+{
+  int lsize = split(frac);
+  return (Range){mbegin, lsize};
+}
+
+inline Range Range::rchild (double frac) const
+{
+  if (msize < 2)
+    return (Range){mbegin, msize};
+  int lsize = split(frac);
+  return (Range){mbegin+lsize, msize-lsize};
 }
 
 
@@ -0,0 +1,25 @@
+#ifndef _CLUSTERING_H
+#define _CLUSTERING_H
+
+#include <vector>
+
+#include "node.h"
+
+// how the points of a node are split between its children
+enum ClusterMethod {
+  CLUSTER_KD,  // widest coordinate of the bounding box
+  CLUSTER_PCA  // principal axis of the points
+};
+
+// Reorders a point cloud so that every node of the tree owns a
+//  compact cluster: the rows of a node are split between its
+//  children along the chosen axis, the left child getting the
+//  lchild()->nrow points with the smallest projections.
+// points holds dim coordinates per point, point after point, and is
+//  reordered in place. perm[i] is the input index of the point that
+//  ends up at row i.
+void cluster_points
+  (const Node *root, int dim, double *points, std::vector<int> &perm,
+   ClusterMethod method=CLUSTER_PCA);
+
+#endif // _CLUSTERING_H
@@ -5,6 +5,8 @@
 #include <fstream>
 
 #include "node.h"
+#include "clustering.h"
+#include "peeling.h"
 #include "legion_matrix.h"
 #include "matrix_array.hpp"
 #include "timer.hpp"
@@ -13,9 +15,13 @@
 
 using namespace LegionRuntime::HighLevel;
 
+// rank of the off-diagonal block of a node from its level in the
+//  global tree (the root is level 0) and its number of rows
+typedef int (*RankFunc)(int level, int nrow);
+
 class HodlrMatrix {
  public:
-  HodlrMatrix() {}
+  HodlrMatrix() : uroot(NULL), vroot(NULL), rankFunc(NULL) {}
   HodlrMatrix
     (int col, int row, int gl, int sl,
      int r, int t, int leaf, const std::string&);
@@ -23,12 +29,83 @@ class HodlrMatrix {
   
   void create_tree
     (Context, HighLevelRuntime *, const LMatrixArray* array=NULL);
+  // machine size used to pick legion leaves when leafSize <= 0
+  void set_machine(int procs, int cores, int tasks_per_core=4) {
+    nProc = procs; nCore = cores; tasksPerCore = tasks_per_core;
+  }
+  // create_tree() makes a matrix whose estimated cost is at most
+  //  this many legion leaf budgets (see leaf_budget()) a single
+  //  legion leaf, solved by one task without H-tiled regions, node
+  //  tasks or temporaries; 0 turns it off. 4 by default.
+  void set_small_problem(int leaves) {smallLeaves = leaves;}
+  // per-node ranks for create_tree(); NULL uses the same rank for
+  //  all blocks. the circulant generator needs the same rank.
+  void set_rank_policy(RankFunc f) {rankFunc = f;}
   void init_rhs
     (const long, const Range&, Context, HighLevelRuntime *);
   void init_circulant_matrix
     (const double, const Range&, Context, HighLevelRuntime *,
      bool skipU=false);
+  // kernel id from register_kernel() and its ndata values of data,
+  //  see kernel_matrix_tasks.h
+  void init_kernel_matrix
+    (const int kernel, const double *data, const int ndata,
+     const double tol, const Range&, Context, HighLevelRuntime *);
+  // from products with A and A^T only, see fill_peeled_matrix()
+  void init_matvec_matrix
+    (MatvecFunc, const long seed, Context, HighLevelRuntime *,
+     int oversample=10);
   //  void init_from_regions(const LMatrixArray &);
+
+  // target = this matrix + sigma*I. target shares the V and H-tiled
+  //  regions and gets its own U (rhs and u columns) and K regions,
+  //  created on the first call and rewritten on later ones. call it
+  //  before solving this matrix (see FastSolver); shifted copies can
+  //  be solved concurrently.
+  void shift(HodlrMatrix &target, const double sigma, const Range&,
+	     Context, HighLevelRuntime *) const;
+  // targets[s] = this matrix + sigmas[s]*I for all shifts, launched
+  //  together; solve every target with its own FastSolver.
+  void shift(const std::vector<HodlrMatrix *> &targets,
+	     const std::vector<double> &sigmas, const Range&,
+	     Context, HighLevelRuntime *) const;
+
+  // geometric ordering of a point cloud after create_tree(), see
+  //  cluster_points(); the points are reordered in place and the
+  //  kernel has to be evaluated on the reordered points
+  void cluster(int dim, double *points,
+	       ClusterMethod method=CLUSTER_PCA);
+  const std::vector<int>& permutation() const {return perm;}
+  // right hand side and solution in the input order of the points,
+  //  rows x rhs_cols with leading dimension LD
+  void set_rhs
+    (const double *b, int LD, Context, HighLevelRuntime *);
+  void get_solution
+    (double *x, int LD, Context, HighLevelRuntime *) const;
+  // the same for some of the right hand side columns only
+  void set_rhs
+    (const double *b, int LD, const Range& columns,
+     Context, HighLevelRuntime *);
+  void get_solution
+    (double *x, int LD, const Range& columns,
+     Context, HighLevelRuntime *) const;
+  // vectors beside the matrix: a tree in the arena with the legion
+  //  leaves of U, each with a region of its rows and ncol columns,
+  //  and one column of it to or from v in the input order
+  void create_vectors
+    (NodeArena &, int ncol, Context, HighLevelRuntime *) const;
+  void destroy_vectors
+    (NodeArena &, Context, HighLevelRuntime *) const;
+  void set_vector
+    (NodeArena &, int col, const double *v,
+     Context, HighLevelRuntime *) const;
+  void get_vector
+    (NodeArena &, int col, double *v,
+     Context, HighLevelRuntime *) const;
+  // legion leaves, numbered left to right, holding a nonzero entry
+  //  of b (as in set_rhs()), see FastSolver::set_rhs_support()
+  void rhs_support
+    (const double *b, int LD, std::vector<int> &leaves) const;
   
   void save_rhs
     (Context, HighLevelRuntime *) const;
@@ -36,7 +113,7 @@ class HodlrMatrix {
     (Context, HighLevelRuntime *) const;
 
   int  launch_level() const {return gloLevel-subLevel;}
-  int  get_num_rhs() {return rhs_cols;}
+  int  get_num_rhs() const {return rhs_cols;}
   int  get_num_leaf() {return nLegionLeaf;}
   std::string get_file_soln() const {return file_soln;}
 
@@ -46,6 +123,8 @@ class HodlrMatrix {
   }
   
   /* --- tree root --- */
+  // both point into the node arena, which is fixed once
+  //  create_tree() returns
   Node *uroot;
   Node *vroot;
 
@@ -56,16 +135,29 @@ class HodlrMatrix {
 		 Context, HighLevelRuntime *, int row_beg = 0);  
   void init_Vmat(Node *node, double diag, Range tag,
 		 Context, HighLevelRuntime *, int row_beg = 0);
+  // estimated cost of one legion leaf
+  double leaf_budget() const;
+  // for shift()
+  void copy_tree(HodlrMatrix &target, const std::string &prefix) const;
   
   /* --- private attributes --- */
   int rhs_cols;
   int rhs_rows;
   int gloLevel;  // level of the global tree
   int subLevel;  // level of the sub problem
-  int rank;      // same rank for all blocks
+  int rank;      // rank of all blocks without a rank policy
+  RankFunc rankFunc;
   int threshold; // threshold of dense blocks
   int leafSize;  // legion leaf size for controlling fine granularity
+                 // (<= 0 chooses legion leaves by the cost model)
   int nLegionLeaf;
+  int smallLeaves; // single legion leaf up to this many budgets
+  int nProc;     // machine nodes
+  int nCore;     // cores per machine node
+  int tasksPerCore;
+  
+  NodeArena arena; // storage of U, V and H-tiled trees
+  std::vector<int> perm; // input index of every row, empty if none
   
  private:
   double timeInit;
@@ -73,6 +165,27 @@ class HodlrMatrix {
   std::string file_soln;
 };
 
+// the tree of a matrix with N rows and ceil(N/threshold) dense
+//  blocks, split by the cost model; also used by HssMatrix
+void create_weighted_tree
+  (NodeArena &, int root, int rank, RankFunc, int level,
+   int threshold);
+
+// appends the V tree mirroring the U tree that ends the arena at
+//  uroot, and returns its root
+int create_Vtree(NodeArena &arena, int uroot);
+
+// marks subtrees of at most leafSize dense blocks as legion leaves
+//  and returns the number of dense blocks; nleaf counts them
+int mark_legion_leaf(Node *, const int leafSize, int &nleaf);
+
+// U and K of the legion leaves below (ubase, vbase) copied into the
+//  regions of the matching nodes of another tree, see shift()
+void shift_leaves
+  (const Node *ubase, const Node *vbase, const Node *unode,
+   const Node *vnode, double sigma, Range tag,
+   Context, HighLevelRuntime *);
+
 void create_Hmatrix(Node *, Node *, int,
 		    Context, HighLevelRuntime *);
   
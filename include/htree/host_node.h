@@ -0,0 +1,37 @@
+#ifndef _HOST_NODE_H
+#define _HOST_NODE_H
+
+#include <vector>
+
+#include "node.h"
+
+// A node of an HODLR matrix copied into the memory of the calling
+//  task, where A(a, b) = a.u * b.v^T for siblings a and b. The nodes
+//  are kept in a vector in depth first order, the root first.
+struct HostNode {
+  int row;   // first global row
+  int nrow;
+  int k;     // rank of the block A(this, sibling)
+  int depth;
+  int lchild, rchild; // -1 for a real leaf
+  std::vector<double> u; // nrow x k
+  std::vector<double> v; // nrow x rank of the sibling
+  std::vector<double> d; // dense block of a real leaf
+};
+
+// appends the nodes below node, without data, and returns its index
+int mirror_tree
+  (const Node *node, int row, int depth, std::vector<HostNode> &t);
+
+// the blocks below t[i], the mirror of a legion leaf (unode, vnode),
+//  written into column major U, V and K buffers of the same layout
+//  as its regions, with leading dimension LD
+void write_host_subtree
+  (const Node *unode, const Node *vnode, const std::vector<HostNode> &t,
+   double *U, double *V, double *K, int LD, int i=0);
+// and the other way round, filling t[i] and the nodes below it
+void read_host_subtree
+  (const Node *unode, const Node *vnode, std::vector<HostNode> &t,
+   const double *U, const double *V, const double *K, int LD, int i=0);
+
+#endif // _HOST_NODE_H
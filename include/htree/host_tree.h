@@ -0,0 +1,21 @@
+#ifndef _HOST_TREE_H
+#define _HOST_TREE_H
+
+#include <vector>
+
+#include "host_node.h"
+#include "legion.h"
+
+using namespace LegionRuntime::HighLevel;
+
+// all the blocks of the tree read from, or written into, the U, V,
+//  H-tiled and K regions through inline mappings. The right hand
+//  side columns are not touched.
+void read_host_tree
+  (Node *uroot, Node *vroot, std::vector<HostNode> &t,
+   Context ctx, HighLevelRuntime *runtime);
+void write_host_tree
+  (Node *uroot, Node *vroot, const std::vector<HostNode> &t,
+   int rhs_cols, Context ctx, HighLevelRuntime *runtime);
+
+#endif // _HOST_TREE_H
@@ -0,0 +1,102 @@
+#ifndef _HSS_MATRIX_H
+#define _HSS_MATRIX_H
+
+#include <string>
+#include <vector>
+
+#include "node.h"
+#include "legion_matrix.h"
+#include "hodlr_matrix.h"
+
+#include "legion.h"
+
+using namespace LegionRuntime::HighLevel;
+
+/**
+ * \class HssMatrix
+ * Matrix with nested bases: only the leaves store U and V, and a
+ *  node tau with children a and b is represented by
+ *    U_tau = [U_a R_a; U_b R_b],  V_tau = [V_a W_a; V_b W_b],
+ *    A(a, b) = U_a B_ab V_b^T,    A(b, a) = U_b B_ba V_a^T,
+ *  so the storage is O(N*r) instead of O(N*r*log N) for HODLR.
+ *
+ * Every node keeps one generator matrix of m rows,
+ *  [U | V | D] with ncol = rank columns for U and V:
+ *  - real leaf: m = nrow, U, V and D are the leaf blocks;
+ *  - other node: m = rank(a) + rank(b), U = [R_a; R_b],
+ *    V = [W_a; W_b] and D = [0, B_ab; B_ba, 0].
+ *  The root has rank 0. Generators above the legion leaves have
+ *  a region each; below a legion leaf, the real leaves are stacked
+ *  by rows in one region and the other nodes are packed one after
+ *  another in a column (see hss_sub_offsets).
+ */
+class HssMatrix {
+ public:
+  HssMatrix
+    (int col, int row, int r, int t, int leaf, const std::string&);
+
+  void create_tree(Context, HighLevelRuntime *);
+  // random generators; diag is added to the dense blocks
+  void init_random_matrix
+    (const long seed, const double diag, const Range&,
+     Context, HighLevelRuntime *);
+  void init_rhs
+    (const long seed, const Range&, Context, HighLevelRuntime *);
+
+  // the right hand side, or the solution after
+  //  FastSolver::hss_solve(), N x nrhs with leading dimension LD,
+  //  through inline mappings
+  void get_solution(double *x, int LD, Context, HighLevelRuntime *);
+  // Y = A X in the calling task for the matrix made by
+  //  init_random_matrix(seed, diag), from the same random streams, so
+  //  it still works once the generators are factored. X and Y are
+  //  N x ncol with leading dimension LD.
+  void random_matvec(long seed, double diag, int ncol, const double *X,
+		     double *Y, int LD) const;
+
+  int get_num_rhs() const {return rhs_cols;}
+  int get_num_leaf() const {return nLegionLeaf;}
+
+  // regions of one node; tasks find them by arena index
+  struct Block {
+    LMatrix *gen; // generators, [E | F | G] after factorization
+    LMatrix *sub; // legion leaf: generators of the nodes below
+    LMatrix *hat; // (V^T D^-1 U)^-1, rank x rank
+    LMatrix *rhs; // rank x nrhs, b^ on the way up, x^ down
+    LMatrix *b;   // legion leaf: right hand side, then solution
+  };
+  Block& block(const Node *node) {return blocks[arena.index(node)];}
+
+  Node *root;
+
+ private:
+  void create_regions(Node *, Context, HighLevelRuntime *);
+  void init_random(Node *, long, double, Range, int,
+		   Context, HighLevelRuntime *);
+  void init_rhs(Node *, long, Range, Context, HighLevelRuntime *);
+  void get_solution(Node *, int, double *, int,
+		    Context, HighLevelRuntime *);
+
+  int rhs_cols;
+  int rhs_rows;
+  int rank;
+  int threshold;
+  int leafSize;
+  int nLegionLeaf;
+
+  NodeArena arena;
+  std::vector<Block> blocks;
+};
+
+// offsets of the packed generators of the nodes in a legion leaf
+//  subtree other than the real leaves, in the order of pack_tree();
+//  real leaves get -1. returns the total size.
+int hss_sub_offsets(const Node *legionLeaf, std::vector<int> &offset);
+
+// number of rows of the generators of a node
+int hss_gen_rows(const Node *);
+
+void register_hss_init_tasks();
+void register_hss_tasks(); // init, factor and solve
+
+#endif // _HSS_MATRIX_H
@@ -3,21 +3,18 @@
 
 #include "range.h"
 
-#include "legion.h"
-
-using namespace LegionRuntime::HighLevel;
-
 class LMatrix;
 
+// Nodes are plain data living in a NodeArena. Children and the
+//  H-tiled matrix are stored as offsets relative to the node, so
+//  a tree stays valid when the arena is moved or copied as a
+//  block. The right child always follows the left child.
 struct Node {
 public:
   Node(int nrow=0,
        int ncol=0,
        int row_beg=0,
        int col_beg=0,
-       Node *lchild=NULL,
-       Node *rchild=NULL,
-       Node *Hmat=NULL,
        LMatrix *matrix=NULL,
        LMatrix *kmat=NULL,
        bool isLegionLeaf=false);
@@ -26,22 +23,73 @@ public:
   bool is_legion_leaf() const;
   void set_legion_leaf(bool);
 
+  Node       *lchild();
+  Node       *rchild();
+  Node       *Hmat();
+  const Node *lchild() const;
+  const Node *rchild() const;
+  const Node *Hmat()   const;
+
+  void set_children(Node *lchild); // rchild is lchild+1
+  void set_Hmat(Node *);
+
+  // share of the processors going to the left child
+  double split_fraction() const;
+  
   int nrow;    
   int ncol;
   int row_beg; // begin index in the region
   int col_beg;
+  double cost; // estimated work of the subtree
 
-  Node *lchild;
-  Node *rchild;
-  Node *Hmat;
-  
   LMatrix *lowrank_matrix; // low rank blocks
   LMatrix *dense_matrix;   // dense blocks
 
 private:
+  int  child; // offset of the left child, 0 for none
+  int  hmat;  // offset of the H-tiled matrix, 0 for none
   bool isLegionLeaf;
 };
 
+inline bool Node::is_real_leaf() const {return child == 0;}
+
+inline Node *Node::lchild() {return child ? this+child   : NULL;}
+inline Node *Node::rchild() {return child ? this+child+1 : NULL;}
+inline Node *Node::Hmat()   {return hmat  ? this+hmat    : NULL;}
+
+inline const Node *Node::lchild() const
+{return child ? this+child   : NULL;}
+inline const Node *Node::rchild() const
+{return child ? this+child+1 : NULL;}
+inline const Node *Node::Hmat()   const
+{return hmat  ? this+hmat    : NULL;}
+
+// One contiguous block holding the U, V and H trees. Nodes are
+//  appended level by level, and the whole block is released with
+//  a single free(). Growing the arena may move it, so callers
+//  building a tree must hold indices rather than pointers.
+class NodeArena {
+public:
+  NodeArena();
+  ~NodeArena();
+
+  int   alloc(int n=1); // index of n consecutive new nodes
+  void  clear();
+  
+  Node       *at(int i)       {return nodes+i;}
+  const Node *at(int i) const {return nodes+i;}
+  int   index(const Node *node) const {return node-nodes;}
+  int   size() const {return count;}
+  
+private:
+  NodeArena(const NodeArena&);
+  NodeArena& operator=(const NodeArena&);
+  
+  Node *nodes;
+  int   count;
+  int   capacity;
+};
+
 void build_subtree(Node *node, int row_beg = 0);
 
 int count_matrix_column(const Node *node, int col_size=0);
@@ -50,9 +98,22 @@ int max_row_size(const Node *);
 
 int count_leaf(const Node *node);
 
-int  tree_to_array(const Node *, Node *, int);
-void tree_to_array(const Node *, Node *, int, int);
-void array_to_tree(Node *, int);
-void array_to_tree(Node *, int, int);
+// A subtree below a Legion leaf is shipped to tasks as a flat
+//  int array: the number of nodes followed by TREE_FIELDS ints
+//  per node in breadth first order. Only the geometry is packed,
+//  the regions travel as region requirements.
+enum {
+  TREE_NROW,
+  TREE_NCOL,
+  TREE_ROW_BEG,
+  TREE_COL_BEG,
+  TREE_LCHILD,  // index of the left child, -1 for a leaf
+  TREE_FIELDS,
+};
+
+int pack_tree_size(const Node *);          // number of ints
+int packed_tree_size(const int *);         // same, from the array
+int pack_tree(const Node *, int *);        // return ints written
+int unpack_tree(const int *, NodeArena &); // return root index
 
 #endif // _HTREE_HELPER
@@ -0,0 +1,30 @@
+#ifndef _PEELING_H
+#define _PEELING_H
+
+#include "node.h"
+#include "legion.h"
+
+using namespace LegionRuntime::HighLevel;
+
+// Y = A X, or A^T X when transpose is set. X and Y are column
+//  major with N rows and ncol columns.
+typedef void (*MatvecFunc)
+  (bool transpose, int ncol, const double *X, double *Y);
+
+// Recovers the U, V and K regions of an HODLR tree from products
+//  with A only (the peeling algorithm). The tree is processed level
+//  by level: the blocks A(a, b) of all sibling pairs on a level are
+//  sampled together by one product with random probes on one side
+//  and zeros on the other, after subtracting the blocks already
+//  recovered on the levels above. The range of every block is
+//  truncated to the node rank, and one product with A^T gives the
+//  other factor. A last product with identity blocks gives the
+//  dense leaves. Together this is 2*levels+1 calls to the matvec,
+//  with node rank + oversample columns per sibling side.
+// The matvec is called from the calling task and the regions are
+//  written through inline mappings.
+void fill_peeled_matrix
+(Node *uroot, Node *vroot, int rhs_cols, MatvecFunc matvec,
+ int oversample, long seed, Context ctx, HighLevelRuntime *runtime);
+
+#endif // _PEELING_H
@@ -32,13 +32,12 @@ class RandomMatrixTask : public TaskLauncher {
 
 class DenseMatrixTask : public TaskLauncher {
  public:
-  template <int N>
-    struct TaskArgs {
-      int row;
-      int rank;
-      double diag;
-      Node treeArray[N];
-    };
+  // followed by the packed V subtree
+  struct TaskArgs {
+    int row;
+    int rank;
+    double diag;
+  };
   
   DenseMatrixTask(TaskArgument arg,
 		  Predicate pred = Predicate::TRUE_PRED,
@@ -76,4 +75,44 @@ class CirculantMatrixTask : public TaskLauncher {
 		       Context ctx, HighLevelRuntime *runtime);
 };
 
+// U and K of a legion leaf copied from a base matrix, with sigma
+//  added to the diagonal of every dense block
+class ShiftMatrixTask : public TaskLauncher {
+ public:
+  // followed by the packed V subtree
+  struct TaskArgs {
+    double sigma;
+  };
+  
+  ShiftMatrixTask(TaskArgument arg,
+		  Predicate pred = Predicate::TRUE_PRED,
+		  MapperID id = 0,
+		  MappingTagID tag = 0);
+  
+  static int TASKID;
+  static void register_tasks(void);
+
+ public:
+  static void cpu_task(const Task *task,
+		       const std::vector<PhysicalRegion> &regions,
+		       Context ctx, HighLevelRuntime *runtime);
+};
+
+// the data of a region copied into another region of the same size
+class CopyMatrixTask : public TaskLauncher {
+ public:
+  CopyMatrixTask(TaskArgument arg,
+		 Predicate pred = Predicate::TRUE_PRED,
+		 MapperID id = 0,
+		 MappingTagID tag = 0);
+  
+  static int TASKID;
+  static void register_tasks(void);
+
+ public:
+  static void cpu_task(const Task *task,
+		       const std::vector<PhysicalRegion> &regions,
+		       Context ctx, HighLevelRuntime *runtime);
+};
+
 #endif // INIT_MATRIX_TASKS_H
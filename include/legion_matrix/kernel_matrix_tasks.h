@@ -0,0 +1,131 @@
+#ifndef KERNEL_MATRIX_TASKS_H
+#define KERNEL_MATRIX_TASKS_H
+
+#include <vector>
+
+#include "legion.h"
+#include "hodlr_matrix.h"
+
+using namespace LegionRuntime::HighLevel;
+using namespace LegionRuntime::Accessor;
+
+// matrix entry A(i, j) from the global row and column indices and
+//  the data given to fill_kernel_matrix(), e.g. the points
+typedef double (*KernelFunc)(int i, int j, const double *data);
+
+// Kernels are looked up by id inside tasks, so they have to be
+//  registered on every process before HighLevelRuntime::start(),
+//  e.g. in main(), and in the same order. The data travels in a
+//  region, so it only has to exist where the matrix is filled.
+int        register_kernel(KernelFunc);
+KernelFunc get_kernel(int id);
+
+void register_kernel_tasks();
+
+// populate the U, V, H-tiled and K regions of an HODLR tree from a
+//  kernel. off-diagonal blocks are compressed by adaptive cross
+//  approximation to the relative tolerance tol, capped at the node
+//  ranks; the dense matrix is never formed. the ndata values of data
+//  are copied into a region read by every kernel task.
+void fill_kernel_matrix
+(Node *uroot, Node *vroot, int kernel, const double *data, int ndata,
+ double tol, const Range &tag, Context ctx, HighLevelRuntime *runtime);
+
+/**
+ * \class Skeleton
+ * Pivot rows and columns of a cross approximation of a block,
+ * relative to the first row and column of the block:
+ *   A ~ A(:, cols) * A(rows, cols)^-1 * A(rows, :)
+ */
+class Skeleton {
+public:
+  int rank() const {return rows.size();}
+public:
+  size_t legion_buffer_size(void) const;
+  size_t legion_serialize(void *buffer) const;
+  size_t legion_deserialize(const void *buffer);
+public:
+  std::vector<int> rows;
+  std::vector<int> cols;
+};
+
+class KernelSkeletonTask : public TaskLauncher {
+ public:
+  struct TaskArgs {
+    int kernel;
+    int row_beg;
+    int nrow;
+    int col_beg;
+    int ncol;
+    int rank;
+    double tol;
+  };
+
+  KernelSkeletonTask(TaskArgument arg,
+		     Predicate pred = Predicate::TRUE_PRED,
+		     MapperID id = 0,
+		     MappingTagID tag = 0);
+
+  static int TASKID;
+  static void register_tasks(void);
+
+ public:
+  static Skeleton cpu_task(const Task *task,
+			   const std::vector<PhysicalRegion> &regions,
+			   Context ctx, HighLevelRuntime *runtime);
+};
+
+// fills the u columns of the ancestors, and the U, V and K regions
+//  of the subtree below the legion leaf
+class KernelLeafTask : public TaskLauncher {
+ public:
+  // followed by (col_beg, ncol, sib_beg) of every ancestor with
+  //  columns in the U region, then the packed U and V subtrees.
+  //  one skeleton future is attached per ancestor.
+  struct TaskArgs {
+    int kernel;
+    int row;
+    int nanc;
+    double tol;
+  };
+
+  KernelLeafTask(TaskArgument arg,
+		 Predicate pred = Predicate::TRUE_PRED,
+		 MapperID id = 0,
+		 MappingTagID tag = 0);
+
+  static int TASKID;
+  static void register_tasks(void);
+
+ public:
+  static void cpu_task(const Task *task,
+		       const std::vector<PhysicalRegion> &regions,
+		       Context ctx, HighLevelRuntime *runtime);
+};
+
+// fills one leaf region of an H-tiled matrix
+class KernelHmatTask : public TaskLauncher {
+ public:
+  // the skeleton of the block is attached as a future
+  struct TaskArgs {
+    int kernel;
+    int row;     // first global row of the region
+    int sib_beg; // first global row of the sibling block
+    int col_beg; // first global row of the block itself
+  };
+
+  KernelHmatTask(TaskArgument arg,
+		 Predicate pred = Predicate::TRUE_PRED,
+		 MapperID id = 0,
+		 MappingTagID tag = 0);
+
+  static int TASKID;
+  static void register_tasks(void);
+
+ public:
+  static void cpu_task(const Task *task,
+		       const std::vector<PhysicalRegion> &regions,
+		       Context ctx, HighLevelRuntime *runtime);
+};
+
+#endif // KERNEL_MATRIX_TASKS_H
@@ -42,6 +42,20 @@ public:
     (const int col, const int row, const int r, const int tag,
      Context ctx, HighLevelRuntime *runtime);
 
+  // copy between host memory (rows x columns.size(), leading
+  //  dimension LD) and the given columns through an inline mapping;
+  //  both wait for the tasks using the region
+  void set_columns
+    (const double *A, int LD, const Range& columns,
+     Context, HighLevelRuntime *);
+  void get_columns
+    (double *A, int LD, const Range& columns,
+     Context, HighLevelRuntime *);
+
+  // overwrite the data by that of src, of the same size
+  void copy(const LMatrix &src, const int,
+	    Context, HighLevelRuntime *);
+
   // output data to file
   void save
     (const std::string&, const Range&,
@@ -61,4 +75,8 @@ void create_matrix
   (LMatrix *(&matrix), int nrow, int ncol,
    Context ctx, HighLevelRuntime *runtime);
 
+// releases the region once the tasks using it are done
+void destroy_matrix
+  (LMatrix *(&matrix), Context ctx, HighLevelRuntime *runtime);
+
 #endif // LEGION_MATRIX_H
@@ -0,0 +1,69 @@
+#ifndef _BATCH_SOLVER_H
+#define _BATCH_SOLVER_H
+
+#include <vector>
+
+#include "hodlr_matrix.h"
+#include "host_tree.h"
+#include "legion.h"
+
+using namespace LegionRuntime::HighLevel;
+
+void register_batch_tasks();
+
+// Many small independent HODLR systems solved together. Every system
+//  gets a tree as in HodlrMatrix, which is a single legion leaf, and
+//  the systems are stacked by rows into shared U, V and K regions,
+//  one set per group of systems. solve() launches one task per group
+//  that runs the serial leaf solve on its systems in turn, so the
+//  runtime cost is per group rather than per system or per node.
+class HodlrBatch {
+ public:
+  HodlrBatch(int rhs_cols, int rank, int threshold, RankFunc f=NULL);
+
+  // a system of nrow rows, returns its index
+  int add_system(int nrow);
+  int size() const {return uroot.size();}
+  // the U tree of a system, to be mirrored by mirror_tree()
+  const Node *tree(int s) const {return arena.at(uroot[s]);}
+
+  // regions of groupSize systems each, after all add_system()
+  void create(int groupSize, Context, HighLevelRuntime *);
+  // the regions have to be released before the batch goes away
+  void destroy(Context, HighLevelRuntime *);
+
+  // blocks of system s as a mirror of tree(s), and its right hand
+  //  side (nrow x rhs_cols, leading dimension nrow); kept in host
+  //  memory until the next solve()
+  void set_system(int s, const std::vector<HostNode> &blocks,
+		  const double *rhs);
+  // writes the systems set since the last call, then solves all
+  void solve(const Range &procs, Context, HighLevelRuntime *);
+  // the solutions stacked in the order of the systems, with
+  //  leading dimension LD
+  void get_solutions(double *x, int LD,
+		     Context, HighLevelRuntime *) const;
+
+ private:
+  HodlrBatch(const HodlrBatch&);
+  HodlrBatch& operator=(const HodlrBatch&);
+
+  struct Group {
+    int first, count; // systems
+    int nrow;
+    LMatrix *U, *V, *K;
+    std::vector<double> hostU, hostV, hostK; // pending data
+  };
+
+  int rhs_cols;
+  int rank;
+  int threshold;
+  RankFunc rankFunc;
+  NodeArena arena;
+  std::vector<int> uroot, vroot; // in the arena
+  std::vector<int> group;        // of every system
+  std::vector<int> rowBeg;       // in its group
+  std::vector<Group> groups;
+};
+
+#endif // _BATCH_SOLVER_H
@@ -2,7 +2,9 @@
 #define __DIRECT_SOLVE
 
 #include <string>
+#include <vector>
 #include "hodlr_matrix.h"
+#include "host_node.h"
 
 /*
 void dirct_circulant_solve(double *soln, double *rhs, int rhs_rows, int rhs_cols, int r, double diag);
@@ -17,12 +19,26 @@ dirct_circulant_solve(std::string soln_file, int rand_seed,
 		      int r, double diag);
 */
 
-void compute_L2_error
+// relative L2 error of the solution in lr_mat against a dense solve
+//  of the circulant matrix
+double compute_L2_error
 (const HodlrMatrix &lr_mat, const long rand_seed, const int rhs_rows,
  const int nregions, const int rhs_cols, const int rank,
  const double diag,
  Context ctx, HighLevelRuntime *runtime);
 
 
-  
+// dense references for the checks of the test drivers, in the order
+//  of the tree rows
+
+// A (N x N, leading dimension N) from the blocks of a host tree,
+//  see read_host_tree()
+void dense_matrix(const std::vector<HostNode> &t, std::vector<double> &A);
+
+// relative L2 error of x against the dense solution of A X = B, or of
+//  A^T X = B when trans is set; B and x are N x nrhs
+double dense_solve_error
+(const std::vector<double> &A, int N, bool trans, const double *B,
+ const double *x, int nrhs);
+
 #endif
@@ -1,11 +1,33 @@
 #ifndef _FAST_SOLVER
 #define _FAST_SOLVER
 
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
 #include "legion.h"
 #include "hodlr_matrix.h"
+#include "hss_matrix.h"
 
 void register_solver_tasks();
+void register_coarse_tasks(); // coarse_solve.cc
+void register_inverse_tasks(); // selected_inverse.cc
+
+// the factors of a node kept by bfs_solve() with keep_factors: the
+//  node system V0Tu0, V1Tu1 and the LU of S for a node above the
+//  legion leaves, the pivots and node systems below it (F) for a
+//  legion leaf. The X_c = A_c^-1 u_c stay in the u columns of U.
+struct KeptFactors {
+  KeptFactors() : F(NULL), V0Tu0(NULL), V1Tu1(NULL), S(NULL) {}
+  LMatrix *F, *V0Tu0, *V1Tu1, *S;
+};
 
+// bfs_solve() works in place: the rhs columns of U end up holding the
+//  solution, the u columns A^-1 u, and the dense blocks in K are
+//  factored over. Unless keep_factors is set, the other factors are
+//  not kept, so a matrix is solved once; copies to be solved as well,
+//  e.g. from HodlrMatrix::shift(), are made before.
 class FastSolver {
  public:
   FastSolver();
@@ -18,6 +40,108 @@ class FastSolver {
   //void solve_bfs(HodlrMatrix &, int, Context, HighLevelRuntime *);
   void bfs_solve(HodlrMatrix &, const Range&,
 		 Context, HighLevelRuntime *);
+  // block Jacobi: bfs_solve() only solves the diagonal blocks of the
+  //  nodes at this level of the tree, skipping the nodes above it;
+  //  legion leaves above the level are solved as they are. 0 (the
+  //  default) solves A, a large level the legion leaves only.
+  void set_jacobi_level(int level) {jacobiLevel = level;}
+  // level synchronous bfs_solve(): the tree is solved one level at a
+  //  time, first all its leaf solves and reductions, then all its node
+  //  solves, then all its broadcasts, with an execution fence after
+  //  each step. Less overlap than the default dataflow order, but the
+  //  runtime analyzes every task against the tasks since the last
+  //  fence only.
+  void set_level_sync(bool sync) {levelSync = sync;}
+  // the nodes of the top k levels in one task: the subtrees below
+  //  are solved as usual, then their few V^T [d | u] columns are
+  //  reduced, one task does all the node solves above, and one task
+  //  per legion leaf applies the result. Fewer and larger tasks at
+  //  the top, where the runtime overhead dominates the flops. 0 (the
+  //  default) launches the top nodes as the others; not used with
+  //  block Jacobi, keep_states or keep_factors.
+  void set_coarse_levels(int k) {coarseLevels = k;}
+  // the nodes of the top k levels skip the node solve task: every
+  //  legion leaf below a node solves the small node system again from
+  //  the reduced V^T [d | u] and applies its own eta, so no eta is
+  //  sent back from one processor. 0 (the default) for none; not used
+  //  with keep_factors.
+  void set_replicated_levels(int k) {replicatedLevels = k;}
+  // sparse right hand sides: the legion leaves (numbered left to
+  //  right) where some rhs entry is not zero, see
+  //  HodlrMatrix::rhs_support(). Only the rhs columns are skipped:
+  //  bfs_solve() leaves them out of the V^T d reductions, node solves
+  //  and broadcasts of the subtrees without such a leaf. Every leaf
+  //  solve and u column reduction still runs, so the cost still
+  //  grows with N, not with the support. Empty (the default) for
+  //  dense right hand sides.
+  void set_rhs_support(const std::vector<int> &leaves);
+  // log|det A| from the dense leaves and the Schur complements met
+  //  by the last bfs_solve(), as a future of a double
+  Future log_determinant() const {return logdet;}
+
+  // keep the factors of every node (see KeptFactors), O(N r) more
+  //  memory, so that resolve() solves new right hand sides without
+  //  factoring A again
+  void keep_factors(bool keep) {keepFactors = keep;}
+  // A^-1 b, or A^-T b with transpose, for the b put in the rhs
+  //  columns with set_rhs() after A was solved by bfs_solve() with
+  //  keep_factors; b is overwritten by the solution. Only the rhs
+  //  columns are touched, with two node tasks and O(r) columns of
+  //  reductions and broadcasts per node, and A^T swaps the roles of
+  //  u and V in them.
+  void resolve(HodlrMatrix &, const Range&,
+	       Context, HighLevelRuntime *, bool transpose=false);
+  // the same for the subtree of A at unode, with the right hand sides
+  //  in the columns cols of target, a tree with the legion leaves of
+  //  unode, such as the U tree itself or a copy of an H-tiled V
+  void resolve(const Node *unode, const Node *vnode,
+	       const Node *target, const Range &cols, const Range&,
+	       bool transpose, Context, HighLevelRuntime *);
+
+  // keep a copy of the U regions of every subtree as it is after the
+  //  subtree is solved, for update(); this is O(log N) copies of U
+  void keep_states(bool keep) {keepStates = keep;}
+  // work is base.shift(work, 0) solved by bfs_solve() with
+  //  keep_states. after the dense blocks of base changed in a few
+  //  legion leaves (numbered left to right), the solution of work is
+  //  brought up to date by solving these leaves again and the nodes
+  //  on their paths to the root; the other subtrees start from their
+  //  kept state, so no other factorization is redone. The nodes are
+  //  solved with the settings of the last bfs_solve() (block Jacobi,
+  //  rhs support, replicated levels).
+  void update(const HodlrMatrix &base, HodlrMatrix &work,
+	      const std::vector<int> &leaves, const Range&,
+	      Context, HighLevelRuntime *);
+
+  // (A + W Z^T) X = B by Sherman-Morrison-Woodbury, for a rank k
+  //  update. The matrix is made with nrhs+k right hand side columns:
+  //  B goes into the first nrhs ones with set_rhs(), and
+  //  set_low_rank_update() writes W (N x k, leading dimension LD)
+  //  into the last k and keeps a copy of Z. The next bfs_solve()
+  //  gives A^-1 B and A^-1 W in one launch, then woodbury_solution()
+  //  solves the k x k system I + Z^T A^-1 W and returns X (N x nrhs).
+  //  W, Z, B and X are in the input order of the rows.
+  void set_low_rank_update(HodlrMatrix &, const double *W,
+			   const double *Z, int k, int LD,
+			   Context, HighLevelRuntime *);
+  void woodbury_solution(const HodlrMatrix &, double *X, int LD,
+			 Context, HighLevelRuntime *) const;
+
+  // diag(A^-1) in the input order of the rows, after bfs_solve() of A
+  //  with keep_factors and no jacobi level. A_c^-1 u comes from the
+  //  solved U and resolve() with A_c^T gives A_c^-T v of every node
+  //  c, then one task per node inverts the small C = I + Z^T D^-1 W
+  //  from the kept factors and one task per legion leaf sums its rows
+  //  of the diagonal, O(N r^2 log N) flops on top of the resolves.
+  void diag_inverse(const HodlrMatrix &, double *diag, const Range&,
+		    Context, HighLevelRuntime *);
+
+  // HSS matrices: the generators are overwritten by the factors,
+  //  and hss_solve() overwrites the right hand sides by the solution
+  void hss_factor(HssMatrix &, const Range&,
+		  Context, HighLevelRuntime *);
+  void hss_solve(HssMatrix &, const Range&,
+		 Context, HighLevelRuntime *);
  
   void display_launch_time() const {
     std::cout << "Time for launching solve-tasks : " << time_launcher
@@ -26,6 +150,22 @@ class FastSolver {
  private:
   void solve_dfs(Node *, Node *, Range,
 		 Context, HighLevelRuntime *);
+  void solve_bfs(Node *, Node *, Range,
+		 Context, HighLevelRuntime *);
+  void solve_levels(std::list<Node *> &, std::list<Node *> &,
+		    std::list<Range> &, std::list<int> &, int,
+		    double &, double &, double &,
+		    Context, HighLevelRuntime *);
+  void update(const Node *, const Node *, Node *, Node *, Range, int,
+	      const std::vector<int> &, int &,
+	      Context, HighLevelRuntime *);
+  Future solve_coarse(Node *, Node *, const Range&,
+		      Context, HighLevelRuntime *);
+  void save_state(const Node *, Range, Context, HighLevelRuntime *);
+  void restore_state(Node *, Range, Context, HighLevelRuntime *);
+  void sum_log_det(Range, Context, HighLevelRuntime *);
+  bool mark_zero_rhs(const Node *, int &);
+  KeptFactors *kept_factors(const Node *);
 
     /*
   void solve_bfs(Node *, Node *, Range, 
@@ -37,6 +177,23 @@ class FastSolver {
   */
  private:
   double time_launcher; // time of launching all the tasks
+  Future logdet;
+  std::map<const Node *, Future> nodeDet; // log|det| of every step
+  bool keepFactors;
+  std::map<const Node *, KeptFactors> factors;
+  bool keepStates;
+  // U regions of the legion leaves of a subtree after its solve
+  std::map<const Node *, std::vector<LMatrix *> > state;
+  // Z of the low rank update, N x rankZ
+  std::vector<double> Zmat;
+  int rankZ;
+  int jacobiLevel;
+  std::vector<int> rhsSupport;
+  std::set<const Node *> zeroRhs; // subtrees with zero rhs
+  int rhsCols;
+  bool levelSync;
+  int coarseLevels;
+  int replicatedLevels;
 };
 
 
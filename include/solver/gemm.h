@@ -25,7 +25,19 @@ void gemm_reduce
    double& tCreate,
    Context ctx, HighLevelRuntime *runtime);
 
+// the same with the column range rv of v, e.g. Gram matrices
+//  of u columns: res = u(ru)^T * u(ru)
+void gemm_reduce
+  (const double alpha,
+   const Node *v, const Range &rv, const Node *u, const Range &ru,
+   const double beta,   LMatrix *(&result),  const Range taskTag,
+   double& tCreate,
+   Context ctx, HighLevelRuntime *runtime);
+
 
+// v(rv) = beta * v(rv) + alpha * u(ru) * eta, with u and v of the
+//  same legion leaves; u is usually v itself, but can also be
+//  another tree such as an H-tiled V
 void gemm_broadcast
   (const double alpha, const Node * u, const Range &ru,
    LMatrix *(&eta),
@@ -0,0 +1,88 @@
+#ifndef _KRYLOV_H
+#define _KRYLOV_H
+
+#include "fast_solver.h"
+#include "hodlr_matrix.h"
+#include "peeling.h" // MatvecFunc
+
+#include "legion.h"
+
+using namespace LegionRuntime::HighLevel;
+
+// z = M^-1 r for an HODLR approximation M of A, usually built with
+//  a low rank and a loose tolerance, or a jacobi level so that only
+//  the diagonal blocks of that level are solved (see
+//  FastSolver::set_jacobi_level()). M is solved in place once, with
+//  keep_factors, and every application is a FastSolver::resolve() of
+//  the first rhs column from the kept factors, O(N r log N) flops.
+//  time_per_apply() includes waiting for z in the calling task.
+class HodlrPreconditioner {
+ public:
+  HodlrPreconditioner(HodlrMatrix &M, const Range &procs,
+		      Context, HighLevelRuntime *, int jacobiLevel=0);
+
+  // r and z have N entries in the input order of the rows
+  void apply(const double *r, double *z,
+	     Context, HighLevelRuntime *);
+  int  size() const {return M.uroot->nrow;}
+  double time_per_apply() const {return nApply ? tApply/nApply : 0;}
+
+ private:
+  HodlrMatrix &M;
+  FastSolver  solver;
+  Range       procs;
+  int         nApply;
+  double      tApply;
+};
+
+// y = A x with the HODLR matrix A, distributed as the solve is: one
+//  task per legion leaf for its own block, then per node the V^T x
+//  reductions and the u broadcasts of the solve, on the same mapping
+//  tags, O(N r log N) flops. x and y live in regions of their own,
+//  one per legion leaf. A is read, so it must not be solved.
+class HodlrOperator {
+ public:
+  HodlrOperator(const HodlrMatrix &A, const Range &procs,
+		Context, HighLevelRuntime *);
+  void destroy(Context, HighLevelRuntime *);
+
+  // x and y have N entries in the input order of the rows
+  void apply(const double *x, double *y,
+	     Context, HighLevelRuntime *);
+  int  size() const {return A.uroot->nrow;}
+
+ private:
+  const HodlrMatrix &A;
+  Range     procs;
+  NodeArena xy; // per legion leaf, x and y in the two columns
+};
+
+// Right preconditioned GMRES(restart) for A x = b, with A given by
+//  its matvec (only the product with one column is used) or as an
+//  HodlrOperator, and M by the HODLR preconditioner, or no
+//  preconditioner when M is NULL. The Krylov vectors are kept in the
+//  calling task. x holds the initial guess and gets the solution.
+//  Stops when |b - A x| <= tol |b| or after maxit products with A,
+//  and returns the number of products; relres gets the final
+//  relative residual.
+int gmres
+  (MatvecFunc A, HodlrPreconditioner *M, int N, const double *b,
+   double *x, int restart, int maxit, double tol,
+   Context, HighLevelRuntime *, double *relres=NULL);
+int gmres
+  (HodlrOperator &A, HodlrPreconditioner *M, const double *b,
+   double *x, int restart, int maxit, double tol,
+   Context, HighLevelRuntime *, double *relres=NULL);
+
+// Preconditioned conjugate gradients, for A and M symmetric positive
+//  definite; the arguments are those of gmres().
+int pcg
+  (MatvecFunc A, HodlrPreconditioner *M, int N, const double *b,
+   double *x, int maxit, double tol,
+   Context, HighLevelRuntime *, double *relres=NULL);
+int pcg
+  (HodlrOperator &A, HodlrPreconditioner *M, const double *b,
+   double *x, int maxit, double tol,
+   Context, HighLevelRuntime *, double *relres=NULL);
+
+#endif // _KRYLOV_H
@@ -0,0 +1,21 @@
+#ifndef _RECOMPRESS_H
+#define _RECOMPRESS_H
+
+#include "hodlr_matrix.h"
+#include "legion.h"
+
+using namespace LegionRuntime::HighLevel;
+
+void register_recompress_tasks();
+
+// truncates every off-diagonal block u * V^T of a populated matrix
+//  to the relative tolerance tol, i.e. singular values below
+//  tol * sigma_max are dropped, keeping at least one.
+// node ranks are updated and the U, V and H-tiled regions are
+//  rebuilt at the new ranks. blocks above the legion leaves are
+//  reduced over the tree, those below are done inside one task per
+//  legion leaf. returns the number of columns removed.
+int recompress(HodlrMatrix &matrix, double tol, const Range &tag,
+	       Context ctx, HighLevelRuntime *runtime);
+
+#endif // _RECOMPRESS_H
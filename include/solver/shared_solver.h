@@ -0,0 +1,65 @@
+#ifndef _SHARED_SOLVER_H
+#define _SHARED_SOLVER_H
+
+#include <utility>
+#include <vector>
+
+#include "host_node.h"
+#include "thread_pool.h"
+
+// The solve of FastSolver::bfs_solve() on one shared memory node,
+//  without the Legion runtime. The blocks are given as a host tree
+//  (host_node.h) and copied into U, V and K buffers of the layout of
+//  a single legion leaf. The subtrees of at most leafSize real leaves
+//  are the leaf tasks, and every node above them gets the tasks
+//  visit() launches: a reduction per leaf task below either child, a
+//  node solve, and a broadcast per leaf task. They run as a DAG on a
+//  ThreadPool with the kernels of the Legion tasks (solver_kernels.h).
+class SharedSolver {
+ public:
+  SharedSolver(const std::vector<HostNode> &t, int rhs_cols,
+	       int leafSize);
+
+  // x (N x rhs_cols, leading dimension LD) holds b on input and gets
+  //  A^-1 b. t has to be the tree given to the constructor; as with
+  //  the Legion solve, the factors are not kept, so every solve
+  //  copies the blocks again. returns log|det A|.
+  double solve(const std::vector<HostNode> &t, double *x, int LD,
+	       ThreadPool &pool);
+
+  int size()          const {return arena.at(uroot)->nrow;}
+  int get_num_leaf()  const {return leaves.size();}
+
+ private:
+  SharedSolver(const SharedSolver&);
+  SharedSolver& operator=(const SharedSolver&);
+
+  struct Job {
+    SharedSolver *solver;
+    int    kind;
+    int    node;  // the leaf, the parent for a node solve, else a child
+    int    leaf;  // rows of a reduction or broadcast
+    int    slot;  // partial of a reduction, or W of the left child
+    int    slot2; // W of the right child, or eta of a broadcast
+    double logdet;
+  };
+  static void run_job(void *);
+  void build(const std::vector<HostNode> &t, int i, int u, int col_beg);
+  int  mark_leaves(int u, int leafSize);
+  void add_jobs(int u, std::vector<int> &last,
+		std::vector<std::pair<int, int> > &deps);
+
+  int rhs_cols;
+  NodeArena arena;
+  int uroot, vroot;  // the V node of U node u is u - uroot + vroot
+  std::vector<int> leaves; // U nodes of the leaf tasks
+  std::vector<int> first;  // of the leaves below every U node
+  std::vector<int> count;
+  std::vector<double> U, V, K;
+
+  // per solve
+  std::vector<Job> jobs;
+  std::vector<std::vector<double> > partial; // of the reductions
+};
+
+#endif // _SHARED_SOLVER_H
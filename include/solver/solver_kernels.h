@@ -0,0 +1,71 @@
+#ifndef _SOLVER_KERNELS_H
+#define _SOLVER_KERNELS_H
+
+#include "node.h"
+
+// The arithmetic of the solver tasks on plain column major buffers,
+//  shared by the Legion tasks and the shared memory solver
+//  (shared_solver.h). Nothing here depends on the runtime.
+
+// the whole subtree below a legion leaf solved in place in the U
+//  region, as done by the leaf solve task: K gets the LU factors of
+//  the dense blocks and U the solution. returns log|det|. With f_ptr
+//  the rest of the factors is kept there for serial_leaf_resolve():
+//  per node in preorder, the LU of the node system and its pivots,
+//  or the pivots of a dense block, leaf_factor_size() doubles.
+double serial_leaf_solve
+  (Node * unode, Node * vnode,
+   double * u_ptr, double * v_ptr, double * k_ptr, int LD,
+   double * f_ptr=NULL);
+int leaf_factor_size(const Node *unode);
+
+// A^-1 b, or A^-T b with trans, for the subtree of a legion leaf
+//  solved by serial_leaf_solve() with f_ptr: the factors are in K
+//  and f_ptr, and the u columns of U hold A_c^-1 u_c of every node c.
+//  b (ncol columns, leading dimension LD) is overwritten.
+void serial_leaf_resolve
+  (bool trans, int ncol, const Node * unode, const Node * vnode,
+   const double * u_ptr, const double * v_ptr, const double * k_ptr,
+   const double * f_ptr, int LD, double * b_ptr);
+
+// y = A x for the subtree of a legion leaf from its unsolved U, V
+//  and K; x and y have ncol columns and leading dimension LD.
+void serial_leaf_matvec
+  (int ncol, const Node * unode, const Node * vnode,
+   const double * u_ptr, const double * v_ptr, const double * k_ptr,
+   int LD, const double * x_ptr, double * y_ptr);
+
+// the node system [I, V0Tu0; V1Tu1, I] [eta1; eta0] = [V0Td0; V1Td1]
+//  with V0Tu0 (n0 x n1), V1Tu1 (n1 x n0) and ncol right hand sides.
+//  eta0 overwrites V1Td1 and eta1 overwrites V0Td0. returns log|det|
+//  of the Schur complement S = I - V1Tu1*V0Tu0. With S_lu the LU of
+//  S (n1 x n1) and its pivots (n1 more) are kept there.
+double node_solve_kernel
+  (int n0, int n1, int ncol,
+   const double *V0Tu0, int LD0, const double *V1Tu1, int LD1,
+   double *V0Td0, int LDd0, double *V1Td1, int LDd1,
+   double *S_lu=NULL);
+
+// the node system again from the kept V0Tu0, V1Tu1 and S_lu, for the
+//  ncol columns of first (n0 rows) and second (n1 rows). For A,
+//  first = V0^T d0 and second = V1^T d1 in, eta1 and eta0 out as in
+//  node_solve_kernel(); for A^T (trans), first = X1^T c1 and second
+//  = X0^T c0 with X_c = A_c^-1 u_c, then the two solves with S^T.
+void node_resolve_kernel
+  (bool trans, int n0, int n1, int ncol,
+   const double *V0Tu0, const double *V1Tu1, const double *S_lu,
+   double *first, int LDf, double *second, int LDs);
+
+// w = alpha * v^T * u + beta * w, with v (k x m) and u (k x n)
+void gemm_reduce_kernel
+  (int m, int n, int k, double alpha,
+   const double *v, int LDv, const double *u, int LDu,
+   double beta, double *w, int LDw);
+
+// d = beta * d + alpha * u * eta, with u (m x k) and eta (k x n)
+void gemm_broadcast_kernel
+  (int m, int n, int k, double alpha,
+   const double *u, int LDu, const double *eta, int LDeta,
+   double beta, double *d, int LDd);
+
+#endif // _SOLVER_KERNELS_H
@@ -2,6 +2,7 @@
 #define _SOLVER_TASKS_H
 
 #include "hodlr_matrix.h"
+#include "solver_kernels.h"
 #include "legion.h"
 
 using namespace LegionRuntime::HighLevel;
@@ -10,17 +11,65 @@ using namespace LegionRuntime::HighLevel;
 void register_solver_operators();
 
 
-void solve_node_matrix
+// both return a future of log|det| of the Schur complement, or of
+//  the whole legion leaf block
+//  With S the LU factors of the node system are kept there (n1 x
+//  n1+1, see node_solve_kernel()), with F those of the legion leaf
+//  (leaf_factor_size() x 1, see serial_leaf_solve()).
+Future solve_node_matrix
 (LMatrix *(&V0Tu0), LMatrix *(&V1Tu1),
  LMatrix *(&V0Td0), LMatrix *(&V1Td1),
  Range task_tag,
+ Context ctx, HighLevelRuntime *runtime,
+ LMatrix *S=NULL);
+
+
+// solve_node_matrix() and the broadcasts of its eta in one step: the
+//  node system is solved again by a task in every legion leaf below
+//  b0 and b1, which then applies its own eta to the leaf, d -= u *
+//  eta. The V^T d inputs are left as they are. Trades r^3 flops per
+//  leaf for the round trip through the processor of the node solve.
+Future solve_node_replicated
+(LMatrix *V0Tu0, LMatrix *V1Tu1,
+ LMatrix *V0Td0, LMatrix *V1Td1,
+ const Node *b0, const Range &ru0, const Range &rd0,
+ const Node *b1, const Range &ru1, const Range &rd1,
+ Range tag0, Range tag1,
  Context ctx, HighLevelRuntime *runtime);
 
 
-void
+Future
 solve_legion_leaf(const Node * uleaf, const Node * vleaf,
 		  const Range task_tag,
-		  Context ctx, HighLevelRuntime *runtime);
+		  Context ctx, HighLevelRuntime *runtime,
+		  LMatrix *F=NULL);
+
+
+// the same again from the kept factors, with A or A^T (trans), for
+//  the columns cols of target: a tree with the legion leaves of
+//  uleaf, e.g. the U tree itself for its rhs columns. first and
+//  second are as in node_resolve_kernel().
+void resolve_legion_leaf
+(bool trans, const Node *uleaf, const Node *vleaf, LMatrix *F,
+ const Node *target, const Range &cols, const Range task_tag,
+ Context ctx, HighLevelRuntime *runtime);
 
+// y = A x for the subtree of a legion leaf, from the columns xcols
+//  into ycols of target, a tree with the legion leaves of uleaf. U
+//  and K must not have been solved.
+void matvec_legion_leaf
+(const Node *uleaf, const Node *vleaf, const Node *target,
+ const Range &xcols, const Range &ycols, const Range task_tag,
+ Context ctx, HighLevelRuntime *runtime);
+
+void resolve_node_matrix
+(bool trans, LMatrix *V0Tu0, LMatrix *V1Tu1, LMatrix *S,
+ LMatrix *first, LMatrix *second, const Range task_tag,
+ Context ctx, HighLevelRuntime *runtime);
+
+// a future of the sum of double futures
+Future sum_futures
+(const std::vector<Future> &, int task_tag,
+ Context ctx, HighLevelRuntime *runtime);
   
 #endif // _SOLVER_TASKS_H
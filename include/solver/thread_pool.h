@@ -0,0 +1,67 @@
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+// A pool of worker threads running a DAG of tasks. Every worker keeps
+//  a deque of ready tasks: it takes its own newest task first and,
+//  when empty, steals the oldest task of another worker. A finished
+//  task makes its successors ready on the deque of the same worker,
+//  so a chain along the tree stays on one thread. The calling thread
+//  only waits in run().
+class ThreadPool {
+ public:
+  typedef void (*TaskFunc)(void *arg);
+
+  explicit ThreadPool(int nthreads);
+  ~ThreadPool();
+
+  int  size() const {return nthreads;}
+
+  // a task to be run after every task it is added a dependence on;
+  //  returns its id
+  int  add_task(TaskFunc f, void *arg);
+  void add_dependence(int before, int after);
+
+  // runs the tasks added since the last run and waits for them
+  void run();
+
+ private:
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
+
+  struct Task {
+    TaskFunc func;
+    void    *arg;
+    int      deps; // unfinished predecessors
+    std::vector<int> succ;
+  };
+  struct Worker {
+    ThreadPool     *pool;
+    int             id;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    std::deque<int> ready;
+  };
+
+  static void *work(void *);
+  bool next_task(int id, int &task);
+  void finish(int id, int task);
+  void push(int id, int task);
+
+  int nthreads;
+  std::vector<Task>    tasks;
+  std::vector<Worker>  workers;
+
+  pthread_mutex_t lock;    // guards the members below
+  pthread_cond_t  start;   // a new run
+  pthread_cond_t  done;    // the last task of a run finished
+  int  round;
+  int  remaining;          // tasks of the run not finished yet
+  bool quit;
+};
+
+#endif // _THREAD_POOL_H
@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "clustering.h"
+
+namespace {
+  // orders point indices by their projection on an axis
+  struct ByProjection {
+    const std::vector<double> *proj;
+    bool operator()(int a, int b) const {return (*proj)[a] < (*proj)[b];}
+  };
+}
+
+// axis of the bounding box with the largest extent
+static void widest_axis
+(const double *points, int dim, const int *idx, int n, double *axis) {
+  int    best  = 0;
+  double width = -1;
+  for (int d=0; d<dim; d++) {
+    double lo = points[idx[0]*dim+d], hi = lo;
+    for (int i=1; i<n; i++) {
+      lo = std::min(lo, points[idx[i]*dim+d]);
+      hi = std::max(hi, points[idx[i]*dim+d]);
+    }
+    if (hi - lo > width) {width = hi - lo; best = d;}
+  }
+  for (int d=0; d<dim; d++)
+    axis[d] = (d == best) ? 1.0 : 0.0;
+}
+
+// leading eigenvector of the covariance by power iteration, started
+//  from the widest axis
+static void principal_axis
+(const double *points, int dim, const int *idx, int n, double *axis) {
+  std::vector<double> mean(dim, 0.0), C(dim*dim, 0.0);
+  for (int i=0; i<n; i++)
+    for (int d=0; d<dim; d++)
+      mean[d] += points[idx[i]*dim+d] / n;
+  for (int i=0; i<n; i++) {
+    const double *p = points + idx[i]*dim;
+    for (int a=0; a<dim; a++)
+      for (int b=0; b<dim; b++)
+	C[a+b*dim] += (p[a]-mean[a]) * (p[b]-mean[b]);
+  }
+
+  widest_axis(points, dim, idx, n, axis);
+  std::vector<double> y(dim);
+  for (int it=0; it<50; it++) {
+    double norm = 0;
+    for (int a=0; a<dim; a++) {
+      y[a] = 0;
+      for (int b=0; b<dim; b++)
+	y[a] += C[a+b*dim] * axis[b];
+      norm += y[a]*y[a];
+    }
+    norm = sqrt(norm);
+    if (norm == 0) return; // all points coincide
+    for (int a=0; a<dim; a++)
+      axis[a] = y[a] / norm;
+  }
+}
+
+static void cluster_node
+(const Node *node, const double *points, int dim, int *idx,
+ ClusterMethod method, std::vector<double> &proj) {
+
+  if (node->is_real_leaf()) return;
+  int n  = node->nrow;
+  int nl = node->lchild()->nrow;
+  assert(n == nl + node->rchild()->nrow);
+
+  std::vector<double> axis(dim);
+  if (method == CLUSTER_KD)
+    widest_axis(points, dim, idx, n, &axis[0]);
+  else
+    principal_axis(points, dim, idx, n, &axis[0]);
+
+  // projections are indexed by point, so the comparison is stable
+  //  while nth_element moves the indices around
+  for (int i=0; i<n; i++) {
+    int p = idx[i];
+    proj[p] = 0;
+    for (int d=0; d<dim; d++)
+      proj[p] += points[p*dim+d] * axis[d];
+  }
+  ByProjection less = {&proj};
+  std::nth_element(idx, idx+nl, idx+n, less);
+
+  cluster_node(node->lchild(), points, dim, idx,    method, proj);
+  cluster_node(node->rchild(), points, dim, idx+nl, method, proj);
+}
+
+void cluster_points
+(const Node *root, int dim, double *points, std::vector<int> &perm,
+ ClusterMethod method) {
+
+  assert(dim > 0);
+  int n = root->nrow;
+  perm.resize(n);
+  for (int i=0; i<n; i++)
+    perm[i] = i;
+  std::vector<double> proj(n);
+  cluster_node(root, points, dim, &perm[0], method, proj);
+
+  std::vector<double> copy(points, points + n*dim);
+  for (int i=0; i<n; i++)
+    memcpy(points + i*dim, &copy[perm[i]*dim], dim*sizeof(double));
+}
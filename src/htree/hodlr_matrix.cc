@@ -1,10 +1,22 @@
+#include <algorithm>
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
 #include "hodlr_matrix.h"
 #include "init_matrix_tasks.h"
+#include "kernel_matrix_tasks.h"
 #include "lapack_blas.h"
 #include "macros.h"
 
-void create_Vtree
-(Node *unode, Node *vnode);
+int create_Vtree
+(NodeArena &arena, int uroot);
+
+void create_Htree
+(NodeArena &arena, int vroot);
 
 void init_UMat
 (Node* node, const LMatrixArray& matQ, size_t& first);
@@ -24,18 +36,21 @@ HodlrMatrix::HodlrMatrix
  int r, int t, int ls, const std::string& name)
   : rhs_cols(col), rhs_rows(row),
     gloLevel(gl),  subLevel(sl),
-    rank(r),       threshold(t),
+    rank(r),       rankFunc(NULL),
+    threshold(t),
     leafSize(ls),  nLegionLeaf(0),
+    smallLeaves(4),
+    nProc(1),      nCore(1),
+    tasksPerCore(4),
     timeInit(0)
 {
   this->file_rhs  = name + "_rhs.txt";
   this->file_soln = name + "_soln.txt";
 }
 
-static void create_balanced_tree
-  (Node *, int, int);
-static int mark_legion_leaf
-(Node *node, const int threshold, int&);
+static int level_rank(RankFunc, int, int, int);
+static void mark_legion_leaf_auto
+(Node *node, const double budget, int&);
 //static int mark_launch_node
 //(Node *node, int threshold);
 static void create_legion_node
@@ -45,15 +60,43 @@ void HodlrMatrix::create_tree
 (Context ctx, HighLevelRuntime *runtime,
  const LMatrixArray* matArr) {
 
-  int nRHS = rhs_cols + rank*(gloLevel-subLevel);
-  uroot = new Node(rhs_rows, nRHS);
+  // u columns of the levels above the sub problem, read off the
+  //  global tree the sub problems are cut from; the sub problems
+  //  have the same size, so the first path stands for all of them
+  int nRHS = rhs_cols;
+  if (launch_level() > 0) {
+    NodeArena global;
+    int gidx = global.alloc();
+    *global.at(gidx) = Node(rhs_rows << launch_level(), 0);
+    create_weighted_tree(global, gidx, rank, rankFunc, 0, threshold);
+    const Node *node = global.at(gidx);
+    for (int l=1; l<=launch_level(); l++) {
+      node = node->lchild();
+      nRHS += node->ncol;
+    }
+    assert(node->nrow == rhs_rows);
+  }
+  arena.clear();
+  int uidx = arena.alloc();
+  *arena.at(uidx) = Node(rhs_rows, nRHS);
 
   // create the H-tree for U matrices
-  create_balanced_tree(uroot, rank, threshold);
+  create_weighted_tree(arena, uidx, rank, rankFunc, launch_level(),
+		       threshold);
+  uroot = arena.at(uidx);
 
   // set legion leaf for granularity control
   // nleaf is initialized to 0 in the constructor
-  mark_legion_leaf(uroot, leafSize, nLegionLeaf);
+  double budget = leaf_budget();
+  if (uroot->cost <= smallLeaves * budget) {
+    // small problems skip the task decomposition: the whole solve
+    //  is the serial recursion of a single leaf task
+    mark_legion_leaf(uroot, INT_MAX, nLegionLeaf);
+  } else if (leafSize > 0) {
+    mark_legion_leaf(uroot, leafSize, nLegionLeaf);
+  } else {
+    mark_legion_leaf_auto(uroot, budget, nLegionLeaf);
+  }
   
   // create region at legion leaf
   if (matArr == NULL) {
@@ -64,10 +107,13 @@ void HodlrMatrix::create_tree
     init_UMat(uroot, *matArr, first);
   }
 
-  // create V tree
-  int v_rhs = 0; // no rhs
-  vroot = new Node(uroot->nrow, v_rhs);
-  create_Vtree(uroot, vroot);
+  // create V tree and the H-tiled matrices hanging on it;
+  // the arena may move while growing, so fetch roots afterwards
+  int vidx = create_Vtree(arena, uidx);
+  create_Htree(arena, vidx);
+  uroot = arena.at(uidx);
+  vroot = arena.at(vidx);
+  
   create_Vregions(vroot, ctx, runtime);
   create_Kregions(vroot, ctx, runtime);
   
@@ -95,6 +141,8 @@ void HodlrMatrix::init_circulant_matrix
 (const double diag, const Range& taskTag,
  Context ctx, HighLevelRuntime *runtime, bool skipU) {
 
+  // the circulant blocks have the same rank on all levels
+  assert(rankFunc == NULL);
   Timer t; t.start();
   if (!skipU) {
     init_Umat(uroot, taskTag, ctx, runtime);     // row_beg = 0
@@ -108,6 +156,169 @@ void HodlrMatrix::init_circulant_matrix
   //print_legion_tree(vroot);
 }
 
+void HodlrMatrix::init_kernel_matrix
+(const int kernel, const double *data, const int ndata,
+ const double tol, const Range& taskTag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  Timer t; t.start();
+  fill_kernel_matrix(uroot, vroot, kernel, data, ndata, tol, taskTag,
+		     ctx, runtime);
+  t.stop();
+  timeInit += t.get_elapsed_time();
+}
+
+void HodlrMatrix::init_matvec_matrix
+(MatvecFunc matvec, const long seed,
+ Context ctx, HighLevelRuntime *runtime, int oversample) {
+
+  Timer t; t.start();
+  fill_peeled_matrix(uroot, vroot, rhs_cols, matvec, oversample, seed,
+		     ctx, runtime);
+  t.stop();
+  timeInit += t.get_elapsed_time();
+}
+
+// a new region of the same size; the copied nodes still point to
+//  the regions of the base
+static void recreate_matrix
+(LMatrix *(&matrix), Context ctx, HighLevelRuntime *runtime) {
+  const LMatrix *m = matrix;
+  create_matrix(matrix, m->rows, m->cols, ctx, runtime);
+  matrix->seed = m->seed; // same rhs
+}
+
+static void recreate_Hmat
+(Node *Hmat, Context ctx, HighLevelRuntime *runtime) {
+  if (Hmat->is_real_leaf())
+    recreate_matrix(Hmat->lowrank_matrix, ctx, runtime);
+  else {
+    recreate_Hmat(Hmat->lchild(), ctx, runtime);
+    recreate_Hmat(Hmat->rchild(), ctx, runtime);
+  }
+}
+
+// U and K regions, and the V and H-tiled ones as well with newV
+static void create_shift_regions
+(Node *unode, Node *vnode, bool newV,
+ Context ctx, HighLevelRuntime *runtime) {
+  if (unode->is_legion_leaf()) {
+    recreate_matrix(unode->lowrank_matrix, ctx, runtime);
+    recreate_matrix(vnode->dense_matrix,   ctx, runtime);
+    if (newV)
+      recreate_matrix(vnode->lowrank_matrix, ctx, runtime);
+  } else {
+    if (newV) {
+      recreate_Hmat(vnode->lchild()->Hmat(), ctx, runtime);
+      recreate_Hmat(vnode->rchild()->Hmat(), ctx, runtime);
+    }
+    create_shift_regions(unode->lchild(), vnode->lchild(), newV,
+			 ctx, runtime);
+    create_shift_regions(unode->rchild(), vnode->rchild(), newV,
+			 ctx, runtime);
+  }
+}
+
+void shift_leaves
+(const Node *ubase, const Node *vbase, const Node *unode,
+ const Node *vnode, double sigma, Range tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  if (ubase->is_legion_leaf()) {
+    ShiftMatrixTask::TaskArgs args = {sigma};
+    int size = sizeof(args) + sizeof(int)*pack_tree_size(vbase);
+    std::vector<char> buf(size);
+    memcpy(&buf[0], &args, sizeof(args));
+    pack_tree(vbase, (int *)&buf[sizeof(args)]);
+
+    ShiftMatrixTask launcher(TaskArgument(&buf[0], size),
+			     Predicate::TRUE_PRED,
+			     0,
+			     tag.begin());
+    LogicalRegion regions[4] = {ubase->lowrank_matrix->data,
+				vbase->dense_matrix->data,
+				unode->lowrank_matrix->data,
+				vnode->dense_matrix->data};
+    for (int i=0; i<4; i++)
+      launcher.add_region_requirement(
+	RegionRequirement(regions[i],
+			  i < 2 ? READ_ONLY : WRITE_DISCARD,
+			  EXCLUSIVE,
+			  regions[i]).add_field(FID_X));
+    Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+    f.get_void_result();
+    printf("Waiting for shift ...\n");
+#endif
+  } else {
+    Range ltag = tag.lchild(ubase->split_fraction());
+    Range rtag = tag.rchild(ubase->split_fraction());
+    shift_leaves(ubase->lchild(), vbase->lchild(), unode->lchild(),
+		 vnode->lchild(), sigma, ltag, ctx, runtime);
+    shift_leaves(ubase->rchild(), vbase->rchild(), unode->rchild(),
+		 vnode->rchild(), sigma, rtag, ctx, runtime);
+  }
+}
+
+// same parameters and a copy of the tree, still pointing to the
+//  regions of this matrix
+void HodlrMatrix::copy_tree
+(HodlrMatrix &target, const std::string &prefix) const {
+  target.rhs_cols     = rhs_cols;
+  target.rhs_rows     = rhs_rows;
+  target.gloLevel     = gloLevel;
+  target.subLevel     = subLevel;
+  target.rank         = rank;
+  target.rankFunc     = rankFunc;
+  target.threshold    = threshold;
+  target.leafSize     = leafSize;
+  target.nLegionLeaf  = nLegionLeaf;
+  target.smallLeaves  = smallLeaves;
+  target.nProc        = nProc;
+  target.nCore        = nCore;
+  target.tasksPerCore = tasksPerCore;
+  target.perm         = perm;
+  target.timeInit     = 0;
+  target.file_rhs     = prefix + file_rhs;
+  target.file_soln    = prefix + file_soln;
+
+  // same tree, copied as a block
+  target.arena.clear();
+  int first = target.arena.alloc(arena.size());
+  for (int i=0; i<arena.size(); i++)
+    *target.arena.at(first+i) = *arena.at(i);
+  target.uroot = target.arena.at(first + arena.index(uroot));
+  target.vroot = target.arena.at(first + arena.index(vroot));
+}
+
+void HodlrMatrix::shift
+(HodlrMatrix &target, const double sigma, const Range& taskTag,
+ Context ctx, HighLevelRuntime *runtime) const {
+
+  assert(&target != this);
+  if (target.uroot == NULL) {
+    copy_tree(target, "shifted_");
+    create_shift_regions(target.uroot, target.vroot, false,
+			 ctx, runtime);
+  }
+
+  Timer t; t.start();
+  shift_leaves(uroot, vroot, target.uroot, target.vroot, sigma,
+	       taskTag, ctx, runtime);
+  t.stop();
+  target.timeInit += t.get_elapsed_time();
+}
+
+void HodlrMatrix::shift
+(const std::vector<HodlrMatrix *> &targets,
+ const std::vector<double> &sigmas, const Range& taskTag,
+ Context ctx, HighLevelRuntime *runtime) const {
+
+  assert(targets.size() == sigmas.size());
+  for (size_t s=0; s<targets.size(); s++)
+    shift(*targets[s], sigmas[s], taskTag, ctx, runtime);
+}
+
 /*
 // TODO: implement change array to queue
 *lowrank_matrix = matQ.front(); // the first one
@@ -123,8 +334,8 @@ void init_UMat
     *node->lowrank_matrix = matQ[first++];
   }
   else {
-    init_UMat(node->lchild, matQ, first);
-    init_UMat(node->rchild, matQ, first);
+    init_UMat(node->lchild(), matQ, first);
+    init_UMat(node->rchild(), matQ, first);
   }
 }
 
@@ -135,36 +346,110 @@ void HodlrMatrix::init_from_regions(const LMatrixArray& matArr) {
 }
 */
 
-/*static*/ void create_balanced_tree
-(Node *node, int rank, int threshold) {
-    
-  // sub-divide the matrix
-  int N = node->nrow;
-  if (N > threshold) {
+// estimated flops to solve a subtree of nrow rows split into
+//  nleaf dense blocks: LU of the blocks plus the products with the
+//  rank-r blocks of all the levels above them.
+static double subtree_cost(int nrow, int nleaf, int rank) {
+  int depth = 0;
+  while ((1 << depth) < nleaf)
+    depth++;
+  double b    = (double)nrow / nleaf; // dense block size
+  double ncol = (double)rank * depth; // u columns in the subtree
+  double leaf = nleaf * (2./3.*b*b*b + 2.*b*b*ncol);
+  double node = depth * 4.*nrow*rank*ncol;
+  return leaf + node;
+}
+
+// number of rows in the left subtree such that both subtrees have
+//  about the same estimated cost. every dense block has to be
+//  larger than the rank.
+static int split_rows(int nrow, int nl, int nr, int rank) {
+  int lo = nl * (rank+1);
+  int hi = nrow - nr * (rank+1);
+  assert(lo <= hi);
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (subtree_cost(mid, nl, rank) <
+	subtree_cost(nrow-mid, nr, rank))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  // take the closer one of the two candidates around the balance
+  if (lo > nl * (rank+1)) {
+    double d0 = subtree_cost(lo-1,      nl, rank) -
+                subtree_cost(nrow-lo+1, nr, rank);
+    double d1 = subtree_cost(lo,        nl, rank) -
+                subtree_cost(nrow-lo,   nr, rank);
+    if (fabs(d0) <= fabs(d1))
+      lo--;
+  }
+  return lo;
+}
 
-    node->lchild = new Node;
-    node->rchild = new Node;
+// rank of the blocks on a level, the same for all without a policy
+/*static*/ int level_rank(RankFunc f, int rank, int level, int nrow) {
+  if (f == NULL)
+    return rank;
+  int r = f(level, nrow);
+  assert(r >= 0);
+  return r;
+}
 
-    node->lchild->nrow = N/2;
-    node->rchild->nrow = N - N/2;
+// the matrix of any size is cut into ceil(N/threshold) dense blocks,
+//  and every node splits its blocks in halves (the left one gets
+//  the extra block) and its rows by the cost model above. When N is
+//  threshold*2^k this is the balanced binary tree.
+// the tree is built breadth first so that every level is
+//  contiguous in the arena. root has to be the last node.
+// children get the rank of their level from the policy f, and the
+//  cost model uses the rank of the level below every node.
+void create_weighted_tree
+(NodeArena &arena, int root, int rank, RankFunc f, int level,
+ int threshold) {
+
+  assert(root == arena.size()-1);
+  int N = arena.at(root)->nrow;
+  std::vector<int> nleaf(1, (N + threshold - 1) / threshold);
+  std::vector<int> depth(1, level);
+  for (int i=root; i<arena.size(); i++) {
     
-    node->lchild->ncol = rank;
-    node->rchild->ncol = rank;
+    int L = nleaf[i-root];
+    int d = depth[i-root];
+    int r = level_rank(f, rank, d+1, arena.at(i)->nrow/2);
+    arena.at(i)->cost = subtree_cost(arena.at(i)->nrow, L, r);
+    if (L > 1) {
+
+      int c = arena.alloc(2);
+      Node *node   = arena.at(i);
+      Node *lchild = arena.at(c);
+      Node *rchild = arena.at(c+1);
+      node->set_children(lchild);
+
+      int nl = (L + 1) / 2;
+      int nr = L - nl;
+      nleaf.push_back(nl);
+      nleaf.push_back(nr);
+      depth.push_back(d+1);
+      depth.push_back(d+1);
+      
+      lchild->nrow = split_rows(node->nrow, nl, nr, r);
+      rchild->nrow = node->nrow - lchild->nrow;
+    
+      lchild->ncol = level_rank(f, rank, d+1, lchild->nrow);
+      rchild->ncol = level_rank(f, rank, d+1, rchild->nrow);
 
-    node->lchild->col_beg = node->col_beg + node->ncol;
-    node->rchild->col_beg = node->col_beg + node->ncol;
+      lchild->col_beg = node->col_beg + node->ncol;
+      rchild->col_beg = node->col_beg + node->ncol;
 
-    // TODO: to be debugged
-    node->lchild->row_beg = node->row_beg;
-    node->rchild->row_beg = node->row_beg + node->lchild->nrow;
-      
-    // recursive call
-    create_balanced_tree(node->lchild, rank, threshold);
-    create_balanced_tree(node->rchild, rank, threshold);
-  }
-  else {
-    // assume the size of dense blocks is larger than the rank
-    assert(N > rank); 
+      lchild->row_beg = node->row_beg;
+      rchild->row_beg = node->row_beg + lchild->nrow;
+    }
+    else {
+      // assume the size of dense blocks is larger than the rank
+      assert(arena.at(i)->nrow > r);
+      assert(i == root || arena.at(i)->nrow > arena.at(i)->ncol);
+    }
   }
 }
 
@@ -199,11 +484,11 @@ init_rhs(const long seed, const Range& procs,
     node->lowrank_matrix->rand(randSeed, range, taskTag.begin(),
 			       ctx, runtime);
   } else {
-    Range ltag = taskTag.lchild();
-    Range rtag = taskTag.rchild();
-    init_rhs_recursive(node->lchild, randSeed, ncol, ltag,
+    Range ltag = taskTag.lchild(node->split_fraction());
+    Range rtag = taskTag.rchild(node->split_fraction());
+    init_rhs_recursive(node->lchild(), randSeed, ncol, ltag,
 		       ctx, runtime);
-    init_rhs_recursive(node->rchild, randSeed, ncol, rtag,
+    init_rhs_recursive(node->rchild(), randSeed, ncol, rtag,
 		       ctx, runtime);
   }  
 }
@@ -222,11 +507,11 @@ void HodlrMatrix::init_Umat
 				    rank, tag.begin(),
 				    ctx, runtime);
   } else {
-    Range ltag = tag.lchild();
-    Range rtag = tag.rchild();
-    init_Umat(node->lchild, ltag, ctx, runtime, row_beg);
-    init_Umat(node->rchild, rtag, ctx, runtime, row_beg +
-	      node->lchild->nrow);
+    Range ltag = tag.lchild(node->split_fraction());
+    Range rtag = tag.rchild(node->split_fraction());
+    init_Umat(node->lchild(), ltag, ctx, runtime, row_beg);
+    init_Umat(node->rchild(), rtag, ctx, runtime, row_beg +
+	      node->lchild()->nrow);
   }
 }
 
@@ -240,8 +525,8 @@ init_Vmat(Node *node, double diag, Range tag,
 	  Context ctx, HighLevelRuntime *runtime,
 	  int row_beg) {
 
-  if (node->Hmat != NULL) // skip vroot
-    set_circulant_Hmatrix_data(node->Hmat, tag,
+  if (node->Hmat() != NULL) // skip vroot
+    set_circulant_Hmatrix_data(node->Hmat(), tag,
 			       ctx, runtime, row_beg);
 
   if ( node->is_legion_leaf() ) {
@@ -256,12 +541,12 @@ init_Vmat(Node *node, double diag, Range tag,
 			tag, ctx, runtime);
     
   } else {
-    Range ltag = tag.lchild();
-    Range rtag = tag.rchild();
-    init_Vmat(node->lchild, diag, ltag,
+    Range ltag = tag.lchild(node->split_fraction());
+    Range rtag = tag.rchild(node->split_fraction());
+    init_Vmat(node->lchild(), diag, ltag,
 	      ctx, runtime, row_beg);
-    init_Vmat(node->rchild, diag, rtag,
-	      ctx, runtime, row_beg+node->lchild->nrow);
+    init_Vmat(node->rchild(), diag, rtag,
+	      ctx, runtime, row_beg+node->lchild()->nrow);
   }
 }
 
@@ -270,24 +555,19 @@ void init_circulant_Kmat
    int rank, double diag, Range mapping_tag,
    Context ctx, HighLevelRuntime *runtime)
 {
-  int nleaf = count_leaf(vLeaf);
-  int max_tree_size = nleaf * 2;
-  assert(max_tree_size < MAX_TREE_SIZE);
-  
   typedef DenseMatrixTask ICKT; 
-  ICKT::TaskArgs<MAX_TREE_SIZE> args;
-
-  args.treeArray[0] = *vLeaf;
-  int size = tree_to_array(vLeaf, args.treeArray, 0);
-  assert(size < max_tree_size);
-
-  // encode the array size
-  //args.treeArray[0].col_beg = max_tree_size;
-  //args.treeSize = max_tree_size;
+  ICKT::TaskArgs args;
   args.row  = row;
   args.rank = rank;
   args.diag = diag;
-  ICKT launcher(TaskArgument(&args, sizeof(args)),
+
+  // the subtree is packed right after the arguments
+  int size = sizeof(args) + sizeof(int)*pack_tree_size(vLeaf);
+  std::vector<char> buf(size);
+  memcpy(&buf[0], &args, sizeof(args));
+  pack_tree(vLeaf, (int *)&buf[sizeof(args)]);
+  
+  ICKT launcher(TaskArgument(&buf[0], size),
 		Predicate::TRUE_PRED,
 		0,
 		mapping_tag.begin());
@@ -314,15 +594,14 @@ void init_circulant_Kmat
 //  coincide.
 // nLegionLeaf records the number of legion leaves as an
 //  indicator of the number of leaf tasks.
-/* static */ int
-mark_legion_leaf(Node *node, const int leafSize, int& nleaf) {
+int mark_legion_leaf(Node *node, const int leafSize, int& nleaf) {
 
   int nRealLeaf;
   if (node->is_real_leaf()) { // real matrix leaf
     nRealLeaf = 1;
   } else {
-    int nl = mark_legion_leaf(node->lchild, leafSize, nleaf);
-    int nr = mark_legion_leaf(node->rchild, leafSize, nleaf);
+    int nl = mark_legion_leaf(node->lchild(), leafSize, nleaf);
+    int nr = mark_legion_leaf(node->rchild(), leafSize, nleaf);
     nRealLeaf = nl + nr;
   }
 
@@ -331,11 +610,52 @@ mark_legion_leaf(Node *node, const int leafSize, int& nleaf) {
   node->set_legion_leaf( (nRealLeaf > leafSize) ? false : true );
   if (node->is_legion_leaf()) {
     build_subtree(node);
+    // the children, if any, were counted as legion leaves
+    if ( ! node->is_real_leaf() )
+      nleaf -= 2;
     nleaf++;
   }
   return nRealLeaf;
 }
 
+static void set_legion_subtree(Node *node) {
+  node->set_legion_leaf(true);
+  if ( ! node->is_real_leaf() ) {
+    set_legion_subtree(node->lchild());
+    set_legion_subtree(node->rchild());
+  }
+}
+
+// the share of the root cost of leafSize dense blocks; in automatic
+//  mode tasksPerCore leaf tasks per core, but no less than the share
+//  of minLeafBlocks dense blocks, below which a task does not pay for
+//  its launch
+double HodlrMatrix::leaf_budget() const {
+  const int minLeafBlocks = 8;
+  int nblock = (uroot->nrow + threshold - 1) / threshold;
+  double perBlock = uroot->cost / nblock;
+  if (leafSize > 0)
+    return perBlock * leafSize;
+  return std::max(perBlock * minLeafBlocks,
+		  uroot->cost / (nProc * nCore * tasksPerCore));
+}
+
+// the first node on every path whose estimated cost fits in the
+//  budget becomes a legion leaf, so legion leaves can sit on
+//  different levels of the tree.
+/* static */ void
+mark_legion_leaf_auto(Node *node, const double budget, int& nleaf) {
+
+  if (node->is_real_leaf() || node->cost <= budget) {
+    set_legion_subtree(node);
+    build_subtree(node);
+    nleaf++;
+  } else {
+    mark_legion_leaf_auto(node->lchild(), budget, nleaf);
+    mark_legion_leaf_auto(node->rchild(), budget, nleaf);
+  }
+}
+
 // return the number of legion leaf
 /* static */ void create_legion_node
 (Node *node, Context ctx, HighLevelRuntime *runtime) {
@@ -346,41 +666,96 @@ mark_legion_leaf(Node *node, const int leafSize, int& nleaf) {
     int nrow = node->nrow;
     create_matrix(node->lowrank_matrix, nrow, ncol, ctx, runtime);
   } else {    
-    create_legion_node(node->lchild, ctx, runtime);
-    create_legion_node(node->rchild, ctx, runtime);
+    create_legion_node(node->lchild(), ctx, runtime);
+    create_legion_node(node->rchild(), ctx, runtime);
   }
 }
 
-void create_Vtree(Node *unode, Node *vnode) {
+// the U tree occupies the arena from uroot to the end, and the
+//  V tree is appended as a node-by-node mirror of it, i.e. the
+//  V node of U node uroot+i is vroot+i. return vroot.
+int create_Vtree(NodeArena &arena, int uroot) {
+
+  int nnode = arena.size() - uroot;
+  int vroot = arena.alloc(nnode);
   
-  if ( ! unode->is_real_leaf() ) {
-    int lnrow = unode->lchild->nrow;
-    int rnrow = unode->rchild->nrow;
-    int lncol = unode->rchild->ncol; // notice the order here
-    int rncol = unode->lchild->ncol; // it is reversed in v
-    int lrow_beg = unode->lchild->row_beg; // u and v have the
-    int rrow_beg = unode->rchild->row_beg; // same row structure    
-    vnode -> lchild = new Node(lnrow, lncol, lrow_beg);
-    vnode -> rchild = new Node(rnrow, rncol, rrow_beg);
-
-    // set column begin index for Legion leaf,
-    // to be used in the big V matrix at Legion leaf
-    if (unode->is_legion_leaf()) {
-      vnode->set_legion_leaf(true);
+  for (int i=0; i<nnode; i++) {
+    const Node *unode = arena.at(uroot+i);
+    Node       *vnode = arena.at(vroot+i);
+    vnode->nrow    = unode->nrow;    // u and v have the
+    vnode->row_beg = unode->row_beg; // same row structure
+    vnode->cost    = unode->cost;
+    vnode->set_legion_leaf( unode->is_legion_leaf() );
+    
+    if ( ! unode->is_real_leaf() ) {
+      int    lidx   = arena.index(unode->lchild()) - uroot;
+      Node * lchild = arena.at(vroot+lidx);
+      Node * rchild = lchild + 1;
+      vnode->set_children(lchild);
       
-      if (unode->lowrank_matrix == NULL) { // skip Legion leaf
-	vnode -> lchild -> col_beg = vnode -> col_beg + vnode -> ncol;
-	vnode -> rchild -> col_beg = vnode -> col_beg + vnode -> ncol;
+      lchild->ncol = unode->rchild()->ncol; // notice the order here
+      rchild->ncol = unode->lchild()->ncol; // it is reversed in v
+
+      // set column begin index for Legion leaf,
+      // to be used in the big V matrix at Legion leaf
+      if (unode->is_legion_leaf() &&
+	  unode->lowrank_matrix == NULL) { // skip Legion leaf
+	lchild->col_beg = vnode->col_beg + vnode->ncol;
+	rchild->col_beg = vnode->col_beg + vnode->ncol;
       }
-    }      
-    create_Vtree(unode->lchild, vnode->lchild);
-    create_Vtree(unode->rchild, vnode->rchild);
-    
-  } else {
-    vnode -> lchild = NULL;
-    vnode -> rchild = NULL;
-    if ( unode->is_legion_leaf() ) {
-      vnode->set_legion_leaf(true);
+    }
+  }
+  return vroot;
+}
+
+// append an H-tiled matrix for either child of every V node
+//  above the Legion leaf level. The H-tiled matrix of a node
+//  mirrors its subtree down to the Legion leaves.
+void create_Htree(NodeArena &arena, int vroot) {
+
+  // V tree is not touched by appending, so the end is fixed here
+  int vend = arena.size();
+  for (int v=vroot; v<vend; v++) {
+    if ( arena.at(v)->is_legion_leaf() ) continue;
+
+    int vchild = arena.index( arena.at(v)->lchild() );
+    for (int k=0; k<2; k++) {
+      
+      int hroot = arena.alloc();
+      *arena.at(hroot) = Node(arena.at(vchild+k)->nrow,
+			      arena.at(vchild+k)->ncol);
+      arena.at(hroot)->cost = arena.at(vchild+k)->cost;
+
+      // pairs of (H node, V node) in breadth first order
+      std::vector< std::pair<int, int> > queue;
+      queue.push_back( std::make_pair(hroot, vchild+k) );
+      for (size_t q=0; q<queue.size(); q++) {
+	int h = queue[q].first;
+	int n = queue[q].second;
+	if ( arena.at(n)->is_legion_leaf() ) {
+	  Node *Hmat = arena.at(h);
+	  Hmat->nrow = arena.at(n)->nrow;
+	  // every tile has the columns of the whole H-tiled matrix
+	  Hmat->ncol = arena.at(hroot)->ncol;
+	  Hmat->set_legion_leaf(true);
+	} else {
+	  int c = arena.alloc(2);
+	  Node *Hmat = arena.at(h);
+	  const Node *node = arena.at(n);
+	  Hmat->set_children( arena.at(c) );
+	  arena.at(c  )->cost = node->lchild()->cost;
+	  arena.at(c+1)->cost = node->rchild()->cost;
+	  
+	  // to be used in initialization
+	  arena.at(c  )->row_beg = Hmat->row_beg;
+	  arena.at(c+1)->row_beg = Hmat->row_beg + node->lchild()->nrow;
+
+	  int nl = arena.index(node->lchild());
+	  queue.push_back( std::make_pair(c,   nl  ) );
+	  queue.push_back( std::make_pair(c+1, nl+1) );
+	}
+      }
+      arena.at(vchild+k)->set_Hmat( arena.at(hroot) );
     }
   }
 }
@@ -392,22 +767,14 @@ void create_Vregions
   // including Legion leaf
   if ( ! vnode->is_legion_leaf() ) {
 
-    int lnrow = vnode -> lchild -> nrow;
-    int rnrow = vnode -> rchild -> nrow;
-    int lncol = vnode -> lchild -> ncol;
-    int rncol = vnode -> rchild -> ncol;
-
-    vnode -> lchild -> Hmat =  new Node(lnrow, lncol);
-    vnode -> rchild -> Hmat =  new Node(rnrow, rncol);
-
-    create_Hmatrix(vnode->lchild, vnode->lchild->Hmat,
-		   vnode->lchild->ncol, ctx, runtime);
-    create_Hmatrix(vnode->rchild, vnode->rchild->Hmat,
-		   vnode->rchild->ncol, ctx, runtime);
+    create_Hmatrix(vnode->lchild(), vnode->lchild()->Hmat(),
+		   vnode->lchild()->ncol, ctx, runtime);
+    create_Hmatrix(vnode->rchild(), vnode->rchild()->Hmat(),
+		   vnode->rchild()->ncol, ctx, runtime);
 
     // recursive call
-    create_Vregions(vnode->lchild, ctx, runtime);
-    create_Vregions(vnode->rchild, ctx, runtime);
+    create_Vregions(vnode->lchild(), ctx, runtime);
+    create_Vregions(vnode->rchild(), ctx, runtime);
   }
     
   // create a big rectangle at Legion leaf for lower levels
@@ -439,8 +806,8 @@ void create_Kregions
 		  ncol, ctx, runtime);
   }
   else {
-    create_Kregions(vnode->lchild, ctx, runtime);
-    create_Kregions(vnode->rchild, ctx, runtime);
+    create_Kregions(vnode->lchild(), ctx, runtime);
+    create_Kregions(vnode->rchild(), ctx, runtime);
   }
 }
 
@@ -449,25 +816,17 @@ void create_Hmatrix
 (Node *node, Node * Hmat, int ncol,
  Context ctx, HighLevelRuntime *runtime) {
 
+  // the nodes are laid out by create_Htree()
   if ( node->is_legion_leaf() ) {
-    Hmat->nrow = node->nrow;
-    Hmat->ncol = node->ncol;
-    Hmat->set_legion_leaf(true);
+    assert(Hmat->is_legion_leaf());
     create_matrix(Hmat -> lowrank_matrix,
 		  node -> nrow,
 		  ncol,
 		  ctx, runtime);
  
   } else {    
-    Hmat->lchild = new Node;
-    Hmat->rchild = new Node;
-
-    // to be used in initialization
-    Hmat->lchild->row_beg = Hmat->row_beg;
-    Hmat->rchild->row_beg = Hmat->row_beg + node->lchild->nrow;
-    
-    create_Hmatrix(node->lchild, Hmat->lchild, ncol, ctx, runtime);
-    create_Hmatrix(node->rchild, Hmat->rchild, ncol, ctx, runtime);
+    create_Hmatrix(node->lchild(), Hmat->lchild(), ncol, ctx, runtime);
+    create_Hmatrix(node->rchild(), Hmat->rchild(), ncol, ctx, runtime);
   }
 }
 
@@ -487,11 +846,11 @@ void set_circulant_Hmatrix_data
 				    tag.begin(), ctx, runtime);
     
   } else {
-    Range ltag = tag.lchild();
-    Range rtag = tag.rchild();
-    set_circulant_Hmatrix_data(Hmat->lchild, ltag,
+    Range ltag = tag.lchild(Hmat->split_fraction());
+    Range rtag = tag.rchild(Hmat->split_fraction());
+    set_circulant_Hmatrix_data(Hmat->lchild(), ltag,
 			       ctx, runtime, row_beg);
-    set_circulant_Hmatrix_data(Hmat->rchild, rtag,
+    set_circulant_Hmatrix_data(Hmat->rchild(), rtag,
 			       ctx, runtime, row_beg);
   }  
 }
@@ -521,8 +880,8 @@ void print_legion_tree(Node * node) {
     printf("K Mat: %d x %d\n", nrow, ncol);
   }
     
-  print_legion_tree(node->lchild);
-  print_legion_tree(node->rchild);
+  print_legion_tree(node->lchild());
+  print_legion_tree(node->rchild());
 }
 
 void fill_circulant_Kmat(Node * vnode, int row_beg_glo, int r, double diag, double *Kmat, int LD) {
@@ -562,8 +921,158 @@ void fill_circulant_Kmat(Node * vnode, int row_beg_glo, int r, double diag, doub
     return;
   }
 
-  fill_circulant_Kmat(vnode->lchild, row_beg_glo, r, diag, Kmat, LD);
-  fill_circulant_Kmat(vnode->rchild, row_beg_glo, r, diag, Kmat, LD);
+  fill_circulant_Kmat(vnode->lchild(), row_beg_glo, r, diag, Kmat, LD);
+  fill_circulant_Kmat(vnode->rchild(), row_beg_glo, r, diag, Kmat, LD);
+}
+
+void HodlrMatrix::cluster
+(int dim, double *points, ClusterMethod method) {
+  assert(uroot != NULL); // needs the tree
+  cluster_points(uroot, dim, points, perm, method);
+}
+
+// copies rows [row, row+nrow) of a column major matrix in the input
+//  order to or from the U regions of the legion leaves
+static void copy_rhs
+(Node *node, int row, const std::vector<int> &perm, double *b, int LD,
+ const Range &cols, bool to_region, Context ctx,
+ HighLevelRuntime *runtime) {
+
+  if (node->is_legion_leaf()) {
+    int n    = node->nrow;
+    int ncol = cols.size();
+    std::vector<double> buf(n*ncol);
+    if ( ! to_region )
+      node->lowrank_matrix->get_columns(&buf[0], n, cols,
+					ctx, runtime);
+    for (int j=0; j<ncol; j++)
+      for (int i=0; i<n; i++) {
+	int r = perm.empty() ? row+i : perm[row+i];
+	if (to_region)
+	  buf[i+j*n] = b[r+j*LD];
+	else
+	  b[r+j*LD] = buf[i+j*n];
+      }
+    if (to_region)
+      node->lowrank_matrix->set_columns(&buf[0], n, cols,
+					ctx, runtime);
+  } else {
+    copy_rhs(node->lchild(), row, perm, b, LD, cols, to_region,
+	     ctx, runtime);
+    copy_rhs(node->rchild(), row + node->lchild()->nrow, perm, b, LD,
+	     cols, to_region, ctx, runtime);
+  }
+}
+
+void HodlrMatrix::set_rhs
+(const double *b, int LD, Context ctx, HighLevelRuntime *runtime) {
+  set_rhs(b, LD, Range(rhs_cols), ctx, runtime);
+}
+
+void HodlrMatrix::get_solution
+(double *x, int LD, Context ctx, HighLevelRuntime *runtime) const {
+  get_solution(x, LD, Range(rhs_cols), ctx, runtime);
+}
+
+void HodlrMatrix::set_rhs
+(const double *b, int LD, const Range &cols,
+ Context ctx, HighLevelRuntime *runtime) {
+  assert(cols.begin() >= 0 && cols.begin()+cols.size() <= rhs_cols);
+  copy_rhs(uroot, 0, perm, (double *)b, LD, cols, true,
+	   ctx, runtime);
+}
+
+void HodlrMatrix::get_solution
+(double *x, int LD, const Range &cols,
+ Context ctx, HighLevelRuntime *runtime) const {
+  assert(cols.begin() >= 0 && cols.begin()+cols.size() <= rhs_cols);
+  copy_rhs(uroot, 0, perm, x, LD, cols, false, ctx, runtime);
+}
+
+// the tree of create_vectors() below node i of the arena
+static void create_vector_tree
+(const Node *unode, NodeArena &arena, int i, int ncol,
+ Context ctx, HighLevelRuntime *runtime) {
+  Node *node = arena.at(i);
+  *node = Node(unode->nrow, ncol, unode->row_beg);
+  if (unode->is_legion_leaf()) {
+    node->set_legion_leaf(true);
+    create_matrix(node->lowrank_matrix, unode->nrow, ncol,
+		  ctx, runtime);
+    return;
+  }
+  int c = arena.alloc(2); // may move the arena
+  arena.at(i)->set_children(arena.at(c));
+  create_vector_tree(unode->lchild(), arena, c,   ncol, ctx, runtime);
+  create_vector_tree(unode->rchild(), arena, c+1, ncol, ctx, runtime);
+}
+
+static void destroy_vector_tree
+(Node *node, Context ctx, HighLevelRuntime *runtime) {
+  if (node->is_legion_leaf())
+    destroy_matrix(node->lowrank_matrix, ctx, runtime);
+  else {
+    destroy_vector_tree(node->lchild(), ctx, runtime);
+    destroy_vector_tree(node->rchild(), ctx, runtime);
+  }
+}
+
+void HodlrMatrix::create_vectors
+(NodeArena &vectors, int ncol,
+ Context ctx, HighLevelRuntime *runtime) const {
+  assert(vectors.size() == 0);
+  create_vector_tree(uroot, vectors, vectors.alloc(), ncol,
+		     ctx, runtime);
+}
+
+void HodlrMatrix::destroy_vectors
+(NodeArena &vectors, Context ctx, HighLevelRuntime *runtime) const {
+  if (vectors.size() > 0)
+    destroy_vector_tree(vectors.at(0), ctx, runtime);
+  vectors.clear();
+}
+
+void HodlrMatrix::set_vector
+(NodeArena &vectors, int col, const double *v,
+ Context ctx, HighLevelRuntime *runtime) const {
+  copy_rhs(vectors.at(0), 0, perm, (double *)v, uroot->nrow,
+	   Range(col, 1), true, ctx, runtime);
+}
+
+void HodlrMatrix::get_vector
+(NodeArena &vectors, int col, double *v,
+ Context ctx, HighLevelRuntime *runtime) const {
+  copy_rhs(vectors.at(0), 0, perm, v, uroot->nrow, Range(col, 1),
+	   false, ctx, runtime);
+}
+
+static void find_support
+(const Node *node, int row, const std::vector<int> &perm,
+ const double *b, int LD, int ncol, int &first,
+ std::vector<int> &leaves) {
+  if (node->is_legion_leaf()) {
+    bool nonzero = false;
+    for (int j=0; j<ncol && !nonzero; j++)
+      for (int i=0; i<node->nrow && !nonzero; i++) {
+	int r = perm.empty() ? row+i : perm[row+i];
+	nonzero = b[r+j*LD] != 0;
+      }
+    if (nonzero)
+      leaves.push_back(first);
+    first++;
+  } else {
+    find_support(node->lchild(), row, perm, b, LD, ncol, first,
+		 leaves);
+    find_support(node->rchild(), row + node->lchild()->nrow, perm, b,
+		 LD, ncol, first, leaves);
+  }
+}
+
+void HodlrMatrix::rhs_support
+(const double *b, int LD, std::vector<int> &leaves) const {
+  leaves.clear();
+  int first = 0;
+  find_support(uroot, 0, perm, b, LD, rhs_cols, first, leaves);
 }
 
 void HodlrMatrix::save_rhs
@@ -598,9 +1107,9 @@ void save_HodlrMatrix
     node->lowrank_matrix->save(filename, rg, ctx, runtime,
 			       print_seed);
   } else {
-    save_HodlrMatrix(node->lchild, filename,
+    save_HodlrMatrix(node->lchild(), filename,
 		     ctx, runtime, rg, print_seed);
-    save_HodlrMatrix(node->rchild, filename,
+    save_HodlrMatrix(node->rchild(), filename,
 		     ctx, runtime, rg, print_seed);
   }
 }
@@ -0,0 +1,87 @@
+#include "host_node.h"
+
+#include <assert.h>
+#include <string.h>
+
+int mirror_tree
+(const Node *node, int row, int depth, std::vector<HostNode> &t) {
+  int i = t.size();
+  HostNode p;
+  p.row = row; p.nrow = node->nrow; p.k = node->ncol; p.depth = depth;
+  p.lchild = p.rchild = -1;
+  t.push_back(p);
+  if ( ! node->is_real_leaf() ) {
+    int l = mirror_tree(node->lchild(), row, depth+1, t);
+    int r = mirror_tree(node->rchild(), row + node->lchild()->nrow,
+			depth+1, t);
+    t[i].lchild = l;
+    t[i].rchild = r;
+  }
+  return i;
+}
+
+// block `src` (nrow x ncol) into `dst` at (row, col)
+static void put
+(double *dst, int LD, int row, int col,
+ const double *src, int nrow, int srcLD, int ncol) {
+  for (int j=0; j<ncol; j++)
+    memcpy(dst + row + (col+j)*LD, src + j*srcLD, nrow*sizeof(double));
+}
+
+// block of `src` at (row, col) into `dst` (nrow x ncol)
+static void get
+(double *dst, int dstLD, int nrow, int ncol,
+ const double *src, int LD, int row, int col) {
+  for (int j=0; j<ncol; j++)
+    memcpy(dst + j*dstLD, src + row + (col+j)*LD, nrow*sizeof(double));
+}
+
+// u, v and dense blocks of the nodes below a legion leaf, with rows
+//  relative to the legion leaf
+void write_host_subtree
+(const Node *unode, const Node *vnode, const std::vector<HostNode> &t,
+ double *U, double *V, double *K, int LD, int i) {
+  const HostNode &p = t[i];
+  if (p.lchild < 0) {
+    put(K, LD, unode->row_beg, 0, &p.d[0], p.nrow, p.nrow, p.nrow);
+    return;
+  }
+  const Node *uc[2] = {unode->lchild(), unode->rchild()};
+  const Node *vc[2] = {vnode->lchild(), vnode->rchild()};
+  int         ic[2] = {p.lchild, p.rchild};
+  for (int s=0; s<2; s++) {
+    const HostNode &c = t[ic[s]];
+    assert(uc[s]->ncol == c.k);
+    put(U, LD, uc[s]->row_beg, uc[s]->col_beg, &c.u[0], c.nrow, c.nrow,
+	c.k);
+    int vcol = c.v.size() / c.nrow;
+    assert(vc[s]->ncol == vcol);
+    put(V, LD, vc[s]->row_beg, vc[s]->col_beg, &c.v[0], c.nrow, c.nrow,
+	vcol);
+    write_host_subtree(uc[s], vc[s], t, U, V, K, LD, ic[s]);
+  }
+}
+
+void read_host_subtree
+(const Node *unode, const Node *vnode, std::vector<HostNode> &t,
+ const double *U, const double *V, const double *K, int LD, int i) {
+  HostNode &p = t[i];
+  if (p.lchild < 0) {
+    p.d.resize(p.nrow*p.nrow);
+    get(&p.d[0], p.nrow, p.nrow, p.nrow, K, LD, unode->row_beg, 0);
+    return;
+  }
+  const Node *uc[2] = {unode->lchild(), unode->rchild()};
+  const Node *vc[2] = {vnode->lchild(), vnode->rchild()};
+  int         ic[2] = {p.lchild, p.rchild};
+  for (int s=0; s<2; s++) {
+    HostNode &c = t[ic[s]];
+    c.u.resize(c.nrow*c.k);
+    get(&c.u[0], c.nrow, c.nrow, c.k, U, LD, uc[s]->row_beg,
+	uc[s]->col_beg);
+    c.v.resize(c.nrow*vc[s]->ncol);
+    get(&c.v[0], c.nrow, c.nrow, vc[s]->ncol, V, LD, vc[s]->row_beg,
+	vc[s]->col_beg);
+    read_host_subtree(uc[s], vc[s], t, U, V, K, LD, ic[s]);
+  }
+}
@@ -0,0 +1,181 @@
+#include "host_tree.h"
+#include "legion_matrix.h"
+
+#include <assert.h>
+#include <string.h>
+
+/* ---- copy into the regions ---- */
+
+// block `src` (nrow x ncol) into `dst` at (row, col)
+static void put
+(double *dst, int LD, int row, int col,
+ const double *src, int nrow, int srcLD, int ncol) {
+  for (int j=0; j<ncol; j++)
+    memcpy(dst + row + (col+j)*LD, src + j*srcLD, nrow*sizeof(double));
+}
+
+// the rows of an H-tiled matrix with root column node c
+static void write_Hmat
+(Node *Hmat, const HostNode &c, int vcol,
+ Context ctx, HighLevelRuntime *runtime) {
+  if (Hmat->is_real_leaf()) {
+    LMatrix *M = Hmat->lowrank_matrix;
+    std::vector<double> buf(M->rows*M->cols, 0.0);
+    assert(vcol <= M->cols);
+    put(&buf[0], M->rows, 0, 0, &c.v[Hmat->row_beg], M->rows, c.nrow,
+	vcol);
+    M->set_columns(&buf[0], M->rows, Range(M->cols), ctx, runtime);
+  } else {
+    write_Hmat(Hmat->lchild(), c, vcol, ctx, runtime);
+    write_Hmat(Hmat->rchild(), c, vcol, ctx, runtime);
+  }
+}
+
+static void write_leaf
+(Node *unode, Node *vnode, const std::vector<HostNode> &t, int i,
+ const std::vector<int> &path, int rhs_cols,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  const HostNode &p = t[i];
+  int n = p.nrow;
+  LMatrix *Umat = unode->lowrank_matrix;
+  LMatrix *Vmat = vnode->lowrank_matrix;
+  LMatrix *Kmat = vnode->dense_matrix;
+  assert(Umat->rows == n && Vmat->rows == n && Kmat->rows == n);
+
+  std::vector<double> U(n*Umat->cols, 0.0);
+  std::vector<double> V(n*Vmat->cols, 0.0);
+  std::vector<double> K(n*Kmat->cols, 0.0);
+
+  // u columns of the ancestors, restricted to these rows
+  for (size_t a=0; a<path.size(); a+=2) {
+    const HostNode &anc = t[path[a]];
+    int col_beg = path[a+1];
+    assert(col_beg + anc.k <= Umat->cols);
+    put(&U[0], n, 0, col_beg, &anc.u[p.row - anc.row], n, anc.nrow,
+	anc.k);
+  }
+  write_host_subtree(unode, vnode, t, &U[0], &V[0], &K[0], n, i);
+
+  Umat->set_columns(&U[rhs_cols*n], n,
+		    Range(rhs_cols, Umat->cols - rhs_cols), ctx, runtime);
+  if (Vmat->cols > 0) // no V when the legion leaf is a real leaf
+    Vmat->set_columns(&V[0], n, Range(Vmat->cols), ctx, runtime);
+  Kmat->set_columns(&K[0], n, Range(Kmat->cols), ctx, runtime);
+}
+
+static void write_tree
+(Node *unode, Node *vnode, const std::vector<HostNode> &t, int i,
+ std::vector<int> &path, int rhs_cols,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  if (unode->is_legion_leaf()) {
+    assert(vnode->is_legion_leaf());
+    write_leaf(unode, vnode, t, i, path, rhs_cols, ctx, runtime);
+    return;
+  }
+  const HostNode &p = t[i];
+  Node *uc[2] = {unode->lchild(), unode->rchild()};
+  Node *vc[2] = {vnode->lchild(), vnode->rchild()};
+  int   ic[2] = {p.lchild, p.rchild};
+  for (int s=0; s<2; s++) {
+    const HostNode &c = t[ic[s]];
+    write_Hmat(vc[s]->Hmat(), c, c.v.size() / c.nrow, ctx, runtime);
+    path.push_back(ic[s]);
+    path.push_back(uc[s]->col_beg);
+    write_tree(uc[s], vc[s], t, ic[s], path, rhs_cols, ctx, runtime);
+    path.pop_back();
+    path.pop_back();
+  }
+}
+
+void write_host_tree
+(Node *uroot, Node *vroot, const std::vector<HostNode> &t, int rhs_cols,
+ Context ctx, HighLevelRuntime *runtime) {
+  std::vector<int> path; // (node, col_beg) of the ancestors
+  write_tree(uroot, vroot, t, 0, path, rhs_cols, ctx, runtime);
+}
+
+
+/* ---- copy out of the regions ---- */
+
+// block of `src` at (row, col) into `dst` (nrow x ncol)
+static void get
+(double *dst, int dstLD, int nrow, int ncol,
+ const double *src, int LD, int row, int col) {
+  for (int j=0; j<ncol; j++)
+    memcpy(dst + j*dstLD, src + row + (col+j)*LD, nrow*sizeof(double));
+}
+
+static void read_Hmat
+(Node *Hmat, HostNode &c, int vcol, Context ctx, HighLevelRuntime *runtime) {
+  if (Hmat->is_real_leaf()) {
+    LMatrix *M = Hmat->lowrank_matrix;
+    std::vector<double> buf(M->rows*M->cols);
+    assert(vcol <= M->cols);
+    M->get_columns(&buf[0], M->rows, Range(M->cols), ctx, runtime);
+    get(&c.v[Hmat->row_beg], c.nrow, M->rows, vcol, &buf[0], M->rows,
+	0, 0);
+  } else {
+    read_Hmat(Hmat->lchild(), c, vcol, ctx, runtime);
+    read_Hmat(Hmat->rchild(), c, vcol, ctx, runtime);
+  }
+}
+
+static void read_leaf
+(Node *unode, Node *vnode, std::vector<HostNode> &t, int i,
+ const std::vector<int> &path, Context ctx, HighLevelRuntime *runtime) {
+
+  int n = t[i].nrow;
+  LMatrix *Umat = unode->lowrank_matrix;
+  LMatrix *Vmat = vnode->lowrank_matrix;
+  LMatrix *Kmat = vnode->dense_matrix;
+  std::vector<double> U(n*Umat->cols);
+  std::vector<double> V(n*Vmat->cols);
+  std::vector<double> K(n*Kmat->cols);
+  Umat->get_columns(&U[0], n, Range(Umat->cols), ctx, runtime);
+  if (Vmat->cols > 0)
+    Vmat->get_columns(&V[0], n, Range(Vmat->cols), ctx, runtime);
+  Kmat->get_columns(&K[0], n, Range(Kmat->cols), ctx, runtime);
+
+  for (size_t a=0; a<path.size(); a+=2) {
+    HostNode &anc = t[path[a]];
+    anc.u.resize(anc.nrow*anc.k);
+    get(&anc.u[t[i].row - anc.row], anc.nrow, n, anc.k, &U[0], n,
+	0, path[a+1]);
+  }
+  read_host_subtree(unode, vnode, t, &U[0], &V[0], &K[0], n, i);
+}
+
+static void read_tree
+(Node *unode, Node *vnode, std::vector<HostNode> &t, int i,
+ std::vector<int> &path, Context ctx, HighLevelRuntime *runtime) {
+
+  if (unode->is_legion_leaf()) {
+    assert(vnode->is_legion_leaf());
+    read_leaf(unode, vnode, t, i, path, ctx, runtime);
+    return;
+  }
+  Node *uc[2] = {unode->lchild(), unode->rchild()};
+  Node *vc[2] = {vnode->lchild(), vnode->rchild()};
+  int   ic[2] = {t[i].lchild, t[i].rchild};
+  for (int s=0; s<2; s++) {
+    HostNode &c = t[ic[s]];
+    c.v.resize(c.nrow*vc[s]->ncol);
+    read_Hmat(vc[s]->Hmat(), c, vc[s]->ncol, ctx, runtime);
+    path.push_back(ic[s]);
+    path.push_back(uc[s]->col_beg);
+    read_tree(uc[s], vc[s], t, ic[s], path, ctx, runtime);
+    path.pop_back();
+    path.pop_back();
+  }
+}
+
+void read_host_tree
+(Node *uroot, Node *vroot, std::vector<HostNode> &t,
+ Context ctx, HighLevelRuntime *runtime) {
+  t.clear();
+  mirror_tree(uroot, 0, 0, t);
+  std::vector<int> path;
+  read_tree(uroot, vroot, t, 0, path, ctx, runtime);
+}
@@ -0,0 +1,518 @@
+#include "hss_matrix.h"
+#include "lapack_blas.h"
+#include "macros.h"
+
+#include <algorithm>
+#include <map>
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h> // for srand48_r() and drand48_r()
+#include <string.h>
+
+namespace {
+
+  // random generators of a legion leaf subtree
+  class HssLeafInitTask : public TaskLauncher {
+  public:
+    // followed by the packed subtree
+    struct TaskArgs {
+      long   seed;
+      double diag;
+      int    row; // first global row
+    };
+
+    HssLeafInitTask(TaskArgument arg,
+		    Predicate pred = Predicate::TRUE_PRED,
+		    MapperID id = 0,
+		    MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+
+  // random generators of a node above the legion leaves
+  class HssNodeInitTask : public TaskLauncher {
+  public:
+    struct TaskArgs {
+      long seed;
+      int  row;  // first global row
+      int  nrow;
+      int  kl;   // rank of the left child
+      int  k;
+    };
+
+    HssNodeInitTask(TaskArgument arg,
+		    Predicate pred = Predicate::TRUE_PRED,
+		    MapperID id = 0,
+		    MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+}
+
+void register_hss_init_tasks() {
+  HssLeafInitTask::register_tasks();
+  HssNodeInitTask::register_tasks();
+}
+
+int hss_gen_rows(const Node *node) {
+  if (node->is_real_leaf())
+    return node->nrow;
+  else
+    return node->lchild()->ncol + node->rchild()->ncol;
+}
+
+int hss_sub_offsets(const Node *leaf, std::vector<int> &offset) {
+
+  offset.clear();
+  int size = 0;
+  std::vector<const Node *> queue(1, leaf);
+  for (size_t i=0; i<queue.size(); i++) {
+    const Node *node = queue[i];
+    if (node->is_real_leaf()) {
+      offset.push_back(-1);
+    } else {
+      int m = hss_gen_rows(node);
+      offset.push_back(size);
+      size += m * (2*node->ncol + m);
+      queue.push_back(node->lchild());
+      queue.push_back(node->rchild());
+    }
+  }
+  return size;
+}
+
+// columns of the stacked generators of the real leaves
+static int leaf_gen_cols(const Node *node) {
+  if (node->is_real_leaf())
+    return 2*node->ncol + node->nrow;
+  else
+    return std::max(leaf_gen_cols(node->lchild()),
+		    leaf_gen_cols(node->rchild()));
+}
+
+HssMatrix::HssMatrix
+(int col, int row, int r, int t, int ls, const std::string& name)
+  : root(NULL),
+    rhs_cols(col), rhs_rows(row),
+    rank(r),       threshold(t),
+    leafSize(ls),  nLegionLeaf(0) {
+  assert(leafSize > 0);
+}
+
+void HssMatrix::create_tree(Context ctx, HighLevelRuntime *runtime) {
+
+  arena.clear();
+  int idx = arena.alloc();
+  *arena.at(idx) = Node(rhs_rows, 0); // no bases at the root
+  create_weighted_tree(arena, idx, rank, NULL, 0, threshold);
+  root = arena.at(idx);
+
+  nLegionLeaf = 0;
+  mark_legion_leaf(root, leafSize, nLegionLeaf);
+
+  Block empty = {NULL, NULL, NULL, NULL, NULL};
+  blocks.assign(arena.size(), empty);
+  create_regions(root, ctx, runtime);
+}
+
+void HssMatrix::create_regions
+(Node *node, Context ctx, HighLevelRuntime *runtime) {
+
+  Block &blk = block(node);
+  int k = node->ncol;
+  if (node != root) {
+    create_matrix(blk.hat, k, k,        ctx, runtime);
+    create_matrix(blk.rhs, k, rhs_cols, ctx, runtime);
+  }
+
+  if (node->is_legion_leaf()) {
+    std::vector<int> offset;
+    int size = hss_sub_offsets(node, offset);
+    create_matrix(blk.gen, node->nrow, leaf_gen_cols(node),
+		  ctx, runtime);
+    create_matrix(blk.sub, std::max(size, 1), 1, ctx, runtime);
+    create_matrix(blk.b,   node->nrow, rhs_cols, ctx, runtime);
+  } else {
+    int m = hss_gen_rows(node);
+    create_matrix(blk.gen, m, 2*k + m, ctx, runtime);
+    create_regions(node->lchild(), ctx, runtime);
+    create_regions(node->rchild(), ctx, runtime);
+  }
+}
+
+void HssMatrix::init_random_matrix
+(const long seed, const double diag, const Range& tag,
+ Context ctx, HighLevelRuntime *runtime) {
+  init_random(root, seed, diag, tag, 0, ctx, runtime);
+}
+
+void HssMatrix::init_random
+(Node *node, long seed, double diag, Range tag, int row,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  Block &blk = block(node);
+  if (node->is_legion_leaf()) {
+    HssLeafInitTask::TaskArgs args = {seed, diag, row};
+    int size = sizeof(args) + sizeof(int)*pack_tree_size(node);
+    std::vector<char> buf(size);
+    memcpy(&buf[0], &args, sizeof(args));
+    pack_tree(node, (int *)&buf[sizeof(args)]);
+
+    HssLeafInitTask launcher(TaskArgument(&buf[0], size),
+			     Predicate::TRUE_PRED,
+			     0,
+			     tag.begin());
+    launcher.add_region_requirement(
+      RegionRequirement(blk.gen->data, WRITE_DISCARD, EXCLUSIVE,
+			blk.gen->data).add_field(FID_X));
+    launcher.add_region_requirement(
+      RegionRequirement(blk.sub->data, WRITE_DISCARD, EXCLUSIVE,
+			blk.sub->data).add_field(FID_X));
+    Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+    f.get_void_result();
+#endif
+  } else {
+    HssNodeInitTask::TaskArgs args =
+      {seed, row, node->nrow, node->lchild()->ncol, node->ncol};
+    HssNodeInitTask launcher(TaskArgument(&args, sizeof(args)),
+			     Predicate::TRUE_PRED,
+			     0,
+			     tag.begin());
+    launcher.add_region_requirement(
+      RegionRequirement(blk.gen->data, WRITE_DISCARD, EXCLUSIVE,
+			blk.gen->data).add_field(FID_X));
+    Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+    f.get_void_result();
+#endif
+
+    Range ltag = tag.lchild(node->split_fraction());
+    Range rtag = tag.rchild(node->split_fraction());
+    init_random(node->lchild(), seed, diag, ltag, row,
+		ctx, runtime);
+    init_random(node->rchild(), seed, diag, rtag,
+		row + node->lchild()->nrow, ctx, runtime);
+  }
+}
+
+void HssMatrix::init_rhs
+(const long seed, const Range& tag,
+ Context ctx, HighLevelRuntime *runtime) {
+  init_rhs(root, seed, tag, ctx, runtime);
+}
+
+void HssMatrix::init_rhs
+(Node *node, long seed, Range tag,
+ Context ctx, HighLevelRuntime *runtime) {
+  if (node->is_legion_leaf()) {
+    block(node).b->rand(seed, Range(rhs_cols), tag.begin(),
+			ctx, runtime);
+  } else {
+    Range ltag = tag.lchild(node->split_fraction());
+    Range rtag = tag.rchild(node->split_fraction());
+    init_rhs(node->lchild(), seed, ltag, ctx, runtime);
+    init_rhs(node->rchild(), seed, rtag, ctx, runtime);
+  }
+}
+
+
+/* ---- random generators ---- */
+
+// every node draws from its own stream, so the matrix does not
+//  depend on the legion leaves
+static void seed_node
+(long seed, int row, int nrow, struct drand48_data *buffer) {
+  assert( srand48_r( seed + 104729L*row + nrow, buffer ) == 0 );
+}
+
+static double uniform(struct drand48_data *buffer) {
+  double x;
+  assert( drand48_r( buffer, &x ) == 0 );
+  return 2*x - 1;
+}
+
+// [U | V | D] of a real leaf with n rows
+static void random_leaf
+(double *X, int LD, int n, int k, double diag, long seed, int row) {
+  struct drand48_data buffer;
+  seed_node(seed, row, n, &buffer);
+  for (int j=0; j<2*k+n; j++)
+    for (int i=0; i<n; i++)
+      X[i + j*LD] = uniform(&buffer);
+  double *D = X + 2*k*LD;
+  for (int i=0; i<n; i++)
+    D[i + i*LD] += diag;
+}
+
+// [R | W | B] of a node with m = kl + kr rows. the transfer matrices
+//  are scaled to keep the nested bases of order one.
+static void random_node
+(double *X, int LD, int m, int kl, int k, long seed, int row, int nrow) {
+  struct drand48_data buffer;
+  seed_node(seed, row, nrow, &buffer);
+  double scale = 1.0 / sqrt((double)m);
+  for (int j=0; j<2*k+m; j++)
+    for (int i=0; i<m; i++)
+      X[i + j*LD] = uniform(&buffer) * (j < 2*k ? scale : 1.0);
+  // no diagonal blocks, they come from the children
+  double *D = X + 2*k*LD;
+  for (int j=0; j<m; j++)
+    for (int i=0; i<m; i++)
+      if ((i < kl) == (j < kl))
+	D[i + j*LD] = 0;
+}
+
+
+/* ---- host products ---- */
+
+void HssMatrix::get_solution
+(double *x, int LD, Context ctx, HighLevelRuntime *runtime) {
+  get_solution(root, 0, x, LD, ctx, runtime);
+}
+
+void HssMatrix::get_solution
+(Node *node, int row, double *x, int LD,
+ Context ctx, HighLevelRuntime *runtime) {
+  if (node->is_legion_leaf()) {
+    block(node).b->get_columns(x + row, LD, Range(rhs_cols),
+			       ctx, runtime);
+  } else {
+    get_solution(node->lchild(), row, x, LD, ctx, runtime);
+    get_solution(node->rchild(), row + node->lchild()->nrow, x, LD,
+		 ctx, runtime);
+  }
+}
+
+// C (m x n) = op(A) * B + beta * C
+static void gemm
+(char transa, int m, int n, int k, const double *A, int LDA,
+ const double *B, int LDB, double beta, double *C, int LDC) {
+  if (m == 0 || n == 0) return;
+  if (k == 0) { // C = beta * C, with no rank
+    for (int j=0; j<n; j++)
+      for (int i=0; i<m; i++)
+	C[i + j*LDC] *= beta;
+    return;
+  }
+  char   transb = 'n';
+  double alpha  = 1.0;
+  blas::dgemm_(&transa, &transb, &m, &n, &k, &alpha,
+	       (double *)A, &LDA, (double *)B, &LDB, &beta, C, &LDC);
+}
+
+typedef std::map<const Node *, std::vector<double> > HatMap;
+
+static double *data(std::vector<double> &v) {
+  return v.empty() ? NULL : &v[0];
+}
+
+// x^ = V^T x at a leaf and [W_a; W_b]^T [x^_a; x^_b] above
+static void random_up
+(const Node *node, int row, long seed, double diag, int ncol,
+ const double *X, int LD, HatMap &xhat) {
+  int k = node->ncol;
+  std::vector<double> &xh = xhat[node];
+  xh.assign(k*ncol, 0.0);
+  if (node->is_real_leaf()) {
+    int n = node->nrow;
+    std::vector<double> G(n*(2*k+n));
+    random_leaf(&G[0], n, n, k, diag, seed, row);
+    gemm('T', k, ncol, n, &G[k*n], n, X + row, LD, 0., data(xh), k);
+    return;
+  }
+  const Node *a = node->lchild();
+  const Node *b = node->rchild();
+  random_up(a, row, seed, diag, ncol, X, LD, xhat);
+  random_up(b, row + a->nrow, seed, diag, ncol, X, LD, xhat);
+  int m  = hss_gen_rows(node);
+  int ka = a->ncol;
+  std::vector<double> G(m*(2*k+m));
+  random_node(&G[0], m, m, ka, k, seed, row, node->nrow);
+  gemm('T', k, ncol, ka,     &G[k*m],      m, data(xhat[a]), ka,
+       0., data(xh), k);
+  gemm('T', k, ncol, m - ka, &G[k*m + ka], m, data(xhat[b]), m - ka,
+       1., data(xh), k);
+}
+
+// f is the coefficient of U of the node from the blocks above it:
+//  y = D x + U f at a leaf, and f_a = R_a f + B_ab x^_b below
+static void random_down
+(const Node *node, int row, long seed, double diag, int ncol,
+ const double *f, const double *X, double *Y, int LD, HatMap &xhat) {
+  int k = node->ncol;
+  if (node->is_real_leaf()) {
+    int n = node->nrow;
+    std::vector<double> G(n*(2*k+n));
+    random_leaf(&G[0], n, n, k, diag, seed, row);
+    gemm('N', n, ncol, n, &G[2*k*n], n, X + row, LD, 0., Y + row, LD);
+    gemm('N', n, ncol, k, &G[0],     n, f,       k,  1., Y + row, LD);
+    return;
+  }
+  const Node *a = node->lchild();
+  const Node *b = node->rchild();
+  int m  = hss_gen_rows(node);
+  int ka = a->ncol;
+  std::vector<double> G(m*(2*k+m)), g(m*ncol), x(m*ncol);
+  random_node(&G[0], m, m, ka, k, seed, row, node->nrow);
+  for (int j=0; j<ncol; j++)
+    for (int i=0; i<m; i++)
+      x[i + j*m] = i < ka ? xhat[a][i + j*ka] : xhat[b][i-ka + j*(m-ka)];
+  gemm('N', m, ncol, m, &G[2*k*m], m, &x[0], m, 0., &g[0], m);
+  gemm('N', m, ncol, k, &G[0],     m, f,     k, 1., &g[0], m);
+  std::vector<double> fa(ka*ncol), fb((m-ka)*ncol);
+  for (int j=0; j<ncol; j++)
+    for (int i=0; i<m; i++)
+      if (i < ka) fa[i + j*ka]       = g[i + j*m];
+      else        fb[i-ka + j*(m-ka)] = g[i + j*m];
+  random_down(a, row, seed, diag, ncol, data(fa), X, Y, LD, xhat);
+  random_down(b, row + a->nrow, seed, diag, ncol, data(fb), X, Y, LD,
+	      xhat);
+}
+
+void HssMatrix::random_matvec
+(long seed, double diag, int ncol, const double *X, double *Y,
+ int LD) const {
+  HatMap xhat;
+  random_up(root, 0, seed, diag, ncol, X, LD, xhat);
+  random_down(root, 0, seed, diag, ncol, NULL, X, Y, LD, xhat);
+}
+
+
+/* ---- HssLeafInitTask implementation ---- */
+
+/*static*/
+int HssLeafInitTask::TASKID;
+
+HssLeafInitTask::HssLeafInitTask(TaskArgument arg,
+				 Predicate pred /*= Predicate::TRUE_PRED*/,
+				 MapperID id /*= 0*/,
+				 MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void HssLeafInitTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <HssLeafInitTask::cpu_task>(AUTO_GENERATE_ID,
+				Processor::LOC_PROC,
+				true,
+				true,
+				AUTO_GENERATE_ID,
+				TaskConfigOptions(true/*leaf*/),
+				"hss_leaf_init");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : hss_leaf_init\n", TASKID);
+#endif
+}
+
+void HssLeafInitTask::cpu_task(const Task *task,
+			       const std::vector<PhysicalRegion> &regions,
+			       Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 2);
+  assert(task->regions.size() == 2);
+  const TaskArgs *args = (const TaskArgs *)task->args;
+  const int *desc = (const int *)(args+1);
+  assert(task->arglen == sizeof(TaskArgs) +
+	 sizeof(int)*packed_tree_size(desc));
+
+  NodeArena arena;
+  int idx = unpack_tree(desc, arena);
+
+  IndexSpace is_g = task->regions[0].region.get_index_space();
+  IndexSpace is_s = task->regions[1].region.get_index_space();
+  Rect<2> rect_g = runtime->get_index_space_domain(ctx, is_g).get_rect<2>();
+  Rect<2> rect_s = runtime->get_index_space_domain(ctx, is_s).get_rect<2>();
+
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *g_ptr = regions[0].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect_g, subrect, offsets);
+  assert(rect_g == subrect);
+  double *s_ptr = regions[1].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect_s, subrect, offsets);
+  assert(rect_s == subrect);
+
+  std::vector<int> offset;
+  int size = hss_sub_offsets(arena.at(idx), offset);
+  assert(size <= rect_s.dim_size(0));
+  int LD = rect_g.dim_size(0);
+
+  for (int i=0; i<desc[0]; i++) {
+    const Node *node = arena.at(idx+i);
+    int row = args->row + node->row_beg;
+    if (node->is_real_leaf()) {
+      assert(2*node->ncol + node->nrow <= rect_g.dim_size(1));
+      random_leaf(g_ptr + node->row_beg, LD, node->nrow, node->ncol,
+		  args->diag, args->seed, row);
+    } else {
+      int m = hss_gen_rows(node);
+      random_node(s_ptr + offset[i], m, m, node->lchild()->ncol,
+		  node->ncol, args->seed, row, node->nrow);
+    }
+  }
+}
+
+
+/* ---- HssNodeInitTask implementation ---- */
+
+/*static*/
+int HssNodeInitTask::TASKID;
+
+HssNodeInitTask::HssNodeInitTask(TaskArgument arg,
+				 Predicate pred /*= Predicate::TRUE_PRED*/,
+				 MapperID id /*= 0*/,
+				 MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void HssNodeInitTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <HssNodeInitTask::cpu_task>(AUTO_GENERATE_ID,
+				Processor::LOC_PROC,
+				true,
+				true,
+				AUTO_GENERATE_ID,
+				TaskConfigOptions(true/*leaf*/),
+				"hss_node_init");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : hss_node_init\n", TASKID);
+#endif
+}
+
+void HssNodeInitTask::cpu_task(const Task *task,
+			       const std::vector<PhysicalRegion> &regions,
+			       Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 1);
+  assert(task->regions.size() == 1);
+  assert(task->arglen == sizeof(TaskArgs));
+  const TaskArgs *args = (const TaskArgs *)task->args;
+
+  IndexSpace is = task->regions[0].region.get_index_space();
+  Rect<2> rect = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *ptr = regions[0].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect, subrect, offsets);
+  assert(rect == subrect);
+
+  int m = rect.dim_size(0);
+  assert(rect.dim_size(1) == 2*args->k + m);
+  random_node(ptr, m, m, args->kl, args->k,
+	      args->seed, args->row, args->nrow);
+}
@@ -1,25 +1,22 @@
+#include <algorithm>
+#include <assert.h>
+#include <stdlib.h>
+#include <vector>
+
 #include "node.h"
 #include "macros.h"
 
 Node::Node(int nrow_, int ncol_,
 		       int row_beg_, int col_beg_,
-		       Node *lchild_,
-		       Node *rchild_,
-		       Node *Hmat_,
 		       LMatrix *matrix_,
 		       LMatrix *kmat_,
 		       bool isLegionLeaf_):
   nrow(nrow_), ncol(ncol_),
-  row_beg(row_beg_), col_beg(col_beg_),
-  lchild(lchild_), rchild(rchild_), Hmat(Hmat_),
+  row_beg(row_beg_), col_beg(col_beg_), cost(0),
   lowrank_matrix(matrix_), dense_matrix(kmat_),
+  child(0), hmat(0),
   isLegionLeaf(isLegionLeaf_) {}
 
-bool Node::is_real_leaf() const {
-  return (lchild == NULL)
-    &&   (rchild == NULL);
-}
-
 bool Node::is_legion_leaf() const {
   return isLegionLeaf;
 }
@@ -28,6 +25,50 @@ void Node::set_legion_leaf(bool is) {
   isLegionLeaf = is;
 }
 
+void Node::set_children(Node *lchild) {
+  child = (lchild == NULL) ? 0 : lchild - this;
+}
+
+void Node::set_Hmat(Node *H) {
+  hmat = (H == NULL) ? 0 : H - this;
+}
+
+double Node::split_fraction() const {
+  assert( ! is_real_leaf() );
+  double lcost = lchild()->cost;
+  double rcost = rchild()->cost;
+  return (lcost + rcost > 0) ? lcost / (lcost + rcost) : 0.5;
+}
+
+NodeArena::NodeArena()
+  : nodes(NULL), count(0), capacity(0) {}
+
+NodeArena::~NodeArena() {
+  free(nodes);
+}
+
+int NodeArena::alloc(int n) {
+  assert(n > 0);
+  if (count + n > capacity) {
+    // links are relative, so moving the block keeps trees intact
+    capacity = std::max(2*capacity, count+n);
+    nodes = (Node *) realloc(nodes, capacity * sizeof(Node));
+    assert(nodes != NULL);
+  }
+  int first = count;
+  for (int i=0; i<n; i++)
+    nodes[first+i] = Node();
+  count += n;
+  return first;
+}
+
+void NodeArena::clear() {
+  free(nodes);
+  nodes    = NULL;
+  count    = 0;
+  capacity = 0;
+}
+
 // this function computes the begining row index in region of
 // Legion leaf i.e. building the subtree with the legion node
 // as the root. This subtree is used in leaf solve (serial) task
@@ -38,8 +79,8 @@ void build_subtree(Node *node, int row_beg) {
   if (node->is_real_leaf()) { // real matrix leaf
     return;
   } else {
-    build_subtree(node->lchild, row_beg);
-    build_subtree(node->rchild, row_beg + node->lchild->nrow);
+    build_subtree(node->lchild(), row_beg);
+    build_subtree(node->rchild(), row_beg + node->lchild()->nrow);
   }
 }
 
@@ -50,8 +91,8 @@ int count_matrix_column(const Node *node, int col_size) {
   if (node->is_real_leaf())
     return col_size;
   else {
-    int nl = count_matrix_column(node->lchild, col_size);
-    int nr = count_matrix_column(node->rchild, col_size);
+    int nl = count_matrix_column(node->lchild(), col_size);
+    int nr = count_matrix_column(node->rchild(), col_size);
     return std::max(nl, nr);
   }
 }
@@ -62,79 +103,69 @@ int max_row_size(const Node * vnode) {
     return vnode->nrow;
   }
 
-  int m1 = max_row_size(vnode->lchild);
-  int m2 = max_row_size(vnode->rchild);
+  int m1 = max_row_size(vnode->lchild());
+  int m2 = max_row_size(vnode->rchild());
   
   return std::max(m1, m2);
 }
 
-int tree_to_array(const Node * leaf, Node * arg, int idx) {
-
-  if (leaf->lchild != NULL && leaf->rchild != NULL) {
-
-    //assert(2*idx+2 < arg.size());
-    arg[ 2*idx+1 ] = *(leaf -> lchild);
-    arg[ 2*idx+2 ] = *(leaf -> rchild);
-    int nl = tree_to_array(leaf->lchild, arg, 2*idx+1);
-    int nr = tree_to_array(leaf->rchild, arg, 2*idx+2);
-    return nl + nr + 1;
-    
-  } else return 1;
+int pack_tree_size(const Node *root) {
+  return 1 + TREE_FIELDS * (2*count_leaf(root) - 1);
 }
 
-void tree_to_array(const Node *tree, Node *array, int idx,
-	      int shift) {
-
-  if (tree->lchild != NULL && tree->rchild != NULL) {
-
-    //assert(2*idx+2+shift < arg.size());
-    array[ 2*idx+1+shift ] = *(tree -> lchild);
-    array[ 2*idx+2+shift ] = *(tree -> rchild);
-    tree_to_array(tree->lchild, array, 2*idx+1, shift);
-    tree_to_array(tree->rchild, array, 2*idx+2, shift); 
-  }
+int packed_tree_size(const int *desc) {
+  return 1 + TREE_FIELDS * desc[0];
 }
 
-void array_to_tree(Node *arg, int idx) {
-
-  if (arg[ idx ].lchild != NULL) {
-    
-    assert(arg[ idx ].rchild != NULL);
-    arg[ idx ].lchild = &arg[ 2*idx+1 ];
-    arg[ idx ].rchild = &arg[ 2*idx+2 ];
-    
-  } else {
-    assert(arg[ idx ].rchild == NULL);
-    return; 
+int pack_tree(const Node *root, int *desc) {
+
+  std::vector<const Node *> queue(1, root);
+  for (size_t i=0; i<queue.size(); i++) {
+    const Node *node = queue[i];
+    int *entry = desc + 1 + TREE_FIELDS*i;
+    entry[TREE_NROW]    = node->nrow;
+    entry[TREE_NCOL]    = node->ncol;
+    entry[TREE_ROW_BEG] = node->row_beg;
+    entry[TREE_COL_BEG] = node->col_beg;
+    if (node->is_real_leaf()) {
+      entry[TREE_LCHILD] = -1;
+    } else {
+      entry[TREE_LCHILD] = queue.size();
+      queue.push_back(node->lchild());
+      queue.push_back(node->rchild());
+    }
   }
-  
-  array_to_tree(arg, 2*idx+1);
-  array_to_tree(arg, 2*idx+2);
+  desc[0] = queue.size();
+  return packed_tree_size(desc);
 }
 
-void array_to_tree(Node *arg, int idx, int shift) {
-
-  if (arg[ idx+shift ].lchild != NULL) {
-    
-    assert(arg[ idx+shift ].rchild != NULL);
-    arg[ idx+shift ].lchild = &arg[ 2*idx+1+shift ];
-    arg[ idx+shift ].rchild = &arg[ 2*idx+2+shift ];
-    
-  } else {
-    assert(arg[ idx+shift ].rchild == NULL);
-    return;
+// every unpacked node is at or below the Legion leaf
+int unpack_tree(const int *desc, NodeArena &arena) {
+
+  int nnode = desc[0];
+  int root  = arena.alloc(nnode);
+  for (int i=0; i<nnode; i++) {
+    const int *entry = desc + 1 + TREE_FIELDS*i;
+    Node *node = arena.at(root+i);
+    node->nrow    = entry[TREE_NROW];
+    node->ncol    = entry[TREE_NCOL];
+    node->row_beg = entry[TREE_ROW_BEG];
+    node->col_beg = entry[TREE_COL_BEG];
+    node->set_legion_leaf(true);
+    if (entry[TREE_LCHILD] >= 0) {
+      assert(entry[TREE_LCHILD]+1 < nnode);
+      node->set_children( arena.at(root+entry[TREE_LCHILD]) );
+    }
   }
-
-  array_to_tree(arg, 2*idx+1, shift);
-  array_to_tree(arg, 2*idx+2, shift);
+  return root;
 }
 
 int count_leaf(const Node *node) {
   if (node->is_real_leaf())
     return 1;
   else {
-    int n1 = count_leaf(node->lchild);
-    int n2 = count_leaf(node->rchild);
+    int n1 = count_leaf(node->lchild());
+    int n2 = count_leaf(node->rchild());
     return n1+n2;
   }
 }
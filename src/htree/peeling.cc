@@ -0,0 +1,191 @@
+#include "peeling.h"
+#include "host_tree.h"
+#include "legion_matrix.h"
+#include "lapack_blas.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <stdlib.h> // for srand48_r() and drand48_r()
+#include <string.h>
+#include <vector>
+
+// C (m x n) += alpha * op(A) * B
+static void gemm
+(char transa, int m, int n, int k, double alpha,
+ const double *A, int LDA, const double *B, int LDB,
+ double *C, int LDC) {
+  if (m == 0 || n == 0 || k == 0) return;
+  char   transb = 'n';
+  double one    = 1.0;
+  blas::dgemm_(&transa, &transb, &m, &n, &k, &alpha,
+	       (double *)A, &LDA, (double *)B, &LDB, &one, C, &LDC);
+}
+
+// Y -= (known part of A) X, or its transpose; the known part holds
+//  the blocks of the children above depth `level`
+static void subtract_known
+(const std::vector<HostNode> &t, int level, bool trans,
+ const double *X, int N, int ncol, double *Y) {
+
+  std::vector<double> tmp;
+  for (size_t i=0; i<t.size(); i++) {
+    const HostNode &p = t[i];
+    if (p.lchild < 0 || p.depth+1 >= level) continue;
+    const HostNode &a = t[p.lchild];
+    const HostNode &b = t[p.rchild];
+    // A(a, b) = a.u b.v^T and A(b, a) = b.u a.v^T
+    const HostNode *pair[2][2] = {{&a, &b}, {&b, &a}};
+    for (int s=0; s<2; s++) {
+      const HostNode &r = *pair[s][0]; // row side
+      const HostNode &c = *pair[s][1]; // column side
+      const std::vector<double> &L = trans ? c.v : r.u;
+      const std::vector<double> &R = trans ? r.u : c.v;
+      const HostNode &out = trans ? c : r;
+      const HostNode &in  = trans ? r : c;
+      int k = r.k;
+      tmp.assign(k*ncol, 0.0);
+      gemm('t', k, ncol, in.nrow, 1.0, &R[0], in.nrow,
+	   X + in.row, N, &tmp[0], k);
+      gemm('n', out.nrow, ncol, k, -1.0, &L[0], out.nrow,
+	   &tmp[0], k, Y + out.row, N);
+    }
+  }
+}
+
+// the k leading left singular vectors of Y (m x n)
+static void range_basis
+(const double *Y, int LD, int m, int n, int k, std::vector<double> &Q) {
+  assert(k <= std::min(m, n));
+  std::vector<double> A(m*n), S(std::min(m, n)), U(m*std::min(m, n));
+  for (int j=0; j<n; j++)
+    memcpy(&A[j*m], Y + j*LD, m*sizeof(double));
+  char jobu  = 's';
+  char jobvt = 'n';
+  int  ldu   = m;
+  int  ldvt  = 1;
+  int  lwork = -1;
+  int  INFO;
+  double vt, query;
+  lapack::dgesvd_(&jobu, &jobvt, &m, &n, &A[0], &m, &S[0], &U[0], &ldu,
+		  &vt, &ldvt, &query, &lwork, &INFO);
+  lwork = (int)query;
+  std::vector<double> work(lwork);
+  lapack::dgesvd_(&jobu, &jobvt, &m, &n, &A[0], &m, &S[0], &U[0], &ldu,
+		  &vt, &ldvt, &work[0], &lwork, &INFO);
+  assert(INFO == 0);
+  Q.assign(U.begin(), U.begin() + m*k);
+}
+
+static void random_rows
+(double *X, int N, int row, int nrow, int ncol,
+ struct drand48_data *buffer) {
+  for (int j=0; j<ncol; j++)
+    for (int i=0; i<nrow; i++) {
+      double x;
+      assert( drand48_r( buffer, &x ) == 0 );
+      X[row+i + j*N] = 2*x - 1;
+    }
+}
+
+static void peel_level
+(std::vector<HostNode> &t, int level, int N, MatvecFunc matvec,
+ int oversample, struct drand48_data *buffer) {
+
+  std::vector<int> parents;
+  int kmax = 0;
+  for (size_t i=0; i<t.size(); i++)
+    if (t[i].depth+1 == level && t[i].lchild >= 0) {
+      parents.push_back(i);
+      kmax = std::max(kmax, t[t[i].lchild].k);
+      kmax = std::max(kmax, t[t[i].rchild].k);
+    }
+  if (parents.empty()) return;
+
+  // random probes on the right children in the first s columns and
+  //  on the left children in the next s, so that the diagonal
+  //  blocks never mix with the sampled ones
+  int s = kmax + oversample;
+  std::vector<double> X(N*2*s, 0.0), Y(N*2*s);
+  for (size_t i=0; i<parents.size(); i++) {
+    const HostNode &a = t[t[parents[i]].lchild];
+    const HostNode &b = t[t[parents[i]].rchild];
+    random_rows(&X[0],   N, b.row, b.nrow, s, buffer);
+    random_rows(&X[N*s], N, a.row, a.nrow, s, buffer);
+  }
+  matvec(false, 2*s, &X[0], &Y[0]);
+  subtract_known(t, level, false, &X[0], N, 2*s, &Y[0]);
+
+  std::vector<double> Z(N*2*kmax, 0.0), W(N*2*kmax);
+  for (size_t i=0; i<parents.size(); i++) {
+    HostNode &a = t[t[parents[i]].lchild];
+    HostNode &b = t[t[parents[i]].rchild];
+    range_basis(&Y[a.row],     N, a.nrow, s, a.k, a.u);
+    range_basis(&Y[b.row+N*s], N, b.nrow, s, b.k, b.u);
+    for (int j=0; j<a.k; j++)
+      memcpy(&Z[a.row + j*N], &a.u[j*a.nrow], a.nrow*sizeof(double));
+    for (int j=0; j<b.k; j++)
+      memcpy(&Z[b.row + (kmax+j)*N], &b.u[j*b.nrow],
+	     b.nrow*sizeof(double));
+  }
+  matvec(true, 2*kmax, &Z[0], &W[0]);
+  subtract_known(t, level, true, &Z[0], N, 2*kmax, &W[0]);
+
+  // A(a, b) = Qa Qa^T A(a, b), so b.v = A(a, b)^T Qa
+  for (size_t i=0; i<parents.size(); i++) {
+    HostNode &a = t[t[parents[i]].lchild];
+    HostNode &b = t[t[parents[i]].rchild];
+    b.v.resize(b.nrow*a.k);
+    for (int j=0; j<a.k; j++)
+      memcpy(&b.v[j*b.nrow], &W[b.row + j*N], b.nrow*sizeof(double));
+    a.v.resize(a.nrow*b.k);
+    for (int j=0; j<b.k; j++)
+      memcpy(&a.v[j*a.nrow], &W[a.row + (kmax+j)*N],
+	     a.nrow*sizeof(double));
+  }
+}
+
+// dense leaves from identity blocks on all real leaves at once
+static void peel_leaves
+(std::vector<HostNode> &t, int N, MatvecFunc matvec) {
+  int nmax = 0;
+  for (size_t i=0; i<t.size(); i++)
+    if (t[i].lchild < 0)
+      nmax = std::max(nmax, t[i].nrow);
+
+  std::vector<double> X(N*nmax, 0.0), Y(N*nmax);
+  for (size_t i=0; i<t.size(); i++)
+    if (t[i].lchild < 0)
+      for (int j=0; j<t[i].nrow; j++)
+	X[t[i].row+j + j*N] = 1.0;
+  matvec(false, nmax, &X[0], &Y[0]);
+  subtract_known(t, t.size()+1, false, &X[0], N, nmax, &Y[0]);
+
+  for (size_t i=0; i<t.size(); i++)
+    if (t[i].lchild < 0) {
+      int n = t[i].nrow;
+      t[i].d.resize(n*n);
+      for (int j=0; j<n; j++)
+	memcpy(&t[i].d[j*n], &Y[t[i].row + j*N], n*sizeof(double));
+    }
+}
+
+
+void fill_peeled_matrix
+(Node *uroot, Node *vroot, int rhs_cols, MatvecFunc matvec,
+ int oversample, long seed, Context ctx, HighLevelRuntime *runtime) {
+
+  std::vector<HostNode> t;
+  mirror_tree(uroot, 0, 0, t);
+  int N     = uroot->nrow;
+  int depth = 0;
+  for (size_t i=0; i<t.size(); i++)
+    depth = std::max(depth, t[i].depth);
+
+  struct drand48_data buffer;
+  assert( srand48_r( seed, &buffer ) == 0 );
+  for (int level=1; level<=depth; level++)
+    peel_level(t, level, N, matvec, oversample, &buffer);
+  peel_leaves(t, N, matvec);
+
+  write_host_tree(uroot, vroot, t, rhs_cols, ctx, runtime);
+}
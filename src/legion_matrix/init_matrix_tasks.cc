@@ -5,11 +5,14 @@
 
 #include <stdlib.h> // for srand48_r() and drand48_r()
 #include <assert.h>
+#include <string.h>
 
 void register_init_tasks() {
   RandomMatrixTask::register_tasks();
   DenseMatrixTask::register_tasks();
   CirculantMatrixTask::register_tasks();
+  ShiftMatrixTask::register_tasks();
+  CopyMatrixTask::register_tasks();
 }
 
 /* ---- RandomMatrixTask implementation ---- */
@@ -113,15 +116,16 @@ void DenseMatrixTask::cpu_task
   assert(regions.size() == 1);
   assert(task->regions.size() == 1);
 
-  TaskArgs<MAX_TREE_SIZE> *args = (TaskArgs<MAX_TREE_SIZE> *)task->args;
+  const TaskArgs *args = (const TaskArgs *)task->args;
   int row_beg_global = args->row;
   int rank = args->rank;
   double diag = args->diag;
-  Node *treeArray = args->treeArray;
-  assert(task->arglen == sizeof(TaskArgs<MAX_TREE_SIZE>));
+  const int *desc = (const int *)(args+1);
+  assert(task->arglen == sizeof(TaskArgs) +
+	 sizeof(int)*packed_tree_size(desc));
 
-  Node *vroot = treeArray;
-  array_to_tree(treeArray, 0);
+  NodeArena arena;
+  Node *vroot = arena.at( unpack_tree(desc, arena) );
   
   RegionAccessor<AccessorType::Generic, double> acc_k = 
     regions[0].get_field_accessor(FID_X).typeify<double>();
@@ -257,7 +261,137 @@ void fill_circulant_Kmat
     return;
   }
 
-  fill_circulant_Kmat(vnode->lchild, row_beg_glo, r, diag, Kmat, LD);
-  fill_circulant_Kmat(vnode->rchild, row_beg_glo, r, diag, Kmat, LD);
+  fill_circulant_Kmat(vnode->lchild(), row_beg_glo, r, diag, Kmat, LD);
+  fill_circulant_Kmat(vnode->rchild(), row_beg_glo, r, diag, Kmat, LD);
 }
 */
+
+
+/* ---- ShiftMatrixTask implementation ---- */
+
+/*static*/
+int ShiftMatrixTask::TASKID;
+
+ShiftMatrixTask::
+ShiftMatrixTask(TaskArgument arg,
+		Predicate pred /*= Predicate::TRUE_PRED*/,
+		MapperID id /*= 0*/,
+		MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void ShiftMatrixTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <ShiftMatrixTask::cpu_task>(AUTO_GENERATE_ID,
+				Processor::LOC_PROC, 
+				true,
+				true,
+				AUTO_GENERATE_ID,
+				TaskConfigOptions(true),
+				"shift_matrix");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : shift_matrix\n", TASKID);
+#endif
+}
+
+static void shift_diagonal
+(const Node *vnode, double sigma, double *k_ptr, int LD) {
+  if (vnode->is_real_leaf()) {
+    double *K = k_ptr + vnode->row_beg;
+    for (int i=0; i<vnode->nrow; i++)
+      K[i + i*LD] += sigma;
+  } else {
+    shift_diagonal(vnode->lchild(), sigma, k_ptr, LD);
+    shift_diagonal(vnode->rchild(), sigma, k_ptr, LD);
+  }
+}
+
+void ShiftMatrixTask::cpu_task
+(const Task *task, const std::vector<PhysicalRegion> &regions,
+ Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 4);
+  assert(task->regions.size() == 4);
+
+  const TaskArgs *args = (const TaskArgs *)task->args;
+  const int *desc = (const int *)(args+1);
+  assert(task->arglen == sizeof(TaskArgs) +
+	 sizeof(int)*packed_tree_size(desc));
+
+  NodeArena arena;
+  Node *vroot = arena.at( unpack_tree(desc, arena) );
+
+  // base U, base K, U and K
+  double *ptr[4];
+  Rect<2> rect[4];
+  for (int i=0; i<4; i++) {
+    IndexSpace is = task->regions[i].region.get_index_space();
+    rect[i] = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+    Rect<2> subrect;
+    ByteOffset offsets[2];
+    ptr[i] = regions[i].get_field_accessor(FID_X).typeify<double>().
+      raw_rect_ptr<2>(rect[i], subrect, offsets);
+    assert(ptr[i] != NULL);
+    assert(rect[i] == subrect);
+  }
+  assert(rect[0].volume() == rect[2].volume());
+  assert(rect[1].volume() == rect[3].volume());
+
+  memcpy(ptr[2], ptr[0], rect[0].volume()*sizeof(double));
+  memcpy(ptr[3], ptr[1], rect[1].volume()*sizeof(double));
+  shift_diagonal(vroot, args->sigma, ptr[3], rect[3].dim_size(0));
+}
+
+
+/* ---- CopyMatrixTask implementation ---- */
+
+/*static*/
+int CopyMatrixTask::TASKID;
+
+CopyMatrixTask::
+CopyMatrixTask(TaskArgument arg,
+	       Predicate pred /*= Predicate::TRUE_PRED*/,
+	       MapperID id /*= 0*/,
+	       MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void CopyMatrixTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <CopyMatrixTask::cpu_task>(AUTO_GENERATE_ID,
+			       Processor::LOC_PROC, 
+			       true,
+			       true,
+			       AUTO_GENERATE_ID,
+			       TaskConfigOptions(true),
+			       "copy_matrix");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : copy_matrix\n", TASKID);
+#endif
+}
+
+void CopyMatrixTask::cpu_task
+(const Task *task, const std::vector<PhysicalRegion> &regions,
+ Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 2);
+  assert(task->regions.size() == 2);
+
+  // source and destination
+  double *ptr[2];
+  Rect<2> rect[2];
+  for (int i=0; i<2; i++) {
+    IndexSpace is = task->regions[i].region.get_index_space();
+    rect[i] = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+    Rect<2> subrect;
+    ByteOffset offsets[2];
+    ptr[i] = regions[i].get_field_accessor(FID_X).typeify<double>().
+      raw_rect_ptr<2>(rect[i], subrect, offsets);
+    assert(ptr[i] != NULL);
+    assert(rect[i] == subrect);
+  }
+  assert(rect[0].volume() == rect[1].volume());
+  memcpy(ptr[1], ptr[0], rect[0].volume()*sizeof(double));
+}
@@ -0,0 +1,649 @@
+#include "kernel_matrix_tasks.h"
+#include "legion_matrix.h"
+#include "node.h"
+#include "lapack_blas.h"
+#include "macros.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+static std::vector<KernelFunc>& kernel_table() {
+  static std::vector<KernelFunc> table;
+  return table;
+}
+
+int register_kernel(KernelFunc kernel) {
+  kernel_table().push_back(kernel);
+  return kernel_table().size()-1;
+}
+
+KernelFunc get_kernel(int id) {
+  assert(id >= 0 && id < (int)kernel_table().size());
+  return kernel_table()[id];
+}
+
+// a registered kernel with the data it reads
+struct Kernel {
+  KernelFunc    func;
+  const double *data;
+  double operator()(int i, int j) const {return func(i, j, data);}
+};
+
+// the kernel of the task arguments with the data region, which is
+//  the last region of every kernel task
+static Kernel task_kernel
+(int id, const Task *task, const std::vector<PhysicalRegion> &regions,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  int r = regions.size()-1;
+  IndexSpace is = task->regions[r].region.get_index_space();
+  Rect<2> rect = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  Kernel kernel;
+  kernel.func = get_kernel(id);
+  kernel.data = regions[r].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect, subrect, offsets);
+  assert(kernel.data != NULL);
+  assert(rect == subrect);
+  return kernel;
+}
+
+static void add_data_region
+(TaskLauncher &launcher, const LMatrix *data) {
+  launcher.add_region_requirement(
+	     RegionRequirement(data->data,
+			       READ_ONLY,
+			       EXCLUSIVE,
+			       data->data)
+	     .add_field(FID_X));
+}
+
+void register_kernel_tasks() {
+  KernelSkeletonTask::register_tasks();
+  KernelLeafTask::register_tasks();
+  KernelHmatTask::register_tasks();
+}
+
+
+/* ---- cross approximation ---- */
+
+// adaptive cross approximation with partial pivoting of the block
+//  A(row:row+m, col:col+n). Only the pivot rows and columns of the
+//  residual are evaluated, i.e. O(rank*(m+n)) kernel calls.
+static void aca
+(const Kernel &kernel, int row, int m, int col, int n,
+ int maxRank, double tol, Skeleton &skel) {
+
+  maxRank = std::min(maxRank, std::min(m, n));
+  std::vector<double> U(m * maxRank); // residual columns
+  std::vector<double> V(n * maxRank); // scaled residual rows
+  std::vector<bool>   usedRow(m, false);
+  std::vector<bool>   usedCol(n, false);
+  double norm2 = 0; // squared Frobenius norm of the approximation
+
+  int i = 0;
+  int t = 0;
+  int nzero = 0; // zero rows met, bounds the kernel calls
+  while (t < maxRank) {
+
+    // residual of row i
+    double *v = &V[t*n];
+    for (int j=0; j<n; j++) {
+      v[j] = kernel(row+i, col+j);
+      for (int s=0; s<t; s++)
+	v[j] -= U[i + s*m] * V[j + s*n];
+    }
+    usedRow[i] = true;
+
+    int jmax = -1;
+    for (int j=0; j<n; j++)
+      if (!usedCol[j] && (jmax < 0 || fabs(v[j]) > fabs(v[jmax])))
+	jmax = j;
+    if (jmax < 0) break;
+
+    if (v[jmax] == 0) { // zero row, try the next unused one
+      if (++nzero >= maxRank) break;
+      i = 0;
+      while (i < m && usedRow[i]) i++;
+      if (i == m) break;
+      continue;
+    }
+
+    // residual of column jmax
+    double pivot = v[jmax];
+    for (int j=0; j<n; j++)
+      v[j] /= pivot;
+    double *u = &U[t*m];
+    for (int k=0; k<m; k++) {
+      u[k] = kernel(row+k, col+jmax);
+      for (int s=0; s<t; s++)
+	u[k] -= U[k + s*m] * V[jmax + s*n];
+    }
+    usedCol[jmax] = true;
+    skel.rows.push_back(i);
+    skel.cols.push_back(jmax);
+
+    // update the norm of the approximation
+    double unorm2 = 0, vnorm2 = 0;
+    for (int k=0; k<m; k++) unorm2 += u[k]*u[k];
+    for (int j=0; j<n; j++) vnorm2 += v[j]*v[j];
+    for (int s=0; s<t; s++) {
+      double uu = 0, vv = 0;
+      for (int k=0; k<m; k++) uu += U[k + s*m] * u[k];
+      for (int j=0; j<n; j++) vv += V[j + s*n] * v[j];
+      norm2 += 2 * uu * vv;
+    }
+    norm2 += unorm2 * vnorm2;
+    t++;
+
+    if (sqrt(unorm2 * vnorm2) <= tol * sqrt(norm2))
+      break;
+
+    // next pivot row: the largest entry of the new column
+    i = -1;
+    for (int k=0; k<m; k++)
+      if (!usedRow[k] && (i < 0 || fabs(u[k]) > fabs(u[i])))
+	i = k;
+    if (i < 0) break;
+  }
+}
+
+// u = A(row:row+m, col+J), zero padded to ncol columns
+static void fill_u
+(const Kernel &kernel, int row, int m, int col, const Skeleton &skel,
+ double *u, int ncol, int LD) {
+
+  for (int t=0; t<ncol; t++)
+    for (int i=0; i<m; i++)
+      u[i + t*LD] = (t < skel.rank()) ?
+	kernel(row+i, col+skel.cols[t]) : 0;
+}
+
+// v = (A(rbeg+I, cbeg+J)^-1 A(rbeg+I, col:col+m))^T, zero padded
+//  to ncol columns. rows I and columns J of the skeleton are
+//  relative to rbeg and cbeg.
+static void fill_v
+(const Kernel &kernel, int rbeg, int cbeg, const Skeleton &skel,
+ int col, int m, double *v, int ncol, int LD) {
+
+  int r = skel.rank();
+  assert(r <= ncol);
+  for (int t=r; t<ncol; t++)
+    for (int i=0; i<m; i++)
+      v[i + t*LD] = 0;
+  if (r == 0) return;
+
+  std::vector<double> M(r*r);
+  std::vector<double> B(r*m);
+  for (int b=0; b<r; b++)
+    for (int a=0; a<r; a++)
+      M[a + b*r] = kernel(rbeg+skel.rows[a], cbeg+skel.cols[b]);
+  for (int i=0; i<m; i++)
+    for (int a=0; a<r; a++)
+      B[a + i*r] = kernel(rbeg+skel.rows[a], col+i);
+
+  int INFO;
+  std::vector<int> IPIV(r);
+  lapack::dgesv_(&r, &m, &M[0], &r, &IPIV[0], &B[0], &r, &INFO);
+  assert(INFO == 0);
+
+  for (int t=0; t<r; t++)
+    for (int i=0; i<m; i++)
+      v[i + t*LD] = B[t + i*r];
+}
+
+
+/* ---- launch the construction ---- */
+
+static Future launch_skeleton
+(int kernel, const LMatrix *data, int row, int m, int col, int n,
+ int rank, double tol, int tag, Context ctx, HighLevelRuntime *runtime) {
+
+  KernelSkeletonTask::TaskArgs args = {kernel, row, m, col, n,
+				       rank, tol};
+  KernelSkeletonTask launcher(TaskArgument(&args, sizeof(args)),
+			      Predicate::TRUE_PRED,
+			      0,
+			      tag);
+  add_data_region(launcher, data);
+  return runtime->execute_task(ctx, launcher);
+}
+
+static void init_kernel_Hmat
+(Node *Hmat, int kernel, const LMatrix *data, int sib_beg, int col_beg,
+ Future skel, const Range &tag, Context ctx, HighLevelRuntime *runtime) {
+
+  if (Hmat->is_real_leaf()) {
+
+    KernelHmatTask::TaskArgs args = {kernel, col_beg + Hmat->row_beg,
+				     sib_beg, col_beg};
+    KernelHmatTask launcher(TaskArgument(&args, sizeof(args)),
+			    Predicate::TRUE_PRED,
+			    0,
+			    tag.begin());
+    launcher.add_region_requirement(
+	       RegionRequirement(Hmat->lowrank_matrix->data,
+				 WRITE_DISCARD,
+				 EXCLUSIVE,
+				 Hmat->lowrank_matrix->data)
+	       .add_field(FID_X));
+    add_data_region(launcher, data);
+    launcher.add_future(skel);
+    Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+    f.get_void_result();
+    printf("Waiting for kernel H-tiled matrix ...\n");
+#endif
+
+  } else {
+    Range ltag = tag.lchild(Hmat->split_fraction());
+    Range rtag = tag.rchild(Hmat->split_fraction());
+    init_kernel_Hmat(Hmat->lchild(), kernel, data, sib_beg, col_beg, skel,
+		     ltag, ctx, runtime);
+    init_kernel_Hmat(Hmat->rchild(), kernel, data, sib_beg, col_beg, skel,
+		     rtag, ctx, runtime);
+  }
+}
+
+// u columns of an ancestor stored in the legion leaf region
+struct Ancestor {
+  int    col_beg;
+  int    ncol;
+  int    sib_beg; // first global row of the sibling
+  Future skel;    // skeleton of the block (ancestor, sibling)
+};
+
+static void init_kernel_leaf
+(Node *uleaf, Node *vleaf, int kernel, const LMatrix *data, double tol,
+ int row, const std::vector<Ancestor> &path,
+ const Range &tag, Context ctx, HighLevelRuntime *runtime) {
+
+  int nanc  = path.size();
+  int usize = pack_tree_size(uleaf);
+  int vsize = pack_tree_size(vleaf);
+  KernelLeafTask::TaskArgs args = {kernel, row, nanc, tol};
+
+  int size = sizeof(args) + sizeof(int)*(3*nanc + usize + vsize);
+  std::vector<char> buf(size);
+  memcpy(&buf[0], &args, sizeof(args));
+  int *desc = (int *)&buf[sizeof(args)];
+  for (int i=0; i<nanc; i++) {
+    *desc++ = path[i].col_beg;
+    *desc++ = path[i].ncol;
+    *desc++ = path[i].sib_beg;
+  }
+  desc += pack_tree(uleaf, desc);
+  pack_tree(vleaf, desc);
+
+  KernelLeafTask launcher(TaskArgument(&buf[0], size),
+			  Predicate::TRUE_PRED,
+			  0,
+			  tag.begin());
+  launcher.add_region_requirement(
+	     RegionRequirement(uleaf->lowrank_matrix->data,
+			       READ_WRITE, // keep the rhs
+			       EXCLUSIVE,
+			       uleaf->lowrank_matrix->data)
+	     .add_field(FID_X));
+  launcher.add_region_requirement(
+	     RegionRequirement(vleaf->lowrank_matrix->data,
+			       WRITE_DISCARD,
+			       EXCLUSIVE,
+			       vleaf->lowrank_matrix->data)
+	     .add_field(FID_X));
+  launcher.add_region_requirement(
+	     RegionRequirement(vleaf->dense_matrix->data,
+			       WRITE_DISCARD,
+			       EXCLUSIVE,
+			       vleaf->dense_matrix->data)
+	     .add_field(FID_X));
+  add_data_region(launcher, data);
+  for (int i=0; i<nanc; i++)
+    launcher.add_future(path[i].skel);
+  Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+  f.get_void_result();
+  printf("Waiting for kernel legion leaf ...\n");
+#endif
+}
+
+static void init_kernel_tree
+(Node *unode, Node *vnode, int kernel, const LMatrix *data, double tol,
+ int row, std::vector<Ancestor> &path,
+ const Range &tag, Context ctx, HighLevelRuntime *runtime) {
+
+  if (unode->is_legion_leaf()) {
+    assert(vnode->is_legion_leaf());
+    init_kernel_leaf(unode, vnode, kernel, data, tol, row, path,
+		     tag, ctx, runtime);
+    return;
+  }
+
+  Node *b0 = unode->lchild();
+  Node *b1 = unode->rchild();
+  int row0 = row;
+  int row1 = row + b0->nrow;
+  const Range tag0 = tag.lchild(unode->split_fraction());
+  const Range tag1 = tag.rchild(unode->split_fraction());
+
+  // A01 = u0 * V1^T and A10 = u1 * V0^T
+  Future s01 = launch_skeleton(kernel, data, row0, b0->nrow, row1,
+			       b1->nrow, b0->ncol, tol, tag0.begin(),
+			       ctx, runtime);
+  Future s10 = launch_skeleton(kernel, data, row1, b1->nrow, row0,
+			       b0->nrow, b1->ncol, tol, tag1.begin(),
+			       ctx, runtime);
+
+  init_kernel_Hmat(vnode->rchild()->Hmat(), kernel, data, row0, row1,
+		   s01, tag1, ctx, runtime);
+  init_kernel_Hmat(vnode->lchild()->Hmat(), kernel, data, row1, row0,
+		   s10, tag0, ctx, runtime);
+
+  Ancestor a0 = {b0->col_beg, b0->ncol, row1, s01};
+  path.push_back(a0);
+  init_kernel_tree(b0, vnode->lchild(), kernel, data, tol, row0, path,
+		   tag0, ctx, runtime);
+  path.pop_back();
+
+  Ancestor a1 = {b1->col_beg, b1->ncol, row0, s10};
+  path.push_back(a1);
+  init_kernel_tree(b1, vnode->rchild(), kernel, data, tol, row1, path,
+		   tag1, ctx, runtime);
+  path.pop_back();
+}
+
+void fill_kernel_matrix
+(Node *uroot, Node *vroot, int kernel, const double *data, int ndata,
+ double tol, const Range &tag, Context ctx, HighLevelRuntime *runtime) {
+
+  // one region for the data of all tasks; a kernel without data
+  //  still gets one entry so that every task has the same regions
+  LMatrix *dataMat = NULL;
+  double zero = 0;
+  create_matrix(dataMat, std::max(ndata, 1), 1, ctx, runtime);
+  dataMat->set_columns(ndata > 0 ? data : &zero, std::max(ndata, 1),
+		       Range(1), ctx, runtime);
+
+  std::vector<Ancestor> path;
+  init_kernel_tree(uroot, vroot, kernel, dataMat, tol, 0, path,
+		   tag, ctx, runtime);
+  destroy_matrix(dataMat, ctx, runtime);
+}
+
+
+/* ---- Skeleton implementation ---- */
+
+size_t Skeleton::legion_buffer_size(void) const {
+  return sizeof(int) * (1 + rows.size() + cols.size());
+}
+
+size_t Skeleton::legion_serialize(void *buffer) const {
+  int *target = (int *)buffer;
+  *target++ = rank();
+  for (int i=0; i<rank(); i++) *target++ = rows[i];
+  for (int i=0; i<rank(); i++) *target++ = cols[i];
+  return size_t(target) - size_t(buffer);
+}
+
+size_t Skeleton::legion_deserialize(const void *buffer) {
+  const int *source = (const int *)buffer;
+  int r = *source++;
+  rows.assign(source, source+r); source += r;
+  cols.assign(source, source+r); source += r;
+  return size_t(source) - size_t(buffer);
+}
+
+
+/* ---- KernelSkeletonTask implementation ---- */
+
+/*static*/
+int KernelSkeletonTask::TASKID;
+
+KernelSkeletonTask::
+KernelSkeletonTask(TaskArgument arg,
+		   Predicate pred /*= Predicate::TRUE_PRED*/,
+		   MapperID id /*= 0*/,
+		   MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void KernelSkeletonTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <Skeleton, KernelSkeletonTask::cpu_task>(AUTO_GENERATE_ID,
+					     Processor::LOC_PROC,
+					     true,
+					     true,
+					     AUTO_GENERATE_ID,
+					     TaskConfigOptions(true/*leaf*/),
+					     "kernel_skeleton");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : kernel_skeleton\n", TASKID);
+#endif
+}
+
+Skeleton KernelSkeletonTask::
+cpu_task(const Task *task,
+	 const std::vector<PhysicalRegion> &regions,
+	 Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 1);
+  assert(task->arglen == sizeof(TaskArgs));
+  const TaskArgs *args = (const TaskArgs *)task->args;
+
+  Skeleton skel;
+  aca(task_kernel(args->kernel, task, regions, ctx, runtime),
+      args->row_beg, args->nrow, args->col_beg, args->ncol,
+      args->rank, args->tol, skel);
+  return skel;
+}
+
+
+/* ---- KernelLeafTask implementation ---- */
+
+/*static*/
+int KernelLeafTask::TASKID;
+
+KernelLeafTask::
+KernelLeafTask(TaskArgument arg,
+	       Predicate pred /*= Predicate::TRUE_PRED*/,
+	       MapperID id /*= 0*/,
+	       MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void KernelLeafTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <KernelLeafTask::cpu_task>(AUTO_GENERATE_ID,
+			       Processor::LOC_PROC,
+			       true,
+			       true,
+			       AUTO_GENERATE_ID,
+			       TaskConfigOptions(true/*leaf*/),
+			       "kernel_legion_leaf");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : kernel_legion_leaf\n", TASKID);
+#endif
+}
+
+// dense blocks at the real leaves and both off-diagonal blocks of
+//  every node in the subtree; row is the first global row.
+static void fill_kernel_subtree
+(const Kernel &kernel, double tol, int row,
+ const Node *unode, const Node *vnode,
+ double *u_ptr, double *v_ptr, double *k_ptr, int LD) {
+
+  if (unode->is_real_leaf()) {
+    int n    = unode->nrow;
+    int glo  = row + unode->row_beg;
+    double *K = k_ptr + unode->row_beg;
+    for (int j=0; j<n; j++)
+      for (int i=0; i<n; i++)
+	K[i + j*LD] = kernel(glo+i, glo+j);
+    return;
+  }
+
+  const Node *u0 = unode->lchild(), *u1 = unode->rchild();
+  const Node *v0 = vnode->lchild(), *v1 = vnode->rchild();
+  int row0 = row + u0->row_beg;
+  int row1 = row + u1->row_beg;
+
+  Skeleton s01, s10;
+  aca(kernel, row0, u0->nrow, row1, u1->nrow, u0->ncol, tol, s01);
+  aca(kernel, row1, u1->nrow, row0, u0->nrow, u1->ncol, tol, s10);
+
+  // A01 = u0 * V1^T
+  fill_u(kernel, row0, u0->nrow, row1, s01,
+	 u_ptr + u0->row_beg + u0->col_beg*LD, u0->ncol, LD);
+  fill_v(kernel, row0, row1, s01, row1, v1->nrow,
+	 v_ptr + v1->row_beg + v1->col_beg*LD, v1->ncol, LD);
+  // A10 = u1 * V0^T
+  fill_u(kernel, row1, u1->nrow, row0, s10,
+	 u_ptr + u1->row_beg + u1->col_beg*LD, u1->ncol, LD);
+  fill_v(kernel, row1, row0, s10, row0, v0->nrow,
+	 v_ptr + v0->row_beg + v0->col_beg*LD, v0->ncol, LD);
+
+  fill_kernel_subtree(kernel, tol, row, u0, v0, u_ptr, v_ptr, k_ptr, LD);
+  fill_kernel_subtree(kernel, tol, row, u1, v1, u_ptr, v_ptr, k_ptr, LD);
+}
+
+void KernelLeafTask::cpu_task
+(const Task *task,
+ const std::vector<PhysicalRegion> &regions,
+ Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 4);
+  assert(task->regions.size() == 4);
+
+  const TaskArgs *args = (const TaskArgs *)task->args;
+  Kernel kernel = task_kernel(args->kernel, task, regions, ctx, runtime);
+  int row  = args->row;
+  int nanc = args->nanc;
+  const int *anc   = (const int *)(args+1);
+  const int *udesc = anc + 3*nanc;
+  const int *vdesc = udesc + packed_tree_size(udesc);
+  assert(task->arglen == sizeof(TaskArgs) + sizeof(int) *
+	 (3*nanc + packed_tree_size(udesc) + packed_tree_size(vdesc)));
+  assert((int)task->futures.size() == nanc);
+
+  NodeArena arena;
+  int uidx = unpack_tree(udesc, arena);
+  int vidx = unpack_tree(vdesc, arena);
+  Node *uroot = arena.at(uidx);
+  Node *vroot = arena.at(vidx);
+
+  RegionAccessor<AccessorType::Generic, double> acc_u =
+    regions[0].get_field_accessor(FID_X).typeify<double>();
+  RegionAccessor<AccessorType::Generic, double> acc_v =
+    regions[1].get_field_accessor(FID_X).typeify<double>();
+  RegionAccessor<AccessorType::Generic, double> acc_k =
+    regions[2].get_field_accessor(FID_X).typeify<double>();
+
+  IndexSpace is_u = task->regions[0].region.get_index_space();
+  IndexSpace is_v = task->regions[1].region.get_index_space();
+  IndexSpace is_k = task->regions[2].region.get_index_space();
+  Rect<2> rect_u = runtime->get_index_space_domain(ctx, is_u).get_rect<2>();
+  Rect<2> rect_v = runtime->get_index_space_domain(ctx, is_v).get_rect<2>();
+  Rect<2> rect_k = runtime->get_index_space_domain(ctx, is_k).get_rect<2>();
+
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+
+  double *u_ptr = acc_u.raw_rect_ptr<2>(rect_u, subrect, offsets);
+  assert(u_ptr != NULL);
+  assert(rect_u == subrect);
+
+  double *v_ptr = NULL;
+  if (rect_v.volume() != 0) {
+    // if legion leaf coinsides real leaf, no V is needed
+    v_ptr = acc_v.raw_rect_ptr<2>(rect_v, subrect, offsets);
+    assert(v_ptr != NULL);
+    assert(rect_v == subrect);
+  }
+
+  double *k_ptr = acc_k.raw_rect_ptr<2>(rect_k, subrect, offsets);
+  assert(k_ptr != NULL);
+  assert(rect_k == subrect);
+
+  int LD = rect_u.dim_size(0);
+  assert(LD == uroot->nrow);
+  memset(k_ptr, 0, rect_k.volume()*sizeof(double));
+
+  // u columns of the ancestors, restricted to these rows
+  for (int i=0; i<nanc; i++) {
+    int col_beg = anc[3*i];
+    int ncol    = anc[3*i+1];
+    int sib_beg = anc[3*i+2];
+    Skeleton skel = task->futures[i].get_result<Skeleton>();
+    assert(col_beg + ncol <= rect_u.dim_size(1));
+    fill_u(kernel, row, LD, sib_beg, skel,
+	   u_ptr + col_beg*LD, ncol, LD);
+  }
+
+  fill_kernel_subtree(kernel, args->tol, row, uroot, vroot,
+		      u_ptr, v_ptr, k_ptr, LD);
+}
+
+
+/* ---- KernelHmatTask implementation ---- */
+
+/*static*/
+int KernelHmatTask::TASKID;
+
+KernelHmatTask::
+KernelHmatTask(TaskArgument arg,
+	       Predicate pred /*= Predicate::TRUE_PRED*/,
+	       MapperID id /*= 0*/,
+	       MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void KernelHmatTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <KernelHmatTask::cpu_task>(AUTO_GENERATE_ID,
+			       Processor::LOC_PROC,
+			       true,
+			       true,
+			       AUTO_GENERATE_ID,
+			       TaskConfigOptions(true/*leaf*/),
+			       "kernel_Hmat");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : kernel_Hmat\n", TASKID);
+#endif
+}
+
+void KernelHmatTask::cpu_task
+(const Task *task,
+ const std::vector<PhysicalRegion> &regions,
+ Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 2);
+  assert(task->regions.size() == 2);
+  assert(task->arglen == sizeof(TaskArgs));
+  assert(task->futures.size() == 1);
+
+  const TaskArgs *args = (const TaskArgs *)task->args;
+  Skeleton skel = task->futures[0].get_result<Skeleton>();
+
+  IndexSpace is   = task->regions[0].region.get_index_space();
+  Domain     dom  = runtime->get_index_space_domain(ctx, is);
+  Rect<2>    rect = dom.get_rect<2>();
+
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *ptr = regions[0].get_field_accessor(FID_X).
+    typeify<double>().raw_rect_ptr<2>(rect, subrect, offsets);
+  assert(rect == subrect);
+  assert(ptr  != NULL);
+
+  int nrow = rect.dim_size(0);
+  int ncol = rect.dim_size(1);
+  fill_v(task_kernel(args->kernel, task, regions, ctx, runtime),
+	 args->sib_beg, args->col_beg, skel,
+	 args->row, nrow, ptr, ncol, nrow);
+}
@@ -1,3 +1,6 @@
+#include <assert.h>
+#include <string.h>
+
 #include "legion_matrix.h"
 #include "init_matrix_tasks.h"
 #include "zero_matrix_task.h"
@@ -26,6 +29,18 @@ void create_matrix
   assert(matrix->data != LogicalRegion::NO_REGION);
 }
 
+void destroy_matrix
+(LMatrix *(&matrix), Context ctx, HighLevelRuntime *runtime) {
+
+  assert(matrix != NULL);
+  LogicalRegion lr = matrix->data;
+  runtime->destroy_logical_region(ctx, lr);
+  runtime->destroy_field_space(ctx, lr.get_field_space());
+  runtime->destroy_index_space(ctx, lr.get_index_space());
+  delete matrix;
+  matrix = NULL;
+}
+
 LMatrix::LMatrix(const int rows_, const int cols_,
 		 const LogicalRegion lr)
   : rows(rows_), cols(cols_), data(lr) {}
@@ -101,6 +116,85 @@ void LMatrix::circulant
 #endif
 }
 
+void LMatrix::copy
+(const LMatrix &src, const int taskTag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  assert(src.rows == rows && src.cols == cols);
+  CopyMatrixTask launcher(TaskArgument(NULL, 0),
+			  Predicate::TRUE_PRED,
+			  0,
+			  taskTag);
+  launcher.add_region_requirement(RegionRequirement
+				  (src.data,
+				   READ_ONLY,
+				   EXCLUSIVE,
+				   src.data).
+				  add_field(FID_X)
+				  );
+  launcher.add_region_requirement(RegionRequirement
+				  (data,
+				   WRITE_DISCARD,
+				   EXCLUSIVE,
+				   data).
+				  add_field(FID_X)
+				  );
+  Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+  std::cout << "Waiting for copy ..." << std::endl;
+  f.get_void_result();
+#endif
+}
+
+// maps the region and returns its column major data
+static double *map_matrix
+(LMatrix *matrix, PrivilegeMode mode, PhysicalRegion &region,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  InlineLauncher launcher(RegionRequirement(matrix->data,
+					    mode,
+					    EXCLUSIVE,
+					    matrix->data).
+			  add_field(FID_X));
+  region = runtime->map_region(ctx, launcher);
+  region.wait_until_valid();
+
+  IndexSpace is = matrix->data.get_index_space();
+  Rect<2> rect = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *ptr = region.get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect, subrect, offsets);
+  assert(rect == subrect);
+  return ptr;
+}
+
+void LMatrix::set_columns
+(const double *A, int LD, const Range& columns,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  assert(columns.begin() + columns.size() <= cols);
+  PhysicalRegion region;
+  double *ptr = map_matrix(this, READ_WRITE, region, ctx, runtime);
+  for (int j=0; j<columns.size(); j++)
+    memcpy(ptr + (columns.begin()+j)*rows, A + j*LD,
+	   rows*sizeof(double));
+  runtime->unmap_region(ctx, region);
+}
+
+void LMatrix::get_columns
+(double *A, int LD, const Range& columns,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  assert(columns.begin() + columns.size() <= cols);
+  PhysicalRegion region;
+  double *ptr = map_matrix(this, READ_ONLY, region, ctx, runtime);
+  for (int j=0; j<columns.size(); j++)
+    memcpy(A + j*LD, ptr + (columns.begin()+j)*rows,
+	   rows*sizeof(double));
+  runtime->unmap_region(ctx, region);
+}
+
 void LMatrix::save
 (const std::string& filename, const Range& columns,
  Context ctx, HighLevelRuntime *runtime, bool print_seed) {
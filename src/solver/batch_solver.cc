@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+#include "batch_solver.h"
+#include "solver_tasks.h"
+#include "macros.h"
+
+namespace {
+
+  class BatchSolveTask : public TaskLauncher {
+  public:
+    // the number of systems, then for every system its first row
+    //  followed by its packed V and U trees
+    BatchSolveTask(TaskArgument arg,
+		   Predicate pred = Predicate::TRUE_PRED,
+		   MapperID id = 0,
+		   MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+}
+
+void register_batch_tasks() {
+  BatchSolveTask::register_tasks();
+}
+
+HodlrBatch::HodlrBatch(int rhs_cols_, int rank_, int threshold_,
+		       RankFunc f)
+  : rhs_cols(rhs_cols_), rank(rank_), threshold(threshold_),
+    rankFunc(f) {}
+
+int HodlrBatch::add_system(int nrow) {
+
+  assert(groups.empty()); // before create()
+  int uidx = arena.alloc();
+  *arena.at(uidx) = Node(nrow, rhs_cols);
+  create_weighted_tree(arena, uidx, rank, rankFunc, 0, threshold);
+  int nleaf = 0;
+  mark_legion_leaf(arena.at(uidx), INT_MAX, nleaf);
+  assert(nleaf == 1);
+  int vidx = create_Vtree(arena, uidx);
+  uroot.push_back(uidx);
+  vroot.push_back(vidx);
+  return uroot.size()-1;
+}
+
+void HodlrBatch::create
+(int groupSize, Context ctx, HighLevelRuntime *runtime) {
+
+  assert(groupSize > 0 && groups.empty());
+  for (int first=0; first<size(); first+=groupSize) {
+    Group g;
+    g.first = first;
+    g.count = std::min(groupSize, size()-first);
+    g.nrow  = 0;
+    int ucol = 0, vcol = 0, kcol = 0;
+    for (int s=first; s<first+g.count; s++) {
+      const Node *u = arena.at(uroot[s]);
+      const Node *v = arena.at(vroot[s]);
+      group.push_back(groups.size());
+      rowBeg.push_back(g.nrow);
+      g.nrow += u->nrow;
+      ucol = std::max(ucol, count_matrix_column(u));
+      vcol = std::max(vcol, count_matrix_column(v) - v->ncol);
+      kcol = std::max(kcol, max_row_size(v));
+    }
+    create_matrix(g.U, g.nrow, ucol, ctx, runtime);
+    create_matrix(g.V, g.nrow, vcol, ctx, runtime);
+    create_matrix(g.K, g.nrow, kcol, ctx, runtime);
+    groups.push_back(g);
+  }
+}
+
+void HodlrBatch::destroy(Context ctx, HighLevelRuntime *runtime) {
+  for (size_t i=0; i<groups.size(); i++) {
+    destroy_matrix(groups[i].U, ctx, runtime);
+    destroy_matrix(groups[i].V, ctx, runtime);
+    destroy_matrix(groups[i].K, ctx, runtime);
+  }
+  groups.clear();
+  group.clear();
+  rowBeg.clear();
+}
+
+void HodlrBatch::set_system
+(int s, const std::vector<HostNode> &blocks, const double *rhs) {
+
+  Group &g = groups[group[s]];
+  if (g.hostU.empty()) {
+    g.hostU.assign(g.nrow*g.U->cols, 0.0);
+    g.hostV.assign(g.nrow*g.V->cols, 0.0);
+    g.hostK.assign(g.nrow*g.K->cols, 0.0);
+  }
+  const Node *u = arena.at(uroot[s]);
+  const Node *v = arena.at(vroot[s]);
+  int n   = u->nrow;
+  int row = rowBeg[s];
+  assert(blocks.size() > 0 && blocks[0].nrow == n);
+  for (int j=0; j<rhs_cols; j++)
+    memcpy(&g.hostU[row + j*g.nrow], rhs + j*n, n*sizeof(double));
+  write_host_subtree(u, v, blocks, &g.hostU[row], &g.hostV[row],
+		     &g.hostK[row], g.nrow);
+}
+
+void HodlrBatch::solve
+(const Range &procs, Context ctx, HighLevelRuntime *runtime) {
+
+  for (size_t i=0; i<groups.size(); i++) {
+    Group &g = groups[i];
+    if ( ! g.hostU.empty() ) {
+      g.U->set_columns(&g.hostU[0], g.nrow, Range(g.U->cols),
+		       ctx, runtime);
+      if (g.V->cols > 0)
+	g.V->set_columns(&g.hostV[0], g.nrow, Range(g.V->cols),
+			 ctx, runtime);
+      g.K->set_columns(&g.hostK[0], g.nrow, Range(g.K->cols),
+		       ctx, runtime);
+      std::vector<double>().swap(g.hostU);
+      std::vector<double>().swap(g.hostV);
+      std::vector<double>().swap(g.hostK);
+    }
+
+    std::vector<int> args(1, g.count);
+    for (int s=g.first; s<g.first+g.count; s++) {
+      const Node *u = arena.at(uroot[s]);
+      const Node *v = arena.at(vroot[s]);
+      int at = args.size();
+      args.resize(at + 1 + pack_tree_size(v) + pack_tree_size(u));
+      args[at] = rowBeg[s];
+      at += 1;
+      at += pack_tree(v, &args[at]);
+      pack_tree(u, &args[at]);
+    }
+
+    BatchSolveTask launcher(TaskArgument(&args[0],
+					 sizeof(int)*args.size()),
+			    Predicate::TRUE_PRED,
+			    0,
+			    procs.begin() + i % procs.size());
+    LogicalRegion regions[3] = {g.U->data, g.V->data, g.K->data};
+    PrivilegeMode modes[3]   = {READ_WRITE, READ_ONLY, READ_WRITE};
+    for (int r=0; r<3; r++)
+      launcher.add_region_requirement(
+	RegionRequirement(regions[r],
+			  modes[r],
+			  EXCLUSIVE,
+			  regions[r]).add_field(FID_X));
+    Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+    std::cout << "Waiting for batch solve ..." << std::endl;
+    f.get_void_result();
+#endif
+  }
+}
+
+void HodlrBatch::get_solutions
+(double *x, int LD, Context ctx, HighLevelRuntime *runtime) const {
+
+  int row = 0;
+  for (size_t i=0; i<groups.size(); i++) {
+    const Group &g = groups[i];
+    std::vector<double> buf(g.nrow*rhs_cols);
+    g.U->get_columns(&buf[0], g.nrow, Range(rhs_cols), ctx, runtime);
+    for (int j=0; j<rhs_cols; j++)
+      memcpy(x + row + j*LD, &buf[j*g.nrow], g.nrow*sizeof(double));
+    row += g.nrow;
+  }
+}
+
+
+/* ---- BatchSolveTask implementation ---- */
+
+/*static*/
+int BatchSolveTask::TASKID;
+
+BatchSolveTask::BatchSolveTask(TaskArgument arg,
+			       Predicate pred /*= Predicate::TRUE_PRED*/,
+			       MapperID id /*= 0*/,
+			       MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void BatchSolveTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <BatchSolveTask::cpu_task>(AUTO_GENERATE_ID,
+			       Processor::LOC_PROC,
+			       true,
+			       true,
+			       AUTO_GENERATE_ID,
+			       TaskConfigOptions(true/*leaf*/),
+			       "batch_solve");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : batch_solve\n", TASKID);
+#endif
+}
+
+void BatchSolveTask::cpu_task(const Task *task,
+			      const std::vector<PhysicalRegion> &regions,
+			      Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 3);
+  assert(task->regions.size() == 3);
+
+  // U, V and K of the group
+  double *ptr[3];
+  int     nrow = 0;
+  for (int i=0; i<3; i++) {
+    IndexSpace is = task->regions[i].region.get_index_space();
+    Rect<2> rect  = runtime->get_index_space_domain(ctx, is).
+      get_rect<2>();
+    ptr[i] = NULL;
+    if (rect.volume() == 0) continue; // no V when all are real leaves
+    Rect<2> subrect;
+    ByteOffset offsets[2];
+    ptr[i] = regions[i].get_field_accessor(FID_X).typeify<double>().
+      raw_rect_ptr<2>(rect, subrect, offsets);
+    assert(ptr[i] != NULL);
+    assert(rect == subrect);
+    nrow = rect.dim_size(0);
+  }
+
+  const int *desc  = (const int *)task->args;
+  int        count = *desc++;
+  for (int s=0; s<count; s++) {
+    int row = *desc++;
+    NodeArena arena;
+    int vidx = unpack_tree(desc, arena);
+    desc += packed_tree_size(desc);
+    int uidx = unpack_tree(desc, arena);
+    desc += packed_tree_size(desc);
+    serial_leaf_solve(arena.at(uidx), arena.at(vidx),
+		      ptr[0] + row, ptr[1] ? ptr[1] + row : NULL,
+		      ptr[2] + row, nrow);
+  }
+  assert((const char *)desc == (const char *)task->args + task->arglen);
+}
@@ -0,0 +1,432 @@
+#include "fast_solver.h"
+#include "gemm.h"
+#include "solver_kernels.h"
+#include "macros.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+// The top levels of the tree in one task. Below the cut, i.e. the
+//  nodes at depth coarseLevels and the legion leaves above it, the
+//  subtrees are solved as usual, so the U region of a cut node s
+//  holds Y_s = A_s^-1 [b | u of the ancestors]. Every node solve and
+//  broadcast above acts on these columns by a right multiplication,
+//  so the state of s is always Y_s T_s for a small m_s x m_s matrix
+//  T_s (m_s = s.col_beg + s.ncol), and the V^T [d | u] of a node c
+//  are sums of G_{c,s} T_s with G_{c,s} = V_c(rows of s)^T Y_s. The
+//  G are reduced for every cut node and its ancestors at once, one
+//  task runs all the node solves of the top levels on them and gives
+//  the T_s, and one task per legion leaf applies its T_s.
+
+namespace {
+
+  class CoarseSolveTask : public TaskLauncher {
+  public:
+    // the top tree as described in coarse_solve(); the regions are
+    //  the T of the cut nodes followed by their G
+    CoarseSolveTask(TaskArgument arg,
+		    Predicate pred = Predicate::TRUE_PRED,
+		    MapperID id = 0,
+		    MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    // returns log|det| of the Schur complements
+    static double cpu_task(const Task *task,
+			   const std::vector<PhysicalRegion> &regions,
+			   Context ctx, HighLevelRuntime *runtime);
+  };
+
+  // U(:, 0:m) = U(:, 0:m) * T in a legion leaf
+  class CoarseScatterTask : public TaskLauncher {
+  public:
+    CoarseScatterTask(TaskArgument arg,
+		      Predicate pred = Predicate::TRUE_PRED,
+		      MapperID id = 0,
+		      MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+}
+
+void register_coarse_tasks() {
+  CoarseSolveTask::register_tasks();
+  CoarseScatterTask::register_tasks();
+}
+
+// The top tree is passed as ints: the number of top nodes and of cut
+//  nodes, then per top node (the root first, in preorder) its
+//  children, with cut node s numbered ntop+s, the col_beg of the
+//  children and their ranks; then per cut node m_s and the number of
+//  its G, which are ordered from s up to the child of the root.
+enum {
+  TOP_LCHILD,
+  TOP_RCHILD,
+  TOP_COL_BEG,
+  TOP_KL,
+  TOP_KR,
+  TOP_FIELDS,
+};
+
+enum {
+  CUT_M,
+  CUT_NG,
+  CUT_FIELDS,
+};
+
+// the node solves of the top tree on the G, bottom up; T gets the
+//  transforms of the cut nodes. returns log|det|.
+static double coarse_solve
+(const int *desc, const std::vector<const double *> &G,
+ const std::vector<double *> &T) {
+
+  int ntop = desc[0];
+  int ncut = desc[1];
+  const int *top = desc + 2;
+  const int *cut = top + TOP_FIELDS*ntop;
+
+  // rows of the V of every node, and the cut nodes below it with
+  //  their G
+  std::vector<int> vrank(ntop+ncut, 0), parent(ntop+ncut, -1);
+  for (int i=0; i<ntop; i++) {
+    const int *p = top + TOP_FIELDS*i;
+    parent[p[TOP_LCHILD]] = i;
+    parent[p[TOP_RCHILD]] = i;
+    vrank[p[TOP_LCHILD]]  = p[TOP_KR]; // reversed in v
+    vrank[p[TOP_RCHILD]]  = p[TOP_KL];
+  }
+  std::vector<std::vector<std::pair<int, int> > > below(ntop+ncut);
+  int g = 0;
+  for (int s=0; s<ncut; s++) {
+    int m = cut[CUT_FIELDS*s + CUT_M];
+    for (int j=0, c=ntop+s; j<cut[CUT_FIELDS*s + CUT_NG]; j++) {
+      below[c].push_back(std::make_pair(s, g++));
+      c = parent[c];
+    }
+    std::fill(T[s], T[s] + m*m, 0.0);
+    for (int j=0; j<m; j++)
+      T[s][j + j*m] = 1.0;
+  }
+  assert(g == (int)G.size());
+
+  double logdet = 0;
+  std::vector<double> W[2];
+  for (int i=ntop-1; i>=0; i--) {
+    const int *p  = top + TOP_FIELDS*i;
+    int child[2]  = {p[TOP_LCHILD], p[TOP_RCHILD]};
+    int k[2]      = {p[TOP_KL], p[TOP_KR]};
+    int cb        = p[TOP_COL_BEG];
+
+    // W = V^T [d, u] = sum over the cut nodes s of G_{c,s} T_s
+    for (int c=0; c<2; c++) {
+      int n = vrank[child[c]];
+      W[c].assign(n*(cb+k[c]), 0.0);
+      for (size_t b=0; b<below[child[c]].size(); b++) {
+	int s = below[child[c]][b].first;
+	int m = cut[CUT_FIELDS*s + CUT_M];
+	gemm_broadcast_kernel(n, cb+k[c], m, 1.0,
+			      G[below[child[c]][b].second], n, T[s], m,
+			      1.0, &W[c][0], n);
+      }
+    }
+
+    // eta0 overwrites the d part of W[1] and eta1 that of W[0]
+    int n0 = k[1];
+    int n1 = k[0];
+    logdet += node_solve_kernel(n0, n1, cb,
+				&W[0][cb*n0], n0, &W[1][cb*n1], n1,
+				&W[0][0], n0, &W[1][0], n1);
+
+    // d -= u * eta, i.e. T(:, 0:cb) -= T(:, cb:cb+k) * eta
+    for (int c=0; c<2; c++) {
+      const double *eta = &W[1-c][0];
+      for (size_t b=0; b<below[child[c]].size(); b++) {
+	int s = below[child[c]][b].first;
+	int m = cut[CUT_FIELDS*s + CUT_M];
+	gemm_broadcast_kernel(m, cb, k[c], -1.0, T[s] + cb*m, m, eta, k[c],
+			      1.0, T[s], m);
+      }
+    }
+  }
+  return logdet;
+}
+
+
+namespace {
+  struct CutNode {
+    Node *unode;
+    Range tag;
+    std::vector<const Node *> Hmat; // of s, then up its ancestors
+    std::vector<int> vrank;
+  };
+}
+
+// the top nodes in preorder and the cut nodes below them; returns the
+//  index of unode, ntop + cut index for a cut node (fixed up by the
+//  caller, as ntop is not known yet)
+static int collect_top
+(Node *unode, Node *vnode, int depth, int levels, const Range &tag,
+ std::vector<const Node *> &Hmat, std::vector<int> &vrank,
+ std::vector<int> &top, std::vector<CutNode> &cuts) {
+
+  if (unode->is_legion_leaf() || depth >= levels) {
+    CutNode s;
+    s.unode = unode;
+    s.tag   = tag;
+    s.Hmat.assign(Hmat.rbegin(), Hmat.rend());
+    s.vrank.assign(vrank.rbegin(), vrank.rend());
+    cuts.push_back(s);
+    return -(int)cuts.size(); // -1 - cut index
+  }
+
+  int i = top.size() / TOP_FIELDS;
+  top.resize(top.size() + TOP_FIELDS);
+  Node *uc[2]    = {unode->lchild(), unode->rchild()};
+  Node *vc[2]    = {vnode->lchild(), vnode->rchild()};
+  Range tc[2]    = {tag.lchild(unode->split_fraction()),
+		    tag.rchild(unode->split_fraction())};
+  int   child[2];
+  for (int c=0; c<2; c++) {
+    // the H-tiled rows of the ancestors follow the path down
+    std::vector<const Node *> H(Hmat.size());
+    for (size_t a=0; a<Hmat.size(); a++)
+      H[a] = c == 0 ? Hmat[a]->lchild() : Hmat[a]->rchild();
+    H.push_back(vc[c]->Hmat());
+    std::vector<int> r(vrank);
+    r.push_back(vc[c]->ncol);
+    child[c] = collect_top(uc[c], vc[c], depth+1, levels, tc[c], H, r,
+			   top, cuts);
+  }
+  top[TOP_FIELDS*i + TOP_LCHILD]  = child[0];
+  top[TOP_FIELDS*i + TOP_RCHILD]  = child[1];
+  top[TOP_FIELDS*i + TOP_COL_BEG] = uc[0]->col_beg;
+  top[TOP_FIELDS*i + TOP_KL]      = uc[0]->ncol;
+  top[TOP_FIELDS*i + TOP_KR]      = uc[1]->ncol;
+  return i;
+}
+
+static void scatter
+(Node *unode, LMatrix *T, int m, const Range &tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  if ( ! unode->is_legion_leaf() ) {
+    scatter(unode->lchild(), T, m, tag.lchild(unode->split_fraction()),
+	    ctx, runtime);
+    scatter(unode->rchild(), T, m, tag.rchild(unode->split_fraction()),
+	    ctx, runtime);
+    return;
+  }
+  CoarseScatterTask launcher(TaskArgument(&m, sizeof(m)),
+			     Predicate::TRUE_PRED,
+			     0,
+			     tag.begin());
+  launcher.add_region_requirement(
+    RegionRequirement(unode->lowrank_matrix->data,
+		      READ_WRITE,
+		      EXCLUSIVE,
+		      unode->lowrank_matrix->data).add_field(FID_X));
+  launcher.add_region_requirement(
+    RegionRequirement(T->data,
+		      READ_ONLY,
+		      EXCLUSIVE,
+		      T->data).add_field(FID_X));
+  Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+  std::cout << "Waiting for coarse scatter ..." << std::endl;
+  f.get_void_result();
+#endif
+}
+
+Future FastSolver::solve_coarse
+(Node *uroot, Node *vroot, const Range &mappingTag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  std::vector<int>          top;
+  std::vector<CutNode>      cuts;
+  std::vector<const Node *> Hmat;
+  std::vector<int>          vrank;
+  collect_top(uroot, vroot, 0, coarseLevels, mappingTag, Hmat, vrank,
+	      top, cuts);
+  int ntop = top.size() / TOP_FIELDS;
+  int ncut = cuts.size();
+  for (size_t i=0; i<top.size(); i+=TOP_FIELDS)
+    for (int c=TOP_LCHILD; c<=TOP_RCHILD; c++)
+      if (top[i+c] < 0)
+	top[i+c] = ntop - 1 - top[i+c];
+
+  // G_{c,s} for every cut node s and the nodes from s up
+  std::vector<int> desc(2, 0);
+  desc[0] = ntop;
+  desc[1] = ncut;
+  desc.insert(desc.end(), top.begin(), top.end());
+  std::vector<LMatrix *> T(ncut, (LMatrix *)NULL);
+  std::vector<LMatrix *> G;
+  double tCreate = 0;
+  for (int s=0; s<ncut; s++) {
+    const CutNode &cut = cuts[s];
+    int m = cut.unode->col_beg + cut.unode->ncol;
+    desc.push_back(m);
+    desc.push_back(cut.Hmat.size());
+    for (size_t j=0; j<cut.Hmat.size(); j++) {
+      G.push_back(NULL);
+      gemm_reduce(1., cut.Hmat[j], Range(cut.vrank[j]), cut.unode,
+		  Range(m), 0., G.back(), cut.tag, tCreate, ctx, runtime);
+    }
+    create_matrix(T[s], m, m, ctx, runtime);
+  }
+
+  CoarseSolveTask launcher(TaskArgument(&desc[0], sizeof(int)*desc.size()),
+			   Predicate::TRUE_PRED,
+			   0,
+			   mappingTag.begin());
+  for (int s=0; s<ncut; s++)
+    launcher.add_region_requirement(
+      RegionRequirement(T[s]->data,
+			READ_WRITE,
+			EXCLUSIVE,
+			T[s]->data).add_field(FID_X));
+  for (size_t g=0; g<G.size(); g++)
+    launcher.add_region_requirement(
+      RegionRequirement(G[g]->data,
+			READ_ONLY,
+			EXCLUSIVE,
+			G[g]->data).add_field(FID_X));
+  Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+  std::cout << "Waiting for coarse solve ..." << std::endl;
+  f.get_void_result();
+#endif
+
+  for (int s=0; s<ncut; s++) {
+    const CutNode &cut = cuts[s];
+    scatter(cut.unode, T[s], cut.unode->col_beg + cut.unode->ncol,
+	    cut.tag, ctx, runtime);
+  }
+  for (int s=0; s<ncut; s++)
+    destroy_matrix(T[s], ctx, runtime);
+  for (size_t g=0; g<G.size(); g++)
+    destroy_matrix(G[g], ctx, runtime);
+  return f;
+}
+
+
+// raw pointer and leading dimension of the i-th region
+static double *region_ptr
+(const Task *task, const std::vector<PhysicalRegion> &regions, int i,
+ Context ctx, HighLevelRuntime *runtime, int &rows, int &cols) {
+  IndexSpace is = task->regions[i].region.get_index_space();
+  Rect<2> rect = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *ptr = regions[i].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect, subrect, offsets);
+  assert(rect == subrect);
+  rows = rect.dim_size(0);
+  cols = rect.dim_size(1);
+  return ptr;
+}
+
+
+/* ---- CoarseSolveTask implementation ---- */
+
+/*static*/
+int CoarseSolveTask::TASKID;
+
+CoarseSolveTask::CoarseSolveTask(TaskArgument arg,
+				 Predicate pred /*= Predicate::TRUE_PRED*/,
+				 MapperID id /*= 0*/,
+				 MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void CoarseSolveTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <double, CoarseSolveTask::cpu_task>(AUTO_GENERATE_ID,
+					Processor::LOC_PROC,
+					true,
+					true,
+					AUTO_GENERATE_ID,
+					TaskConfigOptions(true/*leaf*/),
+					"coarse_solve");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : coarse_solve\n", TASKID);
+#endif
+}
+
+double CoarseSolveTask::cpu_task(const Task *task,
+				 const std::vector<PhysicalRegion> &regions,
+				 Context ctx, HighLevelRuntime *runtime)
+{
+  const int *desc = (const int *)task->args;
+  int ncut = desc[1];
+  assert(task->regions.size() == regions.size());
+  assert((int)regions.size() >= ncut);
+
+  std::vector<double *>       T(ncut);
+  std::vector<const double *> G(regions.size() - ncut);
+  int rows, cols;
+  for (int s=0; s<ncut; s++) {
+    T[s] = region_ptr(task, regions, s, ctx, runtime, rows, cols);
+    assert(rows == cols);
+  }
+  for (size_t g=0; g<G.size(); g++)
+    G[g] = region_ptr(task, regions, ncut+g, ctx, runtime, rows, cols);
+  return coarse_solve(desc, G, T);
+}
+
+
+/* ---- CoarseScatterTask implementation ---- */
+
+/*static*/
+int CoarseScatterTask::TASKID;
+
+CoarseScatterTask::CoarseScatterTask(TaskArgument arg,
+				     Predicate pred /*= Predicate::TRUE_PRED*/,
+				     MapperID id /*= 0*/,
+				     MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void CoarseScatterTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <CoarseScatterTask::cpu_task>(AUTO_GENERATE_ID,
+				  Processor::LOC_PROC,
+				  true,
+				  true,
+				  AUTO_GENERATE_ID,
+				  TaskConfigOptions(true/*leaf*/),
+				  "coarse_scatter");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : coarse_scatter\n", TASKID);
+#endif
+}
+
+void CoarseScatterTask::cpu_task(const Task *task,
+				 const std::vector<PhysicalRegion> &regions,
+				 Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 2);
+  assert(task->regions.size() == 2);
+  assert(task->arglen == sizeof(int));
+  int m = *(const int *)task->args;
+
+  int nrow, ncol, trow, tcol;
+  double *U = region_ptr(task, regions, 0, ctx, runtime, nrow, ncol);
+  double *T = region_ptr(task, regions, 1, ctx, runtime, trow, tcol);
+  assert(trow == m && tcol == m && m <= ncol);
+
+  std::vector<double> Y(U, U + nrow*m);
+  gemm_broadcast_kernel(nrow, m, m, 1.0, &Y[0], nrow, T, m,
+			0.0, U, nrow);
+}
@@ -4,6 +4,7 @@
 #include <fstream>
 #include <stdlib.h>
 #include <iomanip>
+#include <vector>
 
 #include "direct_solve.h"
 #include "lapack_blas.h"
@@ -125,20 +126,24 @@ static void writeToFile
   ofs.close();
 }
 
-static void
+// every legion leaf draws its rhs block from the same seed, so
+//  the reference rhs is rebuilt block by block from their sizes;
+//  returns the relative L2 error of the solution in the file
+static double
 dirct_circulant_solve
 (const std::string& soln_file, const long seed, const int rhs_rows,
- const int nregions, const int rhs_cols, const int r,
+ const std::vector<int>& block_rows, const int rhs_cols, const int r,
  const double diag) {
 
   double *rhs = (double *) malloc(rhs_rows*rhs_cols*sizeof(double));
-  int block_size = rhs_rows/nregions;
-  for (int nr=0; nr<nregions; nr++) {
+  int nregions = block_rows.size();
+  int row_beg  = 0;
+  for (int nr=0; nr<nregions; row_beg += block_rows[nr++]) {
     struct drand48_data buffer;
     assert( srand48_r( seed, &buffer ) == 0 );
-    for (int i=0; i<block_size; i++) {
+    for (int i=0; i<block_rows[nr]; i++) {
       for (int j=0; j<rhs_cols; j++) {
-	int row_idx = nr*block_size + i;
+	int row_idx = row_beg + i;
 	int col_idx = j;
 	int count = row_idx + col_idx*rhs_rows;
 	assert( drand48_r( &buffer, &rhs[count]) == 0 );
@@ -148,11 +153,12 @@ dirct_circulant_solve
 
 #ifdef DEBUG
   std::ofstream ofs("rhs_ref.txt");
-  for (int nr=0; nr<nregions; nr++) {
+  row_beg = 0;
+  for (int nr=0; nr<nregions; row_beg += block_rows[nr++]) {
     ofs << seed << std::endl;
-    for (int i=0; i<block_size; i++) {
+    for (int i=0; i<block_rows[nr]; i++) {
       for (int j=0; j<rhs_cols; j++) {
-	int row_idx = nr*block_size + i;
+	int row_idx = row_beg + i;
 	int col_idx = j;
 	int count = row_idx + col_idx*rhs_rows;
 	ofs << std::setprecision(20)
@@ -222,24 +228,99 @@ dirct_circulant_solve
       denom += rhs[i+j*rhs_rows] * rhs[i+j*rhs_rows];
     }
   }
-  std::cout << "Err: " << sqrt(diff/denom) << std::endl;
+  double err = sqrt(diff/denom);
+  std::cout << "Err: " << err << std::endl;
 
   free(rhs);
   free(soln);
   free(U);
   free(A);
+  return err;
 }
 
 
-void compute_L2_error
+static void legion_leaf_rows
+(const Node *node, std::vector<int>& rows) {
+  if (node->is_legion_leaf())
+    rows.push_back(node->nrow);
+  else {
+    legion_leaf_rows(node->lchild(), rows);
+    legion_leaf_rows(node->rchild(), rows);
+  }
+}
+
+double compute_L2_error
 (const HodlrMatrix &lr_mat, const long rand_seed, const int rhs_rows,
  const int nregions, const int rhs_cols, const int rank,
  const double diag,
  Context ctx, HighLevelRuntime *runtime) {
     
+  // legion leaves may have different sizes
+  std::vector<int> block_rows;
+  legion_leaf_rows(lr_mat.uroot, block_rows);
+  assert((int)block_rows.size() == nregions);
+  
   // write the solution from fast solver
   lr_mat.save_solution(ctx, runtime);
   std::string soln_file = lr_mat.get_file_soln();
-  dirct_circulant_solve(soln_file, rand_seed, rhs_rows, nregions,
-			rhs_cols, rank, diag); 
+  return dirct_circulant_solve(soln_file, rand_seed, rhs_rows,
+			       block_rows, rhs_cols, rank, diag);
+}
+
+
+static void dense_block
+(const std::vector<HostNode> &t, int i, double *A, int N) {
+  const HostNode &p = t[i];
+  if (p.lchild < 0) {
+    for (int j=0; j<p.nrow; j++)
+      for (int r=0; r<p.nrow; r++)
+	A[p.row+r + (p.row+j)*N] = p.d[r + j*p.nrow];
+    return;
+  }
+  // A(a, b) = a.u * b.v^T
+  int c[2] = {p.lchild, p.rchild};
+  for (int s=0; s<2; s++) {
+    const HostNode &a = t[c[s]];
+    const HostNode &b = t[c[1-s]];
+    char   transa = 'n';
+    char   transb = 't';
+    double alpha  = 1.0;
+    double beta   = 0.0;
+    int    m = a.nrow, n = b.nrow, k = a.k;
+    int    LDu = a.nrow, LDv = b.nrow, LDA = N;
+    if (k > 0)
+      blas::dgemm_(&transa, &transb, &m, &n, &k, &alpha,
+		   (double *)&a.u[0], &LDu, (double *)&b.v[0], &LDv,
+		   &beta, A + a.row + b.row*N, &LDA);
+    dense_block(t, c[s], A, N);
+  }
+}
+
+void dense_matrix(const std::vector<HostNode> &t, std::vector<double> &A) {
+  int N = t[0].nrow;
+  A.assign(N*N, 0.0);
+  dense_block(t, 0, &A[0], N);
+}
+
+double dense_solve_error
+(const std::vector<double> &A, int N, bool trans, const double *B,
+ const double *x, int nrhs) {
+
+  std::vector<double> LU(A), X(B, B + N*nrhs);
+  std::vector<int> IPIV(N);
+  int  INFO;
+  char TRANS = trans ? 't' : 'n';
+  lapack::dgetrf_(&N, &N, &LU[0], &N, &IPIV[0], &INFO);
+  assert(INFO == 0);
+  lapack::dgetrs_(&TRANS, &N, &nrhs, &LU[0], &N, &IPIV[0], &X[0], &N,
+		  &INFO);
+  assert(INFO == 0);
+
+  double diff  = 0;
+  double denom = 0;
+  for (int i=0; i<N*nrhs; i++) {
+    diff  += (x[i] - X[i]) * (x[i] - X[i]);
+    denom += X[i] * X[i];
+  }
+  return sqrt(diff/denom);
 }
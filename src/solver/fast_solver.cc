@@ -3,10 +3,13 @@
 #include <list>
 
 #include "fast_solver.h"
+#include "batch_solver.h"
 #include "solver_tasks.h"
 #include "gemm.h"
 #include "zero_matrix_task.h"
 #include "init_matrix_tasks.h"
+#include "kernel_matrix_tasks.h"
+#include "recompress.h"
 #include "save_region_task.h"
 #include "node.h"
 #include "lapack_blas.h"
@@ -18,14 +21,12 @@ void solve_top_bfs
 (const Node *uroot, const Node *vroot, const int launchLevel,
  const Range& mappingTag, Context ctx, HighLevelRuntime *runtime);
 
-void solve_bfs
-(Node * uroot, Node *vroot,
- Range mappingTag, Context ctx, HighLevelRuntime *runtime);
-
 void visit
 (Node *unode, Node *vnode, const Range mappingTag,
  double& tRed, double& tBroad, double& tCreate,
- Context ctx, HighLevelRuntime *runtime);
+ std::vector<Future> &logdet,
+ Context ctx, HighLevelRuntime *runtime,
+ int zeroCols=0, bool replicate=false, KeptFactors *kept=NULL);
 
 void visit_const
 (const Node *unode, const Node *vnode,
@@ -45,12 +46,20 @@ void register_solver_tasks() {
   //register_launch_node_task();
   register_zero_matrix_task();
   register_init_tasks();
+  register_kernel_tasks();
+  register_recompress_tasks();
+  register_hss_tasks();
+  register_batch_tasks();
   register_save_region_task();
+  register_coarse_tasks();
+  register_inverse_tasks();
   std::cout << std::endl;
 }
 
 FastSolver::FastSolver():
-  time_launcher(-1) {}
+  time_launcher(-1), keepFactors(false), keepStates(false), rankZ(0),
+  jacobiLevel(0), rhsCols(0), levelSync(false), coarseLevels(0),
+  replicatedLevels(0) {}
 
 //void FastSolver::solve_bfs
 void FastSolver::bfs_solve
@@ -64,13 +73,78 @@ void FastSolver::bfs_solve
 #endif
   Range tag = procs;
   Timer t; t.start();
+  nodeDet.clear();
+  zeroRhs.clear();
+  rhsCols = lr_mat.get_num_rhs();
+  if ( ! rhsSupport.empty() ) {
+    int first = 0;
+    mark_zero_rhs(lr_mat.uroot, first);
+  }
   solve_bfs(lr_mat.uroot, lr_mat.vroot, tag, ctx, runtime);
+  sum_log_det(tag, ctx, runtime);
   t.stop();
   this->time_launcher = t.get_elapsed_time();
 
   //solve_bfs_launch(lr_mat.uroot, lr_mat.vroot, tag, ctx, runtime);
 }
 
+void FastSolver::set_low_rank_update
+(HodlrMatrix &lr_mat, const double *W, const double *Z, int k, int LD,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  int N    = lr_mat.uroot->nrow;
+  int nrhs = lr_mat.get_num_rhs() - k;
+  assert(k > 0 && nrhs >= 0 && LD >= N);
+  lr_mat.set_rhs(W, LD, Range(nrhs, k), ctx, runtime);
+  this->rankZ = k;
+  this->Zmat.resize(N*k);
+  for (int j=0; j<k; j++)
+    for (int i=0; i<N; i++)
+      Zmat[i+j*N] = Z[i+j*LD];
+}
+
+void FastSolver::woodbury_solution
+(const HodlrMatrix &lr_mat, double *X, int LD,
+ Context ctx, HighLevelRuntime *runtime) const {
+
+  int N    = lr_mat.uroot->nrow;
+  int k    = rankZ;
+  int nrhs = lr_mat.get_num_rhs() - k;
+  assert(k > 0 && (int)Zmat.size() == N*k && LD >= N);
+  if (nrhs == 0) return;
+
+  // Y = [A^-1 B, A^-1 W]
+  std::vector<double> Y(N*(nrhs+k));
+  lr_mat.get_solution(&Y[0], N, ctx, runtime);
+  double *AiB = &Y[0];
+  double *AiW = &Y[N*nrhs];
+
+  // C = I + Z^T A^-1 W, and T = C^-1 Z^T A^-1 B
+  std::vector<double> C(k*k, 0.0), T(k*nrhs);
+  for (int i=0; i<k; i++)
+    C[i+i*k] = 1.0;
+  char transa = 'T', transb = 'N';
+  double one = 1.0, zero = 0.0, minus = -1.0;
+  int n = N;
+  double *Zp = (double *)&Zmat[0];
+  blas::dgemm_(&transa, &transb, &k, &k, &n, &one, Zp, &n,
+	       AiW, &n, &one, &C[0], &k);
+  blas::dgemm_(&transa, &transb, &k, &nrhs, &n, &one, Zp, &n,
+	       AiB, &n, &zero, &T[0], &k);
+  std::vector<int> ipiv(k);
+  int info;
+  lapack::dgesv_(&k, &nrhs, &C[0], &k, &ipiv[0], &T[0], &k, &info);
+  assert(info == 0);
+
+  // X = A^-1 B - A^-1 W T
+  transa = 'N';
+  blas::dgemm_(&transa, &transb, &n, &nrhs, &k, &minus, AiW, &n,
+	       &T[0], &k, &one, AiB, &n);
+  for (int j=0; j<nrhs; j++)
+    for (int i=0; i<N; i++)
+      X[i+j*LD] = AiB[i+j*N];
+}
+
 void FastSolver::solve_top
 (const HodlrMatrix& hMat, const Range& mappingTag,
  Context ctx, HighLevelRuntime *runtime) {
@@ -103,11 +177,16 @@ void solve_top_bfs
   for (; uit != ulist.end(); uit++, vit++, rit++) {
     Range rglchild = rit->lchild();
     Range rgrchild = rit->rchild();
-    Node *ulchild = (*uit)->lchild;
-    Node *urchild = (*uit)->rchild;
-    Node *vlchild = (*vit)->lchild;
-    Node *vrchild = (*vit)->rchild;
-    if ( level < launchLevel ) {
+    if ( ! (*uit)->is_real_leaf() ) {
+      rglchild = rit->lchild((*uit)->split_fraction());
+      rgrchild = rit->rchild((*uit)->split_fraction());
+    }
+    const Node *ulchild = (*uit)->lchild();
+    const Node *urchild = (*uit)->rchild();
+    const Node *vlchild = (*vit)->lchild();
+    const Node *vrchild = (*vit)->rchild();
+    // subtrees may be unbalanced
+    if ( level < launchLevel && ! (*uit)->is_legion_leaf() ) {
       ulist.push_back( ulchild );
       ulist.push_back( urchild );
       vlist.push_back( vlchild );
@@ -133,7 +212,7 @@ void solve_top_bfs
 #endif
 }
 
-void solve_bfs
+void FastSolver::solve_bfs
 (Node *uroot, Node *vroot,
  Range mappingTag, Context ctx, HighLevelRuntime *runtime) {
 
@@ -149,16 +228,24 @@ void solve_bfs
   typedef std::list<Range>::iterator         Riter;
   typedef std::list<Range>::reverse_iterator RRiter;
 
+  std::list<int> dlist; // depth of the nodes
+  dlist.push_back(0);
+  std::list<int>::iterator dit = dlist.begin();
+
   Titer uit = ulist.begin();
   Titer vit = vlist.begin();
   Riter rit = rglist.begin();
-  for (; uit != ulist.end(); uit++, vit++, rit++) {
+  for (; uit != ulist.end(); uit++, vit++, rit++, dit++) {
     Range rglchild = rit->lchild();
     Range rgrchild = rit->rchild();
-    Node *ulchild = (*uit)->lchild;
-    Node *urchild = (*uit)->rchild;
-    Node *vlchild = (*vit)->lchild;
-    Node *vrchild = (*vit)->rchild;
+    if ( ! (*uit)->is_real_leaf() ) {
+      rglchild = rit->lchild((*uit)->split_fraction());
+      rgrchild = rit->rchild((*uit)->split_fraction());
+    }
+    Node *ulchild = (*uit)->lchild();
+    Node *urchild = (*uit)->rchild();
+    Node *vlchild = (*vit)->lchild();
+    Node *vrchild = (*vit)->rchild();
     if (      ! (*uit)->is_legion_leaf() ) {
       assert( ! (*vit)->is_legion_leaf() );
       ulist.push_back( ulchild );
@@ -167,18 +254,42 @@ void solve_bfs
       vlist.push_back( vrchild );
       rglist.push_back( rglchild );
       rglist.push_back( rgrchild );
+      dlist.push_back( *dit+1 );
+      dlist.push_back( *dit+1 );
     }
   }
   RTiter ruit  = ulist.rbegin();
   RTiter rvit  = vlist.rbegin();
   RRiter rrgit = rglist.rbegin();
+  std::list<int>::reverse_iterator rdit = dlist.rbegin();
 
   //std::cout << "ulist size: " << ulist.size() << std::endl;    
   double tRed = 0, tCreate = 0, tBroad = 0;
-  for (; ruit != ulist.rend(); ruit++, rvit++, rrgit++)
-    visit(*ruit, *rvit, *rrgit,
-	  tRed, tBroad, tCreate,
-	  ctx, runtime);
+  // the nodes above skipLevel are left to the coarse solve, or not
+  //  solved at all for block Jacobi
+  bool coarse = coarseLevels > 0 && jacobiLevel == 0 && ! keepStates &&
+    ! keepFactors && ! uroot->is_legion_leaf();
+  int skipLevel = coarse ? coarseLevels : jacobiLevel;
+  if (levelSync) {
+    solve_levels(ulist, vlist, rglist, dlist, skipLevel,
+		 tRed, tBroad, tCreate, ctx, runtime);
+  } else {
+    for (; ruit != ulist.rend(); ruit++, rvit++, rrgit++, rdit++) {
+      if (*rdit < skipLevel && ! (*ruit)->is_legion_leaf())
+	continue;
+      std::vector<Future> logdet;
+      int zeroCols = zeroRhs.count(*ruit) ? rhsCols : 0;
+      visit(*ruit, *rvit, *rrgit,
+	    tRed, tBroad, tCreate, logdet,
+	    ctx, runtime, zeroCols,
+	    *rdit < replicatedLevels && ! keepFactors, kept_factors(*ruit));
+      nodeDet[*ruit] = logdet.back();
+      if (keepStates && *ruit != uroot)
+	save_state(*ruit, *rrgit, ctx, runtime);
+    }
+  }
+  if (coarse)
+    nodeDet[uroot] = solve_coarse(uroot, vroot, mappingTag, ctx, runtime);
 
 #ifdef DEBUG
   std::cout << "launch reduction task: " << tRed    << std::endl
@@ -188,72 +299,495 @@ void solve_bfs
 }
 
 
-void visit
-(Node *unode, Node *vnode, const Range mappingTag,
- double& tRed, double& tBroad, double& tCreate,
- Context ctx, HighLevelRuntime *runtime)
-{
+// whether the subtree holds a legion leaf of the rhs support; the
+//  other subtrees go into zeroRhs. first is the index of the first
+//  legion leaf below node.
+bool FastSolver::mark_zero_rhs(const Node *node, int &first) {
+  bool nonzero;
+  if (node->is_legion_leaf()) {
+    nonzero = std::binary_search(rhsSupport.begin(), rhsSupport.end(),
+				 first);
+    first++;
+  } else {
+    nonzero  = mark_zero_rhs(node->lchild(), first);
+    nonzero |= mark_zero_rhs(node->rchild(), first);
+  }
+  if ( ! nonzero )
+    zeroRhs.insert(node);
+  return nonzero;
+}
+
+KeptFactors *FastSolver::kept_factors(const Node *node) {
+  return keepFactors ? &factors[node] : NULL;
+}
+
+void FastSolver::set_rhs_support(const std::vector<int> &leaves) {
+  rhsSupport = leaves;
+  std::sort(rhsSupport.begin(), rhsSupport.end());
+}
+
+void FastSolver::sum_log_det
+(Range mappingTag, Context ctx, HighLevelRuntime *runtime) {
+  std::vector<Future> logdet;
+  std::map<const Node *, Future>::iterator it = nodeDet.begin();
+  for (; it != nodeDet.end(); it++)
+    logdet.push_back(it->second);
+  this->logdet = sum_futures(logdet, mappingTag.begin(), ctx, runtime);
+}
+
+static void legion_leaves
+(Node *node, Range tag, std::vector<Node *> &leaves,
+ std::vector<Range> &tags) {
+  if (node->is_legion_leaf()) {
+    leaves.push_back(node);
+    tags.push_back(tag);
+  } else {
+    legion_leaves(node->lchild(), tag.lchild(node->split_fraction()),
+		  leaves, tags);
+    legion_leaves(node->rchild(), tag.rchild(node->split_fraction()),
+		  leaves, tags);
+  }
+}
+
+void FastSolver::save_state
+(const Node *node, Range mappingTag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  std::vector<Node *> leaves;
+  std::vector<Range>  tags;
+  legion_leaves(const_cast<Node *>(node), mappingTag, leaves, tags);
+  std::vector<LMatrix *> &copies = state[node];
+  if (copies.empty()) {
+    copies.resize(leaves.size());
+    for (size_t i=0; i<leaves.size(); i++) {
+      const LMatrix *u = leaves[i]->lowrank_matrix;
+      create_matrix(copies[i], u->rows, u->cols, ctx, runtime);
+    }
+  }
+  assert(copies.size() == leaves.size());
+  for (size_t i=0; i<leaves.size(); i++)
+    copies[i]->copy(*leaves[i]->lowrank_matrix, tags[i].begin(),
+		    ctx, runtime);
+}
+
+void FastSolver::restore_state
+(Node *node, Range mappingTag, Context ctx, HighLevelRuntime *runtime) {
+
+  assert(state.count(node) == 1);
+  std::vector<Node *> leaves;
+  std::vector<Range>  tags;
+  legion_leaves(node, mappingTag, leaves, tags);
+  const std::vector<LMatrix *> &copies = state[node];
+  assert(copies.size() == leaves.size());
+  for (size_t i=0; i<leaves.size(); i++)
+    leaves[i]->lowrank_matrix->copy(*copies[i], tags[i].begin(),
+				    ctx, runtime);
+}
+
+void FastSolver::update
+(const HodlrMatrix &base, HodlrMatrix &work,
+ const std::vector<int> &leaves, const Range &procs,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  assert(keepStates);
+  if (leaves.empty()) return;
+  std::vector<int> dirty(leaves);
+  std::sort(dirty.begin(), dirty.end());
   
-  if (      unode->is_legion_leaf() ) {
-    assert( vnode->is_legion_leaf() );
-    solve_legion_leaf(unode, vnode, mappingTag, ctx, runtime);
+  Timer t; t.start();
+  int first = 0;
+  update(base.uroot, base.vroot, work.uroot, work.vroot, procs, 0,
+	 dirty, first, ctx, runtime);
+  assert(dirty.back() < first);
+  sum_log_det(procs, ctx, runtime);
+  t.stop();
+  this->time_launcher = t.get_elapsed_time();
+}
+
+// first is the index of the first legion leaf below unode. the
+//  nodes are solved as solve_bfs() did: the block Jacobi levels are
+//  skipped, and the zero rhs and replicated levels are kept.
+void FastSolver::update
+(const Node *ubase, const Node *vbase, Node *unode, Node *vnode,
+ Range mappingTag, int depth, const std::vector<int> &dirty,
+ int &first, Context ctx, HighLevelRuntime *runtime) {
+
+  std::vector<Node *> leaves;
+  std::vector<Range>  tags;
+  legion_leaves(unode, mappingTag, leaves, tags);
+  int last = first + leaves.size();
+  bool skip = depth < jacobiLevel && ! unode->is_legion_leaf();
+  if (std::lower_bound(dirty.begin(), dirty.end(), first) ==
+      std::lower_bound(dirty.begin(), dirty.end(), last) && ! skip) {
+    // clean subtree, back to the state after its solve
+    restore_state(unode, mappingTag, ctx, runtime);
+    first = last;
     return;
   }
+  
+  if (unode->is_legion_leaf()) {
+    shift_leaves(ubase, vbase, unode, vnode, 0.0, mappingTag,
+		 ctx, runtime);
+    first++;
+  } else {
+    Range tag0 = mappingTag.lchild(unode->split_fraction());
+    Range tag1 = mappingTag.rchild(unode->split_fraction());
+    update(ubase->lchild(), vbase->lchild(), unode->lchild(),
+	   vnode->lchild(), tag0, depth+1, dirty, first, ctx, runtime);
+    update(ubase->rchild(), vbase->rchild(), unode->rchild(),
+	   vnode->rchild(), tag1, depth+1, dirty, first, ctx, runtime);
+  }
+  if (skip)
+    return;
+  
+  double tRed = 0, tCreate = 0, tBroad = 0;
+  std::vector<Future> logdet;
+  int zeroCols = zeroRhs.count(unode) ? rhsCols : 0;
+  visit(unode, vnode, mappingTag, tRed, tBroad, tCreate, logdet,
+	ctx, runtime, zeroCols, depth < replicatedLevels && ! keepFactors,
+	kept_factors(unode));
+  nodeDet[unode] = logdet.back();
+  if (state.count(unode) == 1)
+    save_state(unode, mappingTag, ctx, runtime);
+}
 
-  Node * b0 = unode->lchild;
-  Node * b1 = unode->rchild;  
-  Node * V0 = vnode->lchild;
-  Node * V1 = vnode->rchild;
+// the node system of visit() between its three steps
+struct NodeSystem {
+  LMatrix *V0Tu0, *V0Td0, *V1Tu1, *V1Td1;
+  Range    ru0, ru1, rd0, rd1;
+};
 
-  const Range mappingTag0 = mappingTag.lchild();
-  const Range mappingTag1 = mappingTag.rchild();
+// the F region of a legion leaf, NULL if the factors are not kept
+static LMatrix *leaf_factors
+(const Node *uleaf, KeptFactors *kept,
+ Context ctx, HighLevelRuntime *runtime) {
+  if (kept == NULL) return NULL;
+  if (kept->F == NULL)
+    create_matrix(kept->F, leaf_factor_size(uleaf), 1, ctx, runtime);
+  return kept->F;
+}
 
-  assert( ! unode->is_legion_leaf() );
-  assert( V0->Hmat != NULL );
-  assert( V1->Hmat != NULL );
+// keeps V0Tu0 and V1Tu1 of the node system, and returns the region
+//  for the LU of S; the regions of an earlier solve are replaced
+static LMatrix *node_factors
+(const NodeSystem &sys, KeptFactors *kept,
+ Context ctx, HighLevelRuntime *runtime) {
+  if (kept == NULL) return NULL;
+  if (kept->V0Tu0 != NULL) {
+    destroy_matrix(kept->V0Tu0, ctx, runtime);
+    destroy_matrix(kept->V1Tu1, ctx, runtime);
+  }
+  kept->V0Tu0 = sys.V0Tu0;
+  kept->V1Tu1 = sys.V1Tu1;
+  int n1 = sys.V1Tu1->rows;
+  if (kept->S == NULL)
+    create_matrix(kept->S, n1, n1+1, ctx, runtime);
+  return kept->S;
+}
 
-  // This involves a reduction for V0Tu0, V0Td0, V1Tu1, V1Td1
-  // from leaves to root in the H tree.
-  //LogicalRegion V0Tu0, V0Td0, V1Tu1, V1Td1;
-  LMatrix *V0Tu0 = 0;
-  LMatrix *V0Td0 = 0;
-  LMatrix *V1Tu1 = 0;
-  LMatrix *V1Td1 = 0;
-  Range ru0(b0->col_beg, b0->ncol);
-  Range ru1(b1->col_beg, b1->ncol);
-  Range rd0(0,           b0->col_beg);
-  Range rd1(0,           b1->col_beg);
+// This involves a reduction for V0Tu0, V0Td0, V1Tu1, V1Td1
+// from leaves to root in the H tree.
+static void reduce_node
+(Node *unode, Node *vnode, const Range mappingTag, int zeroCols,
+ NodeSystem &sys, double& tRed, double& tCreate,
+ Context ctx, HighLevelRuntime *runtime)
+{
+  Node * b0 = unode->lchild();
+  Node * b1 = unode->rchild();  
+  Node * V0 = vnode->lchild();
+  Node * V1 = vnode->rchild();
+
+  const Range mappingTag0 = mappingTag.lchild(unode->split_fraction());
+  const Range mappingTag1 = mappingTag.rchild(unode->split_fraction());
+
+  assert( ! unode->is_legion_leaf() );
+  assert( V0->Hmat() != NULL );
+  assert( V1->Hmat() != NULL );
+
+  sys.V0Tu0 = 0;
+  sys.V0Td0 = 0;
+  sys.V1Tu1 = 0;
+  sys.V1Td1 = 0;
+  sys.ru0 = Range(b0->col_beg, b0->ncol);
+  sys.ru1 = Range(b1->col_beg, b1->ncol);
+  // the first zeroCols columns (the rhs) are zero in this subtree
+  //  and stay so, skip them unless nothing else is left
+  if (zeroCols >= b0->col_beg) zeroCols = 0;
+  sys.rd0 = Range(zeroCols,    b0->col_beg - zeroCols);
+  sys.rd1 = Range(zeroCols,    b1->col_beg - zeroCols);
 
   double t0 = timer();
-  gemm_reduce(1., V0->Hmat, b0, ru0, 0., V0Tu0,
+  gemm_reduce(1., V0->Hmat(), b0, sys.ru0, 0., sys.V0Tu0,
 	      mappingTag0, tCreate, ctx, runtime);
-  gemm_reduce(1., V1->Hmat, b1, ru1, 0., V1Tu1,
+  gemm_reduce(1., V1->Hmat(), b1, sys.ru1, 0., sys.V1Tu1,
 	      mappingTag1, tCreate, ctx, runtime);
-  gemm_reduce(1., V0->Hmat, b0, rd0, 0., V0Td0,
+  gemm_reduce(1., V0->Hmat(), b0, sys.rd0, 0., sys.V0Td0,
 	      mappingTag0, tCreate, ctx, runtime);
-  gemm_reduce(1., V1->Hmat, b1, rd1, 0., V1Td1,
+  gemm_reduce(1., V1->Hmat(), b1, sys.rd1, 0., sys.V1Td1,
 	      mappingTag1, tCreate, ctx, runtime);
   tRed += timer() - t0;
-  
-  // V0Td0 and V1Td1 contain the solution on output.
-  // eta0 = V1Td1
-  // eta1 = V0Td0
-  solve_node_matrix(V0Tu0, V1Tu1,
-		    V0Td0, V1Td1,
-		    mappingTag0, ctx, runtime);  
+}
 
-  // This step requires a broadcast of V0Td0 and V1Td1
-  // from root to leaves.
-  // Assemble x from d0 and d1: merge two trees
+// V0Td0 and V1Td1 contain the solution on output.
+// eta0 = V1Td1
+// eta1 = V0Td0
+static Future solve_node
+(Node *unode, NodeSystem &sys, const Range mappingTag,
+ Context ctx, HighLevelRuntime *runtime, LMatrix *S=NULL)
+{
+  return solve_node_matrix(sys.V0Tu0, sys.V1Tu1,
+			   sys.V0Td0, sys.V1Td1,
+			   mappingTag.lchild(unode->split_fraction()),
+			   ctx, runtime, S);
+}
+
+// This step requires a broadcast of V0Td0 and V1Td1
+// from root to leaves.
+// Assemble x from d0 and d1: merge two trees
+static void broadcast_node
+(Node *unode, NodeSystem &sys, const Range mappingTag, double& tBroad,
+ Context ctx, HighLevelRuntime *runtime)
+{
+  Node * b0 = unode->lchild();
+  Node * b1 = unode->rchild();  
+  const Range mappingTag0 = mappingTag.lchild(unode->split_fraction());
+  const Range mappingTag1 = mappingTag.rchild(unode->split_fraction());
 
   double t1 = timer();
-  gemm_broadcast(-1., b0, ru0, V1Td1, 1., b0, rd0,
+  gemm_broadcast(-1., b0, sys.ru0, sys.V1Td1, 1., b0, sys.rd0,
 		 mappingTag0, ctx, runtime);
-  gemm_broadcast(-1., b1, ru1, V0Td0, 1., b1, rd1,
+  gemm_broadcast(-1., b1, sys.ru1, sys.V0Td0, 1., b1, sys.rd1,
 		 mappingTag1, ctx, runtime);
   tBroad += timer() - t1;
 }
 
+// solve_node() and broadcast_node() together, with the node system
+//  solved again in every legion leaf below the node
+static Future replicate_node
+(Node *unode, NodeSystem &sys, const Range mappingTag, double& tBroad,
+ Context ctx, HighLevelRuntime *runtime)
+{
+  double t1 = timer();
+  Future f = solve_node_replicated(sys.V0Tu0, sys.V1Tu1,
+				   sys.V0Td0, sys.V1Td1,
+				   unode->lchild(), sys.ru0, sys.rd0,
+				   unode->rchild(), sys.ru1, sys.rd1,
+				   mappingTag.lchild(unode->split_fraction()),
+				   mappingTag.rchild(unode->split_fraction()),
+				   ctx, runtime);
+  tBroad += timer() - t1;
+  return f;
+}
+
+void visit
+(Node *unode, Node *vnode, const Range mappingTag,
+ double& tRed, double& tBroad, double& tCreate,
+ std::vector<Future> &logdet,
+ Context ctx, HighLevelRuntime *runtime,
+ int zeroCols, bool replicate, KeptFactors *kept)
+{
+  
+  if (      unode->is_legion_leaf() ) {
+    assert( vnode->is_legion_leaf() );
+    logdet.push_back(
+      solve_legion_leaf(unode, vnode, mappingTag, ctx, runtime,
+			leaf_factors(unode, kept, ctx, runtime)));
+    return;
+  }
+
+  NodeSystem sys;
+  reduce_node(unode, vnode, mappingTag, zeroCols, sys, tRed, tCreate,
+	      ctx, runtime);
+  if (replicate) {
+    assert(kept == NULL);
+    logdet.push_back(replicate_node(unode, sys, mappingTag, tBroad,
+				    ctx, runtime));
+    return;
+  }
+  logdet.push_back(solve_node(unode, sys, mappingTag, ctx, runtime,
+			      node_factors(sys, kept, ctx, runtime)));
+  broadcast_node(unode, sys, mappingTag, tBroad, ctx, runtime);
+}
+
+
+// the lists of solve_bfs() one level at a time from the bottom: the
+//  leaf solves and the reductions of the level, the node solves, then
+//  the broadcasts, with an execution fence after every step. the
+//  nodes above skipLevel are skipped.
+void FastSolver::solve_levels
+(std::list<Node *> &ulist, std::list<Node *> &vlist,
+ std::list<Range> &rglist, std::list<int> &dlist, int skipLevel,
+ double& tRed, double& tBroad, double& tCreate,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  std::vector<Node *> unode(ulist.rbegin(), ulist.rend());
+  std::vector<Node *> vnode(vlist.rbegin(), vlist.rend());
+  std::vector<Range>  tag(rglist.rbegin(), rglist.rend());
+  std::vector<int>    depth(dlist.rbegin(), dlist.rend());
+
+  // the depths are decreasing in the reversed bfs order
+  size_t end = 0;
+  while (end < unode.size()) {
+    size_t beg = end;
+    while (end < unode.size() && depth[end] == depth[beg])
+      end++;
+
+    std::vector<size_t>     nodes; // with a node system
+    std::vector<NodeSystem> sys;
+    for (size_t i=beg; i<end; i++) {
+      if (unode[i]->is_legion_leaf()) {
+	LMatrix *F = leaf_factors(unode[i], kept_factors(unode[i]),
+				  ctx, runtime);
+	nodeDet[unode[i]] =
+	  solve_legion_leaf(unode[i], vnode[i], tag[i], ctx, runtime, F);
+      } else if (depth[i] >= skipLevel) {
+	int zeroCols = zeroRhs.count(unode[i]) ? rhsCols : 0;
+	sys.push_back(NodeSystem());
+	reduce_node(unode[i], vnode[i], tag[i], zeroCols, sys.back(),
+		    tRed, tCreate, ctx, runtime);
+	nodes.push_back(i);
+      }
+    }
+    runtime->issue_execution_fence(ctx);
+    // a replicated level has no node solve step
+    bool replicate = depth[beg] < replicatedLevels && ! keepFactors;
+    if ( ! nodes.empty() && ! replicate ) {
+      for (size_t n=0; n<nodes.size(); n++) {
+	LMatrix *S = node_factors(sys[n], kept_factors(unode[nodes[n]]),
+				  ctx, runtime);
+	nodeDet[unode[nodes[n]]] =
+	  solve_node(unode[nodes[n]], sys[n], tag[nodes[n]], ctx, runtime,
+		     S);
+      }
+      runtime->issue_execution_fence(ctx);
+      for (size_t n=0; n<nodes.size(); n++)
+	broadcast_node(unode[nodes[n]], sys[n], tag[nodes[n]], tBroad,
+		       ctx, runtime);
+      runtime->issue_execution_fence(ctx);
+    } else if ( ! nodes.empty() ) {
+      for (size_t n=0; n<nodes.size(); n++)
+	nodeDet[unode[nodes[n]]] =
+	  replicate_node(unode[nodes[n]], sys[n], tag[nodes[n]], tBroad,
+			 ctx, runtime);
+      runtime->issue_execution_fence(ctx);
+    }
+
+    if (keepStates)
+      for (size_t i=beg; i<end; i++)
+	if (unode[i] != unode.back() && nodeDet.count(unode[i]))
+	  save_state(unode[i], tag[i], ctx, runtime);
+  }
+}
+
+
+// one step of resolve(): the legion leaf, or the node from its kept
+//  system. For A, first = V0^T d0 and second = V1^T d1, then d0 -=
+//  X0 * eta0 and d1 -= X1 * eta1 as in visit(); for A^T, first = X1^T
+//  c1 and second = X0^T c0, then c0 -= V0 * first and c1 -= V1 *
+//  second, with the H-tiled V0 and V1 in place of X0 and X1.
+static void resolve_step
+(bool trans, const Node *unode, const Node *vnode, const Node *tnode,
+ const Range &cols, const Range mappingTag, const KeptFactors &kept,
+ Context ctx, HighLevelRuntime *runtime)
+{
+  if (unode->is_legion_leaf()) {
+    resolve_legion_leaf(trans, unode, vnode, kept.F, tnode, cols,
+			mappingTag, ctx, runtime);
+    return;
+  }
+
+  const Node *b0 = unode->lchild(), *t0 = tnode->lchild();
+  const Node *b1 = unode->rchild(), *t1 = tnode->rchild();
+  const Node *V0 = vnode->lchild()->Hmat();
+  const Node *V1 = vnode->rchild()->Hmat();
+  const Range tag0 = mappingTag.lchild(unode->split_fraction());
+  const Range tag1 = mappingTag.rchild(unode->split_fraction());
+  Range ru0(b0->col_beg, b0->ncol);
+  Range ru1(b1->col_beg, b1->ncol);
+
+  LMatrix *first = 0, *second = 0;
+  double tCreate = 0;
+  if ( ! trans ) {
+    gemm_reduce(1., V0, t0, cols, 0., first, tag0, tCreate,
+		ctx, runtime);
+    gemm_reduce(1., V1, t1, cols, 0., second, tag1, tCreate,
+		ctx, runtime);
+  } else {
+    gemm_reduce(1., b1, ru1, t1, cols, 0., first, tag1, tCreate,
+		ctx, runtime);
+    gemm_reduce(1., b0, ru0, t0, cols, 0., second, tag0, tCreate,
+		ctx, runtime);
+  }
+  resolve_node_matrix(trans, kept.V0Tu0, kept.V1Tu1, kept.S,
+		      first, second, tag0, ctx, runtime);
+  if ( ! trans ) {
+    gemm_broadcast(-1., b0, ru0, second, 1., t0, cols, tag0,
+		   ctx, runtime);
+    gemm_broadcast(-1., b1, ru1, first,  1., t1, cols, tag1,
+		   ctx, runtime);
+  } else {
+    gemm_broadcast(-1., V0, Range(V0->ncol), first,  1., t0, cols, tag0,
+		   ctx, runtime);
+    gemm_broadcast(-1., V1, Range(V1->ncol), second, 1., t1, cols, tag1,
+		   ctx, runtime);
+  }
+  destroy_matrix(first,  ctx, runtime);
+  destroy_matrix(second, ctx, runtime);
+}
+
+void FastSolver::resolve
+(HodlrMatrix &lr_mat, const Range& procs,
+ Context ctx, HighLevelRuntime *runtime, bool transpose) {
+
+  Timer t; t.start();
+  resolve(lr_mat.uroot, lr_mat.vroot, lr_mat.uroot,
+	  Range(lr_mat.get_num_rhs()), procs, transpose, ctx, runtime);
+  t.stop();
+  this->time_launcher = t.get_elapsed_time();
+}
+
+// the nodes in breadth first order as in solve_bfs(), bottom up for
+//  A and top down for A^T. The nodes without kept factors (the block
+//  Jacobi levels) are skipped.
+void FastSolver::resolve
+(const Node *uroot, const Node *vroot, const Node *troot,
+ const Range &cols, const Range &mappingTag, bool transpose,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  assert(keepFactors);
+  std::vector<const Node *> ulist(1, uroot);
+  std::vector<const Node *> vlist(1, vroot);
+  std::vector<const Node *> tlist(1, troot);
+  std::vector<Range>        rglist(1, mappingTag);
+  for (size_t i=0; i<ulist.size(); i++) {
+    if (ulist[i]->is_legion_leaf())
+      continue;
+    double f = ulist[i]->split_fraction();
+    ulist.push_back(ulist[i]->lchild());
+    ulist.push_back(ulist[i]->rchild());
+    vlist.push_back(vlist[i]->lchild());
+    vlist.push_back(vlist[i]->rchild());
+    tlist.push_back(tlist[i]->lchild());
+    tlist.push_back(tlist[i]->rchild());
+    rglist.push_back(rglist[i].lchild(f));
+    rglist.push_back(rglist[i].rchild(f));
+  }
+
+  int n = ulist.size();
+  for (int k=0; k<n; k++) {
+    int i = transpose ? k : n-1-k;
+    std::map<const Node *, KeptFactors>::const_iterator it =
+      factors.find(ulist[i]);
+    if (it == factors.end()) {
+      assert( ! ulist[i]->is_legion_leaf() );
+      continue;
+    }
+    resolve_step(transpose, ulist[i], vlist[i], tlist[i], cols,
+		 rglist[i], it->second, ctx, runtime);
+  }
+}
+
+
 void visit_const
 (const Node *unode, const Node *vnode,
  const Range mappingTag,
@@ -267,17 +801,17 @@ void visit_const
     return;
   }
 
-  Node * b0 = unode->lchild;
-  Node * b1 = unode->rchild;  
-  Node * V0 = vnode->lchild;
-  Node * V1 = vnode->rchild;
+  const Node * b0 = unode->lchild();
+  const Node * b1 = unode->rchild();  
+  const Node * V0 = vnode->lchild();
+  const Node * V1 = vnode->rchild();
 
-  const Range mappingTag0 = mappingTag.lchild();
-  const Range mappingTag1 = mappingTag.rchild();
+  const Range mappingTag0 = mappingTag.lchild(unode->split_fraction());
+  const Range mappingTag1 = mappingTag.rchild(unode->split_fraction());
 
   assert( ! unode->is_legion_leaf() );
-  assert( V0->Hmat != NULL );
-  assert( V1->Hmat != NULL );
+  assert( V0->Hmat() != NULL );
+  assert( V1->Hmat() != NULL );
 
   // This involves a reduction for V0Tu0, V0Td0, V1Tu1, V1Td1
   // from leaves to root in the H tree.
@@ -292,13 +826,13 @@ void visit_const
   Range rd1(0,           b1->col_beg);
 
   double t0 = timer();
-  gemm_reduce(1., V0->Hmat, b0, ru0, 0., V0Tu0,
+  gemm_reduce(1., V0->Hmat(), b0, ru0, 0., V0Tu0,
 	      mappingTag0, tCreate, ctx, runtime);
-  gemm_reduce(1., V1->Hmat, b1, ru1, 0., V1Tu1,
+  gemm_reduce(1., V1->Hmat(), b1, ru1, 0., V1Tu1,
 	      mappingTag1, tCreate, ctx, runtime);
-  gemm_reduce(1., V0->Hmat, b0, rd0, 0., V0Td0,
+  gemm_reduce(1., V0->Hmat(), b0, rd0, 0., V0Td0,
 	      mappingTag0, tCreate, ctx, runtime);
-  gemm_reduce(1., V1->Hmat, b1, rd1, 0., V1Td1,
+  gemm_reduce(1., V1->Hmat(), b1, rd1, 0., V1Td1,
 	      mappingTag1, tCreate, ctx, runtime);
   tRed += timer() - t0;
   
@@ -1,4 +1,5 @@
 #include "gemm.h"
+#include "solver_kernels.h"
 #include "zero_matrix_task.h"
 #include "node.h"
 #include "lapack_blas.h"
@@ -19,6 +20,8 @@ namespace {
   public:
     struct TaskArgs {
       double alpha;
+      int v_col_beg;
+      int v_ncol;
       int col_beg;
       int ncol;
     };
@@ -143,8 +146,8 @@ void register_gemm_tasks() {
 
 static void gemm_recursive
   (const double alpha,
-   const Node * v, const Node * u,
-   const Range &range,
+   const Node * v, const Range &rv,
+   const Node * u, const Range &range,
    LMatrix *(&result),
    const Range task_tag, Context ctx,
    HighLevelRuntime * runtime)
@@ -158,7 +161,8 @@ static void gemm_recursive
     assert(result->data            != LogicalRegion::NO_REGION);
 
     typedef GEMM_Reduce_Task GRT;
-    GRT::TaskArgs args = {alpha, range.begin(), range.size()};
+    GRT::TaskArgs args = {alpha, rv.begin(), rv.size(),
+			  range.begin(), range.size()};
     GRT launcher(TaskArgument(
 			      &args,
 			      sizeof(args)
@@ -195,11 +199,11 @@ static void gemm_recursive
       
   } else {
 
-    const Range tag0 = task_tag.lchild();
-    const Range tag1 = task_tag.rchild();
-    gemm_recursive(alpha, v->lchild, u->lchild, range,
+    const Range tag0 = task_tag.lchild(u->split_fraction());
+    const Range tag1 = task_tag.rchild(u->split_fraction());
+    gemm_recursive(alpha, v->lchild(), rv, u->lchild(), range,
 		   result, tag0, ctx, runtime);
-    gemm_recursive(alpha, v->rchild, u->rchild, range,
+    gemm_recursive(alpha, v->rchild(), rv, u->rchild(), range,
 		   result, tag1, ctx, runtime);
   }
 }
@@ -211,10 +215,21 @@ void gemm_reduce
    const double beta,   LMatrix *(&result),  const Range taskTag,
    double& tCreate,
    Context ctx, HighLevelRuntime *runtime) {
+  // all columns of the H-tiled matrix
+  gemm_reduce(alpha, v, Range(v->ncol), u, ru, beta, result,
+	      taskTag, tCreate, ctx, runtime);
+}
+
+void gemm_reduce
+  (const double alpha,
+   const Node *v, const Range &rv, const Node *u, const Range &ru,
+   const double beta,   LMatrix *(&result),  const Range taskTag,
+   double& tCreate,
+   Context ctx, HighLevelRuntime *runtime) {
 
   Timer t; t.start();
   if (result == 0) { // create and initialize the result
-    int nrow = v->ncol;
+    int nrow = rv.size();
     int ncol = ru.size();
     assert(v->nrow == u->nrow);
     create_matrix(result, nrow, ncol, ctx, runtime); 
@@ -224,7 +239,7 @@ void gemm_reduce
   }
   t.stop(); tCreate += t.get_elapsed_time();
     
-  gemm_recursive(alpha, v, u, ru, result, taskTag,
+  gemm_recursive(alpha, v, rv, u, ru, result, taskTag,
 		 ctx, runtime);
 }
 
@@ -238,7 +253,8 @@ void gemm_broadcast
 
   if (     u->is_legion_leaf()                               ) {
     assert(v->is_legion_leaf()                               );
-    assert(u->lowrank_matrix->data == v->lowrank_matrix->data);
+    // u from another region, e.g. an H-tiled V, is read after eta
+    bool other = u->lowrank_matrix->data != v->lowrank_matrix->data;
 
     typedef GEMM_Broadcast_Task GBT;
     GBT::TaskArgs args = {alpha,      beta,
@@ -253,17 +269,23 @@ void gemm_broadcast
 		 tag.begin());
 
     launcher.add_region_requirement(
-               RegionRequirement(u->lowrank_matrix->data,
+               RegionRequirement(v->lowrank_matrix->data,
 				 READ_WRITE,
 				 EXCLUSIVE,
-				 u->lowrank_matrix->data));
+				 v->lowrank_matrix->data));
     launcher.add_region_requirement(
                RegionRequirement(eta->data,
 				 READ_ONLY,
 				 EXCLUSIVE,
 				 eta->data)); // eta
-    launcher.region_requirements[0].add_field(FID_X);
-    launcher.region_requirements[1].add_field(FID_X);
+    if (other)
+      launcher.add_region_requirement(
+	       RegionRequirement(u->lowrank_matrix->data,
+				 READ_ONLY,
+				 EXCLUSIVE,
+				 u->lowrank_matrix->data)); // u
+    for (size_t i=0; i<launcher.region_requirements.size(); i++)
+      launcher.region_requirements[i].add_field(FID_X);
     Future ft = runtime->execute_task(ctx, launcher);
 
 #ifdef SERIAL
@@ -272,13 +294,13 @@ void gemm_broadcast
 #endif
     
   } else {
-    const Range tag0 = tag.lchild();
-    const Range tag1 = tag.rchild();
-    gemm_broadcast(alpha, u->lchild, ru, eta,
-		   beta,  v->lchild, rv,
+    const Range tag0 = tag.lchild(u->split_fraction());
+    const Range tag1 = tag.rchild(u->split_fraction());
+    gemm_broadcast(alpha, u->lchild(), ru, eta,
+		   beta,  v->lchild(), rv,
 		   tag0,  ctx, runtime);
-    gemm_broadcast(alpha, u->rchild, ru, eta,
-		   beta,  v->rchild, rv,
+    gemm_broadcast(alpha, u->rchild(), ru, eta,
+		   beta,  v->rchild(), rv,
 		   tag1,  ctx, runtime);
   }  
 }
@@ -322,6 +344,8 @@ void GEMM_Reduce_Task::cpu_task
   assert(task->arglen         == sizeof(TaskArgs));
   
   TaskArgs arg       = *((TaskArgs*)task->args);
+  int      v_ncol    = arg.v_ncol;
+  int      v_col_beg = arg.v_col_beg;
   int      u_ncol    = arg.ncol;
   int      u_col_beg = arg.col_beg;
   double   alpha     = arg.alpha;
@@ -361,23 +385,18 @@ void GEMM_Reduce_Task::cpu_task
   double *w_ptr = regions[2].get_accessor().typeify<double>().raw_rect_ptr<2>(rect_w, subrect, offsets);
   assert(rect_w == subrect);
   
-  char transa = 't';
-  char transb = 'n';
-  int  m = rect_v.dim_size(1);
+  int  m = v_ncol;
   int  n = u_ncol;
   int  k = rect_v.dim_size(0);
   assert(k == rect_u.dim_size(0));
+  assert(v_col_beg + v_ncol <= rect_v.dim_size(1));
   assert(m == rect_w.dim_size(0));
   assert(n == rect_w.dim_size(1));
   
-  double beta = 1.0;
   int u_nrow = rect_u.dim_size(0);
   double * u  = u_ptr + u_col_beg * u_nrow;
-  blas::dgemm_(&transa, &transb,
-	       &m,      &n,     &k,    &alpha,
-	       v_ptr,   &k,
-	       u,       &k,     &beta,
-	       w_ptr,   &m);
+  double * v  = v_ptr + v_col_beg * k;
+  gemm_reduce_kernel(m, n, k, alpha, v, k, u, k, 1.0, w_ptr, m);
 #ifdef SERIAL
   std::cout << " end of gemm task." << std::endl;
 #endif
@@ -419,8 +438,9 @@ void GEMM_Broadcast_Task::cpu_task
    const std::vector<PhysicalRegion> &regions,
    Context ctx, HighLevelRuntime *runtime)
 {
-  assert(regions.size()       == 2);
-  assert(task->regions.size() == 2);
+  // u is in the first region, or in a third one
+  assert(regions.size()       == 2 || regions.size() == 3);
+  assert(task->regions.size() == regions.size());
   assert(task->arglen         == sizeof(TaskArgs));
 
   TaskArgs arg       = *((TaskArgs*)task->args);
@@ -461,8 +481,6 @@ void GEMM_Broadcast_Task::cpu_task
   int d_rows = rect_u.dim_size(0);
   //int d_cols = d_ncol;
   
-  char transa = 'n';
-  char transb = 'n';
   int  m = u_rows;
   int  n = v_cols;
   int  k = u_cols;
@@ -470,15 +488,16 @@ void GEMM_Broadcast_Task::cpu_task
   
   double * u = u_ptr + u_col_beg * u_rows;
   double * d = u_ptr + d_col_beg * d_rows;
-  blas::dgemm_(&transa, &transb,
-	       &m,      &n,      &k,      &alpha,
-	       u,       &m,
-	       v_ptr,   &k,      &beta,
-	       d,       &m);  
+  if (regions.size() == 3) {
+    IndexSpace is_s = task->regions[2].region.get_index_space();
+    Rect<2> rect_s  = runtime->get_index_space_domain(ctx, is_s).
+      get_rect<2>();
+    assert(rect_s.dim_size(0) == d_rows);
+    assert(u_col_beg + u_ncol <= rect_s.dim_size(1));
+    double *s_ptr = regions[2].get_field_accessor(FID_X).
+      typeify<double>().raw_rect_ptr<2>(rect_s, subrect, offsets);
+    assert(rect_s == subrect);
+    u = s_ptr + u_col_beg * d_rows;
+  }
+  gemm_broadcast_kernel(m, n, k, alpha, u, m, v_ptr, k, beta, d, m);
 }
-
-
-
-
-
-
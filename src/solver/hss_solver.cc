@@ -0,0 +1,822 @@
+#include "fast_solver.h"
+#include "hss_matrix.h"
+#include "node.h"
+#include "lapack_blas.h"
+#include "timer.hpp"
+#include "macros.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+// Factorization of an HSS matrix by compressing the inverse level by
+//  level: with the block diagonal D, U and V of one level and the
+//  coupling B of the level above,
+//    (D + U B V^T)^-1 = E (Dhat + B)^-1 F^T + G,
+//    Dhat = (V^T D^-1 U)^-1,  E = D^-1 U Dhat,
+//    F^T  = Dhat V^T D^-1,    G = D^-1 - E V^T D^-1,
+//  and Dhat + B is again an HSS matrix with one level less whose
+//  generators are the transfer matrices. every node turns its
+//  generators [U | V | D] into [E | F | G] and hands Dhat to its
+//  parent. The solve goes up with b^ = F^T b and down with
+//  x = E x^ + G b, so both are O(N*r^2) for leaves of size O(r).
+
+namespace {
+
+  class HssLeafFactorTask : public TaskLauncher {
+  public:
+    // the packed subtree is the argument
+    HssLeafFactorTask(TaskArgument arg,
+		      Predicate pred = Predicate::TRUE_PRED,
+		      MapperID id = 0,
+		      MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+
+  class HssNodeFactorTask : public TaskLauncher {
+  public:
+    struct TaskArgs {
+      int kl; // ranks of the children
+      int kr;
+      int k;
+    };
+
+    HssNodeFactorTask(TaskArgument arg,
+		      Predicate pred = Predicate::TRUE_PRED,
+		      MapperID id = 0,
+		      MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+
+  // b^ of a legion leaf
+  class HssLeafUpTask : public TaskLauncher {
+  public:
+    // the packed subtree is the argument
+    HssLeafUpTask(TaskArgument arg,
+		  Predicate pred = Predicate::TRUE_PRED,
+		  MapperID id = 0,
+		  MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+
+  // solution of a legion leaf from its x^
+  class HssLeafDownTask : public TaskLauncher {
+  public:
+    // the packed subtree is the argument
+    HssLeafDownTask(TaskArgument arg,
+		    Predicate pred = Predicate::TRUE_PRED,
+		    MapperID id = 0,
+		    MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+
+  // b^ of a node from those of its children, or the x^ of the
+  //  children from that of the node
+  class HssNodeSolveTask : public TaskLauncher {
+  public:
+    struct TaskArgs {
+      int kl;
+      int kr;
+      int k;
+      bool up;
+    };
+
+    HssNodeSolveTask(TaskArgument arg,
+		     Predicate pred = Predicate::TRUE_PRED,
+		     MapperID id = 0,
+		     MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+}
+
+void register_hss_tasks() {
+  register_hss_init_tasks();
+  HssLeafFactorTask::register_tasks();
+  HssNodeFactorTask::register_tasks();
+  HssLeafUpTask::register_tasks();
+  HssLeafDownTask::register_tasks();
+  HssNodeSolveTask::register_tasks();
+}
+
+
+/* ---- dense kernels ---- */
+
+// [U | V | D] (m rows) becomes [E | F | G]; Dhat is k x k
+static void compress_generators
+(double *X, int LD, int m, int k, double *Dhat) {
+
+  double *U = X;
+  double *V = X + k*LD;
+  double *D = X + 2*k*LD;
+
+  // D^-1
+  std::vector<double> LU(m*m), Dinv(m*m, 0.0);
+  for (int j=0; j<m; j++) {
+    memcpy(&LU[j*m], D + j*LD, m*sizeof(double));
+    Dinv[j + j*m] = 1.0;
+  }
+  int INFO;
+  std::vector<int> IPIV(m);
+  lapack::dgetrf_(&m, &m, &LU[0], &m, &IPIV[0], &INFO);
+  assert(INFO == 0);
+  char transn = 'n';
+  char transt = 't';
+  lapack::dgetrs_(&transn, &m, &m, &LU[0], &m, &IPIV[0],
+		  &Dinv[0], &m, &INFO);
+  assert(INFO == 0);
+
+  if (k > 0) {
+    double one  = 1.0;
+    double zero = 0.0;
+    double mone = -1.0;
+    std::vector<double> DiU(m*k), DitV(m*k), M(k*k);
+    // D^-1 U and D^-T V
+    blas::dgemm_(&transn, &transn, &m, &k, &m, &one,
+		 &Dinv[0], &m, U, &LD, &zero, &DiU[0], &m);
+    blas::dgemm_(&transt, &transn, &m, &k, &m, &one,
+		 &Dinv[0], &m, V, &LD, &zero, &DitV[0], &m);
+
+    // Dhat = (V^T D^-1 U)^-1
+    blas::dgemm_(&transt, &transn, &k, &k, &m, &one,
+		 V, &LD, &DiU[0], &m, &zero, &M[0], &k);
+    std::fill(Dhat, Dhat + k*k, 0.0);
+    for (int i=0; i<k; i++)
+      Dhat[i + i*k] = 1.0;
+    std::vector<int> P(k);
+    lapack::dgesv_(&k, &k, &M[0], &k, &P[0], Dhat, &k, &INFO);
+    assert(INFO == 0);
+
+    // E = D^-1 U Dhat, F = D^-T V Dhat^T, G = D^-1 - E (D^-T V)^T
+    blas::dgemm_(&transn, &transn, &m, &k, &k, &one,
+		 &DiU[0], &m, Dhat, &k, &zero, U, &LD);
+    blas::dgemm_(&transn, &transt, &m, &k, &k, &one,
+		 &DitV[0], &m, Dhat, &k, &zero, V, &LD);
+    blas::dgemm_(&transn, &transt, &m, &m, &k, &mone,
+		 U, &LD, &DitV[0], &m, &one, &Dinv[0], &m);
+  }
+  for (int j=0; j<m; j++)
+    memcpy(D + j*LD, &Dinv[j*m], m*sizeof(double));
+}
+
+// adds the Dhat of the children to the diagonal of D
+static void add_children_hat
+(double *X, int LD, int k, int kl, const double *Hl,
+ int kr, const double *Hr) {
+  double *D = X + 2*k*LD;
+  for (int j=0; j<kl; j++)
+    for (int i=0; i<kl; i++)
+      D[i + j*LD] += Hl[i + j*kl];
+  for (int j=0; j<kr; j++)
+    for (int i=0; i<kr; i++)
+      D[kl+i + (kl+j)*LD] += Hr[i + j*kr];
+}
+
+// bhat (k x nrhs) = F^T b
+static void solve_up
+(const double *X, int LD, int m, int k,
+ const double *b, int LDb, int nrhs, double *bhat, int LDh) {
+  if (k == 0) return;
+  char   transa = 't';
+  char   transb = 'n';
+  double one    = 1.0;
+  double zero   = 0.0;
+  blas::dgemm_(&transa, &transb, &k, &nrhs, &m, &one,
+	       (double *)X + k*LD, &LD, (double *)b, &LDb,
+	       &zero, bhat, &LDh);
+}
+
+// x (m x nrhs) = E xhat + G b; x may be b
+static void solve_down
+(const double *X, int LD, int m, int k,
+ const double *xhat, int LDh, const double *b, int LDb, int nrhs,
+ double *x, int LDx) {
+  char   trans = 'n';
+  double one   = 1.0;
+  double zero  = 0.0;
+  std::vector<double> y(m*nrhs);
+  blas::dgemm_(&trans, &trans, &m, &nrhs, &m, &one,
+	       (double *)X + 2*k*LD, &LD, (double *)b, &LDb,
+	       &zero, &y[0], &m);
+  if (k > 0)
+    blas::dgemm_(&trans, &trans, &m, &nrhs, &k, &one,
+		 (double *)X, &LD, (double *)xhat, &LDh,
+		 &one, &y[0], &m);
+  for (int j=0; j<nrhs; j++)
+    memcpy(x + j*LDx, &y[j*m], m*sizeof(double));
+}
+
+
+/* ---- legion leaf subtrees ---- */
+
+namespace {
+  // generators of a legion leaf: real leaves stacked in gen, the
+  //  other nodes packed in sub
+  struct Subtree {
+    NodeArena        arena;
+    int              root;
+    std::vector<int> offset;
+    double          *gen;
+    int              LD;
+    double          *sub;
+
+    int index(const Node *node) {return arena.index(node) - root;}
+    double *X(const Node *node, int &LDX) {
+      if (node->is_real_leaf()) {
+	LDX = LD;
+	return gen + node->row_beg;
+      } else {
+	LDX = hss_gen_rows(node);
+	return sub + offset[index(node)];
+      }
+    }
+  };
+}
+
+static void get_subtree
+(const Task *task, const std::vector<PhysicalRegion> &regions,
+ Context ctx, HighLevelRuntime *runtime, Subtree &s) {
+
+  const int *desc = (const int *)task->args;
+  assert(task->arglen == sizeof(int)*packed_tree_size(desc));
+  s.root = unpack_tree(desc, s.arena);
+  int size = hss_sub_offsets(s.arena.at(s.root), s.offset);
+
+  IndexSpace is_g = task->regions[0].region.get_index_space();
+  IndexSpace is_s = task->regions[1].region.get_index_space();
+  Rect<2> rect_g = runtime->get_index_space_domain(ctx, is_g).get_rect<2>();
+  Rect<2> rect_s = runtime->get_index_space_domain(ctx, is_s).get_rect<2>();
+
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  s.gen = regions[0].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect_g, subrect, offsets);
+  assert(rect_g == subrect);
+  s.sub = regions[1].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect_s, subrect, offsets);
+  assert(rect_s == subrect);
+  assert(size <= rect_s.dim_size(0));
+  s.LD = rect_g.dim_size(0);
+}
+
+// raw pointer and leading dimension of the i-th region
+static double *region_ptr
+(const Task *task, const std::vector<PhysicalRegion> &regions, int i,
+ Context ctx, HighLevelRuntime *runtime, int &rows, int &cols) {
+  IndexSpace is = task->regions[i].region.get_index_space();
+  Rect<2> rect = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *ptr = regions[i].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect, subrect, offsets);
+  assert(rect == subrect);
+  rows = rect.dim_size(0);
+  cols = rect.dim_size(1);
+  return ptr;
+}
+
+static void factor_subtree(Node *node, Subtree &s, std::vector<double> &hat) {
+  int k = node->ncol;
+  int m = hss_gen_rows(node);
+  int LDX;
+  double *X = s.X(node, LDX);
+  if ( ! node->is_real_leaf() ) {
+    std::vector<double> hl, hr;
+    factor_subtree(node->lchild(), s, hl);
+    factor_subtree(node->rchild(), s, hr);
+    add_children_hat(X, LDX, k, node->lchild()->ncol, &hl[0],
+		     node->rchild()->ncol, &hr[0]);
+  }
+  hat.resize(std::max(k*k, 1));
+  compress_generators(X, LDX, m, k, &hat[0]);
+}
+
+// b^ of every node; bred keeps [b^_l; b^_r] of the nodes that are
+//  not real leaves
+static void up_subtree
+(Node *node, Subtree &s, const double *b, int LDb, int nrhs,
+ std::vector< std::vector<double> > &bred, std::vector<double> &bhat) {
+  int k = node->ncol;
+  int m = hss_gen_rows(node);
+  int LDX;
+  const double *X = s.X(node, LDX);
+  bhat.resize(std::max(k*nrhs, 1));
+  if (node->is_real_leaf()) {
+    solve_up(X, LDX, m, k, b + node->row_beg, LDb, nrhs, &bhat[0], k);
+  } else {
+    std::vector<double> bl, br;
+    up_subtree(node->lchild(), s, b, LDb, nrhs, bred, bl);
+    up_subtree(node->rchild(), s, b, LDb, nrhs, bred, br);
+    int kl = node->lchild()->ncol;
+    int kr = node->rchild()->ncol;
+    std::vector<double> &r = bred[s.index(node)];
+    r.resize(m*nrhs);
+    for (int j=0; j<nrhs; j++) {
+      memcpy(&r[j*m],    &bl[j*kl], kl*sizeof(double));
+      memcpy(&r[j*m+kl], &br[j*kr], kr*sizeof(double));
+    }
+    solve_up(X, LDX, m, k, &r[0], m, nrhs, &bhat[0], k);
+  }
+}
+
+// x of the rows of the subtree from the x^ of its root
+static void down_subtree
+(Node *node, Subtree &s, const double *xhat, double *b, int LDb,
+ int nrhs, std::vector< std::vector<double> > &bred) {
+  int k = node->ncol;
+  int m = hss_gen_rows(node);
+  int LDX;
+  const double *X = s.X(node, LDX);
+  if (node->is_real_leaf()) {
+    double *x = b + node->row_beg;
+    solve_down(X, LDX, m, k, xhat, k, x, LDb, nrhs, x, LDb);
+  } else {
+    int kl = node->lchild()->ncol;
+    int kr = node->rchild()->ncol;
+    std::vector<double> xred(m*nrhs), xl(kl*nrhs), xr(kr*nrhs);
+    solve_down(X, LDX, m, k, xhat, k, &bred[s.index(node)][0], m, nrhs,
+	       &xred[0], m);
+    for (int j=0; j<nrhs; j++) {
+      memcpy(&xl[j*kl], &xred[j*m],    kl*sizeof(double));
+      memcpy(&xr[j*kr], &xred[j*m+kl], kr*sizeof(double));
+    }
+    down_subtree(node->lchild(), s, &xl[0], b, LDb, nrhs, bred);
+    down_subtree(node->rchild(), s, &xr[0], b, LDb, nrhs, bred);
+  }
+}
+
+
+/* ---- launching ---- */
+
+static void launch_leaf
+(TaskLauncher &launcher, HssMatrix::Block &blk, PrivilegeMode gen) {
+  launcher.add_region_requirement(
+    RegionRequirement(blk.gen->data, gen, EXCLUSIVE, blk.gen->data)
+    .add_field(FID_X));
+  launcher.add_region_requirement(
+    RegionRequirement(blk.sub->data, gen, EXCLUSIVE, blk.sub->data)
+    .add_field(FID_X));
+}
+
+static void add_region
+(TaskLauncher &launcher, LMatrix *matrix, PrivilegeMode mode) {
+  launcher.add_region_requirement(
+    RegionRequirement(matrix->data, mode, EXCLUSIVE, matrix->data)
+    .add_field(FID_X));
+}
+
+static void factor_tree
+(HssMatrix &H, Node *node, const Range tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  HssMatrix::Block &blk = H.block(node);
+  Future f;
+  if (node->is_legion_leaf()) {
+    std::vector<int> desc(pack_tree_size(node));
+    pack_tree(node, &desc[0]);
+    HssLeafFactorTask launcher(TaskArgument(&desc[0],
+					    sizeof(int)*desc.size()),
+			       Predicate::TRUE_PRED,
+			       0,
+			       tag.begin());
+    launch_leaf(launcher, blk, READ_WRITE);
+    if (node != H.root)
+      add_region(launcher, blk.hat, WRITE_DISCARD);
+    f = runtime->execute_task(ctx, launcher);
+  } else {
+    Range ltag = tag.lchild(node->split_fraction());
+    Range rtag = tag.rchild(node->split_fraction());
+    factor_tree(H, node->lchild(), ltag, ctx, runtime);
+    factor_tree(H, node->rchild(), rtag, ctx, runtime);
+
+    HssNodeFactorTask::TaskArgs args =
+      {node->lchild()->ncol, node->rchild()->ncol, node->ncol};
+    HssNodeFactorTask launcher(TaskArgument(&args, sizeof(args)),
+			       Predicate::TRUE_PRED,
+			       0,
+			       tag.begin());
+    add_region(launcher, blk.gen, READ_WRITE);
+    add_region(launcher, H.block(node->lchild()).hat, READ_ONLY);
+    add_region(launcher, H.block(node->rchild()).hat, READ_ONLY);
+    if (node != H.root)
+      add_region(launcher, blk.hat, WRITE_DISCARD);
+    f = runtime->execute_task(ctx, launcher);
+  }
+#ifdef SERIAL
+  f.get_void_result();
+#endif
+}
+
+static void solve_node
+(HssMatrix &H, Node *node, bool up, const Range tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  HssNodeSolveTask::TaskArgs args =
+    {node->lchild()->ncol, node->rchild()->ncol, node->ncol, up};
+  HssNodeSolveTask launcher(TaskArgument(&args, sizeof(args)),
+			    Predicate::TRUE_PRED,
+			    0,
+			    tag.begin());
+  PrivilegeMode child = up ? READ_ONLY     : READ_WRITE;
+  PrivilegeMode self  = up ? WRITE_DISCARD : READ_ONLY;
+  add_region(launcher, H.block(node).gen,           READ_ONLY);
+  add_region(launcher, H.block(node->lchild()).rhs, child);
+  add_region(launcher, H.block(node->rchild()).rhs, child);
+  if (node != H.root)
+    add_region(launcher, H.block(node).rhs, self);
+  Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+  f.get_void_result();
+#endif
+}
+
+static void solve_up_tree
+(HssMatrix &H, Node *node, const Range tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  if (node->is_legion_leaf()) {
+    if (node == H.root) return; // solved on the way down
+    HssMatrix::Block &blk = H.block(node);
+    std::vector<int> desc(pack_tree_size(node));
+    pack_tree(node, &desc[0]);
+    HssLeafUpTask launcher(TaskArgument(&desc[0],
+					sizeof(int)*desc.size()),
+			   Predicate::TRUE_PRED,
+			   0,
+			   tag.begin());
+    launch_leaf(launcher, blk, READ_ONLY);
+    add_region(launcher, blk.b,   READ_ONLY);
+    add_region(launcher, blk.rhs, WRITE_DISCARD);
+    Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+    f.get_void_result();
+#endif
+  } else {
+    Range ltag = tag.lchild(node->split_fraction());
+    Range rtag = tag.rchild(node->split_fraction());
+    solve_up_tree(H, node->lchild(), ltag, ctx, runtime);
+    solve_up_tree(H, node->rchild(), rtag, ctx, runtime);
+    solve_node(H, node, true, tag, ctx, runtime);
+  }
+}
+
+static void solve_down_tree
+(HssMatrix &H, Node *node, const Range tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  if (node->is_legion_leaf()) {
+    HssMatrix::Block &blk = H.block(node);
+    std::vector<int> desc(pack_tree_size(node));
+    pack_tree(node, &desc[0]);
+    HssLeafDownTask launcher(TaskArgument(&desc[0],
+					  sizeof(int)*desc.size()),
+			     Predicate::TRUE_PRED,
+			     0,
+			     tag.begin());
+    launch_leaf(launcher, blk, READ_ONLY);
+    add_region(launcher, blk.b, READ_WRITE);
+    if (node != H.root)
+      add_region(launcher, blk.rhs, READ_ONLY);
+    Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+    f.get_void_result();
+#endif
+  } else {
+    solve_node(H, node, false, tag, ctx, runtime);
+    Range ltag = tag.lchild(node->split_fraction());
+    Range rtag = tag.rchild(node->split_fraction());
+    solve_down_tree(H, node->lchild(), ltag, ctx, runtime);
+    solve_down_tree(H, node->rchild(), rtag, ctx, runtime);
+  }
+}
+
+void FastSolver::hss_factor
+(HssMatrix &H, const Range& procs,
+ Context ctx, HighLevelRuntime *runtime)
+{
+  Timer t; t.start();
+  factor_tree(H, H.root, procs, ctx, runtime);
+  t.stop();
+  this->time_launcher = t.get_elapsed_time();
+}
+
+void FastSolver::hss_solve
+(HssMatrix &H, const Range& procs,
+ Context ctx, HighLevelRuntime *runtime)
+{
+  Timer t; t.start();
+  solve_up_tree  (H, H.root, procs, ctx, runtime);
+  solve_down_tree(H, H.root, procs, ctx, runtime);
+  t.stop();
+  this->time_launcher += t.get_elapsed_time();
+}
+
+
+/* ---- HssLeafFactorTask implementation ---- */
+
+/*static*/
+int HssLeafFactorTask::TASKID;
+
+HssLeafFactorTask::HssLeafFactorTask(TaskArgument arg,
+				     Predicate pred /*= Predicate::TRUE_PRED*/,
+				     MapperID id /*= 0*/,
+				     MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void HssLeafFactorTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <HssLeafFactorTask::cpu_task>(AUTO_GENERATE_ID,
+				  Processor::LOC_PROC,
+				  true,
+				  true,
+				  AUTO_GENERATE_ID,
+				  TaskConfigOptions(true/*leaf*/),
+				  "hss_leaf_factor");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : hss_leaf_factor\n", TASKID);
+#endif
+}
+
+void HssLeafFactorTask::cpu_task(const Task *task,
+				 const std::vector<PhysicalRegion> &regions,
+				 Context ctx, HighLevelRuntime *runtime)
+{
+  Subtree s;
+  get_subtree(task, regions, ctx, runtime, s);
+  Node *root = s.arena.at(s.root);
+  int   k    = root->ncol;
+  assert(regions.size() == (k > 0 ? 3 : 2));
+
+  std::vector<double> hat;
+  factor_subtree(root, s, hat);
+  if (k > 0) {
+    int rows, cols;
+    double *h = region_ptr(task, regions, 2, ctx, runtime, rows, cols);
+    assert(rows == k && cols == k);
+    memcpy(h, &hat[0], k*k*sizeof(double));
+  }
+}
+
+
+/* ---- HssNodeFactorTask implementation ---- */
+
+/*static*/
+int HssNodeFactorTask::TASKID;
+
+HssNodeFactorTask::HssNodeFactorTask(TaskArgument arg,
+				     Predicate pred /*= Predicate::TRUE_PRED*/,
+				     MapperID id /*= 0*/,
+				     MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void HssNodeFactorTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <HssNodeFactorTask::cpu_task>(AUTO_GENERATE_ID,
+				  Processor::LOC_PROC,
+				  true,
+				  true,
+				  AUTO_GENERATE_ID,
+				  TaskConfigOptions(true/*leaf*/),
+				  "hss_node_factor");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : hss_node_factor\n", TASKID);
+#endif
+}
+
+void HssNodeFactorTask::cpu_task(const Task *task,
+				 const std::vector<PhysicalRegion> &regions,
+				 Context ctx, HighLevelRuntime *runtime)
+{
+  assert(task->arglen == sizeof(TaskArgs));
+  const TaskArgs *args = (const TaskArgs *)task->args;
+  int kl = args->kl, kr = args->kr, k = args->k;
+  int m  = kl + kr;
+  assert(regions.size() == (k > 0 ? 4 : 3));
+
+  int rows, cols;
+  double *X  = region_ptr(task, regions, 0, ctx, runtime, rows, cols);
+  assert(rows == m && cols == 2*k + m);
+  double *Hl = region_ptr(task, regions, 1, ctx, runtime, rows, cols);
+  assert(rows == kl && cols == kl);
+  double *Hr = region_ptr(task, regions, 2, ctx, runtime, rows, cols);
+  assert(rows == kr && cols == kr);
+
+  add_children_hat(X, m, k, kl, Hl, kr, Hr);
+  std::vector<double> hat(std::max(k*k, 1));
+  compress_generators(X, m, m, k, &hat[0]);
+  if (k > 0) {
+    double *h = region_ptr(task, regions, 3, ctx, runtime, rows, cols);
+    assert(rows == k && cols == k);
+    memcpy(h, &hat[0], k*k*sizeof(double));
+  }
+}
+
+
+/* ---- HssLeafUpTask implementation ---- */
+
+/*static*/
+int HssLeafUpTask::TASKID;
+
+HssLeafUpTask::HssLeafUpTask(TaskArgument arg,
+			     Predicate pred /*= Predicate::TRUE_PRED*/,
+			     MapperID id /*= 0*/,
+			     MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void HssLeafUpTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <HssLeafUpTask::cpu_task>(AUTO_GENERATE_ID,
+			      Processor::LOC_PROC,
+			      true,
+			      true,
+			      AUTO_GENERATE_ID,
+			      TaskConfigOptions(true/*leaf*/),
+			      "hss_leaf_up");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : hss_leaf_up\n", TASKID);
+#endif
+}
+
+void HssLeafUpTask::cpu_task(const Task *task,
+			     const std::vector<PhysicalRegion> &regions,
+			     Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 4);
+  Subtree s;
+  get_subtree(task, regions, ctx, runtime, s);
+  Node *root = s.arena.at(s.root);
+
+  int rows, nrhs, k, cols;
+  double *b    = region_ptr(task, regions, 2, ctx, runtime, rows, nrhs);
+  assert(rows == root->nrow);
+  double *bhat = region_ptr(task, regions, 3, ctx, runtime, k, cols);
+  assert(k == root->ncol && cols == nrhs);
+
+  std::vector< std::vector<double> > bred(s.offset.size());
+  std::vector<double> h;
+  up_subtree(root, s, b, rows, nrhs, bred, h);
+  memcpy(bhat, &h[0], k*nrhs*sizeof(double));
+}
+
+
+/* ---- HssLeafDownTask implementation ---- */
+
+/*static*/
+int HssLeafDownTask::TASKID;
+
+HssLeafDownTask::HssLeafDownTask(TaskArgument arg,
+				 Predicate pred /*= Predicate::TRUE_PRED*/,
+				 MapperID id /*= 0*/,
+				 MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void HssLeafDownTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <HssLeafDownTask::cpu_task>(AUTO_GENERATE_ID,
+				Processor::LOC_PROC,
+				true,
+				true,
+				AUTO_GENERATE_ID,
+				TaskConfigOptions(true/*leaf*/),
+				"hss_leaf_down");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : hss_leaf_down\n", TASKID);
+#endif
+}
+
+void HssLeafDownTask::cpu_task(const Task *task,
+			       const std::vector<PhysicalRegion> &regions,
+			       Context ctx, HighLevelRuntime *runtime)
+{
+  Subtree s;
+  get_subtree(task, regions, ctx, runtime, s);
+  Node *root = s.arena.at(s.root);
+  int   k    = root->ncol;
+  assert(regions.size() == (k > 0 ? 4 : 3));
+
+  int rows, nrhs;
+  double *b = region_ptr(task, regions, 2, ctx, runtime, rows, nrhs);
+  assert(rows == root->nrow);
+  const double *xhat = NULL;
+  if (k > 0) {
+    int kk, cols;
+    xhat = region_ptr(task, regions, 3, ctx, runtime, kk, cols);
+    assert(kk == k && cols == nrhs);
+  }
+
+  // the reduced right hand sides below are needed again
+  std::vector< std::vector<double> > bred(s.offset.size());
+  std::vector<double> h;
+  up_subtree(root, s, b, rows, nrhs, bred, h);
+  down_subtree(root, s, xhat, b, rows, nrhs, bred);
+}
+
+
+/* ---- HssNodeSolveTask implementation ---- */
+
+/*static*/
+int HssNodeSolveTask::TASKID;
+
+HssNodeSolveTask::HssNodeSolveTask(TaskArgument arg,
+				   Predicate pred /*= Predicate::TRUE_PRED*/,
+				   MapperID id /*= 0*/,
+				   MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void HssNodeSolveTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <HssNodeSolveTask::cpu_task>(AUTO_GENERATE_ID,
+				 Processor::LOC_PROC,
+				 true,
+				 true,
+				 AUTO_GENERATE_ID,
+				 TaskConfigOptions(true/*leaf*/),
+				 "hss_node_solve");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : hss_node_solve\n", TASKID);
+#endif
+}
+
+void HssNodeSolveTask::cpu_task(const Task *task,
+				const std::vector<PhysicalRegion> &regions,
+				Context ctx, HighLevelRuntime *runtime)
+{
+  assert(task->arglen == sizeof(TaskArgs));
+  const TaskArgs *args = (const TaskArgs *)task->args;
+  int kl = args->kl, kr = args->kr, k = args->k;
+  int m  = kl + kr;
+  assert(regions.size() == (k > 0 ? 4 : 3));
+
+  int rows, cols, nrhs;
+  double *X  = region_ptr(task, regions, 0, ctx, runtime, rows, cols);
+  assert(rows == m && cols == 2*k + m);
+  double *bl = region_ptr(task, regions, 1, ctx, runtime, rows, nrhs);
+  assert(rows == kl);
+  double *br = region_ptr(task, regions, 2, ctx, runtime, rows, cols);
+  assert(rows == kr && cols == nrhs);
+  double *h  = NULL;
+  if (k > 0) {
+    h = region_ptr(task, regions, 3, ctx, runtime, rows, cols);
+    assert(rows == k && cols == nrhs);
+  }
+
+  std::vector<double> bred(m*nrhs);
+  for (int j=0; j<nrhs; j++) {
+    memcpy(&bred[j*m],    bl + j*kl, kl*sizeof(double));
+    memcpy(&bred[j*m+kl], br + j*kr, kr*sizeof(double));
+  }
+  if (args->up) {
+    solve_up(X, m, m, k, &bred[0], m, nrhs, h, k);
+  } else {
+    std::vector<double> xred(m*nrhs);
+    solve_down(X, m, m, k, h, k, &bred[0], m, nrhs, &xred[0], m);
+    for (int j=0; j<nrhs; j++) {
+      memcpy(bl + j*kl, &xred[j*m],    kl*sizeof(double));
+      memcpy(br + j*kr, &xred[j*m+kl], kr*sizeof(double));
+    }
+  }
+}
@@ -0,0 +1,282 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "krylov.h"
+#include "gemm.h"
+#include "solver_tasks.h"
+
+HodlrPreconditioner::HodlrPreconditioner
+(HodlrMatrix &M_, const Range &procs_,
+ Context ctx, HighLevelRuntime *runtime, int jacobiLevel)
+  : M(M_), procs(procs_), nApply(0), tApply(0) {
+  assert(M.get_num_rhs() >= 1);
+  solver.set_jacobi_level(jacobiLevel);
+  solver.keep_factors(true);
+  solver.bfs_solve(M, procs, ctx, runtime);
+}
+
+void HodlrPreconditioner::apply
+(const double *r, double *z, Context ctx, HighLevelRuntime *runtime) {
+  Timer t; t.start();
+  int N = size();
+  M.set_rhs(r, N, Range(1), ctx, runtime);
+  solver.resolve(M.uroot, M.vroot, M.uroot, Range(1), procs, false,
+		 ctx, runtime);
+  M.get_solution(z, N, Range(1), ctx, runtime);
+  t.stop();
+  tApply += t.get_elapsed_time();
+  nApply++;
+}
+
+// y0 = A00 x0 + u0 (V1^T x1) and y1 = A11 x1 + u1 (V0^T x0), with x
+//  in the first and y in the second column of the vector tree
+static void matvec
+(const Node *unode, const Node *vnode, const Node *xy,
+ const Range mappingTag, Context ctx, HighLevelRuntime *runtime) {
+
+  if (unode->is_legion_leaf()) {
+    matvec_legion_leaf(unode, vnode, xy, Range(0, 1), Range(1, 1),
+		       mappingTag, ctx, runtime);
+    return;
+  }
+
+  const Node *b0 = unode->lchild(), *t0 = xy->lchild();
+  const Node *b1 = unode->rchild(), *t1 = xy->rchild();
+  const Node *V0 = vnode->lchild(), *V1 = vnode->rchild();
+  const Range tag0 = mappingTag.lchild(unode->split_fraction());
+  const Range tag1 = mappingTag.rchild(unode->split_fraction());
+  matvec(b0, V0, t0, tag0, ctx, runtime);
+  matvec(b1, V1, t1, tag1, ctx, runtime);
+
+  LMatrix *V0Tx0 = 0, *V1Tx1 = 0;
+  double tCreate = 0;
+  gemm_reduce(1., V0->Hmat(), t0, Range(0, 1), 0., V0Tx0, tag0,
+	      tCreate, ctx, runtime);
+  gemm_reduce(1., V1->Hmat(), t1, Range(0, 1), 0., V1Tx1, tag1,
+	      tCreate, ctx, runtime);
+  gemm_broadcast(1., b0, Range(b0->col_beg, b0->ncol), V1Tx1,
+		 1., t0, Range(1, 1), tag0, ctx, runtime);
+  gemm_broadcast(1., b1, Range(b1->col_beg, b1->ncol), V0Tx0,
+		 1., t1, Range(1, 1), tag1, ctx, runtime);
+  destroy_matrix(V0Tx0, ctx, runtime);
+  destroy_matrix(V1Tx1, ctx, runtime);
+}
+
+HodlrOperator::HodlrOperator
+(const HodlrMatrix &A_, const Range &procs_,
+ Context ctx, HighLevelRuntime *runtime)
+  : A(A_), procs(procs_) {
+  A.create_vectors(xy, 2, ctx, runtime);
+}
+
+void HodlrOperator::destroy(Context ctx, HighLevelRuntime *runtime) {
+  A.destroy_vectors(xy, ctx, runtime);
+}
+
+void HodlrOperator::apply
+(const double *x, double *y, Context ctx, HighLevelRuntime *runtime) {
+  A.set_vector(xy, 0, x, ctx, runtime);
+  matvec(A.uroot, A.vroot, xy.at(0), procs, ctx, runtime);
+  A.get_vector(xy, 1, y, ctx, runtime);
+}
+
+namespace {
+  // A for the Krylov solvers, a matvec or an HodlrOperator
+  struct Operator {
+    MatvecFunc     f;
+    HodlrOperator *h;
+    void apply(const double *x, double *y,
+	       Context ctx, HighLevelRuntime *runtime) const {
+      if (h != NULL)
+	h->apply(x, y, ctx, runtime);
+      else
+	f(false, 1, x, y);
+    }
+  };
+}
+
+static double dot(int N, const double *x, const double *y) {
+  double s = 0;
+  for (int i=0; i<N; i++)
+    s += x[i]*y[i];
+  return s;
+}
+
+static double norm(int N, const double *x) {
+  return sqrt(dot(N, x, x));
+}
+
+// z = M^-1 r
+static void precondition
+(HodlrPreconditioner *M, int N, const double *r, double *z,
+ Context ctx, HighLevelRuntime *runtime) {
+  if (M == NULL)
+    memcpy(z, r, N*sizeof(double));
+  else
+    M->apply(r, z, ctx, runtime);
+}
+
+// r = b - A x
+static void residual
+(const Operator &A, int N, const double *b, const double *x, double *r,
+ Context ctx, HighLevelRuntime *runtime) {
+  A.apply(x, r, ctx, runtime);
+  for (int i=0; i<N; i++)
+    r[i] = b[i] - r[i];
+}
+
+static int gmres
+(const Operator &A, HodlrPreconditioner *M, int N, const double *b,
+ double *x, int restart, int maxit, double tol,
+ Context ctx, HighLevelRuntime *runtime, double *relres) {
+
+  assert(restart > 0);
+  assert(M == NULL || M->size() == N);
+  int m = restart;
+  std::vector<double> V(N*(m+1)), H((m+1)*m), g(m+1), cs(m), sn(m);
+  std::vector<double> r(N), z(N), y(m);
+
+  double bnorm = norm(N, b);
+  if (bnorm == 0) bnorm = 1;
+  int  it        = 0;
+  bool converged = false;
+  while (it < maxit && ! converged) {
+    residual(A, N, b, x, &r[0], ctx, runtime);
+    double beta = norm(N, &r[0]);
+    if (beta <= tol*bnorm) break;
+    for (int i=0; i<N; i++)
+      V[i] = r[i] / beta;
+    g.assign(m+1, 0.0);
+    g[0] = beta;
+
+    // Arnoldi on A M^-1 with modified Gram-Schmidt
+    int k = 0; // size of the Krylov basis
+    while (k < m && it < maxit && ! converged) {
+      double *w = &V[N*(k+1)];
+      precondition(M, N, &V[N*k], &z[0], ctx, runtime);
+      A.apply(&z[0], w, ctx, runtime);
+      it++;
+      double *h = &H[(m+1)*k];
+      for (int i=0; i<=k; i++) {
+	h[i] = dot(N, w, &V[N*i]);
+	for (int l=0; l<N; l++)
+	  w[l] -= h[i] * V[N*i+l];
+      }
+      h[k+1] = norm(N, w);
+      if (h[k+1] > 0)
+	for (int l=0; l<N; l++)
+	  w[l] /= h[k+1];
+
+      // least squares by Givens rotations
+      for (int i=0; i<k; i++) {
+	double t = cs[i]*h[i] + sn[i]*h[i+1];
+	h[i+1]   = -sn[i]*h[i] + cs[i]*h[i+1];
+	h[i]     = t;
+      }
+      double d = sqrt(h[k]*h[k] + h[k+1]*h[k+1]);
+      cs[k] = d > 0 ? h[k]/d   : 1.0;
+      sn[k] = d > 0 ? h[k+1]/d : 0.0;
+      h[k]   = d;
+      h[k+1] = 0;
+      g[k+1] = -sn[k]*g[k];
+      g[k]   =  cs[k]*g[k];
+      k++;
+      // a zero subdiagonal means the solution is in the basis
+      converged = fabs(g[k]) <= tol*bnorm || d == 0;
+    }
+
+    // x += M^-1 V y with H y = g
+    for (int i=k-1; i>=0; i--) {
+      double s = g[i];
+      for (int j=i+1; j<k; j++)
+	s -= H[(m+1)*j+i] * y[j];
+      y[i] = H[(m+1)*i+i] != 0 ? s / H[(m+1)*i+i] : 0;
+    }
+    for (int l=0; l<N; l++) {
+      r[l] = 0;
+      for (int j=0; j<k; j++)
+	r[l] += V[N*j+l] * y[j];
+    }
+    precondition(M, N, &r[0], &z[0], ctx, runtime);
+    for (int l=0; l<N; l++)
+      x[l] += z[l];
+  }
+
+  if (relres != NULL) {
+    residual(A, N, b, x, &r[0], ctx, runtime);
+    *relres = norm(N, &r[0]) / bnorm;
+  }
+  return it;
+}
+
+static int pcg
+(const Operator &A, HodlrPreconditioner *M, int N, const double *b,
+ double *x, int maxit, double tol,
+ Context ctx, HighLevelRuntime *runtime, double *relres) {
+
+  assert(M == NULL || M->size() == N);
+  std::vector<double> r(N), z(N), p(N), q(N);
+  double bnorm = norm(N, b);
+  if (bnorm == 0) bnorm = 1;
+
+  residual(A, N, b, x, &r[0], ctx, runtime);
+  precondition(M, N, &r[0], &z[0], ctx, runtime);
+  p = z;
+  double rz = dot(N, &r[0], &z[0]);
+  int it = 0;
+  while (it < maxit && norm(N, &r[0]) > tol*bnorm) {
+    A.apply(&p[0], &q[0], ctx, runtime);
+    it++;
+    double alpha = rz / dot(N, &p[0], &q[0]);
+    for (int i=0; i<N; i++) {
+      x[i] += alpha * p[i];
+      r[i] -= alpha * q[i];
+    }
+    precondition(M, N, &r[0], &z[0], ctx, runtime);
+    double rz_new = dot(N, &r[0], &z[0]);
+    double beta   = rz_new / rz;
+    rz = rz_new;
+    for (int i=0; i<N; i++)
+      p[i] = z[i] + beta * p[i];
+  }
+
+  if (relres != NULL)
+    *relres = norm(N, &r[0]) / bnorm;
+  return it;
+}
+
+int gmres
+(MatvecFunc A, HodlrPreconditioner *M, int N, const double *b,
+ double *x, int restart, int maxit, double tol,
+ Context ctx, HighLevelRuntime *runtime, double *relres) {
+  Operator op = {A, NULL};
+  return gmres(op, M, N, b, x, restart, maxit, tol, ctx, runtime,
+	       relres);
+}
+
+int gmres
+(HodlrOperator &A, HodlrPreconditioner *M, const double *b,
+ double *x, int restart, int maxit, double tol,
+ Context ctx, HighLevelRuntime *runtime, double *relres) {
+  Operator op = {NULL, &A};
+  return gmres(op, M, A.size(), b, x, restart, maxit, tol,
+	       ctx, runtime, relres);
+}
+
+int pcg
+(MatvecFunc A, HodlrPreconditioner *M, int N, const double *b,
+ double *x, int maxit, double tol,
+ Context ctx, HighLevelRuntime *runtime, double *relres) {
+  Operator op = {A, NULL};
+  return pcg(op, M, N, b, x, maxit, tol, ctx, runtime, relres);
+}
+
+int pcg
+(HodlrOperator &A, HodlrPreconditioner *M, const double *b,
+ double *x, int maxit, double tol,
+ Context ctx, HighLevelRuntime *runtime, double *relres) {
+  Operator op = {NULL, &A};
+  return pcg(op, M, A.size(), b, x, maxit, tol, ctx, runtime, relres);
+}
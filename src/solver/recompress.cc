@@ -0,0 +1,930 @@
+#include "recompress.h"
+#include "gemm.h"
+#include "node.h"
+#include "lapack_blas.h"
+#include "macros.h"
+
+#include <algorithm>
+#include <map>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+namespace {
+
+  // transforms of one block pair from the Gram matrices of both
+  //  sides; returns the new rank
+  class TruncateTask : public TaskLauncher {
+  public:
+    struct TaskArgs {
+      double tol;
+    };
+
+    TruncateTask(TaskArgument arg,
+		 Predicate pred = Predicate::TRUE_PRED,
+		 MapperID id = 0,
+		 MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static int cpu_task(const Task *task,
+			const std::vector<PhysicalRegion> &regions,
+			Context ctx, HighLevelRuntime *runtime);
+  };
+
+  // X(:, col_beg+[0, ncol)) *= T(:, t_col+[0, ncol))
+  class ApplyBasisTask : public TaskLauncher {
+  public:
+    struct TaskArgs {
+      int col_beg;
+      int ncol;
+      int t_col;
+    };
+
+    ApplyBasisTask(TaskArgument arg,
+		   Predicate pred = Predicate::TRUE_PRED,
+		   MapperID id = 0,
+		   MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+
+  // ranks of the nodes of a packed subtree, in the packed order
+  class RankList {
+  public:
+    size_t legion_buffer_size(void) const;
+    size_t legion_serialize(void *buffer) const;
+    size_t legion_deserialize(const void *buffer);
+  public:
+    std::vector<int> ranks;
+  };
+
+  // truncates all blocks below a legion leaf
+  class LeafRecompressTask : public TaskLauncher {
+  public:
+    // followed by the packed V and U subtrees
+    struct TaskArgs {
+      double tol;
+    };
+
+    LeafRecompressTask(TaskArgument arg,
+		       Predicate pred = Predicate::TRUE_PRED,
+		       MapperID id = 0,
+		       MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static RankList cpu_task(const Task *task,
+			     const std::vector<PhysicalRegion> &regions,
+			     Context ctx, HighLevelRuntime *runtime);
+  };
+
+  // copies column blocks of a region into a new one
+  class CompactTask : public TaskLauncher {
+  public:
+    // followed by (old col_beg, new col_beg, ncol) of every block
+    struct TaskArgs {
+      int nblock;
+    };
+
+    CompactTask(TaskArgument arg,
+		Predicate pred = Predicate::TRUE_PRED,
+		MapperID id = 0,
+		MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+}
+
+void register_recompress_tasks() {
+  TruncateTask::register_tasks();
+  ApplyBasisTask::register_tasks();
+  LeafRecompressTask::register_tasks();
+  CompactTask::register_tasks();
+}
+
+
+/* ---- dense kernels ---- */
+
+// factors the Gram matrix G = Q * diag(w) * Q^T (destroyed) as
+//  R^T * R with R = diag(sqrt(w)) * Q^T, and forms the pseudo
+//  inverse Rinv = Q * diag(1/sqrt(w)). tiny eigenvalues are zero.
+static void gram_factor(double *G, int k, double *R, double *Rinv) {
+
+  char jobz = 'V';
+  char uplo = 'U';
+  int  info;
+  int  lwork = -1;
+  double query;
+  std::vector<double> w(k);
+  lapack::dsyev_(&jobz, &uplo, &k, G, &k, &w[0],
+		 &query, &lwork, &info);
+  lwork = (int)query;
+  std::vector<double> work(lwork);
+  lapack::dsyev_(&jobz, &uplo, &k, G, &k, &w[0],
+		 &work[0], &lwork, &info);
+  assert(info == 0);
+
+  double cut = 1e-14 * std::max(w[k-1], 0.0); // ascending order
+  for (int j=0; j<k; j++) {
+    double s = (w[j] > cut) ? sqrt(w[j]) : 0.0;
+    for (int i=0; i<k; i++) {
+      R   [j + i*k] = s * G[i + j*k];
+      Rinv[i + j*k] = (s > 0) ? G[i + j*k] / s : 0.0;
+    }
+  }
+}
+
+// for a block u * v^T of rank k with Gram matrices Gu = u^T u and
+//  Gv = v^T v (both destroyed), computes Tu and Tv (k x k) such that
+//  (u*Tu) * (v*Tv)^T is its truncated SVD. columns past the returned
+//  rank are zero.
+static int truncate_pair
+(double *Gu, double *Gv, int k, double tol, double *Tu, double *Tv) {
+
+  std::vector<double> Ru(k*k), Rv(k*k), RuInv(k*k), RvInv(k*k);
+  gram_factor(Gu, k, &Ru[0], &RuInv[0]);
+  gram_factor(Gv, k, &Rv[0], &RvInv[0]);
+
+  // core matrix Ru * Rv^T = W * diag(s) * Z^T
+  char   transn = 'n';
+  char   transt = 't';
+  double one    = 1.0;
+  double zero   = 0.0;
+  std::vector<double> C(k*k), W(k*k), ZT(k*k), s(k);
+  blas::dgemm_(&transn, &transt, &k, &k, &k, &one,
+	       &Ru[0], &k, &Rv[0], &k, &zero, &C[0], &k);
+
+  char jobu = 'A';
+  char jobvt = 'A';
+  int  info;
+  int  lwork = -1;
+  double query;
+  lapack::dgesvd_(&jobu, &jobvt, &k, &k, &C[0], &k, &s[0],
+		  &W[0], &k, &ZT[0], &k, &query, &lwork, &info);
+  lwork = (int)query;
+  std::vector<double> work(lwork);
+  lapack::dgesvd_(&jobu, &jobvt, &k, &k, &C[0], &k, &s[0],
+		  &W[0], &k, &ZT[0], &k, &work[0], &lwork, &info);
+  assert(info == 0);
+
+  // keep at least one column so that no block becomes empty
+  int r = 1;
+  while (r < k && s[r] > tol * s[0])
+    r++;
+
+  // Tu = Ru^+ * W(:, 1:r) * diag(s), Tv = Rv^+ * Z(:, 1:r)
+  for (int j=0; j<r; j++)
+    for (int i=0; i<k; i++)
+      W[i + j*k] *= s[j];
+  std::fill(Tu, Tu + k*k, 0.0);
+  std::fill(Tv, Tv + k*k, 0.0);
+  blas::dgemm_(&transn, &transn, &k, &r, &k, &one,
+	       &RuInv[0], &k, &W[0], &k, &zero, Tu, &k);
+  blas::dgemm_(&transn, &transt, &k, &r, &k, &one,
+	       &RvInv[0], &k, &ZT[0], &k, &zero, Tv, &k);
+  return r;
+}
+
+// X (m x k) = X * T in place
+static void apply_transform
+(double *X, int m, int LD, int k, double *T, int LDT) {
+
+  char   trans = 'n';
+  double one   = 1.0;
+  double zero  = 0.0;
+  std::vector<double> Y(m*k);
+  blas::dgemm_(&trans, &trans, &m, &k, &k, &one,
+	       X, &LD, T, &LDT, &zero, &Y[0], &m);
+  for (int j=0; j<k; j++)
+    memcpy(X + j*LD, &Y[j*m], m*sizeof(double));
+}
+
+// X^T * X of an m x k block
+static void gram_matrix(double *X, int m, int LD, int k, double *G) {
+  char   transa = 't';
+  char   transb = 'n';
+  double one    = 1.0;
+  double zero   = 0.0;
+  blas::dgemm_(&transa, &transb, &k, &k, &m, &one,
+	       X, &LD, X, &LD, &zero, G, &k);
+}
+
+// A01 = u0 * V1^T and A10 = u1 * V0^T of every node in the subtree;
+//  the unpacked ranks are updated.
+static void recompress_subtree
+(double tol, Node *unode, Node *vnode,
+ double *u_ptr, double *v_ptr, int LD) {
+
+  if (unode->is_real_leaf())
+    return;
+
+  for (int b=0; b<2; b++) {
+    Node *u = (b == 0) ? unode->lchild() : unode->rchild();
+    Node *v = (b == 0) ? vnode->rchild() : vnode->lchild();
+    int   r = u->ncol;
+    assert(v->ncol == r);
+    if (r == 0) continue;
+
+    double *U = u_ptr + u->row_beg + u->col_beg*LD;
+    double *V = v_ptr + v->row_beg + v->col_beg*LD;
+    std::vector<double> Gu(r*r), Gv(r*r), T(2*r*r);
+    gram_matrix(U, u->nrow, LD, r, &Gu[0]);
+    gram_matrix(V, v->nrow, LD, r, &Gv[0]);
+    int rnew = truncate_pair(&Gu[0], &Gv[0], r, tol, &T[0], &T[r*r]);
+    apply_transform(U, u->nrow, LD, r, &T[0],   r);
+    apply_transform(V, v->nrow, LD, r, &T[r*r], r);
+    u->ncol = rnew;
+    v->ncol = rnew;
+  }
+
+  recompress_subtree(tol, unode->lchild(), vnode->lchild(),
+		     u_ptr, v_ptr, LD);
+  recompress_subtree(tol, unode->rchild(), vnode->rchild(),
+		     u_ptr, v_ptr, LD);
+}
+
+
+/* ---- launching ---- */
+
+namespace {
+  // rank of a block above the legion leaves, known when f is ready
+  struct PendingBlock {
+    Node  *u;
+    Node  *v;
+    Future f;
+  };
+  // ranks of a subtree below a legion leaf
+  struct PendingLeaf {
+    Node  *u;
+    Node  *v;
+    Future f;
+  };
+  // a column block moved by compaction
+  struct Block {
+    int old_beg;
+    int new_beg;
+    int ncol;
+  };
+}
+
+static void apply_basis
+(Node *node, int col_beg, int ncol, LMatrix *T, int t_col,
+ const Range tag, Context ctx, HighLevelRuntime *runtime) {
+
+  if (node->is_legion_leaf()) {
+    ApplyBasisTask::TaskArgs args = {col_beg, ncol, t_col};
+    ApplyBasisTask launcher(TaskArgument(&args, sizeof(args)),
+			    Predicate::TRUE_PRED,
+			    0,
+			    tag.begin());
+    launcher.add_region_requirement(
+      RegionRequirement(node->lowrank_matrix->data,
+			READ_WRITE,
+			EXCLUSIVE,
+			node->lowrank_matrix->data)
+      .add_field(FID_X));
+    launcher.add_region_requirement(
+      RegionRequirement(T->data,
+			READ_ONLY,
+			EXCLUSIVE,
+			T->data)
+      .add_field(FID_X));
+    Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+    f.get_void_result();
+#endif
+  } else {
+    const Range tag0 = tag.lchild(node->split_fraction());
+    const Range tag1 = tag.rchild(node->split_fraction());
+    apply_basis(node->lchild(), col_beg, ncol, T, t_col, tag0,
+		ctx, runtime);
+    apply_basis(node->rchild(), col_beg, ncol, T, t_col, tag1,
+		ctx, runtime);
+  }
+}
+
+// the block u * v^T, where u is the U node and v the V node of
+//  the sibling
+static void truncate_block
+(Node *u, Node *v, double tol, const Range tag,
+ std::vector<PendingBlock> &pending,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  int r = u->ncol;
+  assert(v->ncol == r);
+  if (r == 0) return;
+
+  Node  *H = v->Hmat();
+  double tCreate = 0;
+  LMatrix *Gu = 0;
+  LMatrix *Gv = 0;
+  LMatrix *T  = 0;
+  Range ru(u->col_beg, r);
+  gemm_reduce(1., u, ru,       u, ru,       0., Gu, tag, tCreate,
+	      ctx, runtime);
+  gemm_reduce(1., H, Range(r), H, Range(r), 0., Gv, tag, tCreate,
+	      ctx, runtime);
+  create_matrix(T, r, 2*r, ctx, runtime); // [Tu, Tv]
+
+  TruncateTask::TaskArgs args = {tol};
+  TruncateTask launcher(TaskArgument(&args, sizeof(args)),
+			Predicate::TRUE_PRED,
+			0,
+			tag.begin());
+  launcher.add_region_requirement(
+    RegionRequirement(Gu->data, READ_ONLY, EXCLUSIVE, Gu->data)
+    .add_field(FID_X));
+  launcher.add_region_requirement(
+    RegionRequirement(Gv->data, READ_ONLY, EXCLUSIVE, Gv->data)
+    .add_field(FID_X));
+  launcher.add_region_requirement(
+    RegionRequirement(T->data, WRITE_DISCARD, EXCLUSIVE, T->data)
+    .add_field(FID_X));
+  PendingBlock p = {u, v, runtime->execute_task(ctx, launcher)};
+  pending.push_back(p);
+
+  apply_basis(u, u->col_beg, r, T, 0, tag, ctx, runtime);
+  apply_basis(H, 0,          r, T, r, tag, ctx, runtime);
+
+  destroy_matrix(Gu, ctx, runtime);
+  destroy_matrix(Gv, ctx, runtime);
+  destroy_matrix(T,  ctx, runtime);
+}
+
+static void recompress_legion_leaf
+(Node *uleaf, Node *vleaf, double tol, const Range tag,
+ std::vector<PendingLeaf> &pending,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  if (uleaf->is_real_leaf()) return; // no block below
+
+  typedef LeafRecompressTask LRT;
+  LRT::TaskArgs args = {tol};
+  int vsize = pack_tree_size(vleaf);
+  int usize = pack_tree_size(uleaf);
+  int size  = sizeof(args) + sizeof(int)*(vsize + usize);
+  std::vector<char> buf(size);
+  memcpy(&buf[0], &args, sizeof(args));
+  int *desc = (int *)&buf[sizeof(args)];
+  pack_tree(vleaf, desc);
+  pack_tree(uleaf, desc + vsize);
+
+  LRT launcher(TaskArgument(&buf[0], size),
+	       Predicate::TRUE_PRED,
+	       0,
+	       tag.begin());
+  launcher.add_region_requirement(
+    RegionRequirement(uleaf->lowrank_matrix->data,
+		      READ_WRITE,
+		      EXCLUSIVE,
+		      uleaf->lowrank_matrix->data)
+    .add_field(FID_X));
+  launcher.add_region_requirement(
+    RegionRequirement(vleaf->lowrank_matrix->data,
+		      READ_WRITE,
+		      EXCLUSIVE,
+		      vleaf->lowrank_matrix->data)
+    .add_field(FID_X));
+  PendingLeaf p = {uleaf, vleaf, runtime->execute_task(ctx, launcher)};
+  pending.push_back(p);
+}
+
+static void recompress_tree
+(Node *unode, Node *vnode, double tol, const Range tag,
+ std::vector<PendingBlock> &blocks, std::vector<PendingLeaf> &leaves,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  if (unode->is_legion_leaf()) {
+    assert(vnode->is_legion_leaf());
+    recompress_legion_leaf(unode, vnode, tol, tag, leaves,
+			   ctx, runtime);
+    return;
+  }
+
+  const Range tag0 = tag.lchild(unode->split_fraction());
+  const Range tag1 = tag.rchild(unode->split_fraction());
+  truncate_block(unode->lchild(), vnode->rchild(), tol, tag0, blocks,
+		 ctx, runtime);
+  truncate_block(unode->rchild(), vnode->lchild(), tol, tag1, blocks,
+		 ctx, runtime);
+  recompress_tree(unode->lchild(), vnode->lchild(), tol, tag0,
+		  blocks, leaves, ctx, runtime);
+  recompress_tree(unode->rchild(), vnode->rchild(), tol, tag1,
+		  blocks, leaves, ctx, runtime);
+}
+
+
+/* ---- new ranks and column layout ---- */
+
+static void set_Hmat_rank(Node *H, int r) {
+  H->ncol = r;
+  if ( ! H->is_real_leaf() ) {
+    set_Hmat_rank(H->lchild(), r);
+    set_Hmat_rank(H->rchild(), r);
+  }
+}
+
+// V ranks below a legion leaf mirror the U ranks
+static void mirror_ranks(const Node *unode, Node *vnode) {
+  if (unode->is_real_leaf()) return;
+  vnode->lchild()->ncol = unode->rchild()->ncol;
+  vnode->rchild()->ncol = unode->lchild()->ncol;
+  mirror_ranks(unode->lchild(), vnode->lchild());
+  mirror_ranks(unode->rchild(), vnode->rchild());
+}
+
+static void save_col_beg
+(const Node *node, std::map<const Node *, int> &beg) {
+  beg[node] = node->col_beg;
+  if ( ! node->is_real_leaf() ) {
+    save_col_beg(node->lchild(), beg);
+    save_col_beg(node->rchild(), beg);
+  }
+}
+
+// the same layout as create_tree(): u columns of a node follow
+//  those of its parent
+static void set_U_col_beg(Node *node) {
+  if (node->is_real_leaf()) return;
+  node->lchild()->col_beg = node->col_beg + node->ncol;
+  node->rchild()->col_beg = node->col_beg + node->ncol;
+  set_U_col_beg(node->lchild());
+  set_U_col_beg(node->rchild());
+}
+
+// V columns are counted from the children of the legion leaf
+static void set_V_col_beg(Node *node, bool top) {
+  if (node->is_real_leaf()) return;
+  int beg = top ? 0 : node->col_beg + node->ncol;
+  node->lchild()->col_beg = beg;
+  node->rchild()->col_beg = beg;
+  set_V_col_beg(node->lchild(), false);
+  set_V_col_beg(node->rchild(), false);
+}
+
+static void set_V_layout(Node *vnode) {
+  if (vnode->is_legion_leaf()) {
+    set_V_col_beg(vnode, true);
+  } else {
+    set_V_layout(vnode->lchild());
+    set_V_layout(vnode->rchild());
+  }
+}
+
+static void subtree_blocks
+(const Node *node, const std::map<const Node *, int> &beg,
+ std::vector<Block> &blocks) {
+  if (node->is_real_leaf()) return;
+  for (int b=0; b<2; b++) {
+    const Node *c = (b == 0) ? node->lchild() : node->rchild();
+    Block blk = {beg.find(c)->second, c->col_beg, c->ncol};
+    blocks.push_back(blk);
+    subtree_blocks(c, beg, blocks);
+  }
+}
+
+// moves the blocks into a new region of ncol columns
+static void compact_matrix
+(LMatrix *(&matrix), int ncol, const std::vector<Block> &blocks,
+ const Range tag, Context ctx, HighLevelRuntime *runtime) {
+
+  LMatrix *old = matrix;
+  matrix = 0;
+  create_matrix(matrix, old->rows, ncol, ctx, runtime);
+
+  CompactTask::TaskArgs args = {(int)blocks.size()};
+  int size = sizeof(args) + sizeof(Block)*blocks.size();
+  std::vector<char> buf(size);
+  memcpy(&buf[0], &args, sizeof(args));
+  if ( ! blocks.empty() )
+    memcpy(&buf[sizeof(args)], &blocks[0], sizeof(Block)*blocks.size());
+
+  CompactTask launcher(TaskArgument(&buf[0], size),
+		       Predicate::TRUE_PRED,
+		       0,
+		       tag.begin());
+  launcher.add_region_requirement(
+    RegionRequirement(old->data, READ_ONLY, EXCLUSIVE, old->data)
+    .add_field(FID_X));
+  launcher.add_region_requirement(
+    RegionRequirement(matrix->data, WRITE_DISCARD, EXCLUSIVE,
+		      matrix->data)
+    .add_field(FID_X));
+  Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+  f.get_void_result();
+#endif
+  destroy_matrix(old, ctx, runtime);
+}
+
+static void compact_U
+(Node *unode, std::vector<Block> path,
+ const std::map<const Node *, int> &beg, const Range tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  Block self = {beg.find(unode)->second, unode->col_beg, unode->ncol};
+  path.push_back(self);
+
+  if (unode->is_legion_leaf()) {
+    subtree_blocks(unode, beg, path);
+    int ncol = unode->col_beg + count_matrix_column(unode);
+    compact_matrix(unode->lowrank_matrix, ncol, path, tag,
+		   ctx, runtime);
+  } else {
+    const Range tag0 = tag.lchild(unode->split_fraction());
+    const Range tag1 = tag.rchild(unode->split_fraction());
+    compact_U(unode->lchild(), path, beg, tag0, ctx, runtime);
+    compact_U(unode->rchild(), path, beg, tag1, ctx, runtime);
+  }
+}
+
+static void compact_Hmat
+(Node *H, const Range tag, Context ctx, HighLevelRuntime *runtime) {
+  if (H->is_legion_leaf()) {
+    std::vector<Block> blocks(1);
+    Block blk = {0, 0, H->ncol};
+    blocks[0] = blk;
+    compact_matrix(H->lowrank_matrix, H->ncol, blocks, tag,
+		   ctx, runtime);
+  } else {
+    const Range tag0 = tag.lchild(H->split_fraction());
+    const Range tag1 = tag.rchild(H->split_fraction());
+    compact_Hmat(H->lchild(), tag0, ctx, runtime);
+    compact_Hmat(H->rchild(), tag1, ctx, runtime);
+  }
+}
+
+static void compact_V
+(Node *vnode, const std::map<const Node *, int> &beg, const Range tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  if (vnode->is_legion_leaf()) {
+    if (vnode->is_real_leaf()) return; // no V columns
+    std::vector<Block> blocks;
+    subtree_blocks(vnode, beg, blocks);
+    int ncol = count_matrix_column(vnode) - vnode->ncol;
+    compact_matrix(vnode->lowrank_matrix, ncol, blocks, tag,
+		   ctx, runtime);
+  } else {
+    const Range tag0 = tag.lchild(vnode->split_fraction());
+    const Range tag1 = tag.rchild(vnode->split_fraction());
+    compact_Hmat(vnode->lchild()->Hmat(), tag0, ctx, runtime);
+    compact_Hmat(vnode->rchild()->Hmat(), tag1, ctx, runtime);
+    compact_V(vnode->lchild(), beg, tag0, ctx, runtime);
+    compact_V(vnode->rchild(), beg, tag1, ctx, runtime);
+  }
+}
+
+int recompress(HodlrMatrix &matrix, double tol, const Range &tag,
+	       Context ctx, HighLevelRuntime *runtime) {
+
+  Node *uroot = matrix.uroot;
+  Node *vroot = matrix.vroot;
+  assert(uroot != NULL && vroot != NULL);
+
+  std::vector<PendingBlock> blocks;
+  std::vector<PendingLeaf>  leaves;
+  recompress_tree(uroot, vroot, tol, tag, blocks, leaves,
+		  ctx, runtime);
+
+  // the column layout depends on all the new ranks
+  int removed = 0;
+  for (size_t i=0; i<blocks.size(); i++) {
+    int r = blocks[i].f.get_result<int>();
+    removed += blocks[i].u->ncol - r;
+    blocks[i].u->ncol = r;
+    blocks[i].v->ncol = r;
+    set_Hmat_rank(blocks[i].v->Hmat(), r);
+  }
+  for (size_t i=0; i<leaves.size(); i++) {
+    RankList list = leaves[i].f.get_result<RankList>();
+    // the same breadth first order as pack_tree()
+    std::vector<Node *> queue(1, leaves[i].u);
+    for (size_t q=0; q<queue.size(); q++) {
+      Node *node = queue[q];
+      if (q > 0) {
+	removed   += node->ncol - list.ranks[q];
+	node->ncol = list.ranks[q];
+      }
+      if ( ! node->is_real_leaf() ) {
+	queue.push_back(node->lchild());
+	queue.push_back(node->rchild());
+      }
+    }
+    assert(queue.size() == list.ranks.size());
+    mirror_ranks(leaves[i].u, leaves[i].v);
+  }
+  if (removed == 0)
+    return 0;
+
+  std::map<const Node *, int> beg;
+  save_col_beg(uroot, beg);
+  save_col_beg(vroot, beg);
+  set_U_col_beg(uroot);
+  set_V_layout(vroot);
+
+  compact_U(uroot, std::vector<Block>(), beg, tag, ctx, runtime);
+  compact_V(vroot, beg, tag, ctx, runtime);
+  return removed;
+}
+
+
+/* ---- RankList implementation ---- */
+
+size_t RankList::legion_buffer_size(void) const {
+  return sizeof(int) * (1 + ranks.size());
+}
+
+size_t RankList::legion_serialize(void *buffer) const {
+  int *target = (int *)buffer;
+  *target++ = ranks.size();
+  for (size_t i=0; i<ranks.size(); i++) *target++ = ranks[i];
+  return size_t(target) - size_t(buffer);
+}
+
+size_t RankList::legion_deserialize(const void *buffer) {
+  const int *source = (const int *)buffer;
+  int n = *source++;
+  ranks.assign(source, source+n); source += n;
+  return size_t(source) - size_t(buffer);
+}
+
+
+/* ---- TruncateTask implementation ---- */
+
+/*static*/
+int TruncateTask::TASKID;
+
+TruncateTask::TruncateTask(TaskArgument arg,
+			   Predicate pred /*= Predicate::TRUE_PRED*/,
+			   MapperID id /*= 0*/,
+			   MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void TruncateTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <int, TruncateTask::cpu_task>(AUTO_GENERATE_ID,
+				  Processor::LOC_PROC,
+				  true,
+				  true,
+				  AUTO_GENERATE_ID,
+				  TaskConfigOptions(true/*leaf*/),
+				  "truncate_block");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : truncate_block\n", TASKID);
+#endif
+}
+
+int TruncateTask::cpu_task(const Task *task,
+			   const std::vector<PhysicalRegion> &regions,
+			   Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 3);
+  assert(task->regions.size() == 3);
+  assert(task->arglen == sizeof(TaskArgs));
+  const TaskArgs *args = (const TaskArgs *)task->args;
+
+  double *ptr[3];
+  int     rows[3];
+  int     cols[3];
+  for (int i=0; i<3; i++) {
+    IndexSpace is = task->regions[i].region.get_index_space();
+    Rect<2> rect = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+    Rect<2> subrect;
+    ByteOffset offsets[2];
+    ptr[i] = regions[i].get_field_accessor(FID_X).typeify<double>().
+      raw_rect_ptr<2>(rect, subrect, offsets);
+    assert(ptr[i] != NULL);
+    assert(rect == subrect);
+    rows[i] = rect.dim_size(0);
+    cols[i] = rect.dim_size(1);
+  }
+
+  int k = rows[0];
+  assert(cols[0] == k && rows[1] == k && cols[1] == k);
+  assert(rows[2] == k && cols[2] == 2*k);
+  std::vector<double> Gu(ptr[0], ptr[0] + k*k);
+  std::vector<double> Gv(ptr[1], ptr[1] + k*k);
+  return truncate_pair(&Gu[0], &Gv[0], k, args->tol,
+		       ptr[2], ptr[2] + k*k);
+}
+
+
+/* ---- ApplyBasisTask implementation ---- */
+
+/*static*/
+int ApplyBasisTask::TASKID;
+
+ApplyBasisTask::ApplyBasisTask(TaskArgument arg,
+			       Predicate pred /*= Predicate::TRUE_PRED*/,
+			       MapperID id /*= 0*/,
+			       MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void ApplyBasisTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <ApplyBasisTask::cpu_task>(AUTO_GENERATE_ID,
+			       Processor::LOC_PROC,
+			       true,
+			       true,
+			       AUTO_GENERATE_ID,
+			       TaskConfigOptions(true/*leaf*/),
+			       "apply_basis");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : apply_basis\n", TASKID);
+#endif
+}
+
+void ApplyBasisTask::cpu_task(const Task *task,
+			      const std::vector<PhysicalRegion> &regions,
+			      Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 2);
+  assert(task->regions.size() == 2);
+  assert(task->arglen == sizeof(TaskArgs));
+  const TaskArgs *args = (const TaskArgs *)task->args;
+
+  IndexSpace is_x = task->regions[0].region.get_index_space();
+  IndexSpace is_t = task->regions[1].region.get_index_space();
+  Rect<2> rect_x = runtime->get_index_space_domain(ctx, is_x).get_rect<2>();
+  Rect<2> rect_t = runtime->get_index_space_domain(ctx, is_t).get_rect<2>();
+
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *x_ptr = regions[0].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect_x, subrect, offsets);
+  assert(rect_x == subrect);
+  double *t_ptr = regions[1].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect_t, subrect, offsets);
+  assert(rect_t == subrect);
+
+  int m   = rect_x.dim_size(0);
+  int k   = args->ncol;
+  int LDT = rect_t.dim_size(0);
+  assert(LDT == k);
+  assert(args->col_beg + k <= rect_x.dim_size(1));
+  assert(args->t_col   + k <= rect_t.dim_size(1));
+  apply_transform(x_ptr + args->col_beg*m, m, m, k,
+		  t_ptr + args->t_col*LDT, LDT);
+}
+
+
+/* ---- LeafRecompressTask implementation ---- */
+
+/*static*/
+int LeafRecompressTask::TASKID;
+
+LeafRecompressTask::
+LeafRecompressTask(TaskArgument arg,
+		   Predicate pred /*= Predicate::TRUE_PRED*/,
+		   MapperID id /*= 0*/,
+		   MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void LeafRecompressTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <RankList, LeafRecompressTask::cpu_task>(AUTO_GENERATE_ID,
+					     Processor::LOC_PROC,
+					     true,
+					     true,
+					     AUTO_GENERATE_ID,
+					     TaskConfigOptions(true/*leaf*/),
+					     "recompress_legion_leaf");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : recompress_legion_leaf\n", TASKID);
+#endif
+}
+
+RankList LeafRecompressTask::
+cpu_task(const Task *task,
+	 const std::vector<PhysicalRegion> &regions,
+	 Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 2);
+  assert(task->regions.size() == 2);
+
+  const TaskArgs *args = (const TaskArgs *)task->args;
+  const int *vdesc = (const int *)(args+1);
+  const int *udesc = vdesc + packed_tree_size(vdesc);
+  assert(task->arglen == sizeof(TaskArgs) + sizeof(int) *
+	 (packed_tree_size(vdesc) + packed_tree_size(udesc)));
+
+  NodeArena arena;
+  int vidx = unpack_tree(vdesc, arena);
+  int uidx = unpack_tree(udesc, arena);
+
+  IndexSpace is_u = task->regions[0].region.get_index_space();
+  IndexSpace is_v = task->regions[1].region.get_index_space();
+  Rect<2> rect_u = runtime->get_index_space_domain(ctx, is_u).get_rect<2>();
+  Rect<2> rect_v = runtime->get_index_space_domain(ctx, is_v).get_rect<2>();
+
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *u_ptr = regions[0].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect_u, subrect, offsets);
+  assert(u_ptr != NULL);
+  assert(rect_u == subrect);
+  double *v_ptr = regions[1].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect_v, subrect, offsets);
+  assert(v_ptr != NULL);
+  assert(rect_v == subrect);
+
+  int LD = rect_u.dim_size(0);
+  assert(LD == rect_v.dim_size(0));
+  recompress_subtree(args->tol, arena.at(uidx), arena.at(vidx),
+		     u_ptr, v_ptr, LD);
+
+  // unpacked nodes keep the packed order
+  RankList list;
+  for (int i=0; i<udesc[0]; i++)
+    list.ranks.push_back(arena.at(uidx+i)->ncol);
+  return list;
+}
+
+
+/* ---- CompactTask implementation ---- */
+
+/*static*/
+int CompactTask::TASKID;
+
+CompactTask::CompactTask(TaskArgument arg,
+			 Predicate pred /*= Predicate::TRUE_PRED*/,
+			 MapperID id /*= 0*/,
+			 MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void CompactTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <CompactTask::cpu_task>(AUTO_GENERATE_ID,
+			    Processor::LOC_PROC,
+			    true,
+			    true,
+			    AUTO_GENERATE_ID,
+			    TaskConfigOptions(true/*leaf*/),
+			    "compact_columns");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : compact_columns\n", TASKID);
+#endif
+}
+
+void CompactTask::cpu_task(const Task *task,
+			   const std::vector<PhysicalRegion> &regions,
+			   Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 2);
+  assert(task->regions.size() == 2);
+
+  const TaskArgs *args = (const TaskArgs *)task->args;
+  const Block *blocks = (const Block *)(args+1);
+  assert(task->arglen == sizeof(TaskArgs) + sizeof(Block)*args->nblock);
+
+  IndexSpace is_a = task->regions[0].region.get_index_space();
+  IndexSpace is_b = task->regions[1].region.get_index_space();
+  Rect<2> rect_a = runtime->get_index_space_domain(ctx, is_a).get_rect<2>();
+  Rect<2> rect_b = runtime->get_index_space_domain(ctx, is_b).get_rect<2>();
+
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *a_ptr = regions[0].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect_a, subrect, offsets);
+  assert(rect_a == subrect);
+  double *b_ptr = regions[1].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect_b, subrect, offsets);
+  assert(rect_b == subrect);
+
+  int m = rect_a.dim_size(0);
+  assert(m == rect_b.dim_size(0));
+  memset(b_ptr, 0, rect_b.volume()*sizeof(double));
+  for (int i=0; i<args->nblock; i++) {
+    const Block &blk = blocks[i];
+    assert(blk.old_beg + blk.ncol <= rect_a.dim_size(1));
+    assert(blk.new_beg + blk.ncol <= rect_b.dim_size(1));
+    memcpy(b_ptr + blk.new_beg*m, a_ptr + blk.old_beg*m,
+	   sizeof(double)*m*blk.ncol);
+  }
+}
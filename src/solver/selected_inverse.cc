@@ -0,0 +1,521 @@
+#include <assert.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+#include "fast_solver.h"
+#include "gemm.h"
+#include "solver_kernels.h"
+#include "lapack_blas.h"
+#include "macros.h"
+
+// The inverse of a node p with children a and b, from
+//  A_p = D + W Z^T, D = diag(A_a, A_b), W = diag(a.u, b.u) and
+//  Z = [0, a.v; b.v, 0]:
+//
+//    A_p^-1 = D^-1 - D^-1 W C^-1 Z^T D^-1,  C = I + Z^T D^-1 W
+//
+// with X = A_c^-1 c.u and Y = A_c^-T c.v for both children c,
+//  D^-1 W = diag(a.X, b.X) and D^-T Z = [0, a.Y; b.Y, 0]. The
+//  diagonal of A_p^-1 on the rows of a is then that of A_a^-1 minus
+//  the diagonal of a.X E_a a.Y^T, with E_a = C^-1(0:ka, ka:k), and
+//  for b with E_b = C^-1(ka:k, 0:ka).
+//
+// Everything comes from the factors kept by the solve of A (see
+//  FastSolver::keep_factors()): X_c is what the solve leaves in the
+//  u columns of every node c, C is made of the kept V0Tu0 and V1Tu1,
+//  and Y_c is solved from a copy of the H-tiled c.v by resolve() with
+//  A_c^T. One node_inverse task per node forms C^-1, and one
+//  leaf_diagonal task per legion leaf runs the recursion on its own
+//  blocks from the kept leaf factors and subtracts the corrections of
+//  the nodes on its path to the root, O(nrow r^2) per level.
+
+// C (m x n) = alpha * op(A) * B + beta * C
+static void gemm
+(char transa, int m, int n, int k, double alpha,
+ const double *A, int LDA, const double *B, int LDB, double beta,
+ double *C, int LDC) {
+  if (m == 0 || n == 0) return;
+  char transb = 'n';
+  blas::dgemm_(&transa, &transb, &m, &n, &k, &alpha,
+	       (double *)A, &LDA, (double *)B, &LDB, &beta, C, &LDC);
+}
+
+// d -= diag(X E Y^T) for X (n x kx), E (kx x ky) and Y (n x ky)
+static void subtract_diagonal
+(int n, int kx, int ky, const double *X, int LDX, const double *E,
+ int LDE, const double *Y, int LDY, double *d) {
+  std::vector<double> XE(n*ky);
+  gemm('N', n, ky, kx, 1., X, LDX, E, LDE, 0., &XE[0], n);
+  for (int j=0; j<ky; j++)
+    for (int i=0; i<n; i++)
+      d[i] -= XE[i + j*n] * Y[i + j*LDY];
+}
+
+// C^-1 (k x k) of C = [I, P; Q, I] with P (ka x kb), Q (kb x ka)
+static void node_inverse
+(int ka, int kb, const double *P, int LDP, const double *Q, int LDQ,
+ double *Cinv) {
+  int k = ka + kb;
+  std::vector<double> C(k*k, 0.0);
+  std::vector<int>    piv(k);
+  for (int j=0; j<k; j++)
+    C[j+j*k] = 1.0;
+  for (int j=0; j<kb; j++)
+    memcpy(&C[(ka+j)*k], P + j*LDP, ka*sizeof(double));
+  for (int j=0; j<ka; j++)
+    memcpy(&C[ka + j*k], Q + j*LDQ, kb*sizeof(double));
+
+  memset(Cinv, 0, k*k*sizeof(double));
+  for (int j=0; j<k; j++)
+    Cinv[j+j*k] = 1.0;
+  int info;
+  lapack::dgesv_(&k, &k, &C[0], &k, &piv[0], Cinv, &k, &info);
+  assert(info == 0);
+}
+
+// diag(A^-1) of the subtree of a legion leaf solved by
+//  serial_leaf_solve() with f_ptr, into d at the rows of the leaf;
+//  u_ptr holds X and k_ptr the LU of the dense blocks
+static void leaf_diagonal
+(const Node *unode, const Node *vnode, const double *u_ptr,
+ const double *v_ptr, const double *k_ptr, const double *f_ptr,
+ int LD, double *d) {
+
+  if (unode->is_real_leaf()) {
+    int n = unode->nrow;
+    std::vector<double> I(LD*n, 0.0);
+    double *B = &I[unode->row_beg];
+    for (int j=0; j<n; j++)
+      B[j+j*LD] = 1.0;
+    serial_leaf_resolve(false, n, unode, vnode, u_ptr, v_ptr, k_ptr,
+			f_ptr, LD, &I[0]);
+    for (int j=0; j<n; j++)
+      d[unode->row_beg+j] = B[j+j*LD];
+    return;
+  }
+
+  const Node *u[2] = {unode->lchild(), unode->rchild()};
+  const Node *v[2] = {vnode->lchild(), vnode->rchild()};
+  int S_size = u[0]->ncol + u[1]->ncol;
+  const double *f[2];
+  f[0] = f_ptr + S_size*(S_size+1);
+  f[1] = f[0] + leaf_factor_size(u[0]);
+  const double *X[2], *W[2];
+  std::vector<double> Y[2];
+  for (int c=0; c<2; c++) {
+    leaf_diagonal(u[c], v[c], u_ptr, v_ptr, k_ptr, f[c], LD, d);
+    X[c] = u_ptr + u[c]->row_beg + u[c]->col_beg*LD;
+    W[c] = v_ptr + v[c]->row_beg + v[c]->col_beg*LD;
+    // Y_c = A_c^-T c.v
+    int kv = v[c]->ncol;
+    Y[c].assign(LD*kv, 0.0);
+    for (int j=0; j<kv; j++)
+      memcpy(&Y[c][u[c]->row_beg + j*LD], W[c] + j*LD,
+	     u[c]->nrow*sizeof(double));
+    serial_leaf_resolve(true, kv, u[c], v[c], u_ptr, v_ptr, k_ptr, f[c],
+			LD, &Y[c][0]);
+  }
+
+  // P = b.v^T b.X and Q = a.v^T a.X
+  int ka = u[0]->ncol, kb = u[1]->ncol, k = ka + kb;
+  if (ka == 0 || kb == 0) return;
+  std::vector<double> P(ka*kb), Q(kb*ka), Cinv(k*k);
+  gemm('T', ka, kb, u[1]->nrow, 1., W[1], LD, X[1], LD, 0., &P[0], ka);
+  gemm('T', kb, ka, u[0]->nrow, 1., W[0], LD, X[0], LD, 0., &Q[0], kb);
+  node_inverse(ka, kb, &P[0], ka, &Q[0], kb, &Cinv[0]);
+  subtract_diagonal(u[0]->nrow, ka, kb, X[0], LD, &Cinv[ka*k], k,
+		    &Y[0][u[0]->row_beg], LD, d + u[0]->row_beg);
+  subtract_diagonal(u[1]->nrow, kb, ka, X[1], LD, &Cinv[ka], k,
+		    &Y[1][u[1]->row_beg], LD, d + u[1]->row_beg);
+}
+
+
+namespace {
+
+  // C^-1 of a node from V0Tu0 (kb x ka) and V1Tu1 (ka x kb)
+  class NodeInverseTask : public TaskLauncher {
+  public:
+    NodeInverseTask(TaskArgument arg,
+		    Predicate pred = Predicate::TRUE_PRED,
+		    MapperID id = 0,
+		    MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+
+  // diag(A^-1) on the rows of a legion leaf. The regions are U, V, K
+  //  and the kept factors F of the solved A, the tile of the
+  //  diagonal, then the C^-1 and the tiles of Y of the path.
+  class LeafDiagonalTask : public TaskLauncher {
+  public:
+    LeafDiagonalTask(TaskArgument arg,
+		     Predicate pred = Predicate::TRUE_PRED,
+		     MapperID id = 0,
+		     MappingTagID tag = 0);
+
+    static int TASKID;
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+}
+
+void register_inverse_tasks() {
+  NodeInverseTask::register_tasks();
+  LeafDiagonalTask::register_tasks();
+}
+
+// The path of a legion leaf is passed as ints after its length: per
+//  node c from a child of the root down to the leaf, the columns of
+//  X_c in the U of A, the columns of Y_c, and whether c is the right
+//  child.
+enum {
+  PATH_COL_BEG,
+  PATH_NCOL,
+  PATH_T_NCOL,
+  PATH_RIGHT,
+  PATH_FIELDS,
+};
+
+namespace {
+  struct PathNode {
+    const Node *unode; // c in A
+    int         ytile; // tile of Y_c in the arena of the Y trees
+    bool        right;
+    LMatrix    *Cinv;  // of the parent
+  };
+}
+
+// a copy of the H-tiled tree H into node i of the arena, with new
+//  tiles holding the same data
+static void copy_tiles
+(const Node *H, NodeArena &arena, int i, std::vector<LMatrix *> &temps,
+ Range tag, Context ctx, HighLevelRuntime *runtime) {
+
+  Node *node = arena.at(i);
+  *node = Node(H->nrow, H->ncol, H->row_beg);
+  node->cost = H->cost;
+  if (H->is_legion_leaf()) {
+    const LMatrix *src = H->lowrank_matrix;
+    node->set_legion_leaf(true);
+    create_matrix(node->lowrank_matrix, src->rows, src->cols,
+		  ctx, runtime);
+    node->lowrank_matrix->copy(*src, tag.begin(), ctx, runtime);
+    temps.push_back(node->lowrank_matrix);
+    return;
+  }
+  int c = arena.alloc(2); // may move the arena
+  arena.at(i)->set_children(arena.at(c));
+  copy_tiles(H->lchild(), arena, c,   temps,
+	     tag.lchild(H->split_fraction()), ctx, runtime);
+  copy_tiles(H->rchild(), arena, c+1, temps,
+	     tag.rchild(H->split_fraction()), ctx, runtime);
+}
+
+// d -= diag(X_c E_c Y_c^T) for the nodes c of the path
+static void correct_diagonal
+(int n, const int *path, int npath, const double *U, int LD,
+ const std::vector<const double *> &Cinv,
+ const std::vector<const double *> &Ytile, double *d) {
+
+  for (int p=0; p<npath; p++) {
+    const int *e = path + PATH_FIELDS*p;
+    int kx = e[PATH_NCOL];
+    int ky = e[PATH_T_NCOL];
+    int k  = kx + ky;
+    const double *E = e[PATH_RIGHT] ? Cinv[p] + ky : Cinv[p] + kx*k;
+    subtract_diagonal(n, kx, ky, U + e[PATH_COL_BEG]*LD, LD, E, k,
+		      Ytile[p], LD, d);
+  }
+}
+
+typedef std::map<const Node *, KeptFactors> FactorMap;
+
+// fs solved A with keep_factors, which are in factors; the Y trees
+//  are built in ytrees, and the diagonal goes to the tiles below dnode
+static void leaf_diagonals
+(const Node *unode, const Node *vnode, const Node *dnode,
+ FastSolver &fs, const FactorMap &factors, NodeArena &ytrees,
+ const std::vector<PathNode> &path, std::vector<LMatrix *> &temps,
+ Range tag, Context ctx, HighLevelRuntime *runtime) {
+
+  FactorMap::const_iterator kept = factors.find(unode);
+  assert(kept != factors.end());
+  if ( ! unode->is_legion_leaf() ) {
+    const Node *u[2] = {unode->lchild(), unode->rchild()};
+    const Node *v[2] = {vnode->lchild(), vnode->rchild()};
+    const Node *d[2] = {dnode->lchild(), dnode->rchild()};
+    Range      tc[2] = {tag.lchild(unode->split_fraction()),
+			tag.rchild(unode->split_fraction())};
+
+    // C^-1 from the kept V0Tu0 = a.v^T a.X and V1Tu1 = b.v^T b.X
+    LMatrix *Cinv = NULL;
+    int ka = u[0]->ncol;
+    int kb = u[1]->ncol;
+    if (ka > 0 && kb > 0) {
+      create_matrix(Cinv, ka+kb, ka+kb, ctx, runtime);
+      temps.push_back(Cinv);
+      NodeInverseTask launcher(TaskArgument(NULL, 0),
+			       Predicate::TRUE_PRED,
+			       0,
+			       tc[0].begin());
+      LogicalRegion regions[3] = {kept->second.V0Tu0->data,
+				  kept->second.V1Tu1->data,
+				  Cinv->data};
+      for (int i=0; i<3; i++)
+	launcher.add_region_requirement(
+	  RegionRequirement(regions[i],
+			    i < 2 ? READ_ONLY : WRITE_DISCARD,
+			    EXCLUSIVE,
+			    regions[i]).add_field(FID_X));
+      Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+      std::cout << "Waiting for node inverse ..." << std::endl;
+      f.get_void_result();
+#endif
+    }
+
+    // Y_c = A_c^-T c.v on a copy of the H-tiled c.v
+    int ytree[2] = {-1, -1};
+    for (int c=0; Cinv != NULL && c<2; c++) {
+      ytree[c] = ytrees.alloc();
+      copy_tiles(v[c]->Hmat(), ytrees, ytree[c], temps, tc[c],
+		 ctx, runtime);
+      fs.resolve(u[c], v[c], ytrees.at(ytree[c]), Range(v[c]->ncol),
+		 tc[c], true, ctx, runtime);
+    }
+
+    for (int c=0; c<2; c++) {
+      // the tiles of the ancestors follow the path down
+      std::vector<PathNode> p(path);
+      for (size_t i=0; i<p.size(); i++) {
+	const Node *y = ytrees.at(p[i].ytile);
+	p[i].ytile = ytrees.index(c == 0 ? y->lchild() : y->rchild());
+      }
+      if (Cinv != NULL) {
+	PathNode node = {u[c], ytree[c], c == 1, Cinv};
+	p.push_back(node);
+      }
+      leaf_diagonals(u[c], v[c], d[c], fs, factors, ytrees, p, temps,
+		     tc[c], ctx, runtime);
+    }
+    return;
+  }
+
+  int npath = path.size();
+  const Node *trees[2] = {unode, vnode};
+  int size = sizeof(int)*(1 + PATH_FIELDS*npath);
+  for (int i=0; i<2; i++)
+    size += sizeof(int)*pack_tree_size(trees[i]);
+  std::vector<int> buf(size / sizeof(int));
+  int *desc = &buf[0];
+  *desc++ = npath;
+  for (int p=0; p<npath; p++) {
+    desc[PATH_COL_BEG] = path[p].unode->col_beg;
+    desc[PATH_NCOL]    = path[p].unode->ncol;
+    desc[PATH_T_NCOL]  = ytrees.at(path[p].ytile)->ncol;
+    desc[PATH_RIGHT]   = path[p].right;
+    desc += PATH_FIELDS;
+  }
+  for (int i=0; i<2; i++)
+    desc += pack_tree(trees[i], desc);
+
+  LeafDiagonalTask launcher(TaskArgument(&buf[0], size),
+			    Predicate::TRUE_PRED,
+			    0,
+			    tag.begin());
+  LogicalRegion regions[5] = {unode->lowrank_matrix->data,
+			      vnode->lowrank_matrix->data,
+			      vnode->dense_matrix->data,
+			      kept->second.F->data,
+			      dnode->lowrank_matrix->data};
+  for (int i=0; i<5; i++)
+    launcher.add_region_requirement(
+      RegionRequirement(regions[i],
+			i == 4 ? WRITE_DISCARD : READ_ONLY,
+			EXCLUSIVE,
+			regions[i]).add_field(FID_X));
+  for (int p=0; p<npath; p++)
+    launcher.add_region_requirement(
+      RegionRequirement(path[p].Cinv->data,
+			READ_ONLY,
+			EXCLUSIVE,
+			path[p].Cinv->data).add_field(FID_X));
+  for (int p=0; p<npath; p++) {
+    LogicalRegion tile = ytrees.at(path[p].ytile)->lowrank_matrix->data;
+    launcher.add_region_requirement(
+      RegionRequirement(tile,
+			READ_ONLY,
+			EXCLUSIVE,
+			tile).add_field(FID_X));
+  }
+  Future f = runtime->execute_task(ctx, launcher);
+#ifdef SERIAL
+  std::cout << "Waiting for leaf diagonal ..." << std::endl;
+  f.get_void_result();
+#endif
+}
+
+void FastSolver::diag_inverse
+(const HodlrMatrix &lr_mat, double *diag, const Range &procs,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  // every node needs its factors
+  assert(keepFactors && jacobiLevel == 0);
+  NodeArena              ytrees, dtree;
+  std::vector<PathNode>  path;
+  std::vector<LMatrix *> temps;
+  lr_mat.create_vectors(dtree, 1, ctx, runtime);
+  leaf_diagonals(lr_mat.uroot, lr_mat.vroot, dtree.at(0), *this,
+		 factors, ytrees, path, temps, procs, ctx, runtime);
+  lr_mat.get_vector(dtree, 0, diag, ctx, runtime);
+  lr_mat.destroy_vectors(dtree, ctx, runtime);
+  for (size_t i=0; i<temps.size(); i++)
+    destroy_matrix(temps[i], ctx, runtime);
+}
+
+
+// raw pointer and size of the i-th region, NULL if it is empty
+static double *region_ptr
+(const Task *task, const std::vector<PhysicalRegion> &regions, int i,
+ Context ctx, HighLevelRuntime *runtime, int &rows, int &cols) {
+  IndexSpace is = task->regions[i].region.get_index_space();
+  Rect<2> rect = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+  rows = rect.dim_size(0);
+  cols = rect.dim_size(1);
+  if (rect.volume() == 0) return NULL; // V of a real leaf
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *ptr = regions[i].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect, subrect, offsets);
+  assert(ptr != NULL);
+  assert(rect == subrect);
+  return ptr;
+}
+
+
+/* ---- NodeInverseTask implementation ---- */
+
+/*static*/
+int NodeInverseTask::TASKID;
+
+NodeInverseTask::NodeInverseTask(TaskArgument arg,
+				 Predicate pred /*= Predicate::TRUE_PRED*/,
+				 MapperID id /*= 0*/,
+				 MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void NodeInverseTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <NodeInverseTask::cpu_task>(AUTO_GENERATE_ID,
+				Processor::LOC_PROC,
+				true,
+				true,
+				AUTO_GENERATE_ID,
+				TaskConfigOptions(true/*leaf*/),
+				"node_inverse");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : node_inverse\n", TASKID);
+#endif
+}
+
+void NodeInverseTask::cpu_task(const Task *task,
+			       const std::vector<PhysicalRegion> &regions,
+			       Context ctx, HighLevelRuntime *runtime)
+{
+  assert(regions.size() == 3);
+  assert(task->regions.size() == 3);
+
+  int kb, ka, rows, cols, k;
+  const double *Q = region_ptr(task, regions, 0, ctx, runtime, kb, ka);
+  const double *P = region_ptr(task, regions, 1, ctx, runtime, rows, cols);
+  double    *Cinv = region_ptr(task, regions, 2, ctx, runtime, k, cols);
+  assert(rows == ka && cols == k && k == ka+kb);
+  // C = [I, V1Tu1; V0Tu0, I]
+  node_inverse(ka, kb, P, ka, Q, kb, Cinv);
+}
+
+
+/* ---- LeafDiagonalTask implementation ---- */
+
+/*static*/
+int LeafDiagonalTask::TASKID;
+
+LeafDiagonalTask::LeafDiagonalTask(TaskArgument arg,
+				   Predicate pred /*= Predicate::TRUE_PRED*/,
+				   MapperID id /*= 0*/,
+				   MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void LeafDiagonalTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <LeafDiagonalTask::cpu_task>(AUTO_GENERATE_ID,
+				 Processor::LOC_PROC,
+				 true,
+				 true,
+				 AUTO_GENERATE_ID,
+				 TaskConfigOptions(true/*leaf*/),
+				 "leaf_diagonal");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : leaf_diagonal\n", TASKID);
+#endif
+}
+
+void LeafDiagonalTask::cpu_task(const Task *task,
+				const std::vector<PhysicalRegion> &regions,
+				Context ctx, HighLevelRuntime *runtime)
+{
+  const int *path = (const int *)task->args;
+  int npath = *path++;
+  assert((int)regions.size() == 5 + 2*npath);
+  assert(task->regions.size() == regions.size());
+
+  // U and V of the legion leaf of A
+  NodeArena arena;
+  const int *desc = path + PATH_FIELDS*npath;
+  int uroot = unpack_tree(desc, arena);
+  desc += packed_tree_size(desc);
+  int vroot = unpack_tree(desc, arena);
+  desc += packed_tree_size(desc);
+  assert((const char *)desc - (const char *)task->args ==
+	 (long)task->arglen);
+
+  int rows, cols, n = 0;
+  double *ptr[5];
+  for (int i=0; i<5; i++) {
+    ptr[i] = region_ptr(task, regions, i, ctx, runtime, rows, cols);
+    if (i == 0) n = rows;
+    if (i == 3)
+      assert(rows == leaf_factor_size(arena.at(uroot)));
+    else
+      assert(ptr[i] == NULL || rows == n);
+  }
+  std::vector<const double *> Cinv(npath), Ytile(npath);
+  for (int p=0; p<npath; p++) {
+    Cinv[p]  = region_ptr(task, regions, 5+p, ctx, runtime, rows, cols);
+    Ytile[p] = region_ptr(task, regions, 5+npath+p, ctx, runtime,
+			  rows, cols);
+    assert(rows == n && cols == path[PATH_FIELDS*p + PATH_T_NCOL]);
+  }
+
+  // the blocks below the legion leaf from the kept factors, then the
+  //  nodes above
+  double *d = ptr[4];
+  leaf_diagonal(arena.at(uroot), arena.at(vroot), ptr[0], ptr[1],
+		ptr[2], ptr[3], n, d);
+  correct_diagonal(n, path, npath, ptr[0], n, Cinv, Ytile, d);
+}
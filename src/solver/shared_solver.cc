@@ -0,0 +1,226 @@
+#include <assert.h>
+#include <string.h>
+
+#include "shared_solver.h"
+#include "solver_kernels.h"
+
+enum {LEAF_SOLVE, REDUCE, NODE_SOLVE, BROADCAST};
+
+SharedSolver::SharedSolver
+(const std::vector<HostNode> &t, int rhs_cols_, int leafSize)
+  : rhs_cols(rhs_cols_) {
+
+  uroot = arena.alloc();
+  build(t, 0, uroot, 0);
+  Node *root = arena.at(uroot);
+  root->ncol = rhs_cols; // the rhs as in HodlrMatrix
+  build_subtree(root);
+
+  // the V tree mirrors the U tree node by node, see create_Vtree()
+  int nnode = arena.size() - uroot;
+  vroot = arena.alloc(nnode);
+  for (int i=0; i<nnode; i++) {
+    const Node *unode = arena.at(uroot+i);
+    Node       *vnode = arena.at(vroot+i);
+    vnode->nrow    = unode->nrow;
+    vnode->row_beg = unode->row_beg;
+    if ( ! unode->is_real_leaf() ) {
+      int   lidx   = arena.index(unode->lchild()) - uroot;
+      Node *lchild = arena.at(vroot + lidx);
+      Node *rchild = lchild + 1;
+      vnode->set_children(lchild);
+      lchild->ncol    = unode->rchild()->ncol;
+      rchild->ncol    = unode->lchild()->ncol;
+      lchild->col_beg = vnode->col_beg + vnode->ncol;
+      rchild->col_beg = vnode->col_beg + vnode->ncol;
+    }
+  }
+
+  first.resize(nnode);
+  count.resize(nnode);
+  mark_leaves(uroot, leafSize);
+}
+
+// U node u of host node t[i], and the nodes below
+void SharedSolver::build
+(const std::vector<HostNode> &t, int i, int u, int col_beg) {
+  Node *node = arena.at(u);
+  node->nrow    = t[i].nrow;
+  node->ncol    = t[i].k;
+  node->col_beg = col_beg;
+  if (t[i].lchild >= 0) {
+    int c = arena.alloc(2); // may move the arena
+    arena.at(u)->set_children(arena.at(c));
+    int cb = col_beg + (u == uroot ? rhs_cols : t[i].k);
+    build(t, t[i].lchild, c,   cb);
+    build(t, t[i].rchild, c+1, cb);
+  }
+}
+
+// the leaf tasks are the largest subtrees with at most leafSize real
+//  leaves; returns the number of real leaves below u
+int SharedSolver::mark_leaves(int u, int leafSize) {
+  const Node *node = arena.at(u);
+  first[u-uroot] = leaves.size();
+  int nleaf = count_leaf(node);
+  if (nleaf <= leafSize || node->is_real_leaf()) {
+    leaves.push_back(u);
+  } else {
+    mark_leaves(arena.index(node->lchild()), leafSize);
+    mark_leaves(arena.index(node->rchild()), leafSize);
+  }
+  count[u-uroot] = leaves.size() - first[u-uroot];
+  return nleaf;
+}
+
+// the jobs of visit() for the subtree of u, in post order. last has
+//  the latest job writing the rows of every leaf task.
+void SharedSolver::add_jobs
+(int u, std::vector<int> &last, std::vector<std::pair<int, int> > &deps) {
+
+  Job job = {this, LEAF_SOLVE, u, -1, -1, -1, 0.0};
+  int l0  = first[u-uroot];
+  if (count[u-uroot] == 1 && leaves[l0] == u) {
+    last[l0] = jobs.size();
+    jobs.push_back(job);
+    return;
+  }
+
+  const Node *node = arena.at(u);
+  int c[2] = {arena.index(node->lchild()), arena.index(node->rchild())};
+  add_jobs(c[0], last, deps);
+  add_jobs(c[1], last, deps);
+
+  // [V^T d, V^T u] of either child, one partial sum per leaf task
+  std::vector<int> reduce;
+  int slot[2];
+  for (int s=0; s<2; s++) {
+    slot[s] = partial.size();
+    for (int l=first[c[s]-uroot]; l<first[c[s]-uroot]+count[c[s]-uroot];
+	 l++) {
+      Job r = {this, REDUCE, c[s], leaves[l], (int)partial.size(), -1, 0.};
+      partial.push_back(std::vector<double>());
+      deps.push_back(std::make_pair(last[l], (int)jobs.size()));
+      reduce.push_back(jobs.size());
+      jobs.push_back(r);
+    }
+  }
+
+  int solve = jobs.size();
+  Job n = {this, NODE_SOLVE, u, -1, slot[0], slot[1], 0.};
+  jobs.push_back(n);
+  for (size_t i=0; i<reduce.size(); i++)
+    deps.push_back(std::make_pair(reduce[i], solve));
+
+  // d -= u * eta with eta0 in W of the right child and eta1 in W of
+  //  the left one
+  for (int s=0; s<2; s++)
+    for (int l=first[c[s]-uroot]; l<first[c[s]-uroot]+count[c[s]-uroot];
+	 l++) {
+      Job b = {this, BROADCAST, c[s], leaves[l], -1, slot[1-s], 0.};
+      deps.push_back(std::make_pair(solve, (int)jobs.size()));
+      last[l] = jobs.size();
+      jobs.push_back(b);
+    }
+}
+
+void SharedSolver::run_job(void *arg) {
+  Job          *job = (Job *)arg;
+  SharedSolver *s   = job->solver;
+  int           N   = s->size();
+  double       *U   = &s->U[0];
+  double       *V   = s->V.empty() ? NULL : &s->V[0];
+  double       *K   = &s->K[0];
+  Node *unode = s->arena.at(job->node);
+  Node *vnode = s->arena.at(job->node - s->uroot + s->vroot);
+
+  switch (job->kind) {
+  case LEAF_SOLVE:
+    job->logdet = serial_leaf_solve(unode, vnode, U, V, K, N);
+    break;
+
+  case REDUCE: {
+    const Node *leaf = s->arena.at(job->leaf);
+    int m = vnode->ncol;
+    int n = unode->col_beg + unode->ncol;
+    std::vector<double> &W = s->partial[job->slot];
+    W.resize(m*n);
+    gemm_reduce_kernel(m, n, leaf->nrow, 1.0,
+		       V + leaf->row_beg + vnode->col_beg*N, N,
+		       U + leaf->row_beg, N, 0.0, &W[0], m);
+    break;
+  }
+
+  case NODE_SOLVE: {
+    const Node *c[2] = {unode->lchild(), unode->rchild()};
+    int slot[2] = {job->slot, job->slot2};
+    int nslot[2];
+    for (int i=0; i<2; i++)
+      nslot[i] = s->count[s->arena.index(c[i]) - s->uroot];
+    // the partial sums of either child into its first one
+    for (int i=0; i<2; i++) {
+      std::vector<double> &W = s->partial[slot[i]];
+      for (int p=1; p<nslot[i]; p++) {
+	const std::vector<double> &P = s->partial[slot[i]+p];
+	for (size_t j=0; j<W.size(); j++)
+	  W[j] += P[j];
+      }
+    }
+    int n0 = c[1]->ncol; // rows of V0^T, the rank of the right u
+    int n1 = c[0]->ncol;
+    int cb = c[0]->col_beg;
+    double *W0 = &s->partial[slot[0]][0];
+    double *W1 = &s->partial[slot[1]][0];
+    job->logdet = node_solve_kernel(n0, n1, cb,
+				    W0 + cb*n0, n0, W1 + cb*n1, n1,
+				    W0, n0, W1, n1);
+    break;
+  }
+
+  case BROADCAST: {
+    const Node *leaf = s->arena.at(job->leaf);
+    int k = unode->ncol;
+    const double *eta = &s->partial[job->slot2][0];
+    gemm_broadcast_kernel(leaf->nrow, unode->col_beg, k, -1.0,
+			  U + leaf->row_beg + unode->col_beg*N, N, eta, k,
+			  1.0, U + leaf->row_beg, N);
+    break;
+  }
+  default:
+    assert(false);
+  }
+}
+
+double SharedSolver::solve
+(const std::vector<HostNode> &t, double *x, int LD, ThreadPool &pool) {
+
+  int N = size();
+  assert(t.size() > 0 && t[0].nrow == N);
+  U.assign(N*count_matrix_column(arena.at(uroot)), 0.0);
+  V.assign(N*count_matrix_column(arena.at(vroot)), 0.0);
+  K.assign(N*max_row_size(arena.at(vroot)), 0.0);
+  write_host_subtree(arena.at(uroot), arena.at(vroot), t,
+		     &U[0], V.empty() ? NULL : &V[0], &K[0], N);
+  for (int j=0; j<rhs_cols; j++)
+    memcpy(&U[j*N], x + j*LD, N*sizeof(double));
+
+  jobs.clear();
+  partial.clear();
+  std::vector<int> last(leaves.size());
+  std::vector<std::pair<int, int> > deps;
+  add_jobs(uroot, last, deps);
+  for (size_t i=0; i<jobs.size(); i++) {
+    int id = pool.add_task(run_job, &jobs[i]);
+    assert(id == (int)i);
+  }
+  for (size_t i=0; i<deps.size(); i++)
+    pool.add_dependence(deps[i].first, deps[i].second);
+  pool.run();
+
+  for (int j=0; j<rhs_cols; j++)
+    memcpy(x + j*LD, &U[j*N], N*sizeof(double));
+  double sum = 0;
+  for (size_t i=0; i<jobs.size(); i++)
+    sum += jobs[i].logdet;
+  return sum;
+}
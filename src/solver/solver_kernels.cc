@@ -0,0 +1,397 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "solver_kernels.h"
+#include "lapack_blas.h"
+
+// log|det| from the diagonal of an LU factorization
+static double lu_log_det(const double *LU, int N, int LD) {
+  double sum = 0;
+  for (int i=0; i<N; i++)
+    sum += log(fabs(LU[i + i*LD]));
+  return sum;
+}
+
+
+// returns log|det| of the block of the subtree: the dense leaves
+//  and the Schur complements of the nodes
+double serial_leaf_solve
+  (Node * unode, Node * vnode,
+   double * u_ptr, double * v_ptr, double * k_ptr, int LD,
+   double * f_ptr)
+{
+  /*
+  printf("vlchild: %p, vrchild: %p\n", vnode->lchild(), vnode->rchild());
+  printf("ulchild: %p, urchild: %p\n", unode->lchild(), unode->rchild());
+  */
+    
+  if (unode->is_real_leaf()) {
+    //printf("u nrow: %d, v nrow: %d\n", unode->nrow, vnode->nrow);
+    assert(unode->nrow == vnode->nrow);
+    int N     = unode->nrow;
+    int NRHS  = unode->col_beg + unode->ncol;
+    int LDA   = LD;
+    int LDB   = LD;
+    double *A = k_ptr + vnode->row_beg;
+    double *B = u_ptr + vnode->row_beg;
+      
+    int INFO;
+    int IPIV[N];
+      
+    lapack::dgesv_(&N, &NRHS, A, &LDA, IPIV, B, &LDB, &INFO);
+    assert(INFO == 0);
+    double logdet = lu_log_det(A, N, LDA);
+    if (f_ptr != NULL)
+      for (int i=0; i<N; i++)
+	f_ptr[i] = IPIV[i];
+    
+    //lapack::dgetrf_(&N, &N, A, &LDA, IPIV, &INFO);
+    /*
+    //assume no pivoting
+    for (int i=0; i<N; i++)
+      IPIV[i] = i+1;
+    */
+    //char TRANS = 'n';
+    //lapack::dgetrs_(&TRANS, &N, &NRHS, A, &LDA, IPIV, B, &LDB, &INFO);
+
+    return logdet;
+  }
+
+  // the factors of the children follow those of this node
+  int     f_size = unode->lchild()->ncol + unode->rchild()->ncol;
+  double *f0 = f_ptr ? f_ptr + f_size*(f_size+1) : NULL;
+  double *f1 = f_ptr ? f0 + leaf_factor_size(unode->lchild()) : NULL;
+  double logdet =
+    serial_leaf_solve(unode->lchild(), vnode->lchild(), u_ptr, v_ptr, k_ptr, LD, f0) +
+    serial_leaf_solve(unode->rchild(), vnode->rchild(), u_ptr, v_ptr, k_ptr, LD, f1);
+  
+  char   transa = 't';
+  char   transb = 'n';
+  double alpha  = 1.0;
+  double beta   = 0.0;
+  
+  int V0_rows = vnode->lchild()->nrow;
+  int V0_cols = vnode->lchild()->ncol;
+  int V1_rows = vnode->rchild()->nrow;
+  int V1_cols = vnode->rchild()->ncol;
+
+  int u0_rows = unode->lchild()->nrow;
+  int u0_cols = unode->lchild()->ncol;
+  int u1_rows = unode->rchild()->nrow;
+  int u1_cols = unode->rchild()->ncol;
+  
+  int d0_rows = unode->lchild()->nrow;
+  int d0_cols = unode->lchild()->col_beg;
+  int d1_rows = unode->rchild()->nrow;
+  int d1_cols = unode->rchild()->col_beg;
+  
+  double *V0 = v_ptr + vnode->lchild()->row_beg + vnode->lchild()->col_beg*LD;
+  double *V1 = v_ptr + vnode->rchild()->row_beg + vnode->rchild()->col_beg*LD;
+  double *u0 = u_ptr + unode->lchild()->row_beg + unode->lchild()->col_beg*LD;
+  double *u1 = u_ptr + unode->rchild()->row_beg + unode->rchild()->col_beg*LD;
+  double *d0 = u_ptr + unode->lchild()->row_beg;
+  double *d1 = u_ptr + unode->rchild()->row_beg;
+
+
+  // Shur complement
+  assert(V0_cols + V1_cols == u0_cols + u1_cols);
+  int    S_size = V0_cols + V1_cols;
+  double *S = (double *) calloc( S_size*S_size, sizeof(double) );
+
+  assert(d0_cols == d1_cols);
+  double *S_RHS = (double *) malloc( S_size*d0_cols * sizeof(double) );
+  
+  // initialize the off-diagonal blocks to identity
+  for (int i=0; i<S_size; i++)
+    S[ (V0_cols + i)%S_size + i*S_size ] = 1.0;
+
+  assert(V0_rows == u0_rows);
+  assert(V1_rows == u1_rows);
+  assert(V0_rows == d0_rows);
+  assert(V1_rows == d1_rows);
+
+  double *V0Tu0 = S;
+  double *V1Tu1 = S + (V0_cols + u0_cols*S_size);
+  double *V0Td0 = S_RHS;
+  double *V1Td1 = S_RHS + V0_cols;
+  
+  blas::dgemm_(&transa, &transb, &V0_cols, &u0_cols, &V0_rows, &alpha, V0, &LD, u0, &LD, &beta, V0Tu0, &S_size);
+  blas::dgemm_(&transa, &transb, &V1_cols, &u1_cols, &V1_rows, &alpha, V1, &LD, u1, &LD, &beta, V1Tu1, &S_size);
+  blas::dgemm_(&transa, &transb, &V0_cols, &d0_cols, &V0_rows, &alpha, V0, &LD, d0, &LD, &beta, V0Td0, &S_size);
+  blas::dgemm_(&transa, &transb, &V1_cols, &d1_cols, &V1_rows, &alpha, V1, &LD, d1, &LD, &beta, V1Td1, &S_size);
+
+  
+  int INFO;
+  int IPIV[S_size];
+  assert(d0_cols == d1_cols);
+
+  lapack::dgesv_(&S_size, &d0_cols, S, &S_size, IPIV, S_RHS, &S_size, &INFO);
+  assert(INFO == 0);
+  logdet += lu_log_det(S, S_size, S_size);
+  if (f_ptr != NULL) {
+    assert(S_size == f_size);
+    memcpy(f_ptr, S, S_size*S_size*sizeof(double));
+    for (int i=0; i<S_size; i++)
+      f_ptr[S_size*S_size + i] = IPIV[i];
+  }
+
+
+  //save_matrix(S_RHS, S_size, d1_cols, "S_RHS.txt");  
+  transa =  'n';
+  alpha  = -1.0;
+  beta   =  1.0;
+  
+  double * eta0 = S_RHS;          
+  double * eta1 = S_RHS + V1_cols;
+
+  int eta0_rows = V1_cols;
+  int eta0_cols = d0_cols;
+  int eta1_rows = V0_cols;
+  int eta1_cols = d0_cols;
+  
+  assert(u0_cols == eta0_rows);
+  assert(u1_cols == eta1_rows);
+  blas::dgemm_(&transa, &transb, &u0_rows, &eta0_cols, &u0_cols, &alpha, u0, &LD, eta0, &S_size, &beta, d0, &LD);
+  blas::dgemm_(&transa, &transb, &u1_rows, &eta1_cols, &u1_cols, &alpha, u1, &LD, eta1, &S_size, &beta, d1, &LD);
+
+  
+  //printf("d0 2x2: %f, %f, %f, %f.\n", d0[0], d0[1], d0[LD], d0[LD+1]);
+  
+  //save_matrix(V0Tu0, V0_cols, u0_cols, "V0Tu0.txt");
+  //save_matrix(V1Tu1, V1_cols, u1_cols, "V1Tu1.txt");
+  //save_matrix(V0Td0, V0_cols, d0_cols, "V0Td0.txt");
+  //save_matrix(V1Td1, V1_cols, d1_cols, "V1Td1.txt");
+  //save_matrix(S,     S_size, S_size,  "Shur.txt");
+  //save_matrix(S_RHS, S_size, d1_cols, "S_RHS.txt");
+  //save_matrix(d0, unode->nrow, unode->col_beg+unode->ncol, LD, "result.txt");
+
+  free(S);
+  free(S_RHS);
+  return logdet;
+}
+
+
+int leaf_factor_size(const Node *unode) {
+  if (unode->is_real_leaf())
+    return unode->nrow;
+  int S_size = unode->lchild()->ncol + unode->rchild()->ncol;
+  return S_size*(S_size+1) +
+    leaf_factor_size(unode->lchild()) + leaf_factor_size(unode->rchild());
+}
+
+// B = op(A)^-1 B from an LU kept with its pivots as doubles after it
+static void lu_resolve
+(char trans, int N, const double *LU, int LDA, const double *piv,
+ int NRHS, double *B, int LDB) {
+  if (N == 0 || NRHS == 0) return;
+  std::vector<int> IPIV(piv, piv + N);
+  int INFO;
+  lapack::dgetrs_(&trans, &N, &NRHS, (double *)LU, &LDA, &IPIV[0],
+		  B, &LDB, &INFO);
+  assert(INFO == 0);
+}
+
+// C (m x n) += alpha * op(A) * B
+static void gemm_update
+(char transa, int m, int n, int k, double alpha,
+ const double *A, int LDA, const double *B, int LDB, double *C, int LDC) {
+  if (m == 0 || n == 0 || k == 0) return;
+  char   transb = 'n';
+  double beta   = 1.0;
+  blas::dgemm_(&transa, &transb, &m, &n, &k, &alpha, (double *)A, &LDA,
+	       (double *)B, &LDB, &beta, C, &LDC);
+}
+
+void serial_leaf_resolve
+  (bool trans, int ncol, const Node * unode, const Node * vnode,
+   const double * u_ptr, const double * v_ptr, const double * k_ptr,
+   const double * f_ptr, int LD, double * b_ptr)
+{
+  char op = trans ? 't' : 'n';
+  if (unode->is_real_leaf()) {
+    lu_resolve(op, unode->nrow, k_ptr + vnode->row_beg, LD, f_ptr,
+	       ncol, b_ptr + unode->row_beg, LD);
+    return;
+  }
+
+  const Node *u0 = unode->lchild(), *u1 = unode->rchild();
+  const Node *V0 = vnode->lchild(), *V1 = vnode->rchild();
+  int S_size = u0->ncol + u1->ncol;
+  const double *f0 = f_ptr + S_size*(S_size+1);
+  const double *f1 = f0 + leaf_factor_size(u0);
+  // A: the children first, A^T: the children last
+  if ( ! trans ) {
+    serial_leaf_resolve(trans, ncol, u0, V0, u_ptr, v_ptr, k_ptr, f0,
+			LD, b_ptr);
+    serial_leaf_resolve(trans, ncol, u1, V1, u_ptr, v_ptr, k_ptr, f1,
+			LD, b_ptr);
+  }
+
+  // X_c = A_c^-1 u_c is kept in the u columns
+  const double *X0 = u_ptr + u0->row_beg + u0->col_beg*LD;
+  const double *X1 = u_ptr + u1->row_beg + u1->col_beg*LD;
+  const double *W0 = v_ptr + V0->row_beg + V0->col_beg*LD;
+  const double *W1 = v_ptr + V1->row_beg + V1->col_beg*LD;
+  double *b0 = b_ptr + u0->row_beg;
+  double *b1 = b_ptr + u1->row_beg;
+
+  // the rhs of the node system of serial_leaf_solve() or of its
+  //  transpose, then b -= [u0, 0; 0, u1] eta for A and
+  //  b -= [V0, 0; 0, V1] eta for A^T
+  const double *L0 = trans ? X0 : W0, *L1 = trans ? X1 : W1;
+  const double *R0 = trans ? W0 : X0, *R1 = trans ? W1 : X1;
+  int k0 = trans ? u0->ncol : V0->ncol;
+  int k1 = trans ? u1->ncol : V1->ncol;
+  int e0 = trans ? V0->ncol : u0->ncol;
+  int e1 = trans ? V1->ncol : u1->ncol;
+  std::vector<double> eta(S_size*ncol, 0.0);
+  gemm_update('t', k0, ncol, u0->nrow, 1.0, L0, LD, b0, LD,
+	      &eta[0], S_size);
+  gemm_update('t', k1, ncol, u1->nrow, 1.0, L1, LD, b1, LD,
+	      &eta[k0], S_size);
+  lu_resolve(op, S_size, f_ptr, S_size, f_ptr + S_size*S_size,
+	     ncol, &eta[0], S_size);
+  gemm_update('n', u0->nrow, ncol, e0, -1.0, R0, LD, &eta[0], S_size,
+	      b0, LD);
+  gemm_update('n', u1->nrow, ncol, e1, -1.0, R1, LD, &eta[e0], S_size,
+	      b1, LD);
+
+  if (trans) {
+    serial_leaf_resolve(trans, ncol, u0, V0, u_ptr, v_ptr, k_ptr, f0,
+			LD, b_ptr);
+    serial_leaf_resolve(trans, ncol, u1, V1, u_ptr, v_ptr, k_ptr, f1,
+			LD, b_ptr);
+  }
+}
+
+
+void serial_leaf_matvec
+  (int ncol, const Node * unode, const Node * vnode,
+   const double * u_ptr, const double * v_ptr, const double * k_ptr,
+   int LD, const double * x_ptr, double * y_ptr)
+{
+  if (unode->is_real_leaf()) {
+    int n = unode->nrow;
+    for (int j=0; j<ncol; j++)
+      memset(y_ptr + unode->row_beg + j*LD, 0, n*sizeof(double));
+    gemm_update('n', n, ncol, n, 1.0, k_ptr + vnode->row_beg, LD,
+		x_ptr + unode->row_beg, LD, y_ptr + unode->row_beg, LD);
+    return;
+  }
+
+  const Node *u0 = unode->lchild(), *u1 = unode->rchild();
+  const Node *V0 = vnode->lchild(), *V1 = vnode->rchild();
+  serial_leaf_matvec(ncol, u0, V0, u_ptr, v_ptr, k_ptr, LD, x_ptr, y_ptr);
+  serial_leaf_matvec(ncol, u1, V1, u_ptr, v_ptr, k_ptr, LD, x_ptr, y_ptr);
+
+  // y0 += u0 (V1^T x1) and y1 += u1 (V0^T x0)
+  const double *U0 = u_ptr + u0->row_beg + u0->col_beg*LD;
+  const double *U1 = u_ptr + u1->row_beg + u1->col_beg*LD;
+  const double *W0 = v_ptr + V0->row_beg + V0->col_beg*LD;
+  const double *W1 = v_ptr + V1->row_beg + V1->col_beg*LD;
+  std::vector<double> t0(V1->ncol*ncol, 0.0), t1(V0->ncol*ncol, 0.0);
+  gemm_update('t', V1->ncol, ncol, u1->nrow, 1.0, W1, LD,
+	      x_ptr + u1->row_beg, LD, &t0[0], V1->ncol);
+  gemm_update('t', V0->ncol, ncol, u0->nrow, 1.0, W0, LD,
+	      x_ptr + u0->row_beg, LD, &t1[0], V0->ncol);
+  gemm_update('n', u0->nrow, ncol, u0->ncol, 1.0, U0, LD,
+	      &t0[0], V1->ncol, y_ptr + u0->row_beg, LD);
+  gemm_update('n', u1->nrow, ncol, u1->ncol, 1.0, U1, LD,
+	      &t1[0], V0->ncol, y_ptr + u1->row_beg, LD);
+}
+
+
+double node_solve_kernel
+  (int n0, int n1, int ncol,
+   const double *V0Tu0, int LD0, const double *V1Tu1, int LD1,
+   double *V0Td0, int LDd0, double *V1Td1, int LDd1, double *S_lu) {
+
+  char   transa = 'n';
+  char   transb = 'n';
+  double alpha  = -1.;
+  double beta   =  1.;
+
+  // Solve: S * eta0 = V1Td1 - V1Tu1 * V0Td0
+  // where S = I - V1Tu1 * V0Tu0
+  // Note:  eta0 overwrites V1Td1
+  blas::dgemm_(&transa, &transb, &n1, &ncol, &n0,
+	       &alpha, (double *)V1Tu1, &LD1, V0Td0, &LDd0,
+	       &beta,  V1Td1, &LDd1);
+
+  int N = n1;
+  double *S = (double*) calloc( N*N, sizeof(double) );
+  // initialize the indentity matrix
+  for (int i=0; i<N; i++)
+    S[i*(N+1)] = 1.;
+  blas::dgemm_(&transa, &transb, &n1, &n1, &n0,
+	       &alpha, (double *)V1Tu1, &LD1, (double *)V0Tu0, &LD0,
+	       &beta,  S, &N);
+
+  int INFO;
+  int IPIV[N];
+  lapack::dgesv_(&N, &ncol, S, &N, IPIV, V1Td1, &LDd1, &INFO);
+  assert(INFO == 0);
+  // det [I, V0Tu0; V1Tu1, I] = det S
+  double logdet = lu_log_det(S, N, N);
+  if (S_lu != NULL) {
+    memcpy(S_lu, S, N*N*sizeof(double));
+    for (int i=0; i<N; i++)
+      S_lu[N*N + i] = IPIV[i];
+  }
+
+  // Solve: I * eta1 = V0Td0 - V0Tu0 * eta0
+  // where no solve happens because of the indenty coefficience
+  // Note:  eta1 overwrites V0Td0
+  blas::dgemm_(&transa, &transb, &n0, &ncol, &n1,
+	       &alpha, (double *)V0Tu0, &LD0, V1Td1, &LDd1,
+	       &beta,  V0Td0, &LDd0);
+
+  free(S);
+  return logdet;
+}
+
+void node_resolve_kernel
+  (bool trans, int n0, int n1, int ncol,
+   const double *V0Tu0, const double *V1Tu1, const double *S_lu,
+   double *first, int LDf, double *second, int LDs) {
+
+  // A:   second -= V1Tu1 first, S second = second,
+  //      first  -= V0Tu0 second
+  // A^T: second -= V0Tu0^T first, S^T second = second,
+  //      first  -= V1Tu1^T second
+  char op = trans ? 't' : 'n';
+  const double *M1 = trans ? V0Tu0 : V1Tu1;
+  const double *M2 = trans ? V1Tu1 : V0Tu0;
+  int LD1 = trans ? n0 : n1;
+  int LD2 = trans ? n1 : n0;
+  gemm_update(op, n1, ncol, n0, -1.0, M1, LD1, first, LDf,
+	      second, LDs);
+  lu_resolve(op, n1, S_lu, n1, S_lu + n1*n1, ncol, second, LDs);
+  gemm_update(op, n0, ncol, n1, -1.0, M2, LD2, second, LDs,
+	      first, LDf);
+}
+
+void gemm_reduce_kernel
+  (int m, int n, int k, double alpha,
+   const double *v, int LDv, const double *u, int LDu,
+   double beta, double *w, int LDw) {
+  if (m == 0 || n == 0) return;
+  char transa = 't';
+  char transb = 'n';
+  blas::dgemm_(&transa, &transb, &m, &n, &k, &alpha,
+	       (double *)v, &LDv, (double *)u, &LDu, &beta, w, &LDw);
+}
+
+void gemm_broadcast_kernel
+  (int m, int n, int k, double alpha,
+   const double *u, int LDu, const double *eta, int LDeta,
+   double beta, double *d, int LDd) {
+  if (m == 0 || n == 0) return;
+  char transa = 'n';
+  char transb = 'n';
+  blas::dgemm_(&transa, &transb, &m, &n, &k, &alpha,
+	       (double *)u, &LDu, (double *)eta, &LDeta, &beta, d, &LDd);
+}
@@ -3,6 +3,9 @@
 #include "lapack_blas.h"
 #include "macros.h"
 
+#include <math.h>
+#include <vector>
+
 using namespace LegionRuntime::Accessor;
 
 
@@ -26,7 +29,8 @@ namespace {
     static void register_tasks(void);
 
   public:
-    static void
+    // returns log|det S|
+    static double
     cpu_task(const Task *task,
 	     const std::vector<PhysicalRegion> &regions,
 	     Context ctx, HighLevelRuntime *runtime);
@@ -45,20 +49,134 @@ namespace {
 
     static void register_tasks(void);
 
+  public:
+    // returns log|det| of the legion leaf block
+    static double cpu_task(const Task *task,
+			   const std::vector<PhysicalRegion> &regions,
+			   Context ctx, HighLevelRuntime *runtime);
+  };
+
+
+  // the node solve of LUSolveTask on private copies of V0Td0 and
+  //  V1Td1, followed by the broadcast d -= u * eta in one legion leaf
+  class ReplicatedSolveTask : public TaskLauncher {
+  public:
+    struct TaskArgs {
+      int side; // child of the node holding the leaf, 0 or 1
+      int u_col_beg, u_ncol;
+      int d_col_beg, d_ncol;
+    };
+
+    ReplicatedSolveTask(TaskArgument arg,
+			Predicate pred = Predicate::TRUE_PRED,
+			MapperID id = 0,
+			MappingTagID tag = 0);
+
+    static int TASKID;
+
+    static void register_tasks(void);
+
+  public:
+    // returns log|det S|, as every copy does
+    static double cpu_task(const Task *task,
+			   const std::vector<PhysicalRegion> &regions,
+			   Context ctx, HighLevelRuntime *runtime);
+  };
+
+
+  // serial_leaf_resolve() on a legion leaf. The regions are U, V, K
+  //  and the kept factors F, then the target if it is not U.
+  class LeafResolveTask : public TaskLauncher {
+  public:
+    // the arguments, then the V and U subtrees packed
+    enum {ARG_TRANS, ARG_COL_BEG, ARG_NCOL, ARG_FIELDS};
+
+    LeafResolveTask(TaskArgument arg,
+		    Predicate pred = Predicate::TRUE_PRED,
+		    MapperID id = 0,
+		    MappingTagID tag = 0);
+
+    static int TASKID;
+
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+
+
+  // serial_leaf_matvec() on a legion leaf. The regions are U, V and
+  //  K, then the target holding x and y.
+  class LeafMatvecTask : public TaskLauncher {
+  public:
+    // the arguments, then the V and U subtrees packed
+    enum {ARG_X_COL, ARG_Y_COL, ARG_NCOL, ARG_FIELDS};
+
+    LeafMatvecTask(TaskArgument arg,
+		   Predicate pred = Predicate::TRUE_PRED,
+		   MapperID id = 0,
+		   MappingTagID tag = 0);
+
+    static int TASKID;
+
+    static void register_tasks(void);
+
   public:
     static void cpu_task(const Task *task,
 			 const std::vector<PhysicalRegion> &regions,
 			 Context ctx, HighLevelRuntime *runtime);
   };
+
+
+  // node_resolve_kernel() on V0Tu0, V1Tu1, S, first and second
+  class NodeResolveTask : public TaskLauncher {
+  public:
+
+    NodeResolveTask(TaskArgument arg,
+		    Predicate pred = Predicate::TRUE_PRED,
+		    MapperID id = 0,
+		    MappingTagID tag = 0);
+
+    static int TASKID;
+
+    static void register_tasks(void);
+
+  public:
+    static void cpu_task(const Task *task,
+			 const std::vector<PhysicalRegion> &regions,
+			 Context ctx, HighLevelRuntime *runtime);
+  };
+
+
+  // sum of the double futures attached to the launcher
+  class AddFuturesTask : public TaskLauncher {
+  public:
+
+    AddFuturesTask(TaskArgument arg,
+		   Predicate pred = Predicate::TRUE_PRED,
+		   MapperID id = 0,
+		   MappingTagID tag = 0);
+  
+    static int TASKID;
+
+    static void register_tasks(void);
+
+  public:
+    static double cpu_task(const Task *task,
+			   const std::vector<PhysicalRegion> &regions,
+			   Context ctx, HighLevelRuntime *runtime);
+  };
 }
 
 
 // legion task wrapper
-void solve_node_matrix
+Future solve_node_matrix
   (LMatrix *(&V0Tu0), LMatrix *(&V1Tu1),
    LMatrix *(&V0Td0), LMatrix *(&V1Td1),
    Range task_tag, Context ctx,
-   HighLevelRuntime *runtime) {
+   HighLevelRuntime *runtime, LMatrix *S) {
 
   // this task can be indexed by any tag in the range.
   // the first tag is picked here.
@@ -92,10 +210,15 @@ void solve_node_matrix
 				   V1Td1->data)
 				  );
   
-  launcher.region_requirements[0].add_field(FID_X);
-  launcher.region_requirements[1].add_field(FID_X);
-  launcher.region_requirements[2].add_field(FID_X);
-  launcher.region_requirements[3].add_field(FID_X);
+  if (S != NULL)
+    launcher.add_region_requirement(RegionRequirement
+				    (S->data,
+				     WRITE_DISCARD,
+				     EXCLUSIVE,
+				     S->data)
+				    );
+  for (size_t i=0; i<launcher.region_requirements.size(); i++)
+    launcher.region_requirements[i].add_field(FID_X);
 
   Future f = runtime->execute_task(ctx, launcher);
 
@@ -103,6 +226,96 @@ void solve_node_matrix
   std::cout << "Waiting for node_solve task ..." << std::endl;
   f.get_void_result();
 #endif
+  return f;
+}
+
+
+static void launch_replicated
+(const Node *node, int side, const Range &ru, const Range &rd,
+ LMatrix *V0Tu0, LMatrix *V1Tu1, LMatrix *V0Td0, LMatrix *V1Td1,
+ Range task_tag, std::vector<Future> &logdet,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  if ( ! node->is_legion_leaf() ) {
+    launch_replicated(node->lchild(), side, ru, rd,
+		      V0Tu0, V1Tu1, V0Td0, V1Td1,
+		      task_tag.lchild(node->split_fraction()), logdet,
+		      ctx, runtime);
+    launch_replicated(node->rchild(), side, ru, rd,
+		      V0Tu0, V1Tu1, V0Td0, V1Td1,
+		      task_tag.rchild(node->split_fraction()), logdet,
+		      ctx, runtime);
+    return;
+  }
+
+  typedef ReplicatedSolveTask RST;
+  RST::TaskArgs args = {side,
+			ru.begin(), ru.size(),
+			rd.begin(), rd.size()};
+  RST launcher(TaskArgument(&args, sizeof(args)),
+	       Predicate::TRUE_PRED,
+	       0,
+	       task_tag.begin());
+  launcher.add_region_requirement(RegionRequirement
+				  (node->lowrank_matrix->data,
+				   READ_WRITE,
+				   EXCLUSIVE,
+				   node->lowrank_matrix->data)
+				  );
+  LMatrix *sys[4] = {V0Tu0, V1Tu1, V0Td0, V1Td1};
+  for (int i=0; i<4; i++)
+    launcher.add_region_requirement(RegionRequirement
+				    (sys[i]->data,
+				     READ_ONLY,
+				     EXCLUSIVE,
+				     sys[i]->data)
+				    );
+  for (int i=0; i<5; i++)
+    launcher.region_requirements[i].add_field(FID_X);
+
+  Future f = runtime->execute_task(ctx, launcher);
+  logdet.push_back(f);
+
+#ifdef SERIAL
+  std::cout << "Waiting for replicated node_solve task ..." << std::endl;
+  f.get_void_result();
+#endif
+}
+
+Future solve_node_replicated
+  (LMatrix *V0Tu0, LMatrix *V1Tu1,
+   LMatrix *V0Td0, LMatrix *V1Td1,
+   const Node *b0, const Range &ru0, const Range &rd0,
+   const Node *b1, const Range &ru1, const Range &rd1,
+   Range tag0, Range tag1,
+   Context ctx, HighLevelRuntime *runtime) {
+
+  std::vector<Future> logdet;
+  launch_replicated(b0, 0, ru0, rd0, V0Tu0, V1Tu1, V0Td0, V1Td1,
+		    tag0, logdet, ctx, runtime);
+  launch_replicated(b1, 1, ru1, rd1, V0Tu0, V1Tu1, V0Td0, V1Td1,
+		    tag1, logdet, ctx, runtime);
+  // all copies give the same determinant
+  return logdet.front();
+}
+
+
+// raw pointer and size of the i-th region, NULL if it is empty
+static double *region_ptr
+(const Task *task, const std::vector<PhysicalRegion> &regions, int i,
+ Context ctx, HighLevelRuntime *runtime, int &rows, int &cols) {
+  IndexSpace is = task->regions[i].region.get_index_space();
+  Rect<2> rect = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+  rows = rect.dim_size(0);
+  cols = rect.dim_size(1);
+  if (rect.volume() == 0) return NULL; // V of a real leaf
+  Rect<2> subrect;
+  ByteOffset offsets[2];
+  double *ptr = regions[i].get_field_accessor(FID_X).typeify<double>().
+    raw_rect_ptr<2>(rect, subrect, offsets);
+  assert(ptr != NULL);
+  assert(rect == subrect);
+  return ptr;
 }
 
 
@@ -122,7 +335,7 @@ LUSolveTask::LUSolveTask(
 void LUSolveTask::register_tasks(void)
 {
   TASKID = HighLevelRuntime::register_legion_task
-    <LUSolveTask::cpu_task>(
+    <double, LUSolveTask::cpu_task>(
 			    AUTO_GENERATE_ID,
 			    Processor::LOC_PROC, 
 			    true,
@@ -136,13 +349,14 @@ void LUSolveTask::register_tasks(void)
 #endif
 }
 
-void
+double
 LUSolveTask::cpu_task(const Task *task,
 		      const std::vector<PhysicalRegion> &regions,
 		      Context ctx, HighLevelRuntime *runtime) {
   
-  assert(regions.size() == 4);
-  assert(task->regions.size() == 4);
+  // the LU of S is kept in a fifth region
+  assert(regions.size() == 4 || regions.size() == 5);
+  assert(task->regions.size() == regions.size());
   assert(task->arglen == 0);
   
   IndexSpace is_V0Tu0 = task->regions[0].region.get_index_space();
@@ -203,105 +417,93 @@ LUSolveTask::cpu_task(const Task *task,
   assert(V0Tu0_rows + V1Tu1_rows == V0Td0_rows + V1Td1_rows);
 
 
-  /* form the Shur complement:
-     --            --
-     |  I    V0Tu0  | 
-     | V1Tu1  I     |
-     --            --
-     and the solutions eta0 and eta1 overwrite
-     V1Td1 and V0Td0. (Note the reversed order)
-  */
-
-  
-  // Solve: S * eta0 = V1Td1 - V1Tu1 * V0Td0
-  // where S = I - V1Tu1 * V0Tu0
-  // Note:  eta0 overwrites V1Td1
-  
-  char transa  = 'n';
-  char transb  = 'n';
-  double alpha = -1.;
-  double beta  =  1.;
-
-
-  /*
-  const char *save_file0 = "V1Td1.txt";
-  if (remove(save_file0) == 0)
-    std::cout << "Remove file: " << save_file0 << std::endl;
-  save_data(V1Td1, V1Td1_rows, 0, V1Td1_cols, save_file0);
-*/
-  
-  
-  assert(V1Tu1_cols == V0Td0_rows);
-  assert(V1Td1_rows == V1Tu1_rows);
-  blas::dgemm_(&transa, &transb,
-	       &V1Tu1_rows, &V0Td0_cols, &V1Tu1_cols,
-	       &alpha,      V1Tu1,       &V1Tu1_rows,
-	                    V0Td0,       &V0Td0_rows,
-	       &beta,       V1Td1,       &V1Td1_rows);
-
-
-
-  /*
-  const char *save_file3 = "V1Td1_finish.txt";
-  if (remove(save_file3) == 0)
-    std::cout << "Remove file: " << save_file3 << std::endl;
-  save_data(V1Td1, V1Td1_rows, 0, V1Td1_cols, save_file3);
-  */
+  double *S_lu = NULL;
+  if (regions.size() == 5) {
+    int rows, cols;
+    S_lu = region_ptr(task, regions, 4, ctx, runtime, rows, cols);
+    assert(rows == V1Tu1_rows && cols == rows+1);
+  }
 
+  // eta0 overwrites V1Td1 and eta1 overwrites V0Td0
+  return node_solve_kernel(V0Tu0_rows, V1Tu1_rows, V0Td0_cols,
+			   V0Tu0, V0Tu0_rows, V1Tu1, V1Tu1_rows,
+			   V0Td0, V0Td0_rows, V1Td1, V1Td1_rows, S_lu);
+}
 
 
-  
-  int N = V1Tu1_rows;
-  double *S = (double*) calloc( N*N, sizeof(double) );
-  // initialize the indentity matrix
-  for (int i=0; i<N; i++)
-    S[i*(N+1)] = 1.;
-
-  assert(V1Tu1_cols == V0Tu0_rows);
-  blas::dgemm_(&transa, &transb,
-	       &V1Tu1_rows, &V0Tu0_cols, &V1Tu1_cols,
-	       &alpha,      V1Tu1,       &V1Tu1_rows,
-	                    V0Tu0,       &V0Tu0_rows,
-	       &beta,       S,           &N);
+/* ---- ReplicatedSolveTask implementation ---- */
 
+/*static*/
+int ReplicatedSolveTask::TASKID;
 
+ReplicatedSolveTask::ReplicatedSolveTask(
+  TaskArgument arg,
+  Predicate pred /*= Predicate::TRUE_PRED*/,
+  MapperID id /*= 0*/,
+  MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
 
-  
-  /*
-  const char *save_file = "V1Td1.txt";
-  if (remove(save_file) == 0)
-    std::cout << "Remove file: " << save_file << std::endl;
-  save_data(V1Td1, V1Td1_rows, 0, V1Td1_cols, save_file);
-  */
+/*static*/
+void ReplicatedSolveTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <double, ReplicatedSolveTask::cpu_task>(
+			    AUTO_GENERATE_ID,
+			    Processor::LOC_PROC,
+			    true,
+			    true,
+			    AUTO_GENERATE_ID,
+			    TaskConfigOptions(true/*leaf*/),
+			    "Replicated_Solve");
 
-  
-  int INFO;
-  int IPIV[N];
-  assert(V0Td0_cols == V1Td1_cols);
-  lapack::dgesv_(&N,    &V1Td1_cols,
-		 S,     &N,          IPIV,
-		 V1Td1, &V1Td1_rows, &INFO);
-  assert(INFO == 0);
-
-
-  /*
-  const char *save_file2 = "V1Td1_finish.txt";
-  if (remove(save_file2) == 0)
-    std::cout << "Remove file: " << save_file2 << std::endl;
-  save_data(V1Td1, V1Td1_rows, 0, V1Td1_cols, save_file2);
-  */
-  
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : Replicated_Solve\n", TASKID);
+#endif
+}
 
-  // Solve: I * eta1 = V0Td0 - V0Tu0 * eta0
-  // where no solve happens because of the indenty coefficience
-  // Note:  eta1 overwrites V0Td0
-  assert(V0Tu0_cols == V1Td1_rows);
-  blas::dgemm_(&transa, &transb, &V0Tu0_rows, &V1Td1_cols, &V0Tu0_cols,
-	       &alpha,   V0Tu0,  &V0Tu0_rows,
-	                 V1Td1,  &V1Td1_rows,
-	       &beta,    V0Td0,  &V0Td0_rows);   
-  
-  free(S);
+double
+ReplicatedSolveTask::cpu_task(const Task *task,
+			      const std::vector<PhysicalRegion> &regions,
+			      Context ctx, HighLevelRuntime *runtime) {
+
+  assert(regions.size() == 5);
+  assert(task->regions.size() == 5);
+  assert(task->arglen == sizeof(TaskArgs));
+  const TaskArgs arg = *((const TaskArgs *)task->args);
+
+  // the leaf U, then V0Tu0, V1Tu1, V0Td0 and V1Td1
+  double *ptr[5];
+  int     rows[5], cols[5];
+  for (int i=0; i<5; i++) {
+    IndexSpace is = task->regions[i].region.get_index_space();
+    Rect<2> rect  = runtime->get_index_space_domain(ctx, is).get_rect<2>();
+    Rect<2> subrect;
+    ByteOffset offsets[2];
+    ptr[i] = regions[i].get_field_accessor(FID_X).typeify<double>().
+      raw_rect_ptr<2>(rect, subrect, offsets);
+    assert(rect == subrect);
+    rows[i] = rect.dim_size(0);
+    cols[i] = rect.dim_size(1);
+  }
+  assert(cols[3] == cols[4] && cols[3] == arg.d_ncol);
+  assert(rows[1] + rows[2] == cols[1] + cols[2]);
+  assert(arg.u_ncol == (arg.side == 0 ? rows[2] : rows[1]));
+
+  // every copy solves the node system, the inputs stay as they are
+  std::vector<double> V0Td0(ptr[3], ptr[3] + rows[3]*cols[3]);
+  std::vector<double> V1Td1(ptr[4], ptr[4] + rows[4]*cols[4]);
+  double logdet = node_solve_kernel(rows[1], rows[2], cols[3],
+				    ptr[1], rows[1], ptr[2], rows[2],
+				    &V0Td0[0], rows[3], &V1Td1[0], rows[4]);
+
+  // d -= u * eta with eta0 in V1Td1 and eta1 in V0Td0
+  const double *eta = arg.side == 0 ? &V1Td1[0] : &V0Td0[0];
+  double *u = ptr[0];
+  int     m = rows[0];
+  gemm_broadcast_kernel(m, arg.d_ncol, arg.u_ncol, -1.0,
+			u + arg.u_col_beg*m, m, eta, arg.u_ncol,
+			1.0, u + arg.d_col_beg*m, m);
+  return logdet;
 }
 
 
@@ -321,7 +523,7 @@ LeafSolveTask::LeafSolveTask(
 void LeafSolveTask::register_tasks(void)
 {
   TASKID = HighLevelRuntime::register_legion_task
-    <LeafSolveTask::cpu_task>(
+    <double, LeafSolveTask::cpu_task>(
 			      AUTO_GENERATE_ID,
 			      Processor::LOC_PROC, 
 			      true,
@@ -334,31 +536,25 @@ void LeafSolveTask::register_tasks(void)
 #endif
 }
 
-static void serial_leaf_solve
-  (Node * unode, Node * vnode,
-   double * u_ptr, double * v_ptr, double * k_ptr, int LD);
-
-void LeafSolveTask::cpu_task
+double LeafSolveTask::cpu_task
   (const Task *task,
    const std::vector<PhysicalRegion> &regions,
    Context ctx, HighLevelRuntime *runtime) {
 
-  assert(regions.size() == 3);
-  assert(task->regions.size() == 3);
-  Node *arg = (Node *)task->args;
-  
-  // decode tree size
-  int tree_size = arg[0].col_beg;
-  //std::cout << "Tree size: " << tree_size << std::endl;
-  arg[0].col_beg = 0;
-  assert(task->arglen == sizeof(Node)*(tree_size*2));
-
-  Node *vroot = arg;
-  array_to_tree(arg, 0);
-
-  Node *uroot = &arg[tree_size];
-  //array_to_tree(arg, 0, tree_size);
-  array_to_tree(arg+tree_size, 0);
+  // F, for the kept factors, comes fourth
+  assert(regions.size() == 3 || regions.size() == 4);
+  assert(task->regions.size() == regions.size());
+  // V and U subtrees are packed one after the other
+  const int *vdesc = (const int *)task->args;
+  const int *udesc = vdesc + packed_tree_size(vdesc);
+  assert(task->arglen == sizeof(int) *
+	 (packed_tree_size(vdesc) + packed_tree_size(udesc)));
+
+  NodeArena arena;
+  int vidx = unpack_tree(vdesc, arena);
+  int uidx = unpack_tree(udesc, arena);
+  Node *vroot = arena.at(vidx);
+  Node *uroot = arena.at(uidx);
   
   //print_legion_tree(vroot);
   //print_legion_tree(uroot);
@@ -408,175 +604,34 @@ void LeafSolveTask::cpu_task
    int l_dim  = offsets[1].offset / sizeof(double);
    int u_nrow = rect_u.dim_size(0);
    assert( l_dim == u_nrow );   
-   serial_leaf_solve(uroot, vroot, u_ptr, v_ptr, k_ptr, l_dim);
-}
 
-
-static void serial_leaf_solve
-  (Node * unode, Node * vnode,
-   double * u_ptr, double * v_ptr, double * k_ptr, int LD)
-{
-  /*
-  printf("vlchild: %p, vrchild: %p\n", vnode->lchild, vnode->rchild);
-  printf("ulchild: %p, urchild: %p\n", unode->lchild, unode->rchild);
-  */
-    
-  if (unode->is_real_leaf()) {
-    //printf("u nrow: %d, v nrow: %d\n", unode->nrow, vnode->nrow);
-    assert(unode->nrow == vnode->nrow);
-    int N     = unode->nrow;
-    int NRHS  = unode->col_beg + unode->ncol;
-    int LDA   = LD;
-    int LDB   = LD;
-    double *A = k_ptr + vnode->row_beg;
-    double *B = u_ptr + vnode->row_beg;
-      
-    int INFO;
-    int IPIV[N];
-      
-    lapack::dgesv_(&N, &NRHS, A, &LDA, IPIV, B, &LDB, &INFO);
-    assert(INFO == 0);
-    
-    //lapack::dgetrf_(&N, &N, A, &LDA, IPIV, &INFO);
-    /*
-    //assume no pivoting
-    for (int i=0; i<N; i++)
-      IPIV[i] = i+1;
-    */
-    //char TRANS = 'n';
-    //lapack::dgetrs_(&TRANS, &N, &NRHS, A, &LDA, IPIV, B, &LDB, &INFO);
-
-    return;
-  }
-
-  serial_leaf_solve(unode->lchild, vnode->lchild, u_ptr, v_ptr, k_ptr, LD);
-  serial_leaf_solve(unode->rchild, vnode->rchild, u_ptr, v_ptr, k_ptr, LD);
-  
-  char   transa = 't';
-  char   transb = 'n';
-  double alpha  = 1.0;
-  double beta   = 0.0;
-  
-  int V0_rows = vnode->lchild->nrow;
-  int V0_cols = vnode->lchild->ncol;
-  int V1_rows = vnode->rchild->nrow;
-  int V1_cols = vnode->rchild->ncol;
-
-  int u0_rows = unode->lchild->nrow;
-  int u0_cols = unode->lchild->ncol;
-  int u1_rows = unode->rchild->nrow;
-  int u1_cols = unode->rchild->ncol;
-  
-  int d0_rows = unode->lchild->nrow;
-  int d0_cols = unode->lchild->col_beg;
-  int d1_rows = unode->rchild->nrow;
-  int d1_cols = unode->rchild->col_beg;
-  
-  double *V0 = v_ptr + vnode->lchild->row_beg + vnode->lchild->col_beg*LD;
-  double *V1 = v_ptr + vnode->rchild->row_beg + vnode->rchild->col_beg*LD;
-  double *u0 = u_ptr + unode->lchild->row_beg + unode->lchild->col_beg*LD;
-  double *u1 = u_ptr + unode->rchild->row_beg + unode->rchild->col_beg*LD;
-  double *d0 = u_ptr + unode->lchild->row_beg;
-  double *d1 = u_ptr + unode->rchild->row_beg;
-
-
-  // Shur complement
-  assert(V0_cols + V1_cols == u0_cols + u1_cols);
-  int    S_size = V0_cols + V1_cols;
-  double *S = (double *) calloc( S_size*S_size, sizeof(double) );
-
-  assert(d0_cols == d1_cols);
-  double *S_RHS = (double *) malloc( S_size*d0_cols * sizeof(double) );
-  
-  // initialize the off-diagonal blocks to identity
-  for (int i=0; i<S_size; i++)
-    S[ (V0_cols + i)%S_size + i*S_size ] = 1.0;
-
-  assert(V0_rows == u0_rows);
-  assert(V1_rows == u1_rows);
-  assert(V0_rows == d0_rows);
-  assert(V1_rows == d1_rows);
-
-  double *V0Tu0 = S;
-  double *V1Tu1 = S + (V0_cols + u0_cols*S_size);
-  double *V0Td0 = S_RHS;
-  double *V1Td1 = S_RHS + V0_cols;
-  
-  blas::dgemm_(&transa, &transb, &V0_cols, &u0_cols, &V0_rows, &alpha, V0, &LD, u0, &LD, &beta, V0Tu0, &S_size);
-  blas::dgemm_(&transa, &transb, &V1_cols, &u1_cols, &V1_rows, &alpha, V1, &LD, u1, &LD, &beta, V1Tu1, &S_size);
-  blas::dgemm_(&transa, &transb, &V0_cols, &d0_cols, &V0_rows, &alpha, V0, &LD, d0, &LD, &beta, V0Td0, &S_size);
-  blas::dgemm_(&transa, &transb, &V1_cols, &d1_cols, &V1_rows, &alpha, V1, &LD, d1, &LD, &beta, V1Td1, &S_size);
-
-  
-  int INFO;
-  int IPIV[S_size];
-  assert(d0_cols == d1_cols);
-
-  lapack::dgesv_(&S_size, &d0_cols, S, &S_size, IPIV, S_RHS, &S_size, &INFO);
-  assert(INFO == 0);
-
-
-  //save_matrix(S_RHS, S_size, d1_cols, "S_RHS.txt");  
-  transa =  'n';
-  alpha  = -1.0;
-  beta   =  1.0;
-  
-  double * eta0 = S_RHS;          
-  double * eta1 = S_RHS + V1_cols;
-
-  int eta0_rows = V1_cols;
-  int eta0_cols = d0_cols;
-  int eta1_rows = V0_cols;
-  int eta1_cols = d0_cols;
-  
-  assert(u0_cols == eta0_rows);
-  assert(u1_cols == eta1_rows);
-  blas::dgemm_(&transa, &transb, &u0_rows, &eta0_cols, &u0_cols, &alpha, u0, &LD, eta0, &S_size, &beta, d0, &LD);
-  blas::dgemm_(&transa, &transb, &u1_rows, &eta1_cols, &u1_cols, &alpha, u1, &LD, eta1, &S_size, &beta, d1, &LD);
-
-  
-  //printf("d0 2x2: %f, %f, %f, %f.\n", d0[0], d0[1], d0[LD], d0[LD+1]);
-  
-  //save_matrix(V0Tu0, V0_cols, u0_cols, "V0Tu0.txt");
-  //save_matrix(V1Tu1, V1_cols, u1_cols, "V1Tu1.txt");
-  //save_matrix(V0Td0, V0_cols, d0_cols, "V0Td0.txt");
-  //save_matrix(V1Td1, V1_cols, d1_cols, "V1Td1.txt");
-  //save_matrix(S,     S_size, S_size,  "Shur.txt");
-  //save_matrix(S_RHS, S_size, d1_cols, "S_RHS.txt");
-  //save_matrix(d0, unode->nrow, unode->col_beg+unode->ncol, LD, "result.txt");
-
-  free(S);
-  free(S_RHS);
+   double *f_ptr = NULL;
+   if (regions.size() == 4) {
+     int rows, cols;
+     f_ptr = region_ptr(task, regions, 3, ctx, runtime, rows, cols);
+     assert(rows == leaf_factor_size(uroot) && cols == 1);
+   }
+   return serial_leaf_solve(uroot, vroot, u_ptr, v_ptr, k_ptr, l_dim,
+			    f_ptr);
 }
 
 
 // this function wrapper launches leaf tasks
-void solve_legion_leaf
+Future solve_legion_leaf
 (const Node * uleaf, const Node * vleaf,
  const Range task_tag,
- Context ctx, HighLevelRuntime *runtime) {
+ Context ctx, HighLevelRuntime *runtime,
+ LMatrix *F) {
   
-  int nleaf = count_leaf(uleaf);
-  //assert(nleaf == nleaf_per_node);
-  //int max_tree_size = nleaf_per_node * 2;
-  int max_tree_size = nleaf * 2;
-  Node arg[max_tree_size*2+2];
-
-  arg[0] = *vleaf;
-  int tree_size = tree_to_array(vleaf, arg, 0);
-  //std::cout << "Tree size: " << tree_size << std::endl;
-  assert(tree_size < max_tree_size);
-
-  arg[max_tree_size] = *uleaf;
-  tree_to_array(uleaf, arg, 0, max_tree_size);
-
-  // encode the array size
-  arg[0].col_beg = max_tree_size;
-
+  int vsize = pack_tree_size(vleaf);
+  int usize = pack_tree_size(uleaf);
+  std::vector<int> arg(vsize + usize);
+  pack_tree(vleaf, &arg[0]);
+  pack_tree(uleaf, &arg[vsize]);
   
   LeafSolveTask launcher(TaskArgument(
 			   &arg[0],
-			   sizeof(Node)*(max_tree_size*2)),
+			   sizeof(int)*arg.size()),
 			 Predicate::TRUE_PRED,
 			 0,
 			 task_tag.begin()
@@ -594,23 +649,376 @@ void solve_legion_leaf
 		      vleaf->lowrank_matrix->data)); // v region
   launcher.add_region_requirement(
     RegionRequirement(vleaf->dense_matrix->data,
-		      READ_ONLY,
+		      READ_WRITE,
 		      EXCLUSIVE,
-		      vleaf->dense_matrix->data)); // k region
-  launcher.region_requirements[0].add_field(FID_X);
-  launcher.region_requirements[1].add_field(FID_X);
-  launcher.region_requirements[2].add_field(FID_X);    
+		      vleaf->dense_matrix->data)); // k region, factored
+  if (F != NULL)
+    launcher.add_region_requirement(
+      RegionRequirement(F->data,
+			WRITE_DISCARD,
+			EXCLUSIVE,
+			F->data)); // kept factors
+  for (size_t i=0; i<launcher.region_requirements.size(); i++)
+    launcher.region_requirements[i].add_field(FID_X);
   Future ft = runtime->execute_task(ctx, launcher);
   
 #ifdef SERIAL
   std::cout << "Waiting for leaf_solve task ..." << std::endl;
   ft.get_void_result();
 #endif
+  return ft;
+}
+
+
+void resolve_legion_leaf
+(bool trans, const Node *uleaf, const Node *vleaf, LMatrix *F,
+ const Node *target, const Range &cols, const Range task_tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  typedef LeafResolveTask LRT;
+  int vsize = pack_tree_size(vleaf);
+  int usize = pack_tree_size(uleaf);
+  std::vector<int> arg(LRT::ARG_FIELDS + vsize + usize);
+  arg[LRT::ARG_TRANS]   = trans;
+  arg[LRT::ARG_COL_BEG] = cols.begin();
+  arg[LRT::ARG_NCOL]    = cols.size();
+  pack_tree(vleaf, &arg[LRT::ARG_FIELDS]);
+  pack_tree(uleaf, &arg[LRT::ARG_FIELDS + vsize]);
+
+  LRT launcher(TaskArgument(&arg[0], sizeof(int)*arg.size()),
+	       Predicate::TRUE_PRED,
+	       0,
+	       task_tag.begin());
+  LogicalRegion udata = uleaf->lowrank_matrix->data;
+  LogicalRegion tdata = target->lowrank_matrix->data;
+  bool inplace = tdata == udata;
+  LogicalRegion regions[5] = {udata,
+			      vleaf->lowrank_matrix->data,
+			      vleaf->dense_matrix->data,
+			      F->data,
+			      tdata};
+  for (int i=0; i<(inplace ? 4 : 5); i++)
+    launcher.add_region_requirement(
+      RegionRequirement(regions[i],
+			(i == 0 && inplace) || i == 4 ?
+			READ_WRITE : READ_ONLY,
+			EXCLUSIVE,
+			regions[i]).add_field(FID_X));
+  Future ft = runtime->execute_task(ctx, launcher);
+
+#ifdef SERIAL
+  std::cout << "Waiting for leaf_resolve task ..." << std::endl;
+  ft.get_void_result();
+#endif
+}
+
+
+void matvec_legion_leaf
+(const Node *uleaf, const Node *vleaf, const Node *target,
+ const Range &xcols, const Range &ycols, const Range task_tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  typedef LeafMatvecTask LMT;
+  assert(xcols.size() == ycols.size());
+  int vsize = pack_tree_size(vleaf);
+  int usize = pack_tree_size(uleaf);
+  std::vector<int> arg(LMT::ARG_FIELDS + vsize + usize);
+  arg[LMT::ARG_X_COL] = xcols.begin();
+  arg[LMT::ARG_Y_COL] = ycols.begin();
+  arg[LMT::ARG_NCOL]  = xcols.size();
+  pack_tree(vleaf, &arg[LMT::ARG_FIELDS]);
+  pack_tree(uleaf, &arg[LMT::ARG_FIELDS + vsize]);
+
+  LMT launcher(TaskArgument(&arg[0], sizeof(int)*arg.size()),
+	       Predicate::TRUE_PRED,
+	       0,
+	       task_tag.begin());
+  LogicalRegion regions[4] = {uleaf->lowrank_matrix->data,
+			      vleaf->lowrank_matrix->data,
+			      vleaf->dense_matrix->data,
+			      target->lowrank_matrix->data};
+  for (int i=0; i<4; i++)
+    launcher.add_region_requirement(
+      RegionRequirement(regions[i],
+			i == 3 ? READ_WRITE : READ_ONLY,
+			EXCLUSIVE,
+			regions[i]).add_field(FID_X));
+  Future ft = runtime->execute_task(ctx, launcher);
+
+#ifdef SERIAL
+  std::cout << "Waiting for leaf_matvec task ..." << std::endl;
+  ft.get_void_result();
+#endif
+}
+
+
+void resolve_node_matrix
+(bool trans, LMatrix *V0Tu0, LMatrix *V1Tu1, LMatrix *S,
+ LMatrix *first, LMatrix *second, const Range task_tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  int flag = trans;
+  NodeResolveTask launcher(TaskArgument(&flag, sizeof(flag)),
+			   Predicate::TRUE_PRED,
+			   0,
+			   task_tag.begin());
+  LMatrix *sys[5] = {V0Tu0, V1Tu1, S, first, second};
+  for (int i=0; i<5; i++)
+    launcher.add_region_requirement(
+      RegionRequirement(sys[i]->data,
+			i < 3 ? READ_ONLY : READ_WRITE,
+			EXCLUSIVE,
+			sys[i]->data).add_field(FID_X));
+  Future f = runtime->execute_task(ctx, launcher);
+
+#ifdef SERIAL
+  std::cout << "Waiting for node_resolve task ..." << std::endl;
+  f.get_void_result();
+#endif
+}
+
+
+Future sum_futures
+(const std::vector<Future> &futures, int task_tag,
+ Context ctx, HighLevelRuntime *runtime) {
+
+  AddFuturesTask launcher(TaskArgument(NULL, 0),
+			  Predicate::TRUE_PRED,
+			  0,
+			  task_tag);
+  for (size_t i=0; i<futures.size(); i++)
+    launcher.add_future(futures[i]);
+  return runtime->execute_task(ctx, launcher);
+}
+
+
+/* ---- LeafResolveTask implementation ---- */
+
+/*static*/
+int LeafResolveTask::TASKID;
+
+LeafResolveTask::LeafResolveTask(
+  TaskArgument arg,
+  Predicate pred /*= Predicate::TRUE_PRED*/,
+  MapperID id /*= 0*/,
+  MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void LeafResolveTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <LeafResolveTask::cpu_task>(
+			      AUTO_GENERATE_ID,
+			      Processor::LOC_PROC,
+			      true,
+			      true,
+			      AUTO_GENERATE_ID,
+			      TaskConfigOptions(true/*leaf*/),
+			      "Leaf_Resolve");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : Leaf_Resolve\n", TASKID);
+#endif
+}
+
+void LeafResolveTask::cpu_task
+  (const Task *task,
+   const std::vector<PhysicalRegion> &regions,
+   Context ctx, HighLevelRuntime *runtime) {
+
+  assert(regions.size() == 4 || regions.size() == 5);
+  assert(task->regions.size() == regions.size());
+  const int *arg   = (const int *)task->args;
+  const int *vdesc = arg + ARG_FIELDS;
+  const int *udesc = vdesc + packed_tree_size(vdesc);
+  assert(task->arglen == sizeof(int) *
+	 (ARG_FIELDS + packed_tree_size(vdesc) + packed_tree_size(udesc)));
+
+  NodeArena arena;
+  int vidx = unpack_tree(vdesc, arena);
+  int uidx = unpack_tree(udesc, arena);
+
+  int rows, cols, n, bcols;
+  double *u_ptr = region_ptr(task, regions, 0, ctx, runtime, n, bcols);
+  double *v_ptr = region_ptr(task, regions, 1, ctx, runtime, rows, cols);
+  double *k_ptr = region_ptr(task, regions, 2, ctx, runtime, rows, cols);
+  double *f_ptr = region_ptr(task, regions, 3, ctx, runtime, rows, cols);
+  assert(rows == leaf_factor_size(arena.at(uidx)));
+  // the rhs columns of U, or of the target
+  double *b_ptr = u_ptr;
+  if (regions.size() == 5) {
+    b_ptr = region_ptr(task, regions, 4, ctx, runtime, rows, bcols);
+    assert(rows == n);
+  }
+  assert(arg[ARG_COL_BEG] + arg[ARG_NCOL] <= bcols);
+  serial_leaf_resolve(arg[ARG_TRANS], arg[ARG_NCOL],
+		      arena.at(uidx), arena.at(vidx),
+		      u_ptr, v_ptr, k_ptr, f_ptr, n,
+		      b_ptr + arg[ARG_COL_BEG]*n);
+}
+
+
+/* ---- LeafMatvecTask implementation ---- */
+
+/*static*/
+int LeafMatvecTask::TASKID;
+
+LeafMatvecTask::LeafMatvecTask(
+  TaskArgument arg,
+  Predicate pred /*= Predicate::TRUE_PRED*/,
+  MapperID id /*= 0*/,
+  MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void LeafMatvecTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <LeafMatvecTask::cpu_task>(
+			      AUTO_GENERATE_ID,
+			      Processor::LOC_PROC,
+			      true,
+			      true,
+			      AUTO_GENERATE_ID,
+			      TaskConfigOptions(true/*leaf*/),
+			      "Leaf_Matvec");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : Leaf_Matvec\n", TASKID);
+#endif
+}
+
+void LeafMatvecTask::cpu_task
+  (const Task *task,
+   const std::vector<PhysicalRegion> &regions,
+   Context ctx, HighLevelRuntime *runtime) {
+
+  assert(regions.size() == 4);
+  assert(task->regions.size() == 4);
+  const int *arg   = (const int *)task->args;
+  const int *vdesc = arg + ARG_FIELDS;
+  const int *udesc = vdesc + packed_tree_size(vdesc);
+  assert(task->arglen == sizeof(int) *
+	 (ARG_FIELDS + packed_tree_size(vdesc) + packed_tree_size(udesc)));
+
+  NodeArena arena;
+  int vidx = unpack_tree(vdesc, arena);
+  int uidx = unpack_tree(udesc, arena);
+
+  int rows, cols, n, tcols;
+  double *u_ptr = region_ptr(task, regions, 0, ctx, runtime, n, cols);
+  double *v_ptr = region_ptr(task, regions, 1, ctx, runtime, rows, cols);
+  double *k_ptr = region_ptr(task, regions, 2, ctx, runtime, rows, cols);
+  double *t_ptr = region_ptr(task, regions, 3, ctx, runtime, rows, tcols);
+  assert(rows == n);
+  assert(arg[ARG_X_COL] + arg[ARG_NCOL] <= tcols);
+  assert(arg[ARG_Y_COL] + arg[ARG_NCOL] <= tcols);
+  serial_leaf_matvec(arg[ARG_NCOL], arena.at(uidx), arena.at(vidx),
+		     u_ptr, v_ptr, k_ptr, n,
+		     t_ptr + arg[ARG_X_COL]*n, t_ptr + arg[ARG_Y_COL]*n);
+}
+
+
+/* ---- NodeResolveTask implementation ---- */
+
+/*static*/
+int NodeResolveTask::TASKID;
+
+NodeResolveTask::NodeResolveTask(
+  TaskArgument arg,
+  Predicate pred /*= Predicate::TRUE_PRED*/,
+  MapperID id /*= 0*/,
+  MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void NodeResolveTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <NodeResolveTask::cpu_task>(
+			      AUTO_GENERATE_ID,
+			      Processor::LOC_PROC,
+			      true,
+			      true,
+			      AUTO_GENERATE_ID,
+			      TaskConfigOptions(true/*leaf*/),
+			      "Node_Resolve");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : Node_Resolve\n", TASKID);
+#endif
+}
+
+void NodeResolveTask::cpu_task
+  (const Task *task,
+   const std::vector<PhysicalRegion> &regions,
+   Context ctx, HighLevelRuntime *runtime) {
+
+  assert(regions.size() == 5);
+  assert(task->regions.size() == 5);
+  assert(task->arglen == sizeof(int));
+  bool trans = *((const int *)task->args);
+
+  // V0Tu0, V1Tu1, S, first and second
+  double *ptr[5];
+  int     rows[5], cols[5];
+  for (int i=0; i<5; i++)
+    ptr[i] = region_ptr(task, regions, i, ctx, runtime, rows[i], cols[i]);
+  int n0 = rows[0], n1 = rows[1];
+  assert(cols[0] == n1 && cols[1] == n0 && rows[2] == n1);
+  assert(rows[3] == n0 && rows[4] == n1 && cols[3] == cols[4]);
+  node_resolve_kernel(trans, n0, n1, cols[3], ptr[0], ptr[1], ptr[2],
+		      ptr[3], n0, ptr[4], n1);
+}
+
+
+/* ---- AddFuturesTask implementation ---- */
+
+/*static*/
+int AddFuturesTask::TASKID;
+
+AddFuturesTask::AddFuturesTask(
+  TaskArgument arg,
+  Predicate pred /*= Predicate::TRUE_PRED*/,
+  MapperID id /*= 0*/,
+  MappingTagID tag /*= 0*/)
+  : TaskLauncher(TASKID, arg, pred, id, tag) {}
+
+/*static*/
+void AddFuturesTask::register_tasks(void)
+{
+  TASKID = HighLevelRuntime::register_legion_task
+    <double, AddFuturesTask::cpu_task>(
+			      AUTO_GENERATE_ID,
+			      Processor::LOC_PROC, 
+			      true,
+			      true,
+			      AUTO_GENERATE_ID,
+			      TaskConfigOptions(true/*leaf*/),
+			      "add_futures");
+#ifdef SHOW_REGISTER_TASKS
+  printf("Register task %d : add_futures\n", TASKID);
+#endif
+}
+
+double AddFuturesTask::cpu_task
+  (const Task *task,
+   const std::vector<PhysicalRegion> &regions,
+   Context ctx, HighLevelRuntime *runtime) {
+
+  assert(regions.size() == 0);
+  double sum = 0;
+  for (size_t i=0; i<task->futures.size(); i++)
+    sum += task->futures[i].get_result<double>();
+  return sum;
 }
 
 
 void register_solver_operators() {
   LeafSolveTask::register_tasks();
   LUSolveTask::register_tasks();
+  ReplicatedSolveTask::register_tasks();
+  LeafResolveTask::register_tasks();
+  LeafMatvecTask::register_tasks();
+  NodeResolveTask::register_tasks();
+  AddFuturesTask::register_tasks();
 }
 
@@ -0,0 +1,140 @@
+#include <assert.h>
+#include <sched.h>
+
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int n)
+  : nthreads(n), workers(n), round(0), remaining(0), quit(false) {
+
+  assert(n > 0);
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&start, NULL);
+  pthread_cond_init(&done,  NULL);
+  for (int i=0; i<n; i++) {
+    workers[i].pool = this;
+    workers[i].id   = i;
+    pthread_mutex_init(&workers[i].lock, NULL);
+  }
+  for (int i=0; i<n; i++)
+    pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+}
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock(&lock);
+  quit = true;
+  pthread_cond_broadcast(&start);
+  pthread_mutex_unlock(&lock);
+  for (int i=0; i<nthreads; i++)
+    pthread_join(workers[i].thread, NULL);
+  for (int i=0; i<nthreads; i++)
+    pthread_mutex_destroy(&workers[i].lock);
+  pthread_cond_destroy(&done);
+  pthread_cond_destroy(&start);
+  pthread_mutex_destroy(&lock);
+}
+
+int ThreadPool::add_task(TaskFunc f, void *arg) {
+  Task t;
+  t.func = f;
+  t.arg  = arg;
+  t.deps = 0;
+  tasks.push_back(t);
+  return tasks.size()-1;
+}
+
+void ThreadPool::add_dependence(int before, int after) {
+  assert(before < after); // tasks are added in a topological order
+  tasks[before].succ.push_back(after);
+  tasks[after].deps++;
+}
+
+void ThreadPool::run() {
+  if (tasks.empty()) return;
+
+  std::vector<int> sources;
+  for (size_t i=0; i<tasks.size(); i++)
+    if (tasks[i].deps == 0)
+      sources.push_back(i);
+
+  // a worker still leaving the last run may already take these
+  pthread_mutex_lock(&lock);
+  remaining = tasks.size();
+  pthread_mutex_unlock(&lock);
+  for (size_t i=0; i<sources.size(); i++)
+    push(i % nthreads, sources[i]);
+
+  pthread_mutex_lock(&lock);
+  round++;
+  pthread_cond_broadcast(&start);
+  while (remaining > 0)
+    pthread_cond_wait(&done, &lock);
+  pthread_mutex_unlock(&lock);
+  tasks.clear();
+}
+
+void ThreadPool::push(int id, int task) {
+  Worker &w = workers[id];
+  pthread_mutex_lock(&w.lock);
+  w.ready.push_back(task);
+  pthread_mutex_unlock(&w.lock);
+}
+
+// the newest task of worker id, or else the oldest of another one
+bool ThreadPool::next_task(int id, int &task) {
+  for (int i=0; i<nthreads; i++) {
+    Worker &w = workers[(id+i) % nthreads];
+    pthread_mutex_lock(&w.lock);
+    bool found = ! w.ready.empty();
+    if (found && i == 0) {
+      task = w.ready.back();
+      w.ready.pop_back();
+    } else if (found) {
+      task = w.ready.front();
+      w.ready.pop_front();
+    }
+    pthread_mutex_unlock(&w.lock);
+    if (found) return true;
+  }
+  return false;
+}
+
+void ThreadPool::finish(int id, int task) {
+  const std::vector<int> &succ = tasks[task].succ;
+  for (size_t i=0; i<succ.size(); i++)
+    if (__sync_sub_and_fetch(&tasks[succ[i]].deps, 1) == 0)
+      push(id, succ[i]);
+
+  pthread_mutex_lock(&lock);
+  if (--remaining == 0)
+    pthread_cond_signal(&done);
+  pthread_mutex_unlock(&lock);
+}
+
+void *ThreadPool::work(void *arg) {
+  Worker     *me   = (Worker *)arg;
+  ThreadPool *pool = me->pool;
+  int         seen = 0; // the last run taken part in
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while ( ! pool->quit && pool->round == seen )
+      pthread_cond_wait(&pool->start, &pool->lock);
+    bool quit = pool->quit;
+    seen = pool->round;
+    pthread_mutex_unlock(&pool->lock);
+    if (quit) return NULL;
+
+    for (;;) {
+      int task;
+      if (pool->next_task(me->id, task)) {
+	pool->tasks[task].func(pool->tasks[task].arg);
+	pool->finish(me->id, task);
+	continue;
+      }
+      pthread_mutex_lock(&pool->lock);
+      bool over = pool->remaining == 0;
+      pthread_mutex_unlock(&pool->lock);
+      if (over) break;
+      sched_yield();
+    }
+  }
+}
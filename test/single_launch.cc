@@ -1,11 +1,21 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <sstream>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "range.h"
 #include "fast_solver.h"
 #include "direct_solve.h"
+#include "recompress.h"
+#include "shared_solver.h"
+#include "host_tree.h"
+#include "krylov.h"
+#include "kernel_matrix_tasks.h"
+#include "batch_solver.h"
+#include "timer.hpp"
 #include "legion.h"
 #include "custom_mapper.h"
 
@@ -13,70 +23,770 @@ enum {
   TOP_LEVEL_TASK_ID = 0,
 };
 
-void top_level_task(const Task *task,
-		    const std::vector<PhysicalRegion> &regions,
-		    Context ctx, HighLevelRuntime *runtime) {  
- 
-  // assume the tree is balanced
-  int gloTreeLevel = 3;
-  int numMachineNodes = 2;
-
-  // random seed
-  long seed = 1245667;
-
-  // ---------------------------------------------------------
-  // Problem configuration
-  int nRHS = 2;             // # of rhs
-  int rank = 30; //300;
-  int threshold = 60; //600;
-  int leafSize = 1;         // legion leaf size
-  double diagonal = 1.0e4;
-  // ---------------------------------------------------------  
-    
-  int gloLevel = gloTreeLevel;
-  int subLevel = gloLevel;  
-  int nRow = threshold*(1<<subLevel);
-  const char* name = "global";
-  Range procs(numMachineNodes);
-  
-  HodlrMatrix hMatrix(nRHS, nRow, gloLevel, subLevel, rank,
-			threshold, leafSize, name);
-  hMatrix.create_tree( ctx, runtime );
-
-  //-----------------------------------------------
-  // deferred initialization
-  // (1) umat : add row_beg in leaf_solve()
-  // (2) kmat : the same as above
-  // (3) vmat : the same as above
-  //-----------------------------------------------
-
-  
-  // random right hand side
-  hMatrix.init_rhs(seed, procs, ctx, runtime);
-  hMatrix.init_circulant_matrix(diagonal, procs, ctx, runtime);
-  
+// A for the Krylov solvers, from the dense matrix
+static std::vector<double> denseA;
+
+static void dense_matvec
+(bool transpose, int ncol, const double *X, double *Y) {
+  int N = (int)sqrt((double)denseA.size());
+  for (int c=0; c<ncol; c++)
+    for (int i=0; i<N; i++) {
+      double s = 0;
+      for (int j=0; j<N; j++)
+	s += (transpose ? denseA[j+i*N] : denseA[i+j*N]) * X[j+c*N];
+      Y[i+c*N] = s;
+    }
+}
+
+// a Gaussian plus the identity on points in the plane
+static double gaussian_kernel(int i, int j, const double *points) {
+  double dx = points[2*i]   - points[2*j];
+  double dy = points[2*i+1] - points[2*j+1];
+  return exp(-dx*dx - dy*dy) + (i == j ? 1. : 0.);
+}
+static int kernelId;
+
+// the problem of every test, from the command line
+struct Config {
+  int nRow;
+  int nRHS;
+  int rank;
+  int threshold;
+  int leafSize;        // legion leaf size, 0 for automatic
+  int gloLevel;
+  int subLevel;
+  int numMachineNodes;
+  int coresPerNode;    // used by the automatic leaf size
+  int threads;         // of the shared memory solver
+  int levels;          // of the coarse, replicated and jacobi solves
+  int batch;           // systems of the batch test
+  long seed;
+  double diagonal;
+  double tol;          // recompression tolerance
+  Range procs;
+};
+
+// parsed in main() on every process; any problem size -n works.
+//  -test <name> runs one test and can be repeated, -test all runs all
+//  of them; the default is the solve test.
+static Config config;
+static std::vector<std::string> testNames;
+
+// points in the unit square for the kernel matrix, made from the seed
+//  in main() so that every process has the same ones
+static std::vector<double> kernelPoints;
+
+static void parse_config(int argc, char **argv) {
+  Config &c = config;
+  c.nRHS            = 2;
+  c.rank            = 30;
+  c.threshold       = 60;
+  c.leafSize        = 1;
+  c.gloLevel        = 3;
+  c.subLevel        = c.gloLevel;
+  c.nRow            = c.threshold*(1<<c.subLevel);
+  c.numMachineNodes = 2;
+  c.coresPerNode    = 12;
+  c.threads         = 4;
+  c.levels          = 2;
+  c.batch           = 6;
+  c.seed            = 1245667;
+  c.diagonal        = 1.0e4;
+  c.tol             = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i],"-n"))
+      c.nRow = atoi(argv[++i]);
+    if (!strcmp(argv[i],"-np"))
+      c.numMachineNodes = atoi(argv[++i]);
+    if (!strcmp(argv[i],"-leaf"))
+      c.leafSize = atoi(argv[++i]);
+    if (!strcmp(argv[i],"-cores"))
+      c.coresPerNode = atoi(argv[++i]);
+    if (!strcmp(argv[i],"-tol"))
+      c.tol = atof(argv[++i]);
+    if (!strcmp(argv[i],"-threads"))
+      c.threads = atoi(argv[++i]);
+    if (!strcmp(argv[i],"-levels"))
+      c.levels = atoi(argv[++i]);
+    if (!strcmp(argv[i],"-batch"))
+      c.batch = atoi(argv[++i]);
+    if (!strcmp(argv[i],"-test"))
+      testNames.push_back(argv[++i]);
+  }
+  c.procs = Range(c.numMachineNodes);
+  if (testNames.empty())
+    testNames.push_back("solve");
+
+  srand48(c.seed);
+  kernelPoints.resize(2*c.nRow);
+  for (size_t i=0; i<kernelPoints.size(); i++)
+    kernelPoints[i] = drand48();
+}
+
+// Every test checks its errors against a tolerance; a failed check
+//  makes the run exit with status 1 once all tests are done.
+static int failures = 0;
+
+static void check(const std::string &what, double err, double tol) {
+  bool ok = err <= tol; // and not NaN
+  std::cout << what << " : " << err
+	    << (ok ? "" : "  FAILED") << std::endl;
+  if ( ! ok )
+    failures++;
+}
+
+// |x - y| / |y|
+static double relative_error
+(const std::vector<double> &x, const std::vector<double> &y) {
+  assert(x.size() == y.size());
+  double diff = 0, norm = 0;
+  for (size_t i=0; i<x.size(); i++) {
+    diff += (x[i] - y[i]) * (x[i] - y[i]);
+    norm += y[i] * y[i];
+  }
+  return sqrt(diff / norm);
+}
+
+// the circulant test matrix with the random rhs of compute_L2_error()
+static void circulant
+(HodlrMatrix &A, const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  A.set_machine(c.numMachineNodes, c.coresPerNode);
+  A.create_tree(ctx, runtime);
+  A.init_rhs(c.seed, c.procs, ctx, runtime);
+  A.init_circulant_matrix(c.diagonal, c.procs, ctx, runtime);
+}
+
+static double circulant_error
+(const HodlrMatrix &A, const Config &c, double diagonal,
+ Context ctx, HighLevelRuntime *runtime) {
+  return compute_L2_error(A, c.seed, A.uroot->nrow,
+			  const_cast<HodlrMatrix &>(A).get_num_leaf(),
+			  A.get_num_rhs(), c.rank, diagonal, ctx, runtime);
+}
+
+// the solve of the circulant matrix with the given solver settings
+static void solve_circulant
+(const Config &c, FastSolver &fs, const std::string &what,
+ Context ctx, HighLevelRuntime *runtime) {
+  HodlrMatrix A(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		c.threshold, c.leafSize, "global");
+  circulant(A, c, ctx, runtime);
+  fs.bfs_solve(A, c.procs, ctx, runtime);
+  std::cout << "  Legion leaf : " << A.get_num_leaf() << std::endl
+	    << "  log|det A| : "
+	    << fs.log_determinant().get_result<double>() << std::endl;
+  A.display_launch_time();
+  fs.display_launch_time();
+  check(what + " error", circulant_error(A, c, c.diagonal, ctx, runtime),
+	1e-8);
+}
+
+static void test_solve
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  FastSolver fs;
+  solve_circulant(c, fs, "solve", ctx, runtime);
+}
+
+static void test_sync
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
   FastSolver fs;
-  fs.bfs_solve(hMatrix, procs, ctx, runtime);
-  
-  std::cout << "\n================================" << std::endl;
-  std::cout << "problem information:" << std::endl;
-  int nleaf = hMatrix.get_num_leaf();
-  std::cout << "  Legion leaf : "       << nleaf << std::endl
-	    << "  Legion leaf / node: " << nleaf / procs.size()
+  fs.set_level_sync(true);
+  solve_circulant(c, fs, "level synchronous solve", ctx, runtime);
+}
+
+static void test_coarse
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  FastSolver fs;
+  fs.set_coarse_levels(c.levels);
+  solve_circulant(c, fs, "coarse solve", ctx, runtime);
+}
+
+static void test_replicate
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  FastSolver fs;
+  fs.set_replicated_levels(c.levels);
+  solve_circulant(c, fs, "replicated solve", ctx, runtime);
+}
+
+// the truncation error of the blocks shows in the solution
+static void test_recompress
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  HodlrMatrix A(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		c.threshold, c.leafSize, "global");
+  circulant(A, c, ctx, runtime);
+  double tol = c.tol > 0 ? c.tol : 1e-6;
+  int ncol = recompress(A, tol, c.procs, ctx, runtime);
+  std::cout << "recompression removed " << ncol << " columns"
+	    << std::endl;
+  FastSolver fs;
+  fs.bfs_solve(A, c.procs, ctx, runtime);
+  check("recompressed solve error",
+	circulant_error(A, c, c.diagonal, ctx, runtime),
+	std::max(1e-8, 100*tol));
+}
+
+// a copy base of A is solved with keep_states, the dense blocks of
+//  its first legion leaf are changed and update() is checked against
+//  a new solve of base
+static void test_update
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  HodlrMatrix A(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		c.threshold, c.leafSize, "global");
+  circulant(A, c, ctx, runtime);
+  HodlrMatrix base, work, fresh;
+  A.shift(base, 0., c.procs, ctx, runtime);
+  base.shift(work, 0., c.procs, ctx, runtime);
+  FastSolver fsWork;
+  fsWork.keep_states(true);
+  fsWork.bfs_solve(work, c.procs, ctx, runtime);
+
+  std::vector<HostNode> t;
+  read_host_tree(base.uroot, base.vroot, t, ctx, runtime);
+  const Node *leaf = base.uroot;
+  while ( ! leaf->is_legion_leaf() )
+    leaf = leaf->lchild();
+  for (size_t i=0; i<t.size(); i++)
+    if (t[i].lchild < 0 && t[i].row < leaf->nrow)
+      for (int j=0; j<t[i].nrow; j++)
+	t[i].d[j + j*t[i].nrow] *= 2;
+  write_host_tree(base.uroot, base.vroot, t, c.nRHS, ctx, runtime);
+  fsWork.update(base, work, std::vector<int>(1, 0), c.procs,
+		ctx, runtime);
+
+  base.shift(fresh, 0., c.procs, ctx, runtime);
+  FastSolver fsFresh;
+  fsFresh.bfs_solve(fresh, c.procs, ctx, runtime);
+  std::vector<double> x(c.nRow*c.nRHS), y(c.nRow*c.nRHS);
+  work.get_solution(&x[0], c.nRow, ctx, runtime);
+  fresh.get_solution(&y[0], c.nRow, ctx, runtime);
+  check("update difference", relative_error(x, y), 1e-10);
+  double det0 = fsWork.log_determinant().get_result<double>();
+  double det1 = fsFresh.log_determinant().get_result<double>();
+  check("update log|det| difference", fabs(det0 - det1) / fabs(det1),
+	1e-10);
+}
+
+// A is solved with keep_factors, then its rhs is solved again with
+//  A and with A^T from the kept factors
+static void test_transpose
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  HodlrMatrix A(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		c.threshold, c.leafSize, "global");
+  circulant(A, c, ctx, runtime);
+  std::vector<HostNode> blocks;
+  std::vector<double>   b(c.nRow*c.nRHS), x(c.nRow*c.nRHS);
+  read_host_tree(A.uroot, A.vroot, blocks, ctx, runtime);
+  dense_matrix(blocks, denseA);
+  A.get_solution(&b[0], c.nRow, ctx, runtime);
+
+  FastSolver fs;
+  fs.keep_factors(true);
+  fs.bfs_solve(A, c.procs, ctx, runtime);
+
+  A.set_rhs(&b[0], c.nRow, ctx, runtime);
+  fs.resolve(A, c.procs, ctx, runtime);
+  A.get_solution(&x[0], c.nRow, ctx, runtime);
+  check("resolve error",
+	dense_solve_error(denseA, c.nRow, false, &b[0], &x[0], c.nRHS),
+	1e-8);
+
+  A.set_rhs(&b[0], c.nRow, ctx, runtime);
+  fs.resolve(A, c.procs, ctx, runtime, true);
+  A.get_solution(&x[0], c.nRow, ctx, runtime);
+  check("transpose solve error",
+	dense_solve_error(denseA, c.nRow, true, &b[0], &x[0], c.nRHS),
+	1e-8);
+}
+
+// GMRES on A as an HodlrOperator, preconditioned by the block Jacobi
+//  solve (-levels <k>) of a copy of A, against the dense solve
+static void test_gmres
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  HodlrMatrix A(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		c.threshold, c.leafSize, "global");
+  circulant(A, c, ctx, runtime);
+  std::vector<HostNode> blocks;
+  std::vector<double>   b(c.nRow*c.nRHS), x(c.nRow, 0.0);
+  read_host_tree(A.uroot, A.vroot, blocks, ctx, runtime);
+  dense_matrix(blocks, denseA);
+  A.get_solution(&b[0], c.nRow, ctx, runtime);
+
+  HodlrMatrix copy;
+  A.shift(copy, 0., c.procs, ctx, runtime);
+  HodlrPreconditioner M(copy, c.procs, ctx, runtime, c.levels);
+  HodlrOperator op(A, c.procs, ctx, runtime);
+  double relres;
+  Timer tGmres; tGmres.start();
+  int it = gmres(op, &M, &b[0], &x[0], 30, 200, 1e-10, ctx, runtime,
+		 &relres);
+  tGmres.stop();
+  op.destroy(ctx, runtime);
+  std::cout << "gmres iterations : " << it << std::endl
+	    << "gmres time : " << tGmres.get_elapsed_time() << " s, "
+	    << M.time_per_apply() << " s per preconditioner"
+	    << std::endl;
+  check("gmres relative residual", relres, 1e-9);
+  check("gmres solve error",
+	dense_solve_error(denseA, c.nRow, false, &b[0], &x[0], 1), 1e-8);
+}
+
+// a rhs that is zero outside the rows of the first legion leaf,
+//  solved with and without its support
+static void test_sparse
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  HodlrMatrix A(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		c.threshold, c.leafSize, "global");
+  circulant(A, c, ctx, runtime);
+  HodlrMatrix full, part;
+  A.shift(full, 0., c.procs, ctx, runtime);
+  A.shift(part, 0., c.procs, ctx, runtime);
+  const Node *leaf = A.uroot;
+  while ( ! leaf->is_legion_leaf() )
+    leaf = leaf->lchild();
+  std::vector<double> b(c.nRow*c.nRHS, 0.);
+  srand48(c.seed);
+  for (int j=0; j<c.nRHS; j++)
+    for (int i=0; i<leaf->nrow; i++)
+      b[i + j*c.nRow] = drand48();
+  full.set_rhs(&b[0], c.nRow, ctx, runtime);
+  part.set_rhs(&b[0], c.nRow, ctx, runtime);
+  std::vector<int> leaves;
+  A.rhs_support(&b[0], c.nRow, leaves);
+  std::cout << "rhs support : " << leaves.size() << " of "
+	    << A.get_num_leaf() << " legion leaves" << std::endl;
+
+  FastSolver fsFull, fsPart;
+  fsPart.set_rhs_support(leaves);
+  fsFull.bfs_solve(full, c.procs, ctx, runtime);
+  fsPart.bfs_solve(part, c.procs, ctx, runtime);
+  std::vector<double> x(c.nRow*c.nRHS), y(c.nRow*c.nRHS);
+  full.get_solution(&x[0], c.nRow, ctx, runtime);
+  part.get_solution(&y[0], c.nRow, ctx, runtime);
+  check("rhs support difference", relative_error(y, x), 1e-10);
+}
+
+// diag(A^-1) from the factors kept by the solve of A, against the
+//  diagonal of the solution of A X = I, on the same matrix made with
+//  nRow right hand sides; for small -n
+static void test_diag
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  HodlrMatrix A(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		c.threshold, c.leafSize, "global");
+  circulant(A, c, ctx, runtime);
+  FastSolver fs;
+  fs.keep_factors(true);
+  fs.bfs_solve(A, c.procs, ctx, runtime);
+  std::vector<double> d(c.nRow);
+  fs.diag_inverse(A, &d[0], c.procs, ctx, runtime);
+
+  HodlrMatrix eye(c.nRow, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		  c.threshold, c.leafSize, "identity");
+  eye.set_machine(c.numMachineNodes, c.coresPerNode);
+  eye.create_tree(ctx, runtime);
+  eye.init_circulant_matrix(c.diagonal, c.procs, ctx, runtime);
+  std::vector<double> X(c.nRow*c.nRow, 0.0);
+  for (int i=0; i<c.nRow; i++)
+    X[i+i*c.nRow] = 1.0;
+  eye.set_rhs(&X[0], c.nRow, ctx, runtime);
+  FastSolver fsEye;
+  fsEye.bfs_solve(eye, c.procs, ctx, runtime);
+  eye.get_solution(&X[0], c.nRow, ctx, runtime);
+  std::vector<double> ref(c.nRow);
+  for (int i=0; i<c.nRow; i++)
+    ref[i] = X[i+i*c.nRow];
+  check("diag(A^-1) difference", relative_error(d, ref), 1e-10);
+}
+
+// a matrix of two dense blocks is below a few legion leaf budgets in
+//  both leaf modes: a single legion leaf, solved by one task
+static void test_small
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  int leafSizes[2] = {c.leafSize, 0};
+  for (int m=0; m<2; m++) {
+    Config s = c;
+    s.nRow     = 2*c.threshold;
+    s.leafSize = leafSizes[m];
+    HodlrMatrix A(s.nRHS, s.nRow, s.gloLevel, s.gloLevel, s.rank,
+		  s.threshold, s.leafSize, "small");
+    circulant(A, s, ctx, runtime);
+    std::string what = m == 0 ? "small problem" : "small problem (auto)";
+    check(what + " legion leaves - 1", A.get_num_leaf() - 1, 0);
+    FastSolver fs;
+    fs.bfs_solve(A, s.procs, ctx, runtime);
+    check(what + " error", circulant_error(A, s, s.diagonal, ctx, runtime),
+	  1e-8);
+  }
+}
+
+// the same solve on the thread pool from the blocks of A
+static void test_shared
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  HodlrMatrix A(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		c.threshold, c.leafSize, "global");
+  circulant(A, c, ctx, runtime);
+  std::vector<HostNode> blocks;
+  std::vector<double>   b(c.nRow*c.nRHS), x(c.nRow*c.nRHS);
+  read_host_tree(A.uroot, A.vroot, blocks, ctx, runtime);
+  A.get_solution(&b[0], c.nRow, ctx, runtime);
+
+  FastSolver fs;
+  Timer tSolve; tSolve.start();
+  fs.bfs_solve(A, c.procs, ctx, runtime);
+  A.get_solution(&x[0], c.nRow, ctx, runtime);
+  tSolve.stop();
+
+  ThreadPool pool(c.threads);
+  SharedSolver shared(blocks, c.nRHS, std::max(c.leafSize, 1));
+  Timer tShared; tShared.start();
+  shared.solve(blocks, &b[0], c.nRow, pool);
+  tShared.stop();
+  std::cout << "legion solve : " << tSolve.get_elapsed_time() << " s"
+	    << std::endl
+	    << "shared solve : " << tShared.get_elapsed_time() << " s"
+	    << " (" << c.threads << " threads, "
+	    << shared.get_num_leaf() << " leaf tasks)" << std::endl;
+  check("shared solve difference", relative_error(b, x), 1e-10);
+}
+
+// relative error of the solve of the kernel matrix against the dense
+//  kernel; the points are the data of the kernel, read by the kernel
+//  tasks from a region. f is the rank policy, NULL for rank.
+static double kernel_solve_error
+(const Config &c, int rank, RankFunc f, double tol,
+ Context ctx, HighLevelRuntime *runtime) {
+  int nRow = c.nRow;
+  HodlrMatrix A(c.nRHS, nRow, c.gloLevel, c.subLevel, rank,
+		c.threshold, c.leafSize, "kernel");
+  A.set_machine(c.numMachineNodes, c.coresPerNode);
+  A.set_rank_policy(f);
+  A.create_tree(ctx, runtime);
+  A.init_kernel_matrix(kernelId, &kernelPoints[0], kernelPoints.size(),
+		       tol, c.procs, ctx, runtime);
+
+  std::vector<double> b(nRow*c.nRHS), x(nRow*c.nRHS);
+  srand48(c.seed + 1);
+  for (size_t i=0; i<b.size(); i++)
+    b[i] = drand48();
+  A.set_rhs(&b[0], nRow, ctx, runtime);
+  FastSolver fs;
+  fs.bfs_solve(A, c.procs, ctx, runtime);
+  A.get_solution(&x[0], nRow, ctx, runtime);
+
+  std::vector<double> K(nRow*nRow);
+  for (int j=0; j<nRow; j++)
+    for (int i=0; i<nRow; i++)
+      K[i+j*nRow] = gaussian_kernel(i, j, &kernelPoints[0]);
+  return dense_solve_error(K, nRow, false, &b[0], &x[0], c.nRHS);
+}
+
+static void test_kernel
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  double tol = c.tol > 0 ? c.tol : 1e-10;
+  check("kernel solve error",
+	kernel_solve_error(c, std::max(c.rank, 60), NULL, tol,
+			   ctx, runtime),
+	std::max(1e-6, 1e4*tol));
+}
+
+// ranks that shrink down the tree: 50 on the first level, 40 on the
+//  second and 30 below
+static int shrinking_rank(int level, int nrow) {
+  return std::min(nrow/2, std::max(30, 60 - 10*level));
+}
+
+// the kernel matrix with the blocks of every level at their own rank;
+//  the lower ranks truncate more of the kernel
+static void test_rank_policy
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  check("rank policy kernel solve error",
+	kernel_solve_error(c, c.rank, shrinking_rank, 1e-10,
+			   ctx, runtime),
+	1e-4);
+}
+
+// the HSS factorization of a random matrix with nested bases, checked
+//  by the residual with the product of the generators
+static void test_hss
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  int nRow = c.nRow, nRHS = c.nRHS;
+  HssMatrix hssMatrix(nRHS, nRow, c.rank, c.threshold,
+		      std::max(c.leafSize, 1), "hss");
+  hssMatrix.create_tree(ctx, runtime);
+  hssMatrix.init_rhs(c.seed, c.procs, ctx, runtime);
+  hssMatrix.init_random_matrix(c.seed, c.diagonal, c.procs, ctx, runtime);
+
+  std::vector<double> b(nRow*nRHS), x(nRow*nRHS), r(nRow*nRHS);
+  hssMatrix.get_solution(&b[0], nRow, ctx, runtime);
+
+  FastSolver fs;
+  fs.hss_factor(hssMatrix, c.procs, ctx, runtime);
+  fs.hss_solve(hssMatrix, c.procs, ctx, runtime);
+  std::cout << "HSS legion leaf : " << hssMatrix.get_num_leaf()
 	    << std::endl;
-  hMatrix.display_launch_time();
   fs.display_launch_time();
 
-  assert( nRow%threshold == 0 );
-  int nregion = nleaf;
-  if (true) {
-    compute_L2_error(hMatrix, seed, nRow, nregion, nRHS,
-         		   rank, diagonal, ctx, runtime);
+  hssMatrix.get_solution(&x[0], nRow, ctx, runtime);
+  hssMatrix.random_matvec(c.seed, c.diagonal, nRHS, &x[0], &r[0], nRow);
+  check("HSS relative residual", relative_error(r, b), 1e-10);
+}
+
+// the kernel matrix on the points ordered by HodlrMatrix::cluster():
+//  the clustered points are the data of the kernel, the permutation
+//  has to map them back to the input, and the rhs and the solution
+//  stay in the input order
+static void test_cluster
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  int nRow = c.nRow, nRHS = c.nRHS;
+  double tol = c.tol > 0 ? c.tol : 1e-10;
+  HodlrMatrix A(nRHS, nRow, c.gloLevel, c.subLevel, std::max(c.rank, 60),
+		c.threshold, c.leafSize, "cluster");
+  A.set_machine(c.numMachineNodes, c.coresPerNode);
+  A.create_tree(ctx, runtime);
+  std::vector<double> points(kernelPoints);
+  A.cluster(2, &points[0]);
+
+  const std::vector<int> &perm = A.permutation();
+  std::vector<bool> seen(nRow, false);
+  int wrong = (int)perm.size() == nRow ? 0 : 1;
+  for (int t=0; wrong == 0 && t<nRow; t++) {
+    if (perm[t] < 0 || perm[t] >= nRow || seen[perm[t]] ||
+	points[2*t]   != kernelPoints[2*perm[t]] ||
+	points[2*t+1] != kernelPoints[2*perm[t]+1])
+      wrong++;
+    else
+      seen[perm[t]] = true;
+  }
+  check("cluster permutation mismatches", wrong, 0);
+  if (wrong)
+    return;
+  A.init_kernel_matrix(kernelId, &points[0], points.size(), tol,
+		       c.procs, ctx, runtime);
+
+  // b comes back unchanged before the solve
+  std::vector<double> b(nRow*nRHS), x(nRow*nRHS);
+  srand48(c.seed + 1);
+  for (size_t i=0; i<b.size(); i++)
+    b[i] = drand48();
+  A.set_rhs(&b[0], nRow, ctx, runtime);
+  A.get_solution(&x[0], nRow, ctx, runtime);
+  check("cluster rhs round trip", relative_error(x, b), 0);
+  FastSolver fs;
+  fs.bfs_solve(A, c.procs, ctx, runtime);
+  A.get_solution(&x[0], nRow, ctx, runtime);
+
+  std::vector<double> K(nRow*nRow);
+  for (int j=0; j<nRow; j++)
+    for (int i=0; i<nRow; i++)
+      K[i+j*nRow] = gaussian_kernel(i, j, &kernelPoints[0]);
+  check("clustered kernel solve error",
+	dense_solve_error(K, nRow, false, &b[0], &x[0], nRHS),
+	std::max(1e-6, 1e4*tol));
+}
+
+// the circulant matrix recovered by peeling from products with the
+//  dense A and A^T only, against A itself
+static void test_peel
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  HodlrMatrix A(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		c.threshold, c.leafSize, "global");
+  circulant(A, c, ctx, runtime);
+  std::vector<HostNode> t;
+  read_host_tree(A.uroot, A.vroot, t, ctx, runtime);
+  dense_matrix(t, denseA);
+
+  HodlrMatrix peeled(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		     c.threshold, c.leafSize, "peeled");
+  peeled.set_machine(c.numMachineNodes, c.coresPerNode);
+  peeled.create_tree(ctx, runtime);
+  peeled.init_matvec_matrix(dense_matvec, c.seed, ctx, runtime);
+  std::vector<double> P;
+  read_host_tree(peeled.uroot, peeled.vroot, t, ctx, runtime);
+  dense_matrix(t, P);
+  check("peeled matrix error", relative_error(P, denseA), 1e-10);
+
+  // the solve of the peeled matrix, with the rhs of A
+  std::vector<double> b(c.nRow*c.nRHS), x(c.nRow*c.nRHS);
+  A.get_solution(&b[0], c.nRow, ctx, runtime);
+  peeled.set_rhs(&b[0], c.nRow, ctx, runtime);
+  FastSolver fs;
+  fs.bfs_solve(peeled, c.procs, ctx, runtime);
+  peeled.get_solution(&x[0], c.nRow, ctx, runtime);
+  check("peeled solve error",
+	dense_solve_error(denseA, c.nRow, false, &b[0], &x[0], c.nRHS),
+	1e-8);
+}
+
+// A + sigma*I for several shifts, made together from A and solved
+//  concurrently; each against the circulant solution with its own
+//  diagonal
+static void test_shifts
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  HodlrMatrix A(c.nRHS, c.nRow, c.gloLevel, c.subLevel, c.rank,
+		c.threshold, c.leafSize, "global");
+  circulant(A, c, ctx, runtime);
+  const double sigma[] = {-0.5*c.diagonal, c.diagonal, 10*c.diagonal};
+  const int nshift = sizeof(sigma) / sizeof(sigma[0]);
+  std::vector<HodlrMatrix *> shifted(nshift);
+  for (int s=0; s<nshift; s++)
+    shifted[s] = new HodlrMatrix;
+  A.shift(shifted, std::vector<double>(sigma, sigma+nshift), c.procs,
+	  ctx, runtime);
+  std::vector<FastSolver *> fs(nshift);
+  for (int s=0; s<nshift; s++) {
+    fs[s] = new FastSolver;
+    fs[s]->bfs_solve(*shifted[s], c.procs, ctx, runtime);
+  }
+  for (int s=0; s<nshift; s++) {
+    std::stringstream what;
+    what << "shift " << sigma[s] << " error";
+    check(what.str(), circulant_error(*shifted[s], c,
+				      c.diagonal + sigma[s], ctx, runtime),
+	  1e-8);
+    delete fs[s];
+    delete shifted[s];
   }
-  std::cout << "================================\n" << std::endl;
+}
+
+// the circulant matrix with nRHS + k right hand sides for a random
+//  rank k update, against a dense solve with A + W Z^T
+static void test_woodbury
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  int nRow = c.nRow, nRHS = c.nRHS, k = 4;
+  HodlrMatrix lowRank(nRHS + k, nRow, c.gloLevel, c.subLevel, c.rank,
+		      c.threshold, c.leafSize, "low_rank");
+  lowRank.set_machine(c.numMachineNodes, c.coresPerNode);
+  lowRank.create_tree(ctx, runtime);
+  lowRank.init_circulant_matrix(c.diagonal, c.procs, ctx, runtime);
+  std::vector<HostNode> blocks;
+  read_host_tree(lowRank.uroot, lowRank.vroot, blocks, ctx, runtime);
+
+  std::vector<double> W(nRow*k), Z(nRow*k), B(nRow*nRHS), X(nRow*nRHS);
+  srand48(c.seed);
+  for (int i=0; i<nRow*k; i++) {
+    W[i] = drand48() - 0.5;
+    Z[i] = drand48() - 0.5;
+  }
+  for (size_t i=0; i<B.size(); i++)
+    B[i] = drand48();
+  FastSolver fs;
+  lowRank.set_rhs(&B[0], nRow, Range(nRHS), ctx, runtime);
+  fs.set_low_rank_update(lowRank, &W[0], &Z[0], k, nRow, ctx, runtime);
+  fs.bfs_solve(lowRank, c.procs, ctx, runtime);
+  fs.woodbury_solution(lowRank, &X[0], nRow, ctx, runtime);
+
+  std::vector<double> A;
+  dense_matrix(blocks, A);
+  for (int q=0; q<k; q++)
+    for (int j=0; j<nRow; j++)
+      for (int i=0; i<nRow; i++)
+	A[i+j*nRow] += W[i+q*nRow] * Z[j+q*nRow];
+  check("woodbury solve error",
+	dense_solve_error(A, nRow, false, &B[0], &X[0], nRHS), 1e-8);
+}
+
+// a batch of circulant systems of different sizes (-batch <count>),
+//  groups of four; every solution is put back into its own matrix to
+//  be checked
+static void test_batch
+(const Config &c, Context ctx, HighLevelRuntime *runtime) {
+  int batchSize = c.batch;
+  HodlrBatch batch(c.nRHS, c.rank, c.threshold);
+  std::vector<HodlrMatrix *> member(batchSize);
+  std::vector<int> rows(batchSize), first(batchSize+1, 0);
+  for (int s=0; s<batchSize; s++) {
+    rows[s] = std::max(c.threshold, c.nRow >> (s % 3));
+    first[s+1] = first[s] + rows[s];
+    std::stringstream name;
+    name << "batch_" << s;
+    member[s] = new HodlrMatrix(c.nRHS, rows[s], c.gloLevel, c.subLevel,
+				c.rank, c.threshold, c.leafSize,
+				name.str());
+    member[s]->set_machine(c.numMachineNodes, c.coresPerNode);
+    member[s]->create_tree(ctx, runtime);
+    member[s]->init_rhs(c.seed, c.procs, ctx, runtime);
+    member[s]->init_circulant_matrix(c.diagonal, c.procs, ctx, runtime);
+    batch.add_system(rows[s]);
+  }
+  batch.create(4, ctx, runtime);
+  for (int s=0; s<batchSize; s++) {
+    std::vector<HostNode> t;
+    std::vector<double>   rhs(rows[s]*c.nRHS);
+    read_host_tree(member[s]->uroot, member[s]->vroot, t, ctx, runtime);
+    member[s]->get_solution(&rhs[0], rows[s], ctx, runtime);
+    batch.set_system(s, t, &rhs[0]);
+  }
+  batch.solve(c.procs, ctx, runtime);
+  std::vector<double> x(first[batchSize]*c.nRHS);
+  batch.get_solutions(&x[0], first[batchSize], ctx, runtime);
+  for (int s=0; s<batchSize; s++) {
+    member[s]->set_rhs(&x[first[s]], first[batchSize], ctx, runtime);
+    std::stringstream what;
+    what << "batch system " << s << " (" << rows[s] << " rows) error";
+    check(what.str(), circulant_error(*member[s], c, c.diagonal,
+				      ctx, runtime), 1e-8);
+    delete member[s];
+  }
+  batch.destroy(ctx, runtime);
+}
+
+struct Test {
+  const char *name;
+  void (*run)(const Config &, Context, HighLevelRuntime *);
+};
+
+static const Test tests[] = {
+  {"solve",      test_solve},
+  {"sync",       test_sync},
+  {"coarse",     test_coarse},
+  {"replicate",  test_replicate},
+  {"recompress", test_recompress},
+  {"update",     test_update},
+  {"transpose",  test_transpose},
+  {"gmres",      test_gmres},
+  {"sparse",     test_sparse},
+  {"diag",       test_diag},
+  {"batch",      test_batch},
+  {"small",      test_small},
+  {"shared",     test_shared},
+  {"kernel",     test_kernel},
+  {"rank",       test_rank_policy},
+  {"hss",        test_hss},
+  {"cluster",    test_cluster},
+  {"peel",       test_peel},
+  {"shift",      test_shifts},
+  {"woodbury",   test_woodbury},
+};
+static const int nTests = sizeof(tests) / sizeof(tests[0]);
+
+void top_level_task(const Task *task,
+		    const std::vector<PhysicalRegion> &regions,
+		    Context ctx, HighLevelRuntime *runtime) {
+
+  const Config &c = config;
+  for (size_t n=0; n<testNames.size(); n++) {
+    bool found = false;
+    for (int i=0; i<nTests; i++)
+      if (testNames[n] == "all" || testNames[n] == tests[i].name) {
+	std::cout << "\n==== " << tests[i].name << " ====" << std::endl;
+	tests[i].run(c, ctx, runtime);
+	found = true;
+      }
+    if ( ! found ) {
+      std::cout << "unknown test " << testNames[n] << std::endl;
+      failures++;
+    }
+  }
+
+  std::cout << "\n================================" << std::endl
+	    << (failures ? "FAILED" : "PASSED") << std::endl;
+  if (failures)
+    exit(1);
 }
 
 int main(int argc, char *argv[]) {
+  parse_config(argc, argv);
+
   // register top level task
   HighLevelRuntime::set_top_level_task_id(TOP_LEVEL_TASK_ID);
   HighLevelRuntime::register_legion_task<top_level_task>(
@@ -89,8 +799,9 @@ int main(int argc, char *argv[]) {
     "master-task"
   );
 
-  // register fast solver tasks 
+  // register fast solver tasks
   register_solver_tasks();
+  kernelId = register_kernel(gaussian_kernel);
   // register customized mapper
   register_custom_mapper();
   // start legion master task
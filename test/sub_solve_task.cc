@@ -6,8 +6,8 @@ void ExtractRegions
     matArr.append( (*node->lowrank_matrix) );
   }
   else {
-    ExtractRegions(node->lchild, matArr);
-    ExtractRegions(node->rchild, matArr);
+    ExtractRegions(node->lchild(), matArr);
+    ExtractRegions(node->rchild(), matArr);
   }
 }
 